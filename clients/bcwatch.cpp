@@ -11,9 +11,11 @@ using namespace std;
 namespace bcwatchers {
 
 static unique_ptr<bc_channel_msg> buf2msg(const read_buffer &read_queue) {
-	const struct log_format *log = (const struct log_format*) read_queue.extract_buffer().const_ptr();
-	unique_ptr<bc_channel_msg> msg((bc_channel_msg*)::operator new(read_queue.cursor()));
-	memcpy(msg.get(), log, read_queue.cursor());
+	vector<uint8_t> upgraded;
+	size_t len = read_queue.cursor();
+	const struct log_format *log = log_upgrade(read_queue.extract_buffer().const_ptr(), len, upgraded);
+	unique_ptr<bc_channel_msg> msg((bc_channel_msg*)::operator new(len));
+	memcpy(msg.get(), log, len);
 	assert(msg->header.type == BITCOIN);
 	msg->header.source_id = ntoh(msg->header.source_id);
 	msg->header.timestamp = ntoh(msg->header.timestamp);
@@ -21,7 +23,7 @@ static unique_ptr<bc_channel_msg> buf2msg(const read_buffer &read_queue) {
 	msg->update_type = ntoh(msg->update_type);
 	msg->text_len = ntoh(msg->text_len);
 				
-	assert(sizeof(bc_channel_msg) + msg->text_len == read_queue.cursor());
+	assert(sizeof(bc_channel_msg) + msg->text_len == len);
 	return msg;
 }
 
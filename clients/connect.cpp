@@ -6,6 +6,7 @@
 /* standard C++ libraries */
 #include <iostream>
 #include <utility>
+#include <vector>
 
 /* standard unix libraries */
 #include <sys/types.h>
@@ -21,7 +22,7 @@
 #include "bitcoin.hpp"
 #include "config.hpp"
 #include "logger.hpp"
-#include "bcwatch.hpp"
+#include "lib.hpp"
 
 /* This is a simple test client to demonstrate use of the connector */
 
@@ -41,38 +42,6 @@ int main(int argc, char *argv[]) {
 
 	int sock = unix_sock_client((const char*)cfg->lookup("connector.control_path"), false);
 
-	string root((const char*)cfg->lookup("logger.root"));
-	mkdir(root.c_str(), 0777);
-	string client_dir(root + "clients/");
-	int bitcoin_client = unix_sock_client(client_dir + "bitcoin", false);
-	bcwatchers::bcwatch watcher(bitcoin_client, 
-	                [](unique_ptr<bc_channel_msg> msg) {
-		                cout << "Successful connect. Details follow: " << endl;
-		                cout << "\tsource: " << msg->header.source_id << endl;
-		                cout << "\ttime: " << msg->header.timestamp << endl;
-		                cout << "\thandle_id: " << msg->handle_id << endl;
-		                cout << "\tupdate_type: " << msg->update_type << endl;
-		                cout << "\tremote: " << *((struct sockaddr*) &msg->remote_addr) << endl;
-		                cout << "\tlocal: " << *((struct sockaddr*) &msg->local_addr) << endl;
-		                cout << "\ttext_length: " << msg->text_len << endl;
-		                if (msg->text_len) {
-			                cout << "\ttext: " << msg->text << endl;
-		                }
-	                },
-	                [](unique_ptr<bc_channel_msg> msg) {
-		                cout << "Unsuccessful connect. Details follow: " << endl;
-		                cout << "\tsource: " << msg->header.source_id << endl;
-		                cout << "\ttime: " << msg->header.timestamp << endl;
-		                cout << "\tupdate_type: " << msg->update_type << endl;
-		                cout << "\tremote: " << *((struct sockaddr*) &msg->remote_addr) << endl;
-		                cout << "\ttext_length: " << msg->text_len << endl;
-		                if (msg->text_len) {
-			                cout << "\ttext: " << msg->text << endl;
-		                }
-	                });
-	                
-
-	
 	struct sockaddr_in remote_addr;
 	bzero(&remote_addr, sizeof(remote_addr));
 	remote_addr.sin_family = AF_INET;
@@ -94,14 +63,39 @@ int main(int argc, char *argv[]) {
 
 	connect_msg message(&remote_addr, &local_addr);
 
-	pair<wrapped_buffer<uint8_t>, size_t> p = message.serialize();
+	/* the request id comes back on the completion, so any will do with just one outstanding */
+	pair<wrapped_buffer<uint8_t>, size_t> p = message.serialize(1);
 
 	if (write(sock, p.first.ptr(), p.second) != static_cast<ssize_t>(p.second)) {
 		perror("write");
 		return EXIT_FAILURE;
 	}
 
-	watcher.loop_once();
+	struct ctrl::completion completion;
+	vector<uint8_t> payload;
+	if (!read_completion(sock, &completion, payload)) {
+		cerr << "Connector hung up" << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (completion.status == 0 && payload.size() == sizeof(struct ctrl::connection_info)) {
+		struct ctrl::connection_info info;
+		memcpy(&info, payload.data(), sizeof(info));
+		struct sockaddr_in remote(info.remote_addr), local(info.local_addr);
+		cout << "Successful connect. Details follow: " << endl;
+		cout << "\trequest_id: " << completion.request_id << endl;
+		cout << "\thandle_id: " << ntoh(info.handle_id) << endl;
+		cout << "\tremote: " << remote << endl;
+		cout << "\tlocal: " << local << endl;
+	} else {
+		cout << "Unsuccessful connect. Details follow: " << endl;
+		cout << "\trequest_id: " << completion.request_id << endl;
+		cout << "\tstatus: " << completion.status << endl;
+		cout << "\tremote: " << remote_addr << endl;
+		if (payload.size()) {
+			cout << "\ttext: " << (const char *) payload.data() << endl;
+		}
+	}
 	
 	return EXIT_SUCCESS;
 };
@@ -14,6 +14,7 @@
 #include <thread>
 #include <queue>
 #include <atomic>
+#include <vector>
 
 /* standard unix libraries */
 #include <sys/types.h>
@@ -31,7 +32,6 @@
 #include "config.hpp"
 #include "logger.hpp"
 #include "read_buffer.hpp"
-#include "bcwatch.hpp"
 #include "lib.hpp"
 
 
@@ -52,30 +52,37 @@ struct outgoing_message {
 	size_t length;
 };
 
-struct outgoing_message connect_msg(const struct sockaddr_in &remote) {
-	wrapped_buffer<uint8_t> buf(sizeof(struct connect_message));
-	struct connect_message *message = (struct connect_message*) buf.ptr();
-
-	message->version = 0; 
-	message->length = hton((uint32_t)sizeof(connect_payload));
-	message->message_type = CONNECT;
-	message->payload.local_addr.sin_family = AF_INET;
-	message->payload.local_addr.sin_addr.s_addr = 0; /* current version of connector ignores this */
-	message->payload.local_addr.sin_port = 0;
+/* messages are version 1, so the outcome comes back as a completion with request_id */
+struct outgoing_message connect_msg(const struct sockaddr_in &remote, uint32_t request_id) {
+	uint32_t payload_sz = sizeof(request_id) + sizeof(struct connect_payload);
+	wrapped_buffer<uint8_t> buf(sizeof(struct message) + payload_sz);
+	struct message *msg = (struct message*) buf.ptr();
+	struct connect_payload *payload = (struct connect_payload*) (buf.ptr() + sizeof(*msg) + sizeof(request_id));
 
-	memcpy(&message->payload.remote_addr, &remote, sizeof(remote));
-	struct outgoing_message rv = { buf, sizeof(*message) };
+	msg->version = 1; 
+	msg->length = hton(payload_sz);
+	msg->message_type = CONNECT;
+	request_id = hton(request_id);
+	memcpy(msg->payload, &request_id, sizeof(request_id));
+	payload->local_addr.sin_family = AF_INET;
+	payload->local_addr.sin_addr.s_addr = 0; /* current version of connector ignores this */
+	payload->local_addr.sin_port = 0;
+
+	memcpy(&payload->remote_addr, &remote, sizeof(remote));
+	struct outgoing_message rv = { buf, sizeof(*msg) + payload_sz };
 	return rv;
 }
 
-struct outgoing_message disconnect_msg(uint32_t nw_handle_id) {
-	uint32_t payload_sz = sizeof(struct command_msg) + 4;
+struct outgoing_message disconnect_msg(uint32_t nw_handle_id, uint32_t request_id) {
+	uint32_t payload_sz = sizeof(request_id) + sizeof(struct command_msg) + 4;
 	wrapped_buffer<uint8_t> buf(sizeof(struct message) + payload_sz);
 	struct message *msg = (struct message*) buf.ptr();
-	struct command_msg *cmsg = (struct command_msg*) (buf.ptr() + sizeof(*msg));
-	msg->version = 0; 
+	struct command_msg *cmsg = (struct command_msg*) (buf.ptr() + sizeof(*msg) + sizeof(request_id));
+	msg->version = 1; 
 	msg->length = hton(payload_sz);
 	msg->message_type = COMMAND;
+	request_id = hton(request_id);
+	memcpy(msg->payload, &request_id, sizeof(request_id));
 	cmsg->command = COMMAND_DISCONNECT;
 	cmsg->message_id = 0;
 	cmsg->target_cnt = hton((uint32_t)1);
@@ -108,9 +115,6 @@ int main(int argc, char *argv[]) {
 
 	const libconfig::Config *cfg(get_config());
 
-	string root((const char*)cfg->lookup("logger.root"));
-	string client_dir = root + "clients/";
-
 
 	addr_set_t bound_addrs;
 
@@ -146,44 +150,55 @@ int main(int argc, char *argv[]) {
 			}
 		});
 
+	/* request id -> remote address of the connect, zero address for disconnects */
+	map<uint32_t, struct sockaddr_in> pending;
+	uint32_t request_id = 1;
+	struct sockaddr_in no_addr;
+	bzero(&no_addr, sizeof(no_addr));
+
 	size_t cnt = 0;
 
 	for(auto &p : outgoing_cxn) { /* disconnect reconnect */
 	  cnt++;
 	  //cout << "Cycling " << ntoh(p.second) << endl;
-	  struct outgoing_message disconn(disconnect_msg(p.second));
+	  pending[request_id] = no_addr;
+	  struct outgoing_message disconn(disconnect_msg(p.second, request_id++));
 	  do_write(sock, disconn.buffer.const_ptr(), disconn.length);	  
-	  struct outgoing_message conn(connect_msg(p.first));
+	  pending[request_id] = no_addr; /* nothing more to do on these either way */
+	  struct outgoing_message conn(connect_msg(p.first, request_id++));
 	  do_write(sock, conn.buffer.const_ptr(), conn.length);
 	}
 	cout << "cycled " << cnt << " handles\n";
 
-	/* capture any new bitcoin messages before next part */
-	int bitcoin_client = unix_sock_client(client_dir + "bitcoin", false);
-
 	addr_set_t remaining;
 	for(auto &p : incoming_cxn) { /* double connect */
-		struct outgoing_message conn(connect_msg(p.first));
+		pending[request_id] = p.first;
+		struct outgoing_message conn(connect_msg(p.first, request_id++));
 		do_write(sock, conn.buffer.const_ptr(), conn.length);
 		remaining.insert(p.first);
 	}
 
-	/* wait for notices, upon success disconnect old one. Upon failure leave it alone */
-	bcwatchers::bcwatch watcher(bitcoin_client, 
-	                [&](unique_ptr<bc_channel_msg> bc_msg) { 
-		                auto cnt = remaining.erase(bc_msg->remote_addr);
-		                if (cnt > 0) {
-				  cout << "Denatted " << bc_msg->remote_addr << endl;
-				  struct outgoing_message disconn(disconnect_msg(incoming_cxn[bc_msg->remote_addr]));
-				  do_write(sock, disconn.buffer.const_ptr(), disconn.length);		
-		                }
-	                },
-	                [&](unique_ptr<bc_channel_msg> bc_msg) { 
-		                cout << "Could not reach " << bc_msg->remote_addr << endl;
-		                remaining.erase(bc_msg->remote_addr);
-	                });
-	while(remaining.size()) {
-		watcher.loop_once();
+	/* wait for completions, upon success disconnect old one. Upon failure leave it alone */
+	struct completion completion;
+	vector<uint8_t> payload;
+	while(pending.size() && read_completion(sock, &completion, payload)) {
+		auto it = pending.find(completion.request_id);
+		if (it == pending.end()) {
+			continue;
+		}
+		struct sockaddr_in remote = it->second;
+		pending.erase(it);
+		if (completion.message_type != CONNECT || remaining.erase(remote) == 0) {
+			continue;
+		}
+		if (completion.status == 0) {
+			cout << "Denatted " << remote << endl;
+			pending[request_id] = no_addr;
+			struct outgoing_message disconn(disconnect_msg(incoming_cxn[remote], request_id++));
+			do_write(sock, disconn.buffer.const_ptr(), disconn.length);		
+		} else {
+			cout << "Could not reach " << remote << endl;
+		}
 	}
 	return EXIT_SUCCESS;
 };
@@ -323,7 +323,7 @@ mt19937 cxn_handler::twister;
 
 class bc_msg_handler {
 public:
-	bc_msg_handler(int fd) : read_queue(sizeof(uint32_t)), io(), reading_len(true) {
+	bc_msg_handler(int fd) : read_queue(sizeof(uint32_t)), io(), reading_len(true), upgraded() {
 		io.set<bc_msg_handler, &bc_msg_handler::io_cb>(this);
 		io.set(fd, ev::READ);
 		io.start();
@@ -365,8 +365,11 @@ public:
 						reading_len = false;
 					} else {
 
-						const struct bitcoin_msg_log_format *blog = (const struct bitcoin_msg_log_format*)read_queue.extract_buffer().const_ptr();
-						if (! blog->is_sender && strcmp(blog->msg.command, "addr") == 0) {
+						size_t len = read_queue.cursor();
+						const struct bitcoin_msg_log_format *blog = (const struct bitcoin_msg_log_format*)log_upgrade(read_queue.extract_buffer().const_ptr(), len, upgraded);
+						/* the logserver filters for these, but one that predates filters sends everything. Received
+						   messages are never payload references, and payloads we sent are of no interest */
+						if (blog->header.type == BITCOIN_MSG && ! blog->is_sender && strcmp(blog->msg.command, "addr") == 0) {
 							uint32_t handle_id = ntoh(blog->id);
 							struct sockaddr_in to_insert;
 							bzero(&to_insert, sizeof(to_insert));
@@ -426,6 +429,7 @@ private:
 	read_buffer read_queue;
 	ev::io io;
 	bool reading_len;
+	vector<uint8_t> upgraded; /* version 1 records, brought up to date */
 	bc_msg_handler & operator=(bc_msg_handler other);
 	bc_msg_handler(const bc_msg_handler &);
 	bc_msg_handler(const bc_msg_handler &&other);
@@ -544,20 +548,23 @@ int main(int argc, char *argv[]) {
 
 
 
-	string root((const char*)cfg->lookup("logger.root"));
-	string client_dir = root + "clients/";
-
-	string logpath = root + "servers";
 	try {
-		g_log_buffer = new log_buffer(unix_sock_client(logpath, true));
+		g_log_buffer = new log_buffer(log_server_socket(true));
 	} catch (const network_error &e) {
 		cerr << "WARNING: Could not connect to log server! " << e.what() << endl;
 	}
 
 
 	
-	int bc_msg_client = unix_sock_client(client_dir + "bitcoin_msg", true);
-	int bc_client = unix_sock_client(client_dir + "bitcoin", true);
+	int bc_msg_client = log_client_socket("bitcoin_msg", true);
+	struct log_filter addr_filter;
+	addr_filter.types = BITCOIN_MSG;
+	addr_filter.direction = LOG_FILTER_RECEIVED;
+	addr_filter.commands.push_back("addr");
+	if (!log_request_filter(bc_msg_client, addr_filter)) {
+		cerr << "WARNING: Could not send the logserver a filter, getting every message" << endl;
+	}
+	int bc_client = log_client_socket("bitcoin", true);
 	g_control = unix_sock_client((const char*)cfg->lookup("connector.control_path"), false);
 
 
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <functional>
+#include <vector>
 
 #include "network.hpp"
 #include "command_structures.hpp"
@@ -144,6 +145,28 @@ size_t get_all_cxn(int sock, Cgen callgen) {
 }
 
 
+/* reads one completion from a blocking control socket. Numbers in c
+   are converted to host byte order, the payload is left as is.
+   Returns false on disconnect */
+bool read_completion(int sock, struct ctrl::completion *c, std::vector<uint8_t> &payload) {
+	ssize_t rv = recv(sock, c, sizeof(*c), MSG_WAITALL);
+	if (rv == 0) {
+		return false;
+	}
+	if (rv != sizeof(*c)) {
+		throw std::runtime_error(strerror(errno));
+	}
+	c->length = ntoh(c->length);
+	c->request_id = ntoh(c->request_id);
+	c->status = ntoh(c->status);
+	payload.resize(c->length);
+	if (c->length && recv(sock, payload.data(), c->length, MSG_WAITALL) != (ssize_t) c->length) {
+		throw std::runtime_error(strerror(errno));
+	}
+	return true;
+}
+
+
 struct connect_message {
 	uint8_t version;
 	uint32_t length;
@@ -0,0 +1,159 @@
+/* standard C libraries */
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+/* standard C++ libraries */
+#include <iostream>
+#include <chrono>
+#include <vector>
+
+/* standard unix libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "network.hpp"
+#include "command_structures.hpp"
+#include "bitcoin.hpp"
+#include "config.hpp"
+#include "shm_ring.hpp"
+#include "lib.hpp"
+
+using namespace std;
+using namespace ctrl;
+
+/* Compares the cost of pushing commands to the connector over the
+   control socket and over the shared memory ring. Each command is a
+   send of a registered ping to the broadcast target, so with no
+   peers connected this is pure control path overhead. Each run ends
+   with a version 1 GET_CXN whose completion marks that the connector
+   has handled everything before it. */
+
+static vector<uint8_t> send_msg_command(uint32_t message_id) {
+	vector<uint8_t> buf(sizeof(struct message) + sizeof(struct command_msg) + sizeof(uint32_t));
+	struct message *msg = (struct message*) buf.data();
+	struct command_msg *cmsg = (struct command_msg*) msg->payload;
+	msg->version = 0;
+	msg->length = hton((uint32_t) (sizeof(struct command_msg) + sizeof(uint32_t)));
+	msg->message_type = COMMAND;
+	cmsg->command = COMMAND_SEND_MSG;
+	cmsg->message_id = hton(message_id);
+	cmsg->target_cnt = hton((uint32_t) 1);
+	uint32_t target = BROADCAST_TARGET;
+	memcpy(buf.data() + sizeof(*msg) + sizeof(*cmsg), &target, sizeof(target));
+	return buf;
+}
+
+static vector<uint8_t> marker_command(uint32_t request_id) {
+	vector<uint8_t> buf(sizeof(struct message) + sizeof(request_id) + sizeof(struct command_msg));
+	struct message *msg = (struct message*) buf.data();
+	struct command_msg *cmsg = (struct command_msg*) (msg->payload + sizeof(request_id));
+	msg->version = 1;
+	msg->length = hton((uint32_t) (sizeof(request_id) + sizeof(struct command_msg)));
+	msg->message_type = COMMAND;
+	request_id = hton(request_id);
+	memcpy(msg->payload, &request_id, sizeof(request_id));
+	cmsg->command = COMMAND_GET_CXN;
+	cmsg->message_id = 0;
+	cmsg->target_cnt = 0;
+	return buf;
+}
+
+static void wait_for(int sock, uint32_t request_id) {
+	struct completion c;
+	vector<uint8_t> payload;
+	while(read_completion(sock, &c, payload)) {
+		if (c.request_id == request_id) {
+			return;
+		}
+	}
+	throw runtime_error("connector went away");
+}
+
+static uint32_t register_ping(int sock) {
+	vector<uint8_t> nonce(8, 0);
+	unique_ptr<struct bitcoin::packed_message> ping(bitcoin::get_message("ping", nonce));
+	size_t len = sizeof(struct bitcoin::packed_message) + ping->length;
+	vector<uint8_t> buf(sizeof(struct message) + len);
+	struct message *msg = (struct message*) buf.data();
+	msg->version = 0;
+	msg->length = hton((uint32_t) len);
+	msg->message_type = BITCOIN_PACKED_MESSAGE;
+	memcpy(msg->payload, ping.get(), len);
+	do_write(sock, buf.data(), buf.size());
+
+	uint32_t id;
+	if (recv(sock, &id, sizeof(id), MSG_WAITALL) != sizeof(id)) {
+		throw runtime_error(strerror(errno));
+	}
+	return ntoh(id);
+}
+
+static shm_ring * setup_ring(int sock, uint32_t size) {
+	vector<uint8_t> buf(sizeof(struct message) + sizeof(struct ring_setup));
+	struct message *msg = (struct message*) buf.data();
+	msg->version = 0;
+	msg->length = hton((uint32_t) sizeof(struct ring_setup));
+	msg->message_type = RING_SETUP;
+	((struct ring_setup*) msg->payload)->size = hton(size);
+	do_write(sock, buf.data(), buf.size());
+
+	int fds[2];
+	uint32_t got;
+	if (recv_with_fds(sock, (uint8_t*) &got, sizeof(got), fds, 2) != sizeof(got)) {
+		throw runtime_error(strerror(errno));
+	}
+	if (got == 0 || fds[0] < 0 || fds[1] < 0) {
+		throw runtime_error("connector refused ring setup");
+	}
+	return new shm_ring(fds[0], fds[1]);
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc >= 2) {
+		load_config(argv[1]);
+	} else {
+		load_config("../netmine.cfg");
+	}
+	size_t count = argc >= 3 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+	const libconfig::Config *cfg(get_config());
+	int sock = unix_sock_client((const char*)cfg->lookup("connector.control_path"), false);
+
+	uint32_t message_id = register_ping(sock);
+	vector<uint8_t> cmd(send_msg_command(message_id));
+	uint32_t request_id = 1;
+
+	auto start = chrono::steady_clock::now();
+	for(size_t i = 0; i < count; ++i) {
+		do_write(sock, cmd.data(), cmd.size());
+	}
+	vector<uint8_t> marker(marker_command(request_id));
+	do_write(sock, marker.data(), marker.size());
+	wait_for(sock, request_id++);
+	double socket_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	unique_ptr<shm_ring> ring(setup_ring(sock, 1 << 20));
+	size_t spins = 0;
+	start = chrono::steady_clock::now();
+	for(size_t i = 0; i < count; ++i) {
+		while(!ring->write(cmd.data(), cmd.size())) {
+			++spins;
+		}
+	}
+	marker = marker_command(request_id);
+	while(!ring->write(marker.data(), marker.size())) {
+		++spins;
+	}
+	wait_for(sock, request_id++);
+	double ring_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << count << " commands" << endl;
+	cout << "socket: " << socket_secs << "s, " << count / socket_secs << " commands/s" << endl;
+	cout << "ring:   " << ring_secs << "s, " << count / ring_secs << " commands/s (" << spins << " full spins)" << endl;
+
+	close(sock);
+	return EXIT_SUCCESS;
+}
@@ -53,6 +53,9 @@ private:
 	uint32_t id;
 	static uint32_t id_pool;
 
+	bool outbound; /* we initiated the connection */
+	std::string agent; /* user agent from their version message, empty until then */
+
 	inline void io_set(int e) {
 		if (e != io_events) {
 			io_events = e;
@@ -70,11 +73,16 @@ public:
 	void active_pinger_cb(ev::timer &w, int revents);
 	struct sockaddr_in get_remote_addr() const { return remote_addr; }
 	struct sockaddr_in get_local_addr() const { return local_addr; }
+	size_t get_queued() const { return write_queue.to_write(); }
+	bool is_outbound() const { return outbound; }
+	const std::string & get_user_agent() const { return agent; }
 	/* appends message, leaves write queue unseeked, but increments to_write. */
 	void append_for_write(const struct packed_message *m);
 	void append_for_write(std::unique_ptr<struct packed_message> m);
 	/* this is an optimized call for reducing copies. buf better be a packed_message internally */
 	void append_for_write(wrapped_buffer<uint8_t> buf); 
+	/* write what is queued now rather than on the next loop iteration. Used for timed sends */
+	void flush();
 	void disconnect();
 private:
 	void suicide(); /* get yourself ready for suspension (e.g., stop loop activity) if safe, just delete self */
@@ -114,12 +122,19 @@ class connect_handler { /* for non-blocking connectors */
 public:
 	/* fd should be non-blocking socket. Connect has not been called yet */
 	connect_handler(int fd, const struct sockaddr_in &remote_addr); 
+	/* as above, but the outcome is sent as a completion to the control handler ctrl_id */
+	connect_handler(int fd, const struct sockaddr_in &remote_addr, uint32_t ctrl_id, uint32_t request_id); 
 	void io_cb(ev::io &watcher, int revents);
 	~connect_handler();
 private:
 	struct sockaddr_in remote_addr_;
 	ev::io io;
+	bool notify_;
+	uint32_t ctrl_id_;
+	uint32_t request_id_;
+	void start(int fd);
 	void setup_handler(int fd);
+	void failure(int error, const char *err);
 	connect_handler & operator=(connect_handler other);
 	connect_handler(const connect_handler &);
 	connect_handler(const connect_handler &&other);
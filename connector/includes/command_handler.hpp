@@ -4,15 +4,24 @@
 #include <cstdint>
 
 #include <unordered_set>
+#include <vector>
+#include <functional>
+#include <memory>
 
 #include <ev++.h>
 
 #include "crypto.hpp"
 #include "command_structures.hpp"
+#include "network.hpp"
 #include "read_buffer.hpp"
 #include "write_buffer.hpp"
+#include "shm_ring.hpp"
 
 
+namespace bitcoin {
+class handler;
+};
+
 namespace ctrl {
 
 const uint32_t RECV_MASK = 0x0000ffff; // all receive flags should be in the mask 
@@ -23,6 +32,41 @@ const uint32_t SEND_MASK = 0xffff0000;
 const uint32_t SEND_MESSAGE = 0x10000;
 
 
+class registered_msg {
+public:
+	wrapped_buffer<uint8_t> msg;
+	std::vector<struct patch_slot> slots; /* offsets in host byte order */
+
+	/* payload is a packed bitcoin message */
+	registered_msg(const uint8_t *payload, uint32_t length) 
+		: msg(length), slots()
+	{
+		memcpy(msg.ptr(), payload, length);
+	}
+	/* length of the whole TEMPLATE_MESSAGE payload, already validated */
+	registered_msg(const struct template_payload *tmpl, uint32_t length) 
+		: msg(), slots(ntoh(tmpl->slot_cnt))
+	{
+		size_t slot_bytes = sizeof(*tmpl) + slots.size() * sizeof(struct patch_slot);
+		size_t len = length - slot_bytes;
+		msg.realloc(len);
+		memcpy(msg.ptr(), ((const uint8_t *) tmpl) + slot_bytes, len);
+		for(size_t i = 0; i < slots.size(); ++i) {
+			slots[i] = tmpl->slots[i];
+			slots[i].offset = ntoh(tmpl->slots[i].offset);
+		}
+	}
+	registered_msg(registered_msg &&other) 
+		: msg(std::move(other.msg)), slots(std::move(other.slots)) {}
+	registered_msg(const registered_msg &other) 
+		: msg(other.msg), slots(other.slots) {}
+	wrapped_buffer<uint8_t> get_buffer() { return msg; }
+	/* shares the buffer when there is nothing to patch */
+	wrapped_buffer<uint8_t> get_buffer(const bitcoin::handler &target);
+private:
+	registered_msg & operator=(registered_msg other);
+};
+
 class handler {
 private:
 	read_buffer read_queue;
@@ -36,6 +80,13 @@ private:
 	uint32_t regid;
 	ev::io io;
 
+	uint8_t cur_version; /* of the message being handled */
+	uint32_t cur_request; /* request id of the message being handled, if version 1 */
+
+	std::unique_ptr<shm_ring> ring; /* optional, messages from the client */
+	ev::io ring_io; /* on the ring doorbell */
+	wrapped_buffer<uint8_t> ring_buffer; /* message copied out of the ring */
+
 	static uint32_t id_pool;
 
 
@@ -46,9 +97,15 @@ public:
 		  state(RECV_HEADER), 
 		  id(id_pool++), 
 		  regid(nonce_gen32()),
-		  io()
+		  io(),
+		  cur_version(0),
+		  cur_request(0),
+		  ring(),
+		  ring_io(),
+		  ring_buffer(sizeof(struct message))
 	{
 		io.set<handler, &handler::io_cb>(this);
+		ring_io.set<handler, &handler::ring_cb>(this);
 		io.set(fd, ev::READ);
 		io.start();
 	}
@@ -56,13 +113,23 @@ public:
 	uint32_t get_regid() const { return regid;};
 	void receive_header();
 	void receive_payload();
+	/* from either the socket or the ring */
+	void handle_message(const struct message *msg);
 	void handle_message_recv(const struct command_msg *msg);
+	/* queue a completion for a version 1 request, e.g., once a connect finishes */
+	void complete(uint32_t request_id, uint8_t message_type, uint8_t command, int32_t status, const uint8_t *payload, size_t len);
 	void io_cb(ev::io &watcher, int revents);
+	void ring_cb(ev::io &watcher, int revents);
 	~handler();
 private:
 	void do_read(ev::io &watcher, int revents);
 	void do_write(ev::io &watcher, int revents);
 	void suicide();
+	void do_register();
+	void setup_ring(uint32_t size);
+	/* answer the message being handled. Version 1 messages always get a
+	   completion, version 0 messages get the bare payload only if legacy */
+	void reply(uint8_t message_type, uint8_t command, int32_t status, const uint8_t *payload, size_t len, bool legacy = false);
 	handler & operator=(handler other);
 	handler(const handler &);
 	handler(const handler &&other);
@@ -87,6 +154,14 @@ typedef std::unordered_set<handler*, handler_hashfunc, handler_equal> handler_se
 extern handler_set g_active_handlers;
 extern handler_set g_inactive_handlers;
 
+/* returns nullptr if the control connection has gone away */
+handler * find_handler(uint32_t id);
+
+/* calls f on every handler targeted: BROADCAST_TARGET, { GROUP_TARGET,
+   group_id } of a group of control handler ctrl_id, or a list of
+   handle ids. targets is the (packed) uint32_t array, network byte order */
+void foreach_target(uint32_t ctrl_id, const uint8_t *targets, uint32_t target_cnt, std::function<void(bitcoin::handler *)> f);
+
 
 
 class accept_handler {
@@ -0,0 +1,63 @@
+#ifndef PEER_GROUPS_HPP
+#define PEER_GROUPS_HPP
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "command_structures.hpp"
+
+namespace bitcoin {
+class handler;
+};
+
+namespace ctrl {
+
+/* a set of bitcoin handlers defined by predicates, kept as a dense list
+   so commands need no per-target lookup */
+class peer_group {
+public:
+	/* def must have been checked with valid_group */
+	peer_group(const struct group_msg *def);
+	peer_group(peer_group &&other);
+	bool matches(const bitcoin::handler *h) const;
+	void update(bitcoin::handler *h); /* adds or removes h as it (no longer) matches */
+	void remove(bitcoin::handler *h);
+	const std::vector<bitcoin::handler*> & members() const { return members_; }
+private:
+	uint8_t direction_;
+	uint32_t subnet_; /* host byte order, already masked */
+	uint32_t mask_; /* host byte order */
+	std::unordered_set<uint32_t> handles_;
+	std::string agent_;
+
+	std::vector<bitcoin::handler*> members_;
+	std::unordered_map<bitcoin::handler*, size_t> index_; /* position in members_ */
+
+	peer_group & operator=(peer_group other);
+	peer_group(const peer_group &);
+	peer_group & operator=(peer_group &&other);
+};
+
+bool valid_group(const struct group_msg *def, uint32_t length);
+
+/* returns the new group id, or 0 on failure */
+uint32_t define_group(uint32_t ctrl_id, const struct group_msg *def);
+bool delete_group(uint32_t ctrl_id, uint32_t group_id);
+/* nullptr if there is no such group */
+peer_group * find_group(uint32_t ctrl_id, uint32_t group_id);
+/* drop all groups owned by a control connection */
+void delete_groups(uint32_t ctrl_id);
+
+/* called as a handler is set up or learns more about its peer (i.e., version) */
+void groups_update(bitcoin::handler *h);
+/* called as a handler goes away */
+void groups_remove(bitcoin::handler *h);
+
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SCHEDULED_SEND_HPP
+#define SCHEDULED_SEND_HPP
+
+#include <cstdint>
+
+#include <vector>
+#include <utility>
+
+#include <ev++.h>
+
+#include "command_structures.hpp"
+#include "command_handler.hpp"
+
+namespace ctrl {
+
+/* sends a registered message to a list of handles at precise
+   (CLOCK_REALTIME) times using a timerfd. It schedules its own
+   deletion once the last target has been sent to */
+class scheduled_send {
+public:
+	/* ctrl_id is the control handler, for resolving group targets */
+	scheduled_send(uint32_t ctrl_id, const registered_msg &msg, uint32_t message_id, const struct schedule_msg *sched);
+	void io_cb(ev::io &watcher, int revents);
+	size_t target_cnt() const { return targets_.size(); }
+	~scheduled_send();
+private:
+	registered_msg msg_;
+	uint32_t message_id_;
+	std::vector<std::pair<uint64_t, uint32_t> > targets_; /* send time (ns), handle_id. Sorted by time */
+	size_t next_;
+	uint64_t max_skew_;
+	ev::io io;
+
+	void arm();
+	void suicide();
+	scheduled_send & operator=(scheduled_send other);
+	scheduled_send(const scheduled_send &);
+	scheduled_send(const scheduled_send &&other);
+	scheduled_send & operator=(scheduled_send &&other);
+};
+
+};
+
+#endif
@@ -16,6 +16,8 @@
 #include "config.hpp"
 #include "crypto.hpp"
 #include "blacklist.hpp"
+#include "command_handler.hpp"
+#include "peer_groups.hpp"
 
 using namespace std;
 
@@ -92,8 +94,18 @@ static double get_randping() {
 
 
 connect_handler::connect_handler(int fd, const struct sockaddr_in &remote_addr) 
-	: remote_addr_(remote_addr), io() 
+	: remote_addr_(remote_addr), io(), notify_(false), ctrl_id_(0), request_id_(0)
 {
+	start(fd);
+}
+
+connect_handler::connect_handler(int fd, const struct sockaddr_in &remote_addr, uint32_t ctrl_id, uint32_t request_id) 
+	: remote_addr_(remote_addr), io(), notify_(true), ctrl_id_(ctrl_id), request_id_(request_id)
+{
+	start(fd);
+}
+
+void connect_handler::start(int fd) {
 
 	/* clean up old dead ones. There's a logic to this scheme, dumb as it is. Ask
 	   if you want to hear it. */
@@ -103,12 +115,12 @@ connect_handler::connect_handler(int fd, const struct sockaddr_in &remote_addr)
 
 	g_inactive_connection_handlers.clear();
 
-	char *err(nullptr);
-	char bl_emsg[] = "BLACKLISTED";
-
+	int error(0);
+	const char *err(nullptr);
 
 	if (g_blacklist.count(remote_addr_) > 0) {
-		err = bl_emsg;
+		error = EPERM;
+		err = "BLACKLISTED";
 	} else {
 		/* first try it */
 		int rv = connect(fd, (struct sockaddr*)&remote_addr_, sizeof(remote_addr_));
@@ -121,32 +133,54 @@ connect_handler::connect_handler(int fd, const struct sockaddr_in &remote_addr)
 			io.set(fd, ev::WRITE); /* mark as writable once the connection comes in */
 			io.start();
 		} else {
-			err = strerror(errno);
+			error = errno;
+			err = strerror(error);
 		}
 	}
 
-	if (err) { /* oh no, something sad happened */
-		uint32_t len = strlen(err);
+	if (error) { /* oh no, something sad happened */
 		close(fd);
-		struct sockaddr_in local;
-		bzero(&local, sizeof(local));
-		local.sin_family = AF_INET; /* there is no local connection actually */
-		g_log<BITCOIN>(CONNECT_FAILURE, 0, remote_addr_, local, err, len+1);
+		failure(error, err);
 		g_inactive_connection_handlers.insert(this);
 	}
 
 
 }
 
+void connect_handler::failure(int error, const char *err) {
+	uint32_t len = strlen(err);
+	struct sockaddr_in local;
+	bzero(&local, sizeof(local));
+	local.sin_family = AF_INET; /* there is no local connection actually */
+	g_log<BITCOIN>(CONNECT_FAILURE, 0, remote_addr_, local, err, len+1);
+	if (notify_) {
+		ctrl::handler *h = ctrl::find_handler(ctrl_id_);
+		if (h) {
+			h->complete(request_id_, ctrl::CONNECT, 0, error, (const uint8_t *) err, len+1);
+		}
+	}
+}
+
 void connect_handler::setup_handler(int fd) { 
 	struct sockaddr_in local;
 	socklen_t len = sizeof(local);
 	bzero(&local,sizeof(local));
 	if (getsockname(fd, (struct sockaddr*) &local, &len) != 0) {
-		g_log<ERROR>(strerror(errno));
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "connect_handler getsockname");
 	} 
 	unique_ptr<handler> h(new handler(fd, SEND_VERSION_INIT, remote_addr_, local));
-	g_active_handlers.insert(make_pair(h->get_id(), move(h)));
+	uint32_t handle_id = h->get_id();
+	g_active_handlers.insert(make_pair(handle_id, move(h)));
+	if (notify_) {
+		ctrl::handler *ch = ctrl::find_handler(ctrl_id_);
+		if (ch) {
+			struct ctrl::connection_info info;
+			info.handle_id = hton(handle_id);
+			info.remote_addr = remote_addr_;
+			info.local_addr = local;
+			ch->complete(request_id_, ctrl::CONNECT, 0, 0, (const uint8_t *) &info, sizeof(info));
+		}
+	}
 }
 
 void connect_handler::io_cb(ev::io &watcher, int /*revents*/) {
@@ -162,16 +196,12 @@ void connect_handler::io_cb(ev::io &watcher, int /*revents*/) {
 	} else if (errno == EALREADY || errno == EINPROGRESS) {
 		/* spurious event. */
 	} else {
-		char *err = strerror(errno);
-		uint32_t len = strlen(err);
+		int error = errno;
 		close(io.fd);
 		io.stop();
 		io.fd = -1;
 		is_inactive = true;
-		struct sockaddr_in local;
-		bzero(&local, sizeof(local));
-		local.sin_family = AF_INET; /* there is no local connection actually */
-		g_log<BITCOIN>(CONNECT_FAILURE, 0, remote_addr_, local, err, len+1);
+		failure(error, strerror(error));
 	}
 	
 	if (is_inactive) {
@@ -215,7 +245,7 @@ void accept_handler::io_cb(ev::io &watcher, int /*revents*/) {
 		fcntl(client, F_SETFL, O_NONBLOCK);		
 	} catch (network_error &e) {
 		if (e.error_code() != EWOULDBLOCK && e.error_code() != EAGAIN && e.error_code() != ECONNABORTED && e.error_code() != EINTR) {
-			g_log<ERROR>(e.what(), "(bitcoin_handler)", e.error_code());
+			g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) e.error_code(), "accept_handler accept");
 			
 			/* trigger destruction of self via some kind of queue and probably recreate channel! */
 		}
@@ -223,7 +253,7 @@ void accept_handler::io_cb(ev::io &watcher, int /*revents*/) {
 	}
 
 	if (g_blacklist.count(addr)) {
-		g_log<ERROR>("Blacklisted ip address attempted to connect", addr);
+		g_log_event<ERROR>(EVENT_BLACKLISTED_CONNECT, addr);
 		close(client);
 	} else {
 
@@ -231,7 +261,7 @@ void accept_handler::io_cb(ev::io &watcher, int /*revents*/) {
 		socklen_t socklen = sizeof(local);
 		bzero(&local,sizeof(local));
 		if (getsockname(client, (struct sockaddr*) &local, &socklen) != 0) {
-			g_log<ERROR>(strerror(errno));
+			g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "accept_handler getsockname");
 		} 
 
 		/* TODO: if can be converted to smarter pointers sensibly, consider, but
@@ -253,10 +283,19 @@ handler::handler(int fd, uint32_t a_state, const struct sockaddr_in &a_remote_ad
 	  io_events(0), 
 	  io(), timer(), last_activity(timestamp),
 	  active_ping_timer(),
-	  id(id_pool++) 
+	  id(id_pool++),
+	  outbound(a_state == SEND_VERSION_INIT),
+	  agent()
 {
 
 	ostringstream oss;
+
+	/* so received messages are stamped with when they arrived, not
+	   when we got around to them */
+	int one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == 0) {
+		read_queue.want_timestamps(true);
+	}
 	
 	io.set<handler, &handler::io_cb>(this);
 	if (a_state == SEND_VERSION_INIT) { /* we initiated the connection */
@@ -278,7 +317,7 @@ handler::handler(int fd, uint32_t a_state, const struct sockaddr_in &a_remote_ad
 	assert(io.fd > 0);
 	io.start();
 
-	
+	ctrl::groups_update(this);
 }
 
 void handler::start_pingers() {
@@ -342,7 +381,8 @@ void handler::active_pinger_cb(ev::timer &/*w*/, int /*revents*/) {
 
 
 void handler::handle_message_recv(const struct packed_message *msg) { 
-	g_log<BITCOIN_MSG>(id, false, msg);
+	/* the header is read in at cursor 0 */
+	g_log<BITCOIN_MSG>(id, false, msg, read_queue.timestamp());
 	if (strcmp(msg->command, "ping") == 0) {
 		wrapped_buffer<uint8_t> pongbuf(sizeof(*msg) + msg->length);
 		struct packed_message *pong = (struct packed_message *) pongbuf.ptr();
@@ -368,6 +408,19 @@ void handler::handle_message_recv(const struct packed_message *msg) {
 						//we'll jump no more ten guys into the future
 						g_last_block = given_block;
 					}
+
+					/* user agent is a var_str right after the fixed prefix */
+					size_t offset = sizeof(struct packed_version_prefix);
+					if (msg->length > offset) {
+						uint8_t size = get_varint_size(msg->payload + offset);
+						if (offset + size <= msg->length) {
+							uint64_t agent_len = get_varint(msg->payload + offset, NULL);
+							if (offset + size + agent_len <= msg->length) {
+								agent.assign((const char *) msg->payload + offset + size, agent_len);
+								ctrl::groups_update(this);
+							}
+						}
+					}
 				}
 			break;
 		default:
@@ -398,6 +451,7 @@ void handler::suicide() {
 	close(io.fd);
 	io.stop();
 	io.fd = -1;
+	ctrl::groups_remove(this);
 	if (g_active_handlers.find(id) == g_active_handlers.end()) {
 		cerr << "That's not supposed to happen\n";
 	} else {
@@ -432,6 +486,16 @@ void handler::append_for_write(wrapped_buffer<uint8_t> buf) {
 	state |= SEND_MESSAGE;
 }
 
+void handler::flush() {
+	if (io.fd == -1 || !(state & SEND_MASK)) {
+		return;
+	}
+	do_write(io, ev::WRITE);
+	if (io.fd != -1) {
+		io_set((state & SEND_MASK ? ev::WRITE : ev::NONE) | (state & RECV_MASK ? ev::READ : ev::NONE));
+	}
+}
+
 void handler::append_for_write(unique_ptr<struct packed_message> m) {
 	return append_for_write(m.get());
 }
@@ -1,9 +1,12 @@
+#include <cstddef>
+
 #include <iostream>
 #include <iterator>
 #include <sstream>
 #include <map>
 #include <algorithm>
 #include <functional>
+#include <vector>
 
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -11,9 +14,14 @@
 
 #include "command_handler.hpp"
 #include "bitcoin_handler.hpp"
+#include "bitcoin.hpp"
+#include "scheduled_send.hpp"
+#include "peer_groups.hpp"
+#include "shm_ring.hpp"
 #include "netwrap.hpp"
 #include "network.hpp"
 #include "logger.hpp"
+#include "config.hpp"
 
 using namespace std;
 
@@ -30,20 +38,104 @@ int32_t g_active_descriptors(0);
 uint32_t handler::id_pool = 0;
 
 
-class registered_msg {
-public:
-	wrapped_buffer<uint8_t> msg;
+static bool valid_slot(const struct patch_slot &slot, uint32_t payload_len) {
+	uint32_t offset = ntoh(slot.offset);
+	if (offset > payload_len || slot.width > payload_len - offset) {
+		return false;
+	}
+	switch(slot.source) {
+	case PATCH_REMOTE_ADDR:
+	case PATCH_LOCAL_ADDR:
+		return slot.width == 4 || slot.width == 6 || slot.width == 18 ||
+			slot.width == sizeof(struct bc::version_packed_net_addr) ||
+			slot.width == sizeof(struct bc::full_packed_net_addr);
+	case PATCH_NONCE:
+	case PATCH_TIME:
+	case PATCH_HANDLE_ID:
+		return slot.width >= 1 && slot.width <= sizeof(uint64_t);
+	default:
+		return false;
+	}
+}
+
+static void patch_addr(uint8_t *dest, uint8_t width, const struct sockaddr_in &addr) {
+	switch(width) {
+	case 4:
+		memcpy(dest, &addr.sin_addr.s_addr, 4);
+		break;
+	case 6:
+		memcpy(dest, &addr.sin_addr.s_addr, 4);
+		memcpy(dest + 4, &addr.sin_port, 2);
+		break;
+	case 18:
+		{
+			struct bc::version_packed_net_addr full;
+			bc::set_address(&full, addr);
+			memcpy(dest, &full.addr, 18);
+		}
+		break;
+	case sizeof(struct bc::version_packed_net_addr):
+		{
+			struct bc::version_packed_net_addr full;
+			bc::set_address(&full, addr);
+			memcpy(dest, &full, sizeof(full));
+		}
+		break;
+	case sizeof(struct bc::full_packed_net_addr):
+		{
+			struct bc::full_packed_net_addr full;
+			full.time = ev::now(ev_default_loop());
+			bc::set_address(&full.rest, addr);
+			memcpy(dest, &full, sizeof(full));
+		}
+		break;
+	}
+}
+
+static void patch_int(uint8_t *dest, uint8_t width, uint64_t val) {
+	/* little endian, as is everything not an address in bitcoin */
+	for(uint8_t i = 0; i < width; ++i) {
+		dest[i] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+wrapped_buffer<uint8_t> registered_msg::get_buffer(const bc::handler &target) {
+	if (slots.empty()) {
+		return msg;
+	}
 
-	registered_msg(const struct message *messg) 
-		: msg(ntoh(messg->length))
-	{
-		memcpy(msg.ptr(), &messg->payload, ntoh(messg->length));
+	const struct bc::packed_message *orig = (const struct bc::packed_message *) msg.const_ptr();
+	size_t len = sizeof(*orig) + orig->length;
+	wrapped_buffer<uint8_t> rv(len);
+	uint8_t *buf = rv.ptr();
+	memcpy(buf, msg.const_ptr(), len);
+	struct bc::packed_message *packed = (struct bc::packed_message *) buf;
+
+	for(auto it = slots.cbegin(); it != slots.cend(); ++it) {
+		uint8_t *dest = packed->payload + it->offset;
+		switch(it->source) {
+		case PATCH_REMOTE_ADDR:
+			patch_addr(dest, it->width, target.get_remote_addr());
+			break;
+		case PATCH_LOCAL_ADDR:
+			patch_addr(dest, it->width, target.get_local_addr());
+			break;
+		case PATCH_NONCE:
+			patch_int(dest, it->width, nonce_gen64());
+			break;
+		case PATCH_TIME:
+			patch_int(dest, it->width, (uint64_t) ev::now(ev_default_loop()));
+			break;
+		case PATCH_HANDLE_ID:
+			patch_int(dest, it->width, target.get_id());
+			break;
+		}
 	}
-	registered_msg(registered_msg &&other) 
-		: msg(move(other.msg)) {}
-	wrapped_buffer<uint8_t> get_buffer() { return msg; }
 
-};
+	packed->checksum = bc::compute_checksum(packed->payload, packed->length);
+	return rv;
+}
 
 /* TODO, make a vector of registered_messages */
 map<uint32_t, map<uint32_t, registered_msg> > g_messages; /* handle_id, register_id, mesg */
@@ -51,6 +143,8 @@ map<uint32_t, map<uint32_t, registered_msg> > g_messages; /* handle_id, register
 
 handler::~handler() {
 	g_messages.erase(id);
+	delete_groups(id);
+	ring_io.stop();
 	if (io.fd >= 0) {
       --g_active_descriptors;
 		close(io.fd);
@@ -58,43 +152,112 @@ handler::~handler() {
 	}
 }
 
-void foreach_handlers(const struct command_msg *msg, std::function<void(pair<const uint32_t, unique_ptr<bc::handler> >&)> f) {
-	uint32_t target_cnt = ntoh(msg->target_cnt);
-	if (target_cnt == 1 && msg->targets[0] == BROADCAST_TARGET) {
-		for_each(bc::g_active_handlers.begin(), bc::g_active_handlers.end(), f);
+static uint32_t target_at(const uint8_t *targets, uint32_t i) {
+	uint32_t target;
+	memcpy(&target, targets + i * sizeof(target), sizeof(target));
+	return ntoh(target);
+}
+
+void foreach_target(uint32_t ctrl_id, const uint8_t *targets, uint32_t target_cnt, std::function<void(bc::handler *)> f) {
+	/* resolve first, f may disconnect handlers out from under us */
+	vector<bc::handler*> handlers;
+	if (target_cnt == 1 && target_at(targets, 0) == BROADCAST_TARGET) {
+		handlers.reserve(bc::g_active_handlers.size());
+		for(auto it = bc::g_active_handlers.begin(); it != bc::g_active_handlers.end(); ++it) {
+			handlers.push_back(it->second.get());
+		}
+	} else if (target_cnt == 2 && target_at(targets, 0) == GROUP_TARGET) {
+		peer_group *group = find_group(ctrl_id, target_at(targets, 1));
+		if (group) {
+			handlers = group->members();
+		} else {
+			g_log<DEBUG>("Attempting to target non-existant group", target_at(targets, 1));
+		}
 	} else {
 		if (target_cnt > bc::g_active_handlers.size()) {
 			g_log<DEBUG>("Target count larger than all cxn", target_cnt, bc::g_active_handlers.size());
 		}
+		handlers.reserve(target_cnt);
 		for(uint32_t i = 0; i < target_cnt; ++i) {
-			uint32_t target = ntoh(msg->targets[i]);
+			uint32_t target = target_at(targets, i);
 			bc::handler_map::iterator hit = bc::g_active_handlers.find(target);
 			if (hit != bc::g_active_handlers.end()) {
-				f(*hit);
+				handlers.push_back(hit->second.get());
 			} else {
-				g_log<DEBUG>("Attempting to send command message", ntoh(msg->message_id), "to non-existant target", target);
+				g_log<DEBUG>("Attempting to command non-existant target", target);
 			}
 		}
 	}
+	for_each(handlers.begin(), handlers.end(), f);
+}
+
+void handler::reply(uint8_t message_type, uint8_t command, int32_t status, const uint8_t *payload, size_t len, bool legacy) {
+	if (cur_version == 1) {
+		complete(cur_request, message_type, command, status, payload, len);
+	} else if (legacy) {
+		write_queue.append(payload, len);
+		state |= SEND_MESSAGE;
+	}
+}
+
+void handler::complete(uint32_t request_id, uint8_t message_type, uint8_t command, int32_t status, const uint8_t *payload, size_t len) {
+	wrapped_buffer<uint8_t> buffer(sizeof(struct completion) + len);
+	struct completion *c = (struct completion *) buffer.ptr();
+	c->length = hton((uint32_t) len);
+	c->request_id = hton(request_id);
+	c->message_type = message_type;
+	c->command = command;
+	c->status = hton(status);
+	if (len) {
+		memcpy(c->payload, payload, len);
+	}
+	write_queue.append(buffer, sizeof(*c) + len);
+	if (!(state & SEND_MASK) && io.fd >= 0) {
+		/* may be called from outside io_cb, e.g., when a connect finishes */
+		io.set(ev::READ | ev::WRITE);
+	}
+	state |= SEND_MESSAGE;
+}
+
+handler * find_handler(uint32_t id) {
+	/* there are only ever a handful of control connections */
+	for(auto it = g_active_handlers.begin(); it != g_active_handlers.end(); ++it) {
+		if ((*it)->get_id() == id) {
+			return *it;
+		}
+	}
+	return nullptr;
 }
 
 void handler::handle_message_recv(const struct command_msg *msg) { 
 	vector<uint8_t> out;
 
 	if (msg->command == COMMAND_GET_CXN) {
-		g_log<CTRL>("All connections requested", regid);
+		g_log_event<CTRL>(EVENT_CXN_REQUESTED, regid, (uint32_t) bc::g_active_handlers.size());
 		/* format is struct connection_info */
 
+		/* version 1 gets a completion in front, version 0 just the length */
+		size_t prefix = cur_version == 1 ? sizeof(struct completion) : sizeof(uint32_t);
 		wrapped_buffer<uint8_t> buffer;
-		buffer.realloc(sizeof(uint32_t) + bc::g_active_handlers.size() * sizeof(struct connection_info));
+		buffer.realloc(prefix + bc::g_active_handlers.size() * sizeof(struct connection_info));
 		/* I could append these piecemeal to the write_queue, but this would cause more allocations/gc. This does it as one big chunk in the list,
 		   which for an active connector should be one mmapped
 		   segment */
 		uint8_t *writebuf = buffer.ptr();
 		uint32_t len = sizeof(struct connection_info) * bc::g_active_handlers.size();
-		len = hton(len);
-		memcpy(writebuf, &len, sizeof(len));
-		writebuf += sizeof(len);
+		if (cur_version == 1) {
+			struct completion c;
+			c.length = hton(len);
+			c.request_id = hton(cur_request);
+			c.message_type = COMMAND;
+			c.command = COMMAND_GET_CXN;
+			c.status = 0;
+			memcpy(writebuf, &c, sizeof(c));
+		} else {
+			len = hton(len);
+			memcpy(writebuf, &len, sizeof(len));
+		}
+		writebuf += prefix;
 		for(bc::handler_map::const_iterator it = bc::g_active_handlers.cbegin(); it != bc::g_active_handlers.cend(); ++it) {
 			struct connection_info out;
 			out.handle_id = hton(it->first);
@@ -103,29 +266,51 @@ void handler::handle_message_recv(const struct command_msg *msg) {
 			memcpy(writebuf, &out, sizeof(out));
 			writebuf += sizeof(out);
 		}
-		write_queue.append(buffer, sizeof(len) + bc::g_active_handlers.size() * sizeof(struct connection_info));
+		write_queue.append(buffer, prefix + bc::g_active_handlers.size() * sizeof(struct connection_info));
 		state |= SEND_MESSAGE;
 	} else if (msg->command == COMMAND_SEND_MSG) {
 		uint32_t message_id = ntoh(msg->message_id);
 		auto it = g_messages[this->id].find(message_id);
 		if (it == g_messages[this->id].end()) {
-			g_log<ERROR>("invalid message id", message_id);
+			g_log_event<ERROR>(EVENT_INVALID_MESSAGE_ID, regid, message_id);
+			reply(COMMAND, msg->command, ENOENT, nullptr, 0);
 		} else {
-			wrapped_buffer<uint8_t> packed(it->second.get_buffer());
-			foreach_handlers(msg, [&](pair<const uint32_t, unique_ptr<bc::handler> > &p) {
-					p.second->append_for_write(packed);
+			registered_msg &reg = it->second;
+			vector<struct send_result> results;
+			foreach_target(id, (const uint8_t *) msg + sizeof(*msg), ntoh(msg->target_cnt), [&](bc::handler *h) {
+					h->append_for_write(reg.get_buffer(*h));
+					if (cur_version == 1) {
+						struct send_result r = { hton(h->get_id()), hton((uint32_t) h->get_queued()) };
+						results.push_back(r);
+					}
 				});
+			reply(COMMAND, msg->command, 0, (const uint8_t *) results.data(), results.size() * sizeof(struct send_result));
 		}
 	} else if (msg->command == COMMAND_DISCONNECT) {
 		g_log<DEBUG>("disconnect command received");
-		foreach_handlers(msg, [](pair<const uint32_t, unique_ptr<bc::handler> > &p) {
-				p.second->disconnect();
+		uint32_t cnt = 0;
+		foreach_target(id, (const uint8_t *) msg + sizeof(*msg), ntoh(msg->target_cnt), [&](bc::handler *h) {
+				h->disconnect();
+				++cnt;
 			});
+		cnt = hton(cnt);
+		reply(COMMAND, msg->command, 0, (const uint8_t *) &cnt, sizeof(cnt));
 	} else {
 		g_log<CTRL>("UNKNOWN COMMAND_MSG COMMAND: ", msg->command);
+		reply(COMMAND, msg->command, EINVAL, nullptr, 0);
 	}
 }
 
+void handler::do_register() {
+	uint32_t oldid = regid;
+	/* changing id and sending it. */
+	regid = nonce_gen32();
+	g_log_event<CTRL>(EVENT_REGISTER, oldid, regid);
+	uint32_t netorder = hton(regid);
+	reply(REGISTER, 0, 0, (uint8_t*)&netorder, sizeof(netorder), true);
+	g_messages.erase(oldid);
+	/* send back their new user id */
+}
 
 
 void handler::receive_header() {
@@ -133,23 +318,15 @@ void handler::receive_header() {
 	wrapped_buffer<uint8_t> readbuf = read_queue.extract_buffer();
 	const struct message *msg = (const struct message*) readbuf.const_ptr();
 	read_queue.to_read(ntoh(msg->length));
-	if (msg->version != 0) {
+	if (msg->version > 1) {
 		g_log<DEBUG>("Warning: Unsupported version", (int)msg->version);
 		
 	}
 	if (read_queue.to_read() == 0) { /* payload is packed message */
+		cur_version = 0; /* a version 1 message always has its request id */
 		if (msg->message_type == REGISTER) {
-			uint32_t oldid = regid;
-			/* changing id and sending it. */
-			regid = nonce_gen32();
-			g_log<CTRL>("UNREGISTERING", oldid);
-			g_log<CTRL>("REGISTERING", regid);
-			uint32_t netorder = hton(regid);
-			write_queue.append((uint8_t*)&netorder, sizeof(netorder));
-			state |= SEND_MESSAGE;
-			g_messages.erase(oldid);
 			/* msg->payload should be zero length here */
-			/* send back their new user id */
+			do_register();
 		} else {
 			ostringstream oss("Unknown message: ");
 			oss << msg;
@@ -166,50 +343,292 @@ void handler::receive_header() {
 
 static uint32_t g_message_ids = 1;
 
+/* registers the message and returns its id in network byte order, 0 on failure */
+static uint32_t register_message(uint32_t handler_id, uint32_t regid, const struct bitcoin::packed_message *bc_msg, 
+                                 uint32_t slot_cnt, registered_msg &&reg) {
+	uint32_t id = g_message_ids++;
+	auto pair = g_messages[handler_id].insert(make_pair(id, move(reg)));
+	if (pair.second) {
+		g_log_event<CTRL>(EVENT_MESSAGE_REGISTERED, regid, id, string(bc_msg->command, strnlen(bc_msg->command, sizeof(bc_msg->command))),
+		                  bc_msg->length, slot_cnt);
+		return hton(id);
+	} else {
+		g_log<ERROR>("Duplicate id generated, surprising");
+		return 0;
+	}
+}
+
 void handler::receive_payload() {
 	wrapped_buffer<uint8_t> readbuf = read_queue.extract_buffer();
-	const struct message *msg = (const struct message*) readbuf.const_ptr();
+	handle_message((const struct message*) readbuf.const_ptr());
+	read_queue.cursor(0);
+	read_queue.to_read(sizeof(struct message));
+	state = (state & SEND_MASK) | RECV_HEADER;
+}
+
+/* bytes of ring a client may ask for, from connector.max_ring */
+static size_t max_ring_size() {
+	long long max_ring = 64 * 1024 * 1024;
+	get_config()->lookupValue("connector.max_ring", max_ring);
+	return max_ring;
+}
+
+void handler::setup_ring(uint32_t size) {
+	static const size_t max_ring = max_ring_size();
+	int32_t status = 0;
+	ring_io.stop();
+	ring.reset();
+	if (size > max_ring) {
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) EFBIG, "command_handler RING_SETUP too large");
+		status = EFBIG;
+	} else {
+		try {
+			ring.reset(new shm_ring(size));
+		} catch (network_error &e) {
+			g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) e.error_code(), "command_handler RING_SETUP");
+			status = e.error_code();
+		}
+	}
+
+	/* the fds have to ride along with the reply, so everything queued before must be out */
+	if (!status) {
+		do_write(io, ev::WRITE);
+		if (io.fd < 0) {
+			return;
+		}
+		if (write_queue.to_write()) {
+			status = EAGAIN;
+			ring.reset();
+		}
+	}
 
-	if (msg->version != 0) {
+	uint32_t net_size = hton((uint32_t) (status ? 0 : ring->size()));
+	uint8_t reply_buf[sizeof(struct completion) + sizeof(net_size)];
+	size_t reply_len = 0;
+	if (cur_version == 1) {
+		struct completion *c = (struct completion *) reply_buf;
+		c->length = hton((uint32_t) sizeof(net_size));
+		c->request_id = hton(cur_request);
+		c->message_type = RING_SETUP;
+		c->command = 0;
+		c->status = hton(status);
+		reply_len = sizeof(*c);
+	}
+	memcpy(reply_buf + reply_len, &net_size, sizeof(net_size));
+	reply_len += sizeof(net_size);
+
+	if (status) {
+		write_queue.append(reply_buf, reply_len);
+		state |= SEND_MESSAGE;
+		return;
+	}
+
+	int fds[2] = { ring->memfd(), ring->doorbell() };
+	ssize_t r = send_with_fds(io.fd, reply_buf, reply_len, fds, 2);
+	if (r < 0) {
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "command_handler RING_SETUP");
+		ring.reset();
+		net_size = 0;
+		if (cur_version == 1) {
+			int32_t err = hton((int32_t) errno);
+			memcpy(reply_buf + offsetof(struct completion, status), &err, sizeof(err));
+		}
+		memcpy(reply_buf + reply_len - sizeof(net_size), &net_size, sizeof(net_size));
+		write_queue.append(reply_buf, reply_len);
+		state |= SEND_MESSAGE;
+		return;
+	} else if ((size_t) r < reply_len) {
+		write_queue.append(reply_buf + r, reply_len - r);
+		state |= SEND_MESSAGE;
+	}
+
+	g_log_event<CTRL>(EVENT_RING_SETUP, regid, (uint32_t) ring->size());
+	ring_io.set(ring->doorbell(), ev::READ);
+	ring_io.start();
+	if (!ring->sleep()) { /* client was quick, won't ring for what is there */
+		ring_io.feed_event(ev::READ);
+	}
+}
+
+void handler::ring_cb(ev::io & /* watcher */, int /* revents */) {
+	ring->clear_doorbell();
+	size_t avail; /* what was there when we stopped, the start of a message waits for the rest */
+	bool corrupt = false;
+	do {
+		while ((avail = ring->readable()) >= sizeof(struct message)) {
+			struct message hdr;
+			ring->peek((uint8_t *) &hdr, sizeof(hdr));
+			size_t len = sizeof(hdr) + ntoh(hdr.length);
+			if (len > ring->size()) {
+				corrupt = true;
+				break;
+			}
+			if (avail < len) {
+				break; /* clients write whole messages, else the rest rings for us */
+			}
+			if (ring_buffer.allocated() < len) {
+				ring_buffer.realloc(len);
+			}
+			ring->peek(ring_buffer.ptr(), len);
+			/* the client can still write there, keep the length we checked */
+			memcpy(ring_buffer.ptr(), &hdr, sizeof(hdr));
+			ring->consume(len);
+			handle_message((const struct message *) ring_buffer.const_ptr());
+			if (io.fd < 0 || !ring) { /* handling killed us or the ring */
+				return;
+			}
+		}
+		if (corrupt || ring->corrupt()) {
+			g_log<ERROR>("Corrupt control ring, dropping it", regid);
+			ring_io.stop();
+			ring.reset();
+			return;
+		}
+	} while (!ring->sleep(avail));
+
+	if (state & SEND_MASK) {
+		io.set(ev::READ | ev::WRITE);
+	}
+}
+
+void handler::handle_message(const struct message *msg) {
+	const uint8_t *payload = msg->payload;
+	uint32_t length = ntoh(msg->length);
+
+	cur_version = msg->version;
+	if (msg->version == 1) {
+		/* version 1 is prefixed with the request id to put on its completion */
+		uint32_t netreq;
+		if (length < sizeof(netreq)) {
+			g_log<ERROR>("Version 1 message without request id", regid);
+			cur_version = 0;
+			return;
+		}
+		memcpy(&netreq, payload, sizeof(netreq));
+		cur_request = ntoh(netreq);
+		payload += sizeof(netreq);
+		length -= sizeof(netreq);
+	} else if (msg->version != 0) {
 		g_log<DEBUG>("Warning: unsupported version. Attempting to receive payload");
-		
+		cur_version = 0;
 	}
 
 	switch(msg->message_type) {
+	case REGISTER:
+		do_register();
+		break;
 	case BITCOIN_PACKED_MESSAGE:
 		/* register message and send back its id */
 		{
-			const struct bitcoin::packed_message *bc_msg = (struct bitcoin::packed_message *) msg->payload;
+			const struct bitcoin::packed_message *bc_msg = (struct bitcoin::packed_message *) payload;
 			uint32_t netid = 0;
-			if (ntoh(msg->length) < sizeof(struct bitcoin::packed_message) || 
-			    ntoh(msg->length) != sizeof(struct bitcoin::packed_message) + bc_msg->length) {
-				g_log<ERROR>("Attempted to register invalid message");
+			if (length < sizeof(struct bitcoin::packed_message) || 
+			    length != sizeof(struct bitcoin::packed_message) + bc_msg->length) {
+				g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
 			} else {
-				uint32_t id = g_message_ids++;
-				auto pair = g_messages[this->id].insert(make_pair(id, registered_msg(msg)));
-				g_log<CTRL>("Registering message ", regid, (struct bitcoin::packed_message *) msg->payload);
-				if (pair.second) {
-					netid = hton(id);
-					g_log<CTRL>("message registered", regid, id);
-				} else {
-					netid = 0;
-					g_log<ERROR>("Duplicate id generated, surprising");
-				}
+				netid = register_message(this->id, regid, bc_msg, 0, registered_msg(payload, length));
 			}
-			write_queue.append((uint8_t*)&netid, sizeof(netid));
-			state |= SEND_MESSAGE;
+			reply(msg->message_type, 0, netid ? 0 : EINVAL, (uint8_t*)&netid, sizeof(netid), true);
+		}
+		break;
+	case TEMPLATE_MESSAGE:
+		/* register message with its patch slots and send back its id */
+		{
+			const struct template_payload *tmpl = (const struct template_payload *) payload;
+			uint32_t netid = 0;
+			size_t slot_bytes = 0;
+			const struct bitcoin::packed_message *bc_msg = NULL;
+			if (length >= sizeof(*tmpl)) {
+				slot_bytes = sizeof(*tmpl) + (size_t) ntoh(tmpl->slot_cnt) * sizeof(struct patch_slot);
+			}
+			if (length >= sizeof(*tmpl) && length >= slot_bytes + sizeof(struct bitcoin::packed_message)) {
+				bc_msg = (const struct bitcoin::packed_message *) (payload + slot_bytes);
+			}
+			bool valid = bc_msg != NULL && length == slot_bytes + sizeof(*bc_msg) + bc_msg->length;
+			for(uint32_t i = 0; valid && i < ntoh(tmpl->slot_cnt); ++i) {
+				valid = valid_slot(tmpl->slots[i], bc_msg->length);
+			}
+			if (!valid) {
+				g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+			} else {
+				netid = register_message(this->id, regid, bc_msg, ntoh(tmpl->slot_cnt), registered_msg(tmpl, length));
+			}
+			reply(msg->message_type, 0, netid ? 0 : EINVAL, (uint8_t*)&netid, sizeof(netid), true);
+		}
+		break;
+	case SCHEDULE:
+		{
+			const struct schedule_msg *sched = (const struct schedule_msg *) payload;
+			if (length < sizeof(*sched) || length != sizeof(*sched) + (size_t) ntoh(sched->target_cnt) * sizeof(uint32_t)) {
+				g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+				reply(msg->message_type, 0, EINVAL, nullptr, 0);
+				break;
+			}
+			uint32_t message_id = ntoh(sched->message_id);
+			auto it = g_messages[this->id].find(message_id);
+			if (it == g_messages[this->id].end()) {
+				g_log_event<ERROR>(EVENT_INVALID_MESSAGE_ID, regid, message_id);
+				reply(msg->message_type, 0, ENOENT, nullptr, 0);
+			} else {
+				/* yes, it dangles. It schedules itself for cleanup */
+				scheduled_send *s = new scheduled_send(id, it->second, message_id, sched);
+				uint32_t cnt = hton((uint32_t) s->target_cnt());
+				reply(msg->message_type, 0, 0, (uint8_t*)&cnt, sizeof(cnt));
+			}
+		}
+		break;
+	case GROUP:
+		{
+			const struct group_msg *group = (const struct group_msg *) payload;
+			if (!valid_group(group, length)) {
+				g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+				/* a define still gets its (zero) id */
+				uint32_t netid = 0;
+				bool define = length > 0 && payload[0] == GROUP_DEFINE;
+				reply(msg->message_type, define ? GROUP_DEFINE : 0, EINVAL, (uint8_t*)&netid, define ? sizeof(netid) : 0, define);
+			} else if (group->operation == GROUP_DEFINE) {
+				uint32_t group_id = define_group(id, group);
+				g_log_event<CTRL>(EVENT_GROUP_DEFINED, regid, group_id, (uint32_t) (group_id ? find_group(id, group_id)->members().size() : 0));
+				uint32_t netid = hton(group_id);
+				reply(msg->message_type, group->operation, group_id ? 0 : EINVAL, (uint8_t*)&netid, sizeof(netid), true);
+			} else if (group->operation == GROUP_DELETE) {
+				bool deleted = delete_group(id, ntoh(group->group_id));
+				g_log_event<CTRL>(EVENT_GROUP_DELETED, regid, ntoh(group->group_id), (uint32_t) deleted);
+				reply(msg->message_type, group->operation, deleted ? 0 : ENOENT, nullptr, 0);
+			} else {
+				reply(msg->message_type, group->operation, EINVAL, nullptr, 0);
+			}
+		}
+		break;
+	case RING_SETUP:
+		if (length != sizeof(struct ring_setup)) {
+			g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+			uint32_t zero = 0;
+			reply(msg->message_type, 0, EINVAL, (uint8_t*)&zero, sizeof(zero), true);
+		} else {
+			setup_ring(ntoh(((const struct ring_setup *) payload)->size));
 		}
 		break;
 	case COMMAND:
-		handle_message_recv((struct command_msg*) msg->payload);
-		state = (state & SEND_MASK);
+		if (length < sizeof(struct command_msg) || 
+		    length != sizeof(struct command_msg) + (size_t) ntoh(((const struct command_msg*) payload)->target_cnt) * sizeof(uint32_t)) {
+			g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+			reply(msg->message_type, length ? payload[0] : 0, EINVAL, nullptr, 0);
+			break;
+		}
+		handle_message_recv((struct command_msg*) payload);
 		break;
 	case CONNECT:
 		{
 			/* format is remote packed_net_addr, local packed_net_addr */
 			/* currently local is ignored, but would be used if we bound to more than one interface */
-			struct connect_payload *payload = (struct connect_payload*) msg->payload;
-			g_log<CTRL>("Attempting to connect to", payload->remote_addr, "for", regid);
+			if (length != sizeof(struct connect_payload)) {
+				g_log_event<ERROR>(EVENT_INVALID_CTRL_MESSAGE, regid, (uint32_t) msg->message_type);
+				reply(msg->message_type, 0, EINVAL, nullptr, 0);
+				break;
+			}
+			const struct connect_payload *connect = (const struct connect_payload*) payload;
+			g_log_event<CTRL>(EVENT_CONNECT_ATTEMPT, regid, connect->remote_addr);
 
 			int fd(-1);
 			// TODO: setting local on the client does nothing, but could specify the interface used
@@ -221,23 +640,26 @@ void handler::receive_payload() {
 					close(fd);
 					fd = -1;
 				}
-				g_log<ERROR>(e.what(), "(command_handler CONNECT)");
+				g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) e.error_code(), "command_handler CONNECT");
+				const char *err = strerror(e.error_code());
+				reply(msg->message_type, 0, e.error_code(), (const uint8_t *) err, strlen(err) + 1);
 			}
 
 			if (fd >= 0) {
 				/* yes, it dangles. It schedules itself for cleanup. yech */
-				new bc::connect_handler(fd, payload->remote_addr); 
+				if (cur_version == 1) {
+					new bc::connect_handler(fd, connect->remote_addr, id, cur_request); 
+				} else {
+					new bc::connect_handler(fd, connect->remote_addr); 
+				}
 			}
 		}
 		break;
 	default:
 		g_log<CTRL>("unknown payload type", regid, msg);
+		reply(msg->message_type, 0, EINVAL, nullptr, 0);
 		break;
 	}
-	read_queue.cursor(0);
-	read_queue.to_read(sizeof(struct message));
-	state = (state & SEND_MASK) | RECV_HEADER;
-
 }
 
 void handler::do_read(ev::io &watcher, int /* revents */) {
@@ -247,14 +669,14 @@ void handler::do_read(ev::io &watcher, int /* revents */) {
 			pair<int,bool> res(read_queue.do_read(watcher.fd));
 			r = res.first;
 			if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN) { 
-				g_log<ERROR>(strerror(errno), "(command_handler)");
+				g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "command_handler");
 				suicide();
 				return;
 			}
 
 			if (r == 0) { /* got disconnected! */
 				/* LOG disconnect */
-				g_log<CTRL>("Orderly disconnect", id);
+				g_log_event<CTRL>(EVENT_CTRL_DISCONNECT, id);
 				suicide();
 				return;
 			}
@@ -283,6 +705,8 @@ void handler::suicide() {
 	close(io.fd);
 	io.stop();
 	io.fd = -1;
+	ring_io.stop();
+	ring.reset();
 
 	if (g_active_handlers.find(this) != g_active_handlers.end()) {
 		g_active_handlers.erase(this);
@@ -297,7 +721,7 @@ void handler::do_write(ev::io &watcher, int /* revents */) {
 		pair<int,bool> res = write_queue.do_write(watcher.fd);
 		r = res.first;
 		if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN) { 
-			g_log<ERROR>(strerror(errno), "(command_handler)");
+			g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "command_handler");
 			suicide();
 			return;
 		}
@@ -44,10 +44,10 @@ namespace bc = bitcoin;
 ipaddr_set g_blacklist;
 
 
-static void log_watcher(ev::timer &w, int /*revents*/) {
+static void log_watcher(ev::timer &/*w*/, int /*revents*/) {
 	if (g_log_buffer == nullptr) {
 		try {
-			g_log_buffer = new log_buffer(unix_sock_client(*static_cast<string*>(w.data), true));
+			g_log_buffer = new log_buffer(log_server_socket(true));
 		} catch(const network_error &e) {
 			g_log_buffer = nullptr;
 			g_log<ERROR>(e.what());
@@ -76,7 +76,7 @@ static void load_blacklist() {
 			}
 		}
 	
-		g_log<CONNECTOR>("Loading blacklist, received", g_blacklist.size(), "unique entries");
+		g_log_event<CONNECTOR>(EVENT_BLACKLIST_LOADED, (uint32_t) g_blacklist.size());
 	} else {
 		g_log<ERROR>("Could not open blacklist file");
 	}
@@ -117,17 +117,50 @@ int main(int argc, char *argv[]) {
 
 	cerr << "Starting up and transferring to log server" << endl;
 
-	string root((const char*)cfg->lookup("logger.root"));
-	string logpath = root + "servers";
+	cfg->lookupValue("logger.dedup_payloads", g_log_dedup_payloads);
+	cfg->lookupValue("logger.max_latency", g_log_max_latency);
+	unsigned int max_batch = g_log_max_batch;
+	cfg->lookupValue("logger.max_batch", max_batch);
+	g_log_max_batch = max_batch;
+	g_log_stats_interval = 60;
+	cfg->lookupValue("logger.stats_interval", g_log_stats_interval);
+	unsigned int ring_size = 0;
+	cfg->lookupValue("logger.shm_ring", ring_size);
+	g_log_ring_size = ring_size;
+	const char *compression = "";
+	cfg->lookupValue("logger.compression", compression);
+	g_log_codec = log_codec_from_str(compression);
+	if (*compression && g_log_codec == LOG_CODEC_NONE && strcmp(compression, "none") != 0) {
+		cerr << "WARNING: Unknown logger.compression " << compression << ", not compressing" << endl;
+	}
+	const char *spool_path = "";
+	if (cfg->lookupValue("logger.spool.path", spool_path) && *spool_path) {
+		unsigned int spool_memory = g_log_spool_memory;
+		cfg->lookupValue("logger.spool.memory", spool_memory);
+		g_log_spool_memory = spool_memory;
+		long long spool_max = g_log_spool_max;
+		cfg->lookupValue("logger.spool.max_size", spool_max);
+		g_log_spool_max = spool_max;
+		const char *policy = "drop_newest";
+		cfg->lookupValue("logger.spool.policy", policy);
+		if (strcmp(policy, "drop_oldest") == 0) {
+			g_log_spool_policy = SPOOL_DROP_OLDEST;
+		} else if (strcmp(policy, "drop_newest") != 0) {
+			cerr << "WARNING: Unknown logger.spool.policy " << policy << ", dropping newest" << endl;
+		}
+		if (!g_log_open_spool(spool_path)) {
+			cerr << "WARNING: Could not open log spool " << spool_path << ": " << strerror(errno) << endl;
+		}
+	}
 	try {
-		g_log_buffer = new log_buffer(unix_sock_client(logpath, true));
+		g_log_buffer = new log_buffer(log_server_socket(true));
 	} catch (const network_error &e) {
 		cerr << "WARNING: Could not connect to log server! " << e.what() << endl;
 	}
 
 
 	ev::timer logwatch;
-	logwatch.set<log_watcher>(&logpath);
+	logwatch.set<log_watcher>();
 	logwatch.set(10.0, 10.0);
 	logwatch.start();
 
@@ -206,7 +239,7 @@ int main(int argc, char *argv[]) {
 		for(string line; getline(cfile,line);) {
 			s += line + "\n";
 		}
-		g_log<CONNECTOR>("Initiating with commit: ", commit_hash);
+		g_log_event<CONNECTOR>(EVENT_STARTUP, commit_hash);
 		g_log<CONNECTOR>("Full config: ", s);
 		cfile.close();
 	}
@@ -218,6 +251,6 @@ int main(int argc, char *argv[]) {
 		loop.run();
 	}
 	
-	g_log<CONNECTOR>("Orderly shutdown");
+	g_log_event<CONNECTOR>(EVENT_SHUTDOWN);
 	return EXIT_SUCCESS;
 }
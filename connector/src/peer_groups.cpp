@@ -0,0 +1,142 @@
+#include "peer_groups.hpp"
+
+#include <cstring>
+
+#include "bitcoin_handler.hpp"
+#include "network.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace bc = bitcoin;
+
+namespace ctrl {
+
+static uint32_t g_group_ids = 1;
+
+/* ctrl handler id, group id, group */
+static map<uint32_t, map<uint32_t, peer_group> > g_groups;
+
+peer_group::peer_group(const struct group_msg *def)
+	: direction_(def->direction), 
+	  subnet_(0), 
+	  mask_(def->prefix_len ? 0xffffffff << (32 - def->prefix_len) : 0),
+	  handles_(), agent_(), members_(), index_()
+{
+	subnet_ = ntoh(def->subnet) & mask_;
+	uint32_t handle_cnt = ntoh(def->handle_cnt);
+	for(uint32_t i = 0; i < handle_cnt; ++i) {
+		handles_.insert(ntoh(def->handles[i]));
+	}
+	const char *agent = (const char *) (def->handles + handle_cnt);
+	agent_.assign(agent, ntoh(def->agent_len));
+}
+
+peer_group::peer_group(peer_group &&other)
+	: direction_(other.direction_), subnet_(other.subnet_), mask_(other.mask_),
+	  handles_(move(other.handles_)), agent_(move(other.agent_)),
+	  members_(move(other.members_)), index_(move(other.index_))
+{
+}
+
+bool peer_group::matches(const bc::handler *h) const {
+	if (direction_ == DIRECTION_OUTBOUND && !h->is_outbound()) {
+		return false;
+	}
+	if (direction_ == DIRECTION_INBOUND && h->is_outbound()) {
+		return false;
+	}
+	if ((ntoh((uint32_t) h->get_remote_addr().sin_addr.s_addr) & mask_) != subnet_) {
+		return false;
+	}
+	if (!handles_.empty() && handles_.find(h->get_id()) == handles_.end()) {
+		return false;
+	}
+	if (!agent_.empty() && h->get_user_agent().find(agent_) == string::npos) {
+		return false;
+	}
+	return true;
+}
+
+void peer_group::update(bc::handler *h) {
+	if (matches(h)) {
+		if (index_.find(h) == index_.end()) {
+			index_[h] = members_.size();
+			members_.push_back(h);
+		}
+	} else {
+		remove(h);
+	}
+}
+
+void peer_group::remove(bc::handler *h) {
+	auto it = index_.find(h);
+	if (it != index_.end()) {
+		/* swap with the last to stay dense */
+		size_t pos = it->second;
+		index_.erase(it);
+		if (pos != members_.size() - 1) {
+			members_[pos] = members_.back();
+			index_[members_[pos]] = pos;
+		}
+		members_.pop_back();
+	}
+}
+
+bool valid_group(const struct group_msg *def, uint32_t length) {
+	if (length < sizeof(*def)) {
+		return false;
+	}
+	uint64_t expected = sizeof(*def) + (uint64_t) ntoh(def->handle_cnt) * sizeof(uint32_t) + ntoh(def->agent_len);
+	return expected == length && def->prefix_len <= 32 && def->direction <= DIRECTION_INBOUND;
+}
+
+uint32_t define_group(uint32_t ctrl_id, const struct group_msg *def) {
+	uint32_t id = g_group_ids++;
+	auto pair = g_groups[ctrl_id].insert(make_pair(id, peer_group(def)));
+	if (!pair.second) {
+		g_log<ERROR>("Duplicate group id generated, surprising");
+		return 0;
+	}
+	peer_group &group = pair.first->second;
+	for(auto it = bc::g_active_handlers.begin(); it != bc::g_active_handlers.end(); ++it) {
+		group.update(it->second.get());
+	}
+	return id;
+}
+
+bool delete_group(uint32_t ctrl_id, uint32_t group_id) {
+	auto it = g_groups.find(ctrl_id);
+	return it != g_groups.end() && it->second.erase(group_id) > 0;
+}
+
+peer_group * find_group(uint32_t ctrl_id, uint32_t group_id) {
+	auto it = g_groups.find(ctrl_id);
+	if (it == g_groups.end()) {
+		return nullptr;
+	}
+	auto git = it->second.find(group_id);
+	return git == it->second.end() ? nullptr : &git->second;
+}
+
+void delete_groups(uint32_t ctrl_id) {
+	g_groups.erase(ctrl_id);
+}
+
+void groups_update(bc::handler *h) {
+	for(auto it = g_groups.begin(); it != g_groups.end(); ++it) {
+		for(auto git = it->second.begin(); git != it->second.end(); ++git) {
+			git->second.update(h);
+		}
+	}
+}
+
+void groups_remove(bc::handler *h) {
+	for(auto it = g_groups.begin(); it != g_groups.end(); ++it) {
+		for(auto git = it->second.begin(); git != it->second.end(); ++git) {
+			git->second.remove(h);
+		}
+	}
+}
+
+};
@@ -0,0 +1,157 @@
+#include "scheduled_send.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "bitcoin_handler.hpp"
+#include "network.hpp"
+#include "logger.hpp"
+#include "crypto.hpp"
+
+using namespace std;
+
+namespace bc = bitcoin;
+
+namespace ctrl {
+
+static unordered_set<scheduled_send*> g_inactive_scheduled_sends;
+
+static uint64_t realtime_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool addr_less(uint32_t lhs, uint32_t rhs) {
+	struct sockaddr_in l = bc::g_active_handlers.at(lhs)->get_remote_addr();
+	struct sockaddr_in r = bc::g_active_handlers.at(rhs)->get_remote_addr();
+	if (l.sin_addr.s_addr != r.sin_addr.s_addr) {
+		return ntoh(l.sin_addr.s_addr) < ntoh(r.sin_addr.s_addr);
+	}
+	return ntoh(l.sin_port) < ntoh(r.sin_port);
+}
+
+scheduled_send::scheduled_send(uint32_t ctrl_id, const registered_msg &msg, uint32_t message_id, const struct schedule_msg *sched)
+	: msg_(msg), message_id_(message_id), targets_(), next_(0), max_skew_(0), io()
+{
+	for(auto it = g_inactive_scheduled_sends.begin(); it != g_inactive_scheduled_sends.end(); ++it) {
+		delete *it;
+	}
+	g_inactive_scheduled_sends.clear();
+
+	vector<uint32_t> handles;
+	foreach_target(ctrl_id, (const uint8_t *) sched + sizeof(*sched), ntoh(sched->target_cnt), [&](bc::handler *h) {
+			handles.push_back(h->get_id());
+		});
+
+	switch(sched->ordering) {
+	case ORDER_RANDOM:
+		shuffle(handles.begin(), handles.end(), nonce_gen64.gen);
+		break;
+	case ORDER_ADDRESS:
+		sort(handles.begin(), handles.end(), addr_less);
+		break;
+	case ORDER_EXPLICIT:
+		break;
+	default:
+		g_log<ERROR>("Unknown schedule ordering", (int) sched->ordering, "using explicit");
+		break;
+	}
+
+	uint64_t start = ntoh(sched->start);
+	uint64_t window = ntoh(sched->window);
+	if (start == 0) {
+		start = realtime_ns();
+	}
+
+	targets_.reserve(handles.size());
+	for(size_t i = 0; i < handles.size(); ++i) {
+		uint64_t offset = handles.size() > 1 ? (uint64_t) ((double) window * i / (handles.size() - 1)) : 0;
+		targets_.push_back(make_pair(start + offset, handles[i]));
+	}
+
+	g_log_event<CTRL>(EVENT_SCHEDULE, message_id_, (uint32_t) targets_.size(), start, window);
+
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "scheduled_send timerfd_create");
+		g_inactive_scheduled_sends.insert(this);
+		return;
+	}
+	io.set<scheduled_send, &scheduled_send::io_cb>(this);
+	io.set(fd, ev::READ);
+	io.start();
+	arm();
+}
+
+void scheduled_send::arm() {
+	if (next_ >= targets_.size()) {
+		g_log_event<CTRL>(EVENT_SCHEDULE_COMPLETE, message_id_, (uint32_t) targets_.size(), max_skew_);
+		suicide();
+		return;
+	}
+	struct itimerspec spec;
+	bzero(&spec, sizeof(spec));
+	uint64_t when = targets_[next_].first;
+	spec.it_value.tv_sec = when / 1000000000ULL;
+	spec.it_value.tv_nsec = when % 1000000000ULL;
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+		spec.it_value.tv_nsec = 1; /* zero would disarm */
+	}
+	if (timerfd_settime(io.fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "scheduled_send timerfd_settime");
+		suicide();
+	}
+}
+
+void scheduled_send::io_cb(ev::io &watcher, int /*revents*/) {
+	uint64_t expirations;
+	if (read(watcher.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		g_log_event<ERROR>(EVENT_SYSCALL_ERROR, (int32_t) errno, "scheduled_send");
+		suicide();
+		return;
+	}
+
+	uint64_t now = realtime_ns();
+	while(next_ < targets_.size() && targets_[next_].first <= now) {
+		uint64_t scheduled = targets_[next_].first;
+		uint32_t handle_id = targets_[next_].second;
+		++next_;
+
+		bc::handler_map::iterator hit = bc::g_active_handlers.find(handle_id);
+		if (hit == bc::g_active_handlers.end()) {
+			g_log<DEBUG>("Scheduled target went away", message_id_, handle_id);
+			continue;
+		}
+
+		hit->second->append_for_write(msg_.get_buffer(*hit->second));
+		hit->second->flush();
+		now = realtime_ns();
+		max_skew_ = max(max_skew_, now - scheduled);
+		g_log_event<CTRL>(EVENT_SCHEDULED_SEND, message_id_, handle_id, scheduled, now);
+	}
+
+	arm();
+}
+
+void scheduled_send::suicide() {
+	if (io.fd >= 0) {
+		io.stop();
+		close(io.fd);
+		io.fd = -1;
+	}
+	g_inactive_scheduled_sends.insert(this);
+}
+
+scheduled_send::~scheduled_send() {
+	assert(! io.is_active());
+}
+
+};
@@ -19,16 +19,50 @@ class message_types(object):
     COMMAND = 2;
     REGISTER = 3;
     CONNECT = 4;
+    TEMPLATE_MESSAGE = 5;
+    SCHEDULE = 6;
+    GROUP = 7;
+    RING_SETUP = 8;
 
     str_mapping = {
         1 : 'BITCOIN_PACKED_MESSAGE',
         2 : 'COMMAND',
         3 : 'REGISTER',
         4 : 'CONNECT',
+        5 : 'TEMPLATE_MESSAGE',
+        6 : 'SCHEDULE',
+        7 : 'GROUP',
+        8 : 'RING_SETUP',
     }
 
+class patch_sources(object):
+    PATCH_REMOTE_ADDR = 1;
+    PATCH_LOCAL_ADDR = 2;
+    PATCH_NONCE = 3;
+    PATCH_TIME = 4;
+    PATCH_HANDLE_ID = 5;
+
+class schedule_ordering(object):
+    ORDER_RANDOM = 0;
+    ORDER_ADDRESS = 1;
+    ORDER_EXPLICIT = 2;
+
+class group_operations(object):
+    GROUP_DEFINE = 1;
+    GROUP_DELETE = 2;
+
+class group_direction(object):
+    DIRECTION_ANY = 0;
+    DIRECTION_OUTBOUND = 1;
+    DIRECTION_INBOUND = 2;
+
 class targets(object):
     BROADCAST = 0xFFFFFFFF;
+    GROUP = 0xFFFFFFFE; # followed by the group id
+
+    @staticmethod
+    def group(group_id):
+        return (targets.GROUP, group_id)
 
 
 class message(object): # Just a generic message
@@ -37,7 +71,10 @@ class message(object): # Just a generic message
         self.message_type = message_type
         self.payload = payload
 
-    def serialize(self):
+    def serialize(self, request_id=None):
+        # with a request_id this is a version 1 message, answered by a completion
+        if request_id is not None:
+            return pack('>BIBI', 1, len(self.payload) + 4, self.message_type, request_id) + self.payload
         return pack('>BIB', self.version, len(self.payload), self.message_type) + self.payload
 
     @staticmethod
@@ -82,6 +119,50 @@ class bitcoin_msg(message):
     def bitcoin_msg(self,value):
         self.payload = value;
 
+class template_msg(message):
+    # payload is a protocol encoded bitcoin message, slots is a list of
+    # (offset, width, source) with offset relative to the bitcoin payload
+    def repack(self):
+        rv = pack('>I', len(self.slots_))
+        for offset, width, source in self.slots_:
+            rv += pack('>IBB', offset, width, source)
+        return rv + self.bitcoin_msg_
+
+    def __init__(self, payload, slots=()):
+        self.bitcoin_msg_ = payload
+        self.slots_ = slots
+        super(template_msg,self).__init__(message_types.TEMPLATE_MESSAGE, self.repack())
+
+    @staticmethod
+    def deserialize(serialization):
+        version, length, message_type = unpack('>BIB', serialization[:6]);
+        payload = serialization[6:]
+        if version != 0 or length != len(payload) or message_type != message_types.TEMPLATE_MESSAGE:
+            raise Exception("bad template message");
+        slot_cnt = unpack('>I', payload[:4])[0]
+        slots = []
+        for i in range(slot_cnt):
+            slots.append(unpack('>IBB', payload[4 + 6*i:10 + 6*i]))
+        return template_msg(payload[4 + 6*slot_cnt:], tuple(slots))
+
+    @property
+    def bitcoin_msg(self):
+        return self.bitcoin_msg_
+
+    @bitcoin_msg.setter
+    def bitcoin_msg(self,value):
+        self.bitcoin_msg_ = value;
+        self.payload = self.repack();
+
+    @property
+    def slots(self):
+        return self.slots_
+
+    @slots.setter
+    def slots(self,value):
+        self.slots_ = value;
+        self.payload = self.repack();
+
 class connect_msg(message):
 
     def repack(self):
@@ -220,6 +301,147 @@ class command_msg(message):
         self.targets_ = value;
         self.payload = self.repack();
 
+class group_msg(message):
+    # subnet is a dotted quad, every predicate given must match
+
+    def repack(self):
+        return pack('>BIBIBII{0}I'.format(len(self.handles_)), self.operation_, self.group_id_, self.direction_,
+                    socket.ntohl(inet_aton(self.subnet_)), self.prefix_len_, len(self.handles_), len(self.agent_),
+                    *self.handles_) + self.agent_
+
+    def __init__(self, operation, group_id=0, direction=group_direction.DIRECTION_ANY, subnet='0.0.0.0',
+                 prefix_len=0, handles=(), agent=''):
+        self.operation_ = operation
+        self.group_id_ = group_id
+        self.direction_ = direction
+        self.subnet_ = subnet
+        self.prefix_len_ = prefix_len
+        self.handles_ = handles
+        self.agent_ = agent
+        super(group_msg, self).__init__(message_types.GROUP, self.repack())
+
+    @staticmethod
+    def define(**kwargs):
+        return group_msg(group_operations.GROUP_DEFINE, **kwargs)
+
+    @staticmethod
+    def delete(group_id):
+        return group_msg(group_operations.GROUP_DELETE, group_id)
+
+    @staticmethod
+    def deserialize(serialization):
+        version, length, message_type = unpack('>BIB', serialization[:6]);
+        payload = serialization[6:]
+        if version != 0 or length != len(payload) or message_type != message_types.GROUP:
+            raise Exception("bad group message");
+        operation, group_id, direction, subnet, prefix_len, handle_cnt, agent_len = unpack('>BIBIBII', payload[:19])
+        if len(payload) != 19 + 4 * handle_cnt + agent_len:
+            raise Exception("bad payload", len(payload))
+        handles = unpack('>{0}I'.format(handle_cnt), payload[19:19 + 4 * handle_cnt])
+        return group_msg(operation, group_id, direction, inet_ntoa(socket.htonl(subnet)), prefix_len,
+                         handles, payload[19 + 4 * handle_cnt:])
+
+    @property
+    def operation(self):
+        return self.operation_
+
+    @property
+    def group_id(self):
+        return self.group_id_
+
+    @property
+    def direction(self):
+        return self.direction_
+
+    @property
+    def subnet(self):
+        return self.subnet_
+
+    @property
+    def prefix_len(self):
+        return self.prefix_len_
+
+    @property
+    def handles(self):
+        return self.handles_
+
+    @property
+    def agent(self):
+        return self.agent_
+
+class schedule_msg(message):
+    # start is ns since the epoch (0 is now), window is ns
+
+    def repack(self):
+        return pack('>IQQBI{0}I'.format(len(self.targets_)), self.message_id_, self.start_, self.window_,
+                    self.ordering_, len(self.targets_), *self.targets_)
+
+    def __init__(self, message_id, start, window, ordering, targets_list=()):
+        self.message_id_ = message_id
+        self.start_ = start
+        self.window_ = window
+        self.ordering_ = ordering
+        self.targets_ = targets_list
+        super(schedule_msg, self).__init__(message_types.SCHEDULE, self.repack())
+
+    @staticmethod
+    def deserialize(serialization):
+        version, length, message_type = unpack('>BIB', serialization[:6]);
+        payload = serialization[6:]
+        if version != 0 or length != len(payload) or message_type != message_types.SCHEDULE:
+            raise Exception("bad schedule message");
+        if (len(payload) < 25 or (len(payload) - 25) % 4 != 0):
+            raise Exception("bad payload", len(payload))
+        res = unpack('>IQQBI{0}I'.format((len(payload) - 25) / 4), payload)
+        if res[4] != len(res[5:]):
+            raise Exception("target count and target list mismatch")
+        return schedule_msg(res[0], res[1], res[2], res[3], res[5:])
+
+    @property
+    def message_id(self):
+        return self.message_id_
+
+    @message_id.setter
+    def message_id(self,value):
+        self.message_id_ = value;
+        self.payload = self.repack();
+
+    @property
+    def start(self):
+        return self.start_
+
+    @start.setter
+    def start(self,value):
+        self.start_ = value;
+        self.payload = self.repack();
+
+    @property
+    def window(self):
+        return self.window_
+
+    @window.setter
+    def window(self,value):
+        self.window_ = value;
+        self.payload = self.repack();
+
+    @property
+    def ordering(self):
+        return self.ordering_
+
+    @ordering.setter
+    def ordering(self,value):
+        self.ordering_ = value;
+        self.payload = self.repack();
+
+    @property
+    def targets(self):
+        return self.targets_
+
+    @targets.setter
+    def targets(self,value):
+        self.targets_ = value;
+        self.payload = self.repack();
+
 def deserialize_message(serialization):
     version, length, message_type = unpack('>BIB', serialization[:6]);
     payload = serialization[6:]
@@ -235,6 +457,43 @@ def deserialize_message(serialization):
     # (I figure this is mostly for debugging) you'll want to fix that)
     return type_to_obj[message_type].deserialize(serialization);
 
+class completion(object):
+    # reply to every version 1 message. payload depends on message_type/command
+    header_len = 14
+
+    def __init__(self, request_id, message_type, command, status, payload):
+        self.request_id = request_id
+        self.message_type = message_type
+        self.command = command
+        self.status = status
+        self.payload = payload
+
+    @staticmethod
+    def deserialize(serialization):
+        length, request_id, message_type, command, status = unpack('>IIBBi', serialization[:completion.header_len])
+        payload = serialization[completion.header_len:]
+        if length != len(payload):
+            raise Exception("bad completion length")
+        return completion(request_id, message_type, command, status, payload)
+
+    @staticmethod
+    def read(sock):
+        # reads one completion from a blocking socket
+        header = sock.recv(completion.header_len, socket.MSG_WAITALL)
+        if len(header) != completion.header_len:
+            raise Exception("connector hung up")
+        length = unpack('>I', header[:4])[0]
+        payload = sock.recv(length, socket.MSG_WAITALL) if length else ''
+        return completion.deserialize(header + payload)
+
+    @property
+    def success(self):
+        return self.status == 0
+
+    @property
+    def error(self):
+        return self.payload.rstrip('\0') if self.status != 0 else None
+
 class connection_info(object):
     # largely a copy of another structure above. Should be refactored
     def repack(self):
@@ -303,7 +562,10 @@ type_to_obj = {
     message_types.BITCOIN_PACKED_MESSAGE : bitcoin_msg,
     message_types.COMMAND : command_msg,
     message_types.REGISTER : register_msg,
-    message_types.CONNECT : connect_msg
+    message_types.CONNECT : connect_msg,
+    message_types.TEMPLATE_MESSAGE : template_msg,
+    message_types.SCHEDULE : schedule_msg,
+    message_types.GROUP : group_msg
 }
 
 
@@ -1,11 +1,13 @@
 from struct import *
 import socket
+import collections
 from datetime import *
 
 from common import *
 import traceback;
 
 class log_types(object):
+    PAYLOAD = 0x1; #/* message bodies BITCOIN_MSG records refer to */
     DEBUG = 0x2; #/* interpret as a string */
     CTRL = 0x4; #/* control messages */
     ERROR = 0x8; #/* strings */
@@ -15,6 +17,7 @@ class log_types(object):
     CLIENT = 0x80;
 
     str_mapping = {
+        0x1 : 'PAYLOAD',
         0x2 : 'DEBUG',
         0x4 : 'CTRL',
         0x8 : 'ERROR',
@@ -45,6 +48,64 @@ class update_types(object):
         0x80 : 'CONNECTOR_DISCONNECT',
     }
 
+class log_events(object):
+    # CTRL
+    REGISTER = 1;
+    MESSAGE_REGISTERED = 2;
+    CXN_REQUESTED = 3;
+    CONNECT_ATTEMPT = 4;
+    CTRL_DISCONNECT = 5;
+    SCHEDULE = 6;
+    SCHEDULED_SEND = 7;
+    SCHEDULE_COMPLETE = 8;
+    GROUP_DEFINED = 9;
+    GROUP_DELETED = 10;
+    RING_SETUP = 11;
+    # CONNECTOR
+    STARTUP = 32;
+    SHUTDOWN = 33;
+    BLACKLIST_LOADED = 34;
+    LOG_BATCHING = 35;
+    LOG_SPOOL_DRAINED = 36;
+    LOG_METRICS = 37;
+    # ERROR
+    SYSCALL_ERROR = 64;
+    INVALID_CTRL_MESSAGE = 65;
+    INVALID_MESSAGE_ID = 66;
+    BLACKLISTED_CONNECT = 67;
+
+    # event id -> (name, field names)
+    str_mapping = {
+        1 : ('REGISTER', ('old_regid', 'new_regid')),
+        2 : ('MESSAGE_REGISTERED', ('regid', 'message_id', 'command', 'length', 'slot_cnt')),
+        3 : ('CXN_REQUESTED', ('regid', 'connections')),
+        4 : ('CONNECT_ATTEMPT', ('regid', 'remote')),
+        5 : ('CTRL_DISCONNECT', ('handler_id',)),
+        6 : ('SCHEDULE', ('message_id', 'targets', 'start', 'window')),
+        7 : ('SCHEDULED_SEND', ('message_id', 'handle_id', 'scheduled', 'actual')),
+        8 : ('SCHEDULE_COMPLETE', ('message_id', 'targets', 'max_skew')),
+        9 : ('GROUP_DEFINED', ('regid', 'group_id', 'members')),
+        10 : ('GROUP_DELETED', ('regid', 'group_id', 'deleted')),
+        11 : ('RING_SETUP', ('regid', 'size')),
+        32 : ('STARTUP', ('commit',)),
+        33 : ('SHUTDOWN', ()),
+        34 : ('BLACKLIST_LOADED', ('entries',)),
+        35 : ('LOG_BATCHING', ('batches', 'bytes', 'mean_latency_us', 'max_latency_us', 'batch_size')),
+        36 : ('LOG_SPOOL_DRAINED', ('bytes', 'dropped')),
+        37 : ('LOG_METRICS', ('snapshot',)),
+        64 : ('SYSCALL_ERROR', ('errno', 'context')),
+        65 : ('INVALID_CTRL_MESSAGE', ('regid', 'message_type')),
+        66 : ('INVALID_MESSAGE_ID', ('regid', 'message_id')),
+        67 : ('BLACKLISTED_CONNECT', ('remote',)),
+    }
+
+class log_fields(object):
+    U32 = 1;
+    I32 = 2;
+    U64 = 3;
+    ADDR = 4; # sockaddr_in, comes out as (ip, port)
+    STR = 5;
+
 class log(object):
     def __init__(self, log_type, source_id, timestamp, rest):
         self.source_id = source_id
@@ -54,8 +115,17 @@ class log(object):
 
     @staticmethod
     def deserialize_parts(serialization):
-        source_id, log_type, timestamp = unpack('>IBQ', serialization[:13])
-        rest = serialization[13:]
+        # version 2 records have a version byte where the top byte of
+        # a version 1 timestamp (whole seconds, so always 0) was, and
+        # count nanoseconds. timestamp comes back in seconds either way
+        source_id, log_type, version = unpack('>IBB', serialization[:6])
+        if version == 0:
+            source_id, log_type, timestamp = unpack('>IBQ', serialization[:13])
+            rest = serialization[13:]
+        else:
+            source_id, log_type, version, timestamp = unpack('>IBBQ', serialization[:14])
+            timestamp = timestamp / 1e9
+            rest = serialization[14:]
         return (source_id, log_type, timestamp, rest);
 
     @staticmethod
@@ -65,6 +135,59 @@ class log(object):
     def __str__(self):
         return "[{0}] ({1}) {2}: {3}".format(unix2str(self.timestamp), self.source_id, log_types.str_mapping[self.log_type], self.rest);
 
+class event_log(log):
+    # structured CTRL, CONNECTOR and ERROR records. The rest starts
+    # with a zero byte so it reads as an empty string to text readers
+    def __init__(self, log_type, source_id, timestamp, event_id, fields, rest):
+        self.event_id = event_id
+        self.fields = fields
+        super(event_log, self).__init__(log_type, source_id, timestamp, rest)
+
+    @staticmethod
+    def is_event(rest):
+        return len(rest) >= 4 and rest[:1] == b'\x00'
+
+    @staticmethod
+    def deserialize(log_type, source_id, timestamp, rest):
+        event_id, field_cnt = unpack('>HB', rest[1:4])
+        fields = []
+        pos = 4
+        for i in range(field_cnt):
+            tag, = unpack('B', rest[pos:pos+1])
+            pos += 1
+            if tag == log_fields.U32:
+                val, = unpack('>I', rest[pos:pos+4])
+                pos += 4
+            elif tag == log_fields.I32:
+                val, = unpack('>i', rest[pos:pos+4])
+                pos += 4
+            elif tag == log_fields.U64:
+                val, = unpack('>Q', rest[pos:pos+8])
+                pos += 8
+            elif tag == log_fields.ADDR:
+                fam, port, addr = unpack('=hHI8x', rest[pos:pos+16])
+                val = (inet_ntoa(addr), socket.ntohs(port))
+                pos += 16
+            elif tag == log_fields.STR:
+                str_len, = unpack('>I', rest[pos:pos+4])
+                val = rest[pos+4:pos+4+str_len]
+                pos += 4 + str_len
+            else:
+                raise ValueError('unknown field tag {0}'.format(tag))
+            fields.append(val)
+        return event_log(log_type, source_id, timestamp, event_id, fields, rest)
+
+    @property
+    def name(self):
+        return log_events.str_mapping.get(self.event_id, ('EVENT({0})'.format(self.event_id), ()))[0]
+
+    def as_dict(self):
+        names = log_events.str_mapping.get(self.event_id, ('', ()))[1]
+        return dict((names[i] if i < len(names) else str(i), v) for i, v in enumerate(self.fields))
+
+    def __str__(self):
+        return "[{0}] ({1}) {2}: {3} {4}".format(unix2str(self.timestamp), self.source_id, log_types.str_mapping[self.log_type], self.name, self.as_dict());
+
 class debug_log(log):
     @staticmethod
     def deserialize(source_id, timestamp, rest):
@@ -79,17 +202,23 @@ class client_log(log):
 class connector_log(log):
     @staticmethod
     def deserialize(source_id, timestamp, rest):
+        if event_log.is_event(rest):
+            return event_log.deserialize(log_types.CONNECTOR, source_id, timestamp, rest)
         return connector_log(log_types.CONNECTOR, source_id, timestamp, rest)
 
 class ctrl_log(log):
     @staticmethod
     def deserialize(source_id, timestamp, rest):
+        if event_log.is_event(rest):
+            return event_log.deserialize(log_types.CTRL, source_id, timestamp, rest)
         return ctrl_log(log_types.CTRL, source_id, timestamp, rest)
 
 
 class error_log(log):
     @staticmethod
     def deserialize(source_id, timestamp, rest):
+        if event_log.is_event(rest):
+            return event_log.deserialize(log_types.ERROR, source_id, timestamp, rest)
         return error_log(log_types.ERROR, source_id, timestamp, rest)
 
 class bitcoin_log(log): # bitcoin connection/disconnection events
@@ -142,26 +271,73 @@ class bitcoin_log(log): # bitcoin connection/disconnection events
     def local_port(self):
         return socket.ntohs(self.l_port_)
 
+# Messages the connector sends may be logged once as a PAYLOAD record
+# and referred to by hash from the BITCOIN_MSG records for them. The
+# payloads seen so far, by (source_id, hash), to resolve those with.
+# Past PAYLOADS_MAX bytes of them the oldest are forgotten.
+payloads = collections.OrderedDict()
+payloads_bytes = 0
+PAYLOADS_MAX = 64 * 1024 * 1024
+
+def remember_payload(key, msg):
+    global payloads_bytes
+    old = payloads.pop(key, None)
+    if old is not None:
+        payloads_bytes -= len(old)
+    payloads[key] = msg
+    payloads_bytes += len(msg)
+    while payloads_bytes > PAYLOADS_MAX and len(payloads) > 1:
+        _, oldest = payloads.popitem(last=False)
+        payloads_bytes -= len(oldest)
+
+BITCOIN_MSG_PAYLOAD_REF = 0x2
+
+class payload_log(log):
+    def __init__(self, source_id, timestamp, payload_hash, bitcoin_msg):
+        self.payload_hash = payload_hash
+        self.bitcoin_msg = bitcoin_msg
+        rest = pack('>Q', payload_hash) + bitcoin_msg
+        super(payload_log, self).__init__(log_types.PAYLOAD, source_id, timestamp, rest)
+
+    @staticmethod
+    def deserialize(source_id, timestamp, rest):
+        payload_hash, = unpack('>Q', rest[:8])
+        remember_payload((source_id, payload_hash), rest[8:])
+        return payload_log(source_id, timestamp, payload_hash, rest[8:])
+
+    def __str__(self):
+        return "[{0}] ({1}) {2}: hash: {3:x}, bitcoin_msg: (ommitted)".format(unix2str(self.timestamp), self.source_id, log_types.str_mapping[self.log_type], self.payload_hash)
+
 class bitcoin_msg_log(log):
+    # bitcoin_msg is None if it refers to a payload never seen (e.g.,
+    # one logged before the reader started)
     def repack(self):
+        if self.payload_hash is not None:
+            return pack('>IBQ', self.handle_id, 1 | BITCOIN_MSG_PAYLOAD_REF, self.payload_hash)
         return pack('>I?', self.handle_id, self.is_sender) + self.bitcoin_msg
 
-    def __init__(self, source_id, timestamp, handle_id, is_sender, bitcoin_msg):
+    def __init__(self, source_id, timestamp, handle_id, is_sender, bitcoin_msg, payload_hash = None):
         self.handle_id = handle_id;
         self.is_sender = is_sender
         self.bitcoin_msg = bitcoin_msg
+        self.payload_hash = payload_hash
         rest = self.repack()
         super(bitcoin_msg_log, self).__init__(log_types.BITCOIN_MSG, source_id, timestamp, rest)
 
     @staticmethod
     def deserialize(source_id, timestamp, rest):
-        handle_id, is_sender = unpack('>I?', rest[:5])
-        return bitcoin_msg_log(source_id, timestamp, handle_id, is_sender, rest[5:])
+        handle_id, is_sender = unpack('>IB', rest[:5])
+        if is_sender & BITCOIN_MSG_PAYLOAD_REF:
+            payload_hash, = unpack('>Q', rest[5:13])
+            return bitcoin_msg_log(source_id, timestamp, handle_id, True,
+                                   payloads.get((source_id, payload_hash)), payload_hash)
+        return bitcoin_msg_log(source_id, timestamp, handle_id, bool(is_sender), rest[5:])
 
     def __str__(self):
-        return "[{0}] ({1}) {2}: handle_id: {3}, is_sender: {4}, bitcoin_msg: (ommitted)".format(unix2str(self.timestamp), self.source_id, log_types.str_mapping[self.log_type], self.handle_id, self.is_sender)
+        return "[{0}] ({1}) {2}: handle_id: {3}, is_sender: {4}, bitcoin_msg: {5}".format(unix2str(self.timestamp), self.source_id, log_types.str_mapping[self.log_type], self.handle_id, self.is_sender, "(ommitted)" if self.bitcoin_msg is not None else "(payload never seen)")
 
 type_to_obj = {
+    log_types.PAYLOAD : payload_log,
     log_types.DEBUG : debug_log,
 	log_types.CTRL : ctrl_log,
 	log_types.ERROR : error_log,
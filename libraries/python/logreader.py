@@ -12,7 +12,7 @@ import logger;
 # use of the logger.py classes
 
 # Set the log type you are interested in here 
-interests = ~(logger.log_types.BITCOIN_MSG | logger.log_types.BITCOIN)
+interests = ~(logger.log_types.BITCOIN_MSG | logger.log_types.PAYLOAD | logger.log_types.BITCOIN)
 
 for filename in sys.argv[1:]:
     fp = open(filename, 'rb')
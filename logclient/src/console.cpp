@@ -25,7 +25,10 @@
 
 using namespace std;
 
-string time_to_str(const time_t *t)  {
+static payload_cache g_payloads;
+static vector<uint8_t> g_upgraded; /* version 1 records, brought up to date */
+
+string time_to_str(const time_t *t, uint32_t nsec)  {
 	// return put_time(localtime(t), "%FT%T%z") !!!NOT IN G++ YET
 	
 	/* uncomment abouve when it is available...*/
@@ -36,7 +39,8 @@ string time_to_str(const time_t *t)  {
 	    << '-' << setfill('0') << setw(2) << tm->tm_mday
 	    << 'T' << setfill('0') << setw(2) << tm->tm_hour << ':' 
 	    << setfill('0') << setw(2) << tm->tm_min << ':'  
-	    << setfill('0') << setw(2) << tm->tm_sec;
+	    << setfill('0') << setw(2) << tm->tm_sec
+	    << '.' << setfill('0') << setw(9) << nsec;
 	if (offset < 0) {
 		oss << '-';
 		offset = -offset;
@@ -62,20 +66,30 @@ string time_to_str(const time_t *t)  {
 
 
 void print_message(read_buffer &input_buf) {
-	const struct log_format *log = (const struct log_format*) input_buf.extract_buffer().const_ptr();
+	size_t len = input_buf.cursor();
+	const struct log_format *log = log_upgrade(input_buf.extract_buffer().const_ptr(), len, g_upgraded);
 	enum log_type lt(static_cast<log_type>(log->type));
-	time_t time = ntoh(log->timestamp);
+	uint64_t nanos = ntoh(log->timestamp);
+	time_t time = nanos / 1000000000ULL;
 	
 	const uint8_t *msg = log->rest;
 
-	cout << time_to_str(&time);
+	cout << time_to_str(&time, nanos % 1000000000ULL);
 	cout << " (" << ntoh(log->source_id) << ") ";
 	cout << type_to_str(lt);
 
 	if (lt == BITCOIN_MSG) {
-		cout << " ID:" << ntoh(*((uint32_t*) msg)) << " IS_SENDER:" << *((bool*) (msg+4));
-		msg += 5;
-		cout << " " << ((const struct bitcoin::packed_message*)(msg)) << endl;
+		cout << " ID:" << ntoh(*((uint32_t*) msg)) << " IS_SENDER:" << (msg[4] & 1);
+		const struct bitcoin::packed_message *m = g_payloads.resolve(log, len);
+		if (m) {
+			cout << " " << m << endl;
+		} else {
+			cout << " (payload never seen)" << endl;
+		}
+	} else if (lt == PAYLOAD) {
+		g_payloads.remember(log, len);
+		const struct payload_log_format *p = (const struct payload_log_format*) log;
+		cout << " HASH:" << hex << ntoh(p->hash) << dec << " " << &p->msg << endl;
 	} else if (lt == BITCOIN) {
 
 		/* TODO: write a function to unwrap this as a struct */
@@ -125,6 +139,12 @@ void print_message(read_buffer &input_buf) {
 
 		
 
+	} else if (*msg == 0) { /* structured event */
+		cout << " ";
+		if (!print_event(cout, msg, len - sizeof(*log))) {
+			cout << " (truncated event)";
+		}
+		cout << endl;
 	} else {
 		cout << " " << ((char*)msg) << endl;
 	}
@@ -137,15 +157,7 @@ int main(int argc, char *argv[]) {
 		load_config("../netmine.cfg");
 	}
 
-	const libconfig::Config *cfg(get_config());
-
-	string root((const char*)cfg->lookup("logger.root"));
-
-	/* TODO: make configurable */
-	mkdir(root.c_str(), 0777);
-	string client_dir(root + "clients/");
-
-	int client = unix_sock_client(client_dir + "all", false);
+	int client = log_client_socket("all", false);
 
 	bool reading_len(true);
 
@@ -25,7 +25,10 @@ const size_t MULT = 10000;
 
 using namespace std;
 
-string time_to_str(const time_t *t)  {
+static payload_cache g_payloads;
+static vector<uint8_t> g_upgraded; /* version 1 records, brought up to date */
+
+string time_to_str(const time_t *t, uint32_t nsec)  {
 	// return put_time(localtime(t), "%FT%T%z") !!!NOT IN G++ YET
 	
 	/* uncomment abouve when it is available...*/
@@ -36,7 +39,8 @@ string time_to_str(const time_t *t)  {
 	    << '-' << setfill('0') << setw(2) << tm->tm_mday
 	    << 'T' << setfill('0') << setw(2) << tm->tm_hour << ':' 
 	    << setfill('0') << setw(2) << tm->tm_min << ':'  
-	    << setfill('0') << setw(2) << tm->tm_sec;
+	    << setfill('0') << setw(2) << tm->tm_sec
+	    << '.' << setfill('0') << setw(9) << nsec;
 	if (offset < 0) {
 		oss << '-';
 		offset = -offset;
@@ -62,21 +66,29 @@ string time_to_str(const time_t *t)  {
 
 
 void print_message(const uint8_t *buf, size_t len) {
-	(void) len;
-	const struct log_format *log = (const struct log_format*) buf;
+	const struct log_format *log = log_upgrade(buf, len, g_upgraded);
 	enum log_type lt(static_cast<log_type>(log->type));
-	time_t time = ntoh(log->timestamp);
+	uint64_t nanos = ntoh(log->timestamp);
+	time_t time = nanos / 1000000000ULL;
 	
 	const uint8_t *msg = log->rest;
 
-	cout << time_to_str(&time);
+	cout << time_to_str(&time, nanos % 1000000000ULL);
 	cout << " (" << ntoh(log->source_id) << ") ";
 	cout << type_to_str(lt);
 
 	if (lt == BITCOIN_MSG) {
-		cout << " ID:" << ntoh(*((uint32_t*) msg)) << " IS_SENDER:" << *((bool*) (msg+4));
-		msg += 5;
-		cout << " " << ((const struct bitcoin::packed_message*)(msg)) << endl;
+		cout << " ID:" << ntoh(*((uint32_t*) msg)) << " IS_SENDER:" << (msg[4] & 1);
+		const struct bitcoin::packed_message *m = g_payloads.resolve(log, len);
+		if (m) {
+			cout << " " << m << endl;
+		} else {
+			cout << " (payload never seen)" << endl;
+		}
+	} else if (lt == PAYLOAD) {
+		g_payloads.remember(log, len);
+		const struct payload_log_format *p = (const struct payload_log_format*) log;
+		cout << " HASH:" << hex << ntoh(p->hash) << dec << " " << &p->msg << endl;
 	} else if (lt == BITCOIN) {
 		/* TODO: write a function to unwrap this as a struct */
 		uint32_t update_type = ntoh(*((uint32_t*)(msg + 4)));
@@ -122,11 +134,38 @@ void print_message(const uint8_t *buf, size_t len) {
 		} else {
 			cout << endl;
 		}
+	} else if (*msg == 0) { /* structured event */
+		cout << " ";
+		if (!print_event(cout, msg, len - sizeof(*log))) {
+			cout << " (truncated event)";
+		}
+		cout << endl;
 	} else {
 		cout << " " << ((char*)msg) << endl;
 	}
 }
 
+/* a compressed batch, as verbatim writes them */
+void print_frame(const uint8_t *buf, size_t len) {
+	const uint8_t *frame = buf + sizeof(LOG_READER_FRAME_HEADER);
+	len -= sizeof(LOG_READER_FRAME_HEADER);
+	vector<uint8_t> raw(log_frame_size(frame, len));
+	if (raw.empty() || !log_unframe(frame, len, raw.data())) {
+		cerr << "Skipping corrupt frame" << endl;
+		return;
+	}
+	size_t off = 0;
+	while(off + sizeof(uint32_t) <= raw.size()) {
+		uint32_t rec = ntoh(*((const uint32_t*) (raw.data() + off)));
+		if (off + sizeof(uint32_t) + rec > raw.size()) {
+			cerr << "Truncated record in frame" << endl;
+			return;
+		}
+		print_message(raw.data() + off + sizeof(uint32_t), rec);
+		off += sizeof(uint32_t) + rec;
+	}
+}
+
 void grow_buf(uint8_t **buf, uint32_t sz) {
 	*buf = (uint8_t *) realloc((void *) *buf, sz);
 }
@@ -173,7 +212,11 @@ int main(int argc, char *argv[]) {
 				cerr << "Hit end at partial message" << endl;
 				break;
 			};
-			print_message(buf, (size_t) bytes_read);
+			if (log_is_frame(buf, bytes_read)) {
+				print_frame(buf, bytes_read);
+			} else {
+				print_message(buf, (size_t) bytes_read);
+			}
 			reading_len = true;
 		}
 	}
@@ -33,6 +33,9 @@ using namespace std;
 
 bool g_prerotate = false;
 bool g_postrotate = false;
+/* asked the logserver to send payloads again, and waiting for its
+   mark to rotate on */
+bool g_resending = false;
 
 fstream logout;
 
@@ -45,9 +48,15 @@ void sigusr(int num) {
 }
 
 
-void print_message(read_buffer &input_buf) {
+/* false if it is the mark answering LOG_CLIENT_RESEND */
+bool print_message(read_buffer &input_buf) {
 	const uint8_t *buf = input_buf.extract_buffer().const_ptr();
+	uint64_t offset; /* after the length, which is written out too */
+	if (log_is_mark(buf + sizeof(uint32_t), input_buf.cursor() - sizeof(uint32_t), &offset)) {
+		return false;
+	}
 	logout.write((const char*)buf, input_buf.cursor());
+	return true;
 }
 
 void open_log() {
@@ -72,6 +81,18 @@ void open_log() {
 	}
 }
 
+/* Don't write until rotation finished (i.e., received postrotate) */
+void rotate() {
+	logout.flush();
+	logout.close();
+
+	while(!g_postrotate) {
+		sleep(1);
+	}
+
+	open_log();
+	g_prerotate = g_postrotate = g_resending = false;
+}
 
 int main(int argc, char *argv[]) {
 
@@ -80,12 +101,15 @@ int main(int argc, char *argv[]) {
 	}
 	const libconfig::Config *cfg(get_config());
 
-	string root((const char*)cfg->lookup("logger.root"));
+	int client = log_client_socket("all", false);
 
-	mkdir(root.c_str(), 0777);
-	string client_dir(root + "clients/");
-
-	int client = unix_sock_client(client_dir + "all", false);
+	/* frames are written out as they come */
+	const char *compression = "";
+	cfg->lookupValue("verbatim.compression", compression);
+	enum log_codec codec = log_codec_from_str(compression);
+	if (codec != LOG_CODEC_NONE && !log_request_codec(client, codec)) {
+		cerr << "Could not ask for " << compression << " frames: " << strerror(errno) << endl;
+	}
 
 	open_log();
 
@@ -113,16 +137,16 @@ int main(int argc, char *argv[]) {
 			return EXIT_FAILURE;
 		}
 
-		if (g_prerotate) { /* do log rotation if necessary. Don't write until rotation finished (i.e., received postrotate) */
-			logout.flush();
-			logout.close();
-
-			while(!g_postrotate) {
-				sleep(1);
+		/* Each PAYLOAD is only sent once, so for the new file to have
+		   the ones it refers to, have the logserver send them again, and
+		   keep writing to the old one until its mark says they will be */
+		if (g_prerotate && !g_resending) {
+			if (log_request_resend(client)) {
+				g_resending = true;
+			} else {
+				cerr << "Could not ask for payloads again, rotating anyway: " << strerror(errno) << endl;
+				rotate();
 			}
-
-			open_log();
-			g_prerotate = g_postrotate = false;
 		}
 
 		if (!input_buf.hungry()) {
@@ -131,7 +155,9 @@ int main(int argc, char *argv[]) {
 				input_buf.to_read(ntoh(netlen));
 				reading_len = false;
 			} else {
-				print_message(input_buf);
+				if (!print_message(input_buf) && g_resending) {
+					rotate();
+				}
 				input_buf.cursor(0);
 				input_buf.to_read(4);
 				reading_len = true;
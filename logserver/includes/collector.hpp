@@ -5,46 +5,178 @@
 #include <memory>
 #include <unordered_map>
 #include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+#include <ev++.h>
 
 #include "output_cxn.hpp"
 #include "wrapped_buffer.hpp"
+#include "spill.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
 
 struct sized_buffer {
 	wrapped_buffer<uint8_t> buffer;
+	size_t offset; // where the record starts, records from a ring share a buffer
 	size_t len; // usable length
 	uint32_t source_id;
-	sized_buffer(wrapped_buffer<uint8_t> other, size_t a_len, uint32_t source) : buffer(other), len(a_len), source_id(source) {}
-	sized_buffer(const sized_buffer &o) : buffer(o.buffer), len(o.len), source_id(o.source_id) {}
-	sized_buffer() : buffer(), len(0), source_id(0) {}
-	sized_buffer & operator=(sized_buffer &o) {
+	sized_buffer(wrapped_buffer<uint8_t> other, size_t a_len, uint32_t source, size_t a_offset = 0) 
+		: buffer(other), offset(a_offset), len(a_len), source_id(source) {}
+	sized_buffer(const sized_buffer &o) : buffer(o.buffer), offset(o.offset), len(o.len), source_id(o.source_id) {}
+	sized_buffer() : buffer(), offset(0), len(0), source_id(0) {}
+	sized_buffer & operator=(const sized_buffer &o) {
 		buffer = o.buffer;
+		offset = o.offset;
 		len = o.len;
 		source_id = o.source_id;
 		return *this;
 	}
 };
 
-struct sized_buffer_queue {
-	std::deque<struct sized_buffer> queue;
-	size_t total_size;
-	sized_buffer_queue() : queue(), total_size(0) {};
+/* source_id, hash of a PAYLOAD record */
+typedef std::pair<uint32_t, uint64_t> payload_key;
+
+/* a record in the ring, with what consumers get filtered on */
+struct ring_entry {
+	struct sized_buffer record;
+	uint64_t start; /* bytes appended before it */
+	payload_key key; /* if has_hash */
+	uint64_t end; /* journal offset past it, if there is a journal */
+	uint32_t partition[2]; /* by group_key */
+	uint8_t type;
+	bool has_hash;
+	ring_entry(const struct sized_buffer &p, uint64_t a_start, uint8_t a_type, bool a_has_hash, const payload_key &a_key,
+	           uint64_t a_end, uint32_t by_handle, uint32_t by_remote)
+		: record(p), start(a_start), key(a_key), end(a_end), partition(), type(a_type), has_hash(a_has_hash) {
+		partition[GROUP_BY_HANDLE] = by_handle;
+		partition[GROUP_BY_REMOTE] = by_remote;
+	}
+};
+
+/* The members of a group from some point in the ring on. A record
+   goes to the member its partition hashes to among the members when
+   it was appended, so one that joins or leaves doesn't change who has
+   the records already in the ring */
+struct group_epoch {
+	uint64_t from; /* bytes appended before it */
+	std::vector<output_cxn::handler *> members;
+	group_epoch(uint64_t a_from, const std::vector<output_cxn::handler *> &a_members)
+		: from(a_from), members(a_members) {}
+};
+
+struct consumer_group {
+	enum group_key key;
+	std::deque<struct group_epoch> epochs;
+	consumer_group(enum group_key a_key) : key(a_key), epochs() {}
+};
+
+struct consumer_state {
+	uint64_t cursor; /* sequence number of the next record to look at */
+	std::set<payload_key> payloads; /* the ones this consumer has been sent */
+	/* what it fell too far behind on, read before the ring */
+	std::unique_ptr<class spill> spilled;
+	/* what it asked for from the journal, read before that */
+	std::unique_ptr<class journal_reader> replay;
+	/* records a member of its group left unread, read before the ring */
+	std::deque<struct sized_buffer> handed;
+	uint64_t ring_position; /* journal offset past the record before cursor */
+	uint64_t position; /* journal offset past what it has been given */
+	consumer_state(uint64_t a_cursor, uint64_t a_position)
+		: cursor(a_cursor), payloads(), spilled(), replay(), handed(), ring_position(a_position), position(a_position) {}
 };
 
 class collector {
 public:
 
-	void append(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id);
+	/* the record is the len bytes of data from offset on */
+	void append(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset = 0);
 	struct sized_buffer pop(output_cxn::handler *h);
 	void add_consumer(output_cxn::handler *h); /* adds a consumer handler */
 	void retire_consumer(output_cxn::handler *h);
-	static collector & get() {
-		static collector c;
-		return c;
-	}
+	std::vector<struct consumer_lag> lags() const;
+	/* has h start with what the journal has from value on (see
+	   log_replay_from). False if this collector has no journal */
+	bool replay(output_cxn::handler *h, enum log_replay_from from, uint64_t value);
+	/* journal offset past what h has been given */
+	uint64_t position(output_cxn::handler *h) const;
+	/* h's reader forgot the payloads it was sent, so send them again */
+	void resend_payloads(output_cxn::handler *h);
+	/* union of what its consumers want */
+	uint8_t interests() const { return interests_; }
+	/* when a consumer's interests changed, e.g., it sent a filter */
+	void update_interests();
+	/* each fan-out loop has its own */
+	static collector & get();
 private:
-	collector() : queues() {}
-	std::unordered_map<output_cxn::handler *, sized_buffer_queue> queues;
-	                   
+	collector();
+	/* the next record in the ring for h. pop, without the bookkeeping */
+	struct sized_buffer next(output_cxn::handler *h, consumer_state &c);
+	/* moves what h has yet to read in the ring to its spill, up to
+	   step bytes of it, taking them off step. False if it is past
+	   logger.spill.max_size, or there is no spilling */
+	bool spill_backlog(output_cxn::handler *h, consumer_state &c, uint64_t &step);
+	/* spills or drops the slowest consumers' backlogs, up to step
+	   bytes of them, until the ring is under max_buffer */
+	void shed(uint64_t step);
+	void spiller_cb(ev::prepare &, int);
+	void lag_cb(ev::timer &, int);
+	void remember_payload(const payload_key &key, const struct sized_buffer &p);
+	/* charges the ring for p's buffer, if nothing else in it has */
+	void hold(const struct sized_buffer &p);
+	void release(const struct sized_buffer &p);
+	/* drops the records every consumer is past */
+	void trim();
+	/* if h gets e, by its interests, its group and its filter */
+	bool wanted(output_cxn::handler *h, const struct ring_entry &e) const;
+	/* likewise, whoever in its group e went to */
+	bool matches(output_cxn::handler *h, const struct ring_entry &e) const;
+	/* the message of a BITCOIN_MSG record, NULL if its payload is gone */
+	const struct bitcoin::packed_message * message_of(const struct ring_entry &e) const;
+	const char * command_of(const struct ring_entry &e) const;
+	/* the member of h's group e goes to */
+	const output_cxn::handler * owner(const output_cxn::handler *h, const struct ring_entry &e) const;
+	void join_group(output_cxn::handler *h);
+	void leave_group(output_cxn::handler *h);
+	void hand_over(output_cxn::handler *h, consumer_state &from, const struct consumer_group &g,
+	               output_cxn::handler *heir, const std::vector<output_cxn::handler *> &members);
+	void set_members(struct consumer_group &g, const std::vector<output_cxn::handler *> &members);
+	/* partition of a record with a handle id, by its peer if known */
+	uint32_t remote_partition(uint32_t source_id, uint8_t type, const uint8_t *rest, size_t len, uint32_t by_handle);
+	/* bytes of records c has yet to look at */
+	uint64_t lag(const consumer_state &c) const;
+	/* Every record goes in the ring once, and consumers read it at
+	   their own cursor, skipping the types they don't want. It holds
+	   what the slowest consumer has yet to read */
+	std::deque<struct ring_entry> ring;
+	uint64_t ring_base; /* sequence number of ring.front() */
+	/* Records from a producer's ring or a frame share the buffer they
+	   came in, which is kept whole as long as any of them is in the
+	   ring. So the ring is charged for each buffer, once */
+	size_t ring_bytes;
+	std::unordered_map<const uint8_t *, size_t> chunks; /* records in the ring, by buffer */
+	uint64_t appended; /* bytes ever appended */
+	std::unordered_map<output_cxn::handler *, consumer_state> consumers;
+	/* consumers at the end of the ring, waiting to be woken */
+	std::set<output_cxn::handler *> idle;
+	uint8_t interests_;
+	/* Producers only send a payload once, so they are kept for
+	   consumers that join after it went by */
+	std::map<payload_key, struct sized_buffer> payloads;
+	size_t payloads_size;
+	std::map<std::string, struct consumer_group> groups;
+	/* source_id << 32 | handle id, to the partition of its peer's
+	   address. From BITCOIN records, for the BITCOIN_MSG ones after */
+	std::unordered_map<uint64_t, uint32_t> remotes;
+	ev::timer lag_timer; /* reports consumers that are behind every logger.lag_interval */
+	ev::prepare spiller; /* sheds a step a loop iteration, while the ring is too big */
+	journal *journal_; /* if this collector keeps it */
+	metrics *metrics_; /* likewise */
+
+	collector & operator=(collector other);
+	collector(const collector &);
 };
 
 #endif
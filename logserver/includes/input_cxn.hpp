@@ -2,29 +2,57 @@
 #define INPUT_CXN_HPP
 
 #include <cstdint>
+#include <memory>
+#include <unordered_map>
 
 #include <ev++.h>
 
 #include "read_buffer.hpp"
+#include "write_buffer.hpp"
 #include "netwrap.hpp"
 #include "accept_handler.hpp"
+#include "shm_ring.hpp"
 
 namespace input_cxn {
 
 class handler {
 private:
 	read_buffer read_queue;
+	write_buffer write_queue; /* interest updates back to the producer */
 	uint32_t state;
 	ev::io io;
 	uint32_t id;
+	std::unique_ptr<shm_ring> ring; /* where the producer's records are, once it attached one */
+	ev::io ring_io;
+	/* if it is a logserver forwarding to us, its source_ids to ours */
+	bool forwarded;
+	std::unordered_map<uint32_t, uint32_t> sources;
 public:
-	handler(int fd);
+	handler(int fd, uint32_t id);
 	~handler();
 	void io_cb(ev::io &watcher, int revents);
+	void ring_cb(ev::io &watcher, int revents);
+	void send_interests(uint8_t interests);
+	void send_codecs(); /* what frames we can take */
+	void send_source_id(uint32_t theirs, uint32_t ours);
+	void refuse_ring(); /* it has to use the socket */
+	/* a source_id no other source has had since we started, without
+	   waiting. Starts from the time, as they always have */
+	static uint32_t next_id();
+	/* tells every producer */
+	static void announce_interests(uint8_t interests);
+	/* stops (or resumes) reading every producer on this ingest loop */
+	static void hold(bool on);
 	static void handle_accept_error(handlers::accept_handler<handler> *handler, const network_error &e);
 	static void handle_accept(handlers::accept_handler<handler> *handler, int fd);
 	uint32_t get_id() const { return id; }
 private:
+	void watch(); /* sets what io waits for */
+	void handle_transport(const uint8_t *msg, size_t len);
+	void handle_forwarded(const wrapped_buffer<uint8_t> &buf, size_t len);
+	uint32_t source_of(uint32_t theirs);
+	bool unframe(const uint8_t *frame, size_t len);
+	ssize_t drain_ring();
 	void suicide(); /* get yourself ready for suspension (e.g., stop loop activity) if safe, just delete self */
 	/* could implement move operators, but others are odd */
 	handler & operator=(handler other);
@@ -0,0 +1,114 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <ev++.h>
+
+#include "wrapped_buffer.hpp"
+
+struct sized_buffer;
+
+/* Every record the logserver gets, appended to segment files under
+   logger.journal.path, for readers to replay. A record's offset is
+   where it starts in the journal as a whole, and only ever grows,
+   restarts included. Segments are named by the offset they start at
+   and hold records as verbatim writes them, with a length and
+   source_id first. Next to each is an index of the offset and time
+   of a record every INDEX_INTERVAL bytes, to find where to start
+   from. Only the first fan-out loop's collector writes it */
+
+class journal {
+public:
+	/* NULL if there is no logger.journal.path */
+	static journal * get();
+
+	/* returns the offset just past p */
+	uint64_t append(const struct sized_buffer &p);
+	/* writes out what append has buffered, for readers */
+	void flush();
+
+	/* oldest offset still kept, and where the next record goes */
+	uint64_t begin() const;
+	uint64_t end() const { return end_; }
+	/* an offset to read from to find offset, or the records logged
+	   since ns, at or before it */
+	uint64_t seek_offset(uint64_t offset) const;
+	uint64_t seek_time(uint64_t ns) const;
+	/* the segment offset is in: its path, base and bytes. False if
+	   there is none, i.e., offset is past the end */
+	bool locate(uint64_t offset, std::string &path, uint64_t &base, uint64_t &size) const;
+
+private:
+	struct index_entry {
+		uint64_t time; /* ns, when the logserver got it, never going backwards */
+		uint64_t offset;
+	};
+	struct segment {
+		uint64_t base;
+		uint64_t size; /* buffered bytes included */
+		std::vector<struct index_entry> index;
+	};
+
+	/* from logger.journal */
+	static journal * configured();
+	journal(const std::string &dir, uint64_t segment_size, uint64_t max_size);
+	void recover();
+	void roll();
+	void open_last();
+	std::string path(uint64_t base, const char *ext) const;
+	void flush_cb(ev::timer &, int) { flush(); }
+
+	std::string dir;
+	uint64_t segment_size;
+	uint64_t max_size; /* of all segments, before the oldest go */
+	std::map<uint64_t, struct segment> segments; /* by base */
+	uint64_t total; /* bytes in them */
+	int fd; /* of the last segment, and its index */
+	int index_fd;
+	std::vector<uint8_t> pending; /* appended, not yet written */
+	std::vector<uint8_t> index_pending;
+	uint64_t end_;
+	uint64_t next_index; /* index the first record from here on */
+	uint64_t last_time;
+	ev::timer flush_timer;
+
+	journal & operator=(journal other);
+	journal(const journal &);
+};
+
+/* Reads a replay's worth of journal, from one offset up to another,
+   a chunk at a time */
+class journal_reader {
+public:
+	/* records starting at or after from, before stop, and logged at
+	   or after since ns */
+	journal_reader(const journal &j, uint64_t from, uint64_t stop, uint64_t since);
+	~journal_reader();
+	/* the next record, len 0 once it gets to stop. end is set to the
+	   offset past it */
+	struct sized_buffer next(uint64_t &end);
+	uint64_t remaining() const { return stop > pos ? stop - pos : 0; }
+private:
+	bool fill(); /* reads the chunk pos is in */
+	const journal &j;
+	int fd;
+	uint64_t base; /* of the segment fd is */
+	uint64_t size;
+	uint64_t pos;
+	uint64_t from;
+	uint64_t stop;
+	uint64_t since;
+	wrapped_buffer<uint8_t> chunk;
+	uint64_t chunk_base; /* offset chunk starts at */
+	size_t chunk_len;
+
+	journal_reader & operator=(journal_reader other);
+	journal_reader(const journal_reader &);
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MERGE_QUEUE_HPP
+#define MERGE_QUEUE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <unordered_map>
+
+#include <ev++.h>
+
+#include "collector.hpp"
+
+/* With logger.merge_delay set, as on a logserver others forward to,
+   records are held for up to that many seconds and handed to the
+   collector in timestamp order, so readers see one ordered stream for
+   all the sources. Each source logs in order, so this is a k-way merge
+   of them: a record goes once every source heard from within the
+   delay has sent one at least as new, or once it has waited the
+   delay, so a quiet or stalled source holds the others up no longer
+   than that. One per fan-out loop, in front of its collector */
+
+class merge_queue {
+public:
+	/* if logger.merge_delay is set */
+	static bool enabled();
+	static merge_queue & get();
+	void push(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset);
+private:
+	struct pending {
+		struct sized_buffer record;
+		uint64_t timestamp; /* ns, as logged */
+		double arrived;
+		pending(const struct sized_buffer &p, uint64_t a_timestamp, double a_arrived)
+			: record(p), timestamp(a_timestamp), arrived(a_arrived) {}
+	};
+	struct source {
+		std::deque<struct pending> queue;
+		uint64_t newest; /* timestamp of the last record it sent */
+		double heard; /* when that came */
+		source() : queue(), newest(0), heard(0) {}
+	};
+	/* the timestamp at the head of a source's queue */
+	typedef std::pair<uint64_t, uint32_t> head;
+
+	merge_queue(double delay);
+	/* hands over whatever can go by now */
+	void release();
+	void timer_cb(ev::timer &, int);
+
+	double delay;
+	std::unordered_map<uint32_t, struct source> sources;
+	/* heads of the non-empty queues, oldest on top */
+	std::priority_queue<head, std::vector<head>, std::greater<head> > heads;
+	size_t held;
+	ev::timer timer; /* for what is held once the sources go quiet */
+
+	merge_queue & operator=(merge_queue other);
+	merge_queue(const merge_queue &);
+};
+
+#endif
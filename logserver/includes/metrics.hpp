@@ -0,0 +1,92 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <ev++.h>
+
+#include "accept_handler.hpp"
+#include "bitcoin.hpp"
+
+struct ring_entry;
+class collector;
+
+/* how far behind a consumer is */
+struct consumer_lag {
+	std::string consumer; /* its handler's name */
+	uint64_t bytes; /* of records it has yet to get, spilled or not */
+	uint64_t spilled; /* of those, on disk */
+	double seconds; /* since the oldest of them was logged */
+};
+
+/* With logger.metrics set, the first fan-out loop's collector counts
+   what it appends, a second at a time, for the last WINDOW seconds:
+   records and bytes by type, messages and their bytes by command and
+   direction, BITCOIN updates by update_type, and the handles each
+   source has open. Readers of the metrics endpoint get a snapshot of
+   them, as text, and are hung up on. With logger.metrics.interval, a
+   snapshot also goes to every reader that often, as a LOG_METRICS
+   event, so dashboards need not read the raw stream to count it.
+   Each fan-out loop's collector also reports how far behind its
+   readers are every logger.lag_interval, which snapshots include as
+   of the last report */
+
+class metrics {
+public:
+	/* if logger.metrics is set */
+	static bool enabled();
+	/* the types producers have to send, for the counts */
+	static uint8_t types();
+	/* NULL unless enabled, and called from the first fan-out loop */
+	static metrics * get();
+	/* msg is that of a BITCOIN_MSG record, NULL if its payload is gone */
+	void count(const struct ring_entry &e, const struct bitcoin::packed_message *msg);
+	/* a line per count: name, the last whole second, the WINDOW before */
+	std::string snapshot();
+	/* the handles of a producer that went away are no longer open */
+	static void forget(uint32_t source_id);
+	/* the lag of every consumer of from, replacing what it reported before */
+	static void report_lags(const collector *from, const std::vector<struct consumer_lag> &lags);
+	static void handle_accept_error(handlers::accept_handler<metrics> *h, const network_error &e);
+	static void handle_accept(handlers::accept_handler<metrics> *h, int fd);
+	/* what handle_accept does, also for readers over TCP */
+	static void serve(int fd);
+private:
+	/* by is_sender */
+	struct msg_count {
+		uint64_t count[2];
+		uint64_t bytes[2];
+		msg_count() : count(), bytes() {}
+	};
+	struct second {
+		time_t when;
+		uint64_t records[8]; /* by bit of log_type */
+		uint64_t bytes[8];
+		uint64_t updates[8]; /* by bit of update_type */
+		std::unordered_map<std::string, struct msg_count> msgs; /* by command */
+		second() : when(0), records(), bytes(), updates(), msgs() {}
+	};
+
+	/* from logger.metrics */
+	static metrics * configured();
+	metrics(double interval);
+	/* the bucket for the current second, emptied if it was older */
+	struct second & current();
+	void interval_cb(ev::timer &, int);
+
+	std::vector<struct second> seconds; /* by when, modulo WINDOW */
+	std::unordered_map<uint32_t, std::unordered_set<uint32_t> > handles; /* open ones, by source */
+	std::unordered_map<const collector *, std::vector<struct consumer_lag> > lags; /* by fan-out loop */
+	ev::timer timer; /* sends a snapshot every logger.metrics.interval */
+
+	metrics & operator=(metrics other);
+	metrics(const metrics &);
+};
+
+#endif
@@ -2,36 +2,98 @@
 #define OUTPUT_CXN_HPP
 
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <functional>
 
 #include <ev++.h>
 
 #include "accept_handler.hpp"
 #include "netwrap.hpp"
 #include "write_buffer.hpp"
+#include "read_buffer.hpp"
+#include "logger.hpp"
+#include "record_filter.hpp"
+
+/* how a consumer group splits records among its members */
+enum group_key {
+	GROUP_BY_HANDLE=0, /* source and handle id, by source for records without one */
+	GROUP_BY_REMOTE=1, /* the peer's address, so its connections all go to one member */
+};
 
 namespace output_cxn {
 
+/* Readers on a group's endpoint share its records instead of each
+   getting a copy. All of them live on the same fan-out loop */
+struct group_spec {
+	std::string name; /* empty if it is not a group */
+	enum group_key key;
+	size_t lane; /* which fan-out loop */
+	group_spec() : name(), key(GROUP_BY_HANDLE), lane(0) {}
+};
+
 class handler {
 private:
 	uint8_t interests;
+	uint8_t endpoint; /* the interests of the socket it came in on */
+	std::unique_ptr<record_filter> filter; /* if it sent one */
+	struct group_spec group;
+	/* on the replay endpoint it waits for LOG_CLIENT_REPLAY, then gets
+	   a mark after each batch */
+	bool replays;
+	bool waiting;
+	uint64_t marked; /* offset of the last mark */
+	/* to an upstream logserver, which writes back as to a producer */
+	bool forwards;
+	/* its group, or what it reads, and a serial number. Logs and
+	   metrics go by it, pointers get reused */
+	std::string name;
 	int events;
 	write_buffer write_queue;
+	read_buffer read_queue; /* LOG_CLIENT_CODEC and the like */
+	uint32_t state;
+	enum log_codec codec; /* what the reader asked its records in */
+	wrapped_buffer<uint8_t> headers; /* length and source_id of each record in the write_queue */
+	uint64_t records_sent;
+	uint64_t writes; /* syscalls it took */
 	ev::io io;
 public:
-	handler(int fd, uint8_t interests);
+	handler(int fd, uint8_t interests, const struct group_spec &group = group_spec(), bool replays = false,
+	        bool forwards = false);
 	~handler();
 	void io_cb(ev::io &watcher, int revents);
 	void set_events(int events);
 	int get_events() const;
-	bool interested(uint8_t x) const { return x & interests; }
+	/* payloads go along with the BITCOIN_MSG records referring to them */
+	bool interested(uint8_t x) const { return (x == PAYLOAD ? (uint8_t) BITCOIN_MSG : x) & interests; }
+	uint8_t interest_mask() const { return interests; }
+	const record_filter * get_filter() const { return filter.get(); }
+	const struct group_spec & get_group() const { return group; }
+	const std::string & get_name() const { return name; }
 
 	/* for creation functions */
 	static void set_interest(handlers::accept_handler<handler> *h, uint8_t interest);
 	static uint8_t get_interests(handlers::accept_handler<handler> *h) ;
+	static void set_group(handlers::accept_handler<handler> *h, const struct group_spec &group);
+	/* readers on h can replay the journal */
+	static void set_replay(handlers::accept_handler<handler> *h);
+	/* the name readers over TCP use for h, in LOG_CLIENT_CHANNEL */
+	static void set_channel(handlers::accept_handler<handler> *h, const std::string &name);
+	/* for endpoints of something else, which join takes the fd of */
+	static void set_channel(const std::string &name, std::function<void(int)> join);
+	/* as if fd had connected to the endpoint named name. False if
+	   there is none */
+	static bool join_channel(const std::string &name, int fd);
 	static void handle_accept_error(handlers::accept_handler<handler> *handler, const network_error &e);
 	static void handle_accept(handlers::accept_handler<handler> *handler, int fd);
 
 private:
+	void handle_message(const uint8_t *msg, size_t len);
+	void handle_upstream(const uint8_t *msg, size_t len);
+	void append_batch();
+	void append_frame();
+	/* where it has got to in the journal, if that moved or always is set */
+	void append_mark(bool always = false);
 	void suicide(); /* get yourself ready for suspension (e.g., stop loop activity) if safe, just delete self */
 	/* could implement move operators, but others are odd */
 	handler & operator=(handler other);
@@ -40,6 +102,43 @@ private:
 	handler & operator=(handler &&other);
 };
 
+/* Keeps a handler forwarding everything this logserver gets to
+   logger.upstream, a unix socket path or host:port, trying again every
+   so often while there is none. Lives on the main loop */
+class uplink {
+private:
+	std::string upstream;
+	ev::timer timer;
+public:
+	uplink(const std::string &upstream, enum log_codec codec);
+	void timer_cb(ev::timer &, int);
+private:
+	uplink & operator=(uplink other);
+	uplink(const uplink &);
+};
+
+/* A reader on the TCP port, until its LOG_CLIENT_CHANNEL says which
+   endpoint it is for and a handler takes it over. Lives on the main
+   loop, like the accept handlers */
+class greeter {
+private:
+	ev::io io;
+	ev::timer timeout;
+	uint8_t msg[sizeof(uint32_t) + 1 + LOG_CHANNEL_MAX];
+	size_t got;
+	size_t want; /* the length, then the message */
+public:
+	static void handle_accept_error(handlers::accept_handler<greeter> *h, const network_error &e);
+	static void handle_accept(handlers::accept_handler<greeter> *h, int fd);
+	void io_cb(ev::io &watcher, int revents);
+	void timeout_cb(ev::timer &, int);
+private:
+	greeter(int fd);
+	~greeter();
+	void done(bool joined);
+	greeter & operator=(greeter other);
+	greeter(const greeter &);
+};
 
 };
 #endif
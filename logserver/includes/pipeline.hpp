@@ -0,0 +1,74 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <cstdint>
+#include <functional>
+
+#include <ev++.h>
+
+#include "wrapped_buffer.hpp"
+
+/* The logserver runs as a pipeline of event loops. Ingest loops read
+   the producers (input_cxn) and fan-out loops each keep a collector
+   and serve the readers (output_cxn) handed to them. With no threads
+   configured for a stage, the main loop does that stage itself.
+
+   Records go from each ingest loop to each fan-out loop through a
+   lock-free spsc_queue, one per pair, so the records of a producer
+   arrive in the order it sent them. If a fan-out loop falls behind
+   and its queue fills, what does not fit is parked on the ingest loop,
+   which stops reading its producers until the queue took it all.
+   Creating handlers and telling
+   producers what to send are rare, and go through a locked task list */
+
+namespace pipeline {
+
+/* call once, from main, before anything else here */
+void start(unsigned ingest_threads, unsigned fanout_threads);
+
+/* from main, once its loop returned. Each fan-out loop takes in what
+   the ingest loops queued for it and writes out the journal, then
+   every worker thread stops and is joined, ingest loops first */
+void stop();
+
+/* runs make on the next ingest / fan-out loop, which is where the
+   handler it creates lives */
+void ingest(std::function<void()> make);
+void fanout(std::function<void()> make);
+/* on fan-out loop lane, modulo how many there are, for handlers
+   that have to share a collector */
+void fanout(size_t lane, std::function<void()> make);
+
+/* if the calling thread is the first fan-out loop, whose collector
+   keeps the journal and the metrics */
+bool first_fanout();
+
+/* the loop of the calling thread, for its watchers */
+struct ev_loop * loop();
+
+/* how many fan-out loops there are, for limits to split among them */
+size_t fanout_loops();
+
+/* from an ingest loop, hands a record to every collector. The
+   fan-out loops are only woken by flush, so call that once done with
+   a batch */
+void publish(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset = 0);
+void flush();
+/* from a fan-out loop, hands a record the logserver made itself to
+   every collector */
+void inject(const wrapped_buffer<uint8_t> &data, size_t len, uint32_t source_id);
+
+/* what producers are to send. Union of every collector's readers,
+   logger.always_forward and what the metrics count */
+uint8_t interests();
+
+/* from a fan-out loop, when its collector's readers changed */
+void set_interests(uint8_t mask);
+
+/* from a fan-out loop whose collector forgot its payloads, so the
+   producers send them again */
+void forget_payloads();
+
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef RECORD_FILTER_HPP
+#define RECORD_FILTER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <array>
+
+/* A reader's LOG_CLIENT_FILTER (see logger.hpp), compiled into what
+   is quick to test each record in the ring against: handle ids
+   sorted, commands padded out as in the message header, and the
+   sampling rate as a threshold on the record hash */
+
+class record_filter {
+public:
+	/* msg is the message after its kind. NULL if it is malformed */
+	static std::unique_ptr<record_filter> parse(const uint8_t *msg, size_t len);
+
+	uint8_t types() const { return types_; }
+
+	/* everything but the command. rec is a record as a producer sends
+	   it, i.e., starting at its type */
+	bool matches(const uint8_t *rec, size_t len, uint32_t source_id) const;
+
+	/* only BITCOIN_MSG records have a command, and the collector has
+	   to look it up in the payload of a reference */
+	bool has_commands() const { return !commands.empty(); }
+	/* command is the 12 bytes of a message header, NULL if unknown */
+	bool command_matches(const char *command) const;
+
+private:
+	record_filter() : types_(0), direction(0), source_id_(0), sample_below(0), handle_ids(), commands() {}
+	uint8_t types_;
+	uint8_t direction;
+	uint32_t source_id_;
+	uint64_t sample_below; /* kept if the low 32 bits of the hash are under this */
+	std::vector<uint32_t> handle_ids;
+	std::vector<std::array<char, 12> > commands;
+};
+
+#endif
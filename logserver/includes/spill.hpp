@@ -0,0 +1,54 @@
+#ifndef SPILL_HPP
+#define SPILL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <deque>
+
+#include "wrapped_buffer.hpp"
+
+struct sized_buffer;
+
+/* A consumer's backlog once it is too far behind for the ring to keep
+   it, in mmap'd segment files under logger.spill.path. Records go in
+   with their length, source_id and a tag in front, and come back out
+   in order, copied a chunk at a time. The files are unlinked as soon as
+   they are made, so nothing is left behind */
+
+class spill {
+public:
+	spill(const std::string &dir);
+	~spill();
+	/* false if it could not get the disk for it. tag is the journal
+	   offset past p */
+	bool push(const struct sized_buffer &p, uint64_t tag);
+	/* the next record and its tag, len 0 if there are none */
+	struct sized_buffer pop(uint64_t &tag);
+	bool empty() const { return written == read; }
+	/* bytes on disk yet to be read */
+	uint64_t size() const { return written - read; }
+	/* the oldest record in it, NULL if it is empty */
+	const uint8_t * front() const;
+private:
+	struct segment {
+		int fd;
+		uint8_t *base;
+		size_t capacity;
+		size_t end; /* written up to */
+		size_t pos; /* read up to */
+	};
+	void release_front();
+	std::string dir;
+	std::deque<struct segment> segments;
+	wrapped_buffer<uint8_t> chunk; /* records copied out, being handed out */
+	size_t chunk_pos;
+	size_t chunk_end;
+	uint64_t written;
+	uint64_t read;
+
+	spill & operator=(spill other);
+	spill(const spill &);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+#include <vector>
+
+/* single producer, single consumer queue of T between two threads,
+   the in process cousin of shm_ring. Bounded, so a producer that
+   gets ahead finds it full and has to wait its turn */
+
+template <typename T>
+class spsc_queue {
+public:
+	/* capacity is rounded up to a power of two */
+	spsc_queue(size_t capacity) : head(0), pad1(), tail(0), pad2(), slots(), mask(0) {
+		size_t size = 1;
+		while(size < capacity) {
+			size <<= 1;
+		}
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	/* producer side. false if it is full */
+	bool push(const T &val) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask) {
+			return false;
+		}
+		slots[h & mask] = val;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* consumer side. false if it is empty */
+	bool pop(T &val) {
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		val = slots[t & mask];
+		slots[t & mask] = T(); /* don't hold on to it */
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::atomic<uint64_t> head; /* pushed, producer owned */
+	char pad1[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> tail; /* popped, consumer owned */
+	char pad2[64 - sizeof(std::atomic<uint64_t>)];
+	std::vector<T> slots;
+	size_t mask;
+
+	spsc_queue & operator=(spsc_queue other);
+	spsc_queue(const spsc_queue &);
+};
+
+#endif
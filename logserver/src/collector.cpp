@@ -1,62 +1,685 @@
 #include <iostream>
 #include <utility>
 #include <set>
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
 
 #include "config.hpp"
 #include "collector.hpp"
+#include "pipeline.hpp"
+#include "logger.hpp"
+#include "network.hpp"
+#include "record_filter.hpp"
 
 using namespace std;
 
-void collector::append(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id) {
+static size_t lookup_max_size() {
+	const libconfig::Config *cfg(get_config());
+	return (uint32_t)cfg->lookup("logger.max_buffer");
+}
+
+static size_t max_size() {
+	static const size_t max_size = lookup_max_size();
+	return max_size;
+}
+
+/* every fan-out loop's collector keeps its own, so they split it */
+static size_t lookup_max_payloads() {
+	const libconfig::Config *cfg(get_config());
+	int size = 64 * 1024 * 1024;
+	cfg->lookupValue("logger.payload_cache", size);
+	return size / pipeline::fanout_loops();
+}
+
+/* where readers' spills go, empty to disconnect them instead */
+static string lookup_spill_dir() {
+	const libconfig::Config *cfg(get_config());
+	const char *path = "";
+	cfg->lookupValue("logger.spill.path", path);
+	string dir(path);
+	if (!dir.empty()) {
+		if (dir[dir.size() - 1] != '/') {
+			dir += '/';
+		}
+		mkdir(dir.c_str(), 0777);
+	}
+	return dir;
+}
+
+static const string & spill_dir() {
+	static const string dir = lookup_spill_dir();
+	return dir;
+}
+
+static uint64_t lookup_spill_max() {
+	const libconfig::Config *cfg(get_config());
+	long long size = 4LL * 1024 * 1024 * 1024;
+	cfg->lookupValue("logger.spill.max_size", size);
+	return size;
+}
+
+static double lookup_lag_interval() {
+	const libconfig::Config *cfg(get_config());
+	double interval = 60;
+	cfg->lookupValue("logger.lag_interval", interval);
+	return interval;
+}
+
+/* connections remembered for GROUP_BY_REMOTE, in case some are never
+   seen to disconnect */
+const size_t MAX_REMOTES = 1 << 20;
+
+/* bytes of backlog spilled per loop iteration, so the readers (and
+   the ring) don't wait on a whole backlog going to disk */
+const uint64_t SPILL_STEP = 4 * 1024 * 1024;
+
+/* murmur3's 64 bit finalizer */
+static uint32_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* Lamping and Veach's jump consistent hash. A member joining only
+   takes keys from the others, rather than reshuffling all of them */
+static size_t jump_hash(uint64_t key, size_t buckets) {
+	int64_t b = -1, j = 0;
+	while(j < (int64_t) buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+	return b;
+}
+
+/* PAYLOAD records and BITCOIN_MSG records referring to them carry the hash */
+static bool payload_hash_of(const uint8_t *rec, size_t len, uint64_t &hash) {
+	uint8_t type = rec[0];
+	const size_t prolog = log_prolog_len(rec);
+	if (type == PAYLOAD && len >= prolog + sizeof(hash)) {
+		memcpy(&hash, rec + prolog, sizeof(hash));
+	} else if (type == BITCOIN_MSG && len >= prolog + sizeof(uint32_t) + 1 + sizeof(hash) &&
+	           (rec[prolog + sizeof(uint32_t)] & BITCOIN_MSG_PAYLOAD_REF)) {
+		memcpy(&hash, rec + prolog + sizeof(uint32_t) + 1, sizeof(hash));
+	} else {
+		return false;
+	}
+	hash = ntoh(hash);
+	return true;
+}
+
+collector::collector()
+	: ring(), ring_base(0), ring_bytes(0), chunks(), appended(0), consumers(), idle(), interests_(0),
+	  payloads(), payloads_size(0), groups(), remotes(), lag_timer(pipeline::loop()), spiller(pipeline::loop()),
+	  journal_(pipeline::first_fanout() ? journal::get() : nullptr), metrics_(metrics::get()) {
+	spiller.set<collector, &collector::spiller_cb>(this);
+	static const double interval = lookup_lag_interval();
+	if (interval > 0) {
+		lag_timer.set<collector, &collector::lag_cb>(this);
+		lag_timer.start(interval, interval);
+	}
+}
+
+collector & collector::get() {
+	static thread_local collector *c = nullptr;
+	if (c == nullptr) {
+		c = new collector();
+	}
+	return *c;
+}
+
+void collector::remember_payload(const payload_key &key, const struct sized_buffer &p) {
+	static const size_t max_payloads = lookup_max_payloads();
+
+	if (payloads_size + p.len > max_payloads) {
+		/* start over, and have the producers do so too */
+		payloads.clear();
+		payloads_size = 0;
+		for(auto it = consumers.begin(); it != consumers.end(); ++it) {
+			it->second.payloads.clear();
+		}
+		pipeline::forget_payloads();
+	}
+
+	if (payloads.count(key)) {
+		return;
+	}
+	/* p may be one of many records in a chunk from the ring, which
+	   would be kept whole for it */
+	wrapped_buffer<uint8_t> own(p.len);
+	memcpy(own.ptr(), p.buffer.const_ptr() + p.offset, p.len);
+	payloads.insert(make_pair(key, sized_buffer(own, p.len, p.source_id)));
+	payloads_size += p.len;
+}
+
+void collector::append(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset) {
 	
-	static size_t max_size = 0;
-	struct sized_buffer p(data, len, source_id);
-	if (max_size == 0) {
-		const libconfig::Config *cfg(get_config());
-		max_size = (uint32_t)cfg->lookup("logger.max_buffer");
-	}
-	set<output_cxn::handler *> morose;
-	for(auto it = queues.begin(); it != queues.end(); ++it) {
-		if (it->first->interested((data.const_ptr())[0])) {
-			it->second.total_size += p.len;
-			it->second.queue.push_front(p);
-			int events = it->first->get_events();
-			it->first->set_events( events | ev::WRITE);
-
-			if (it->second.total_size > max_size) {
-				cerr << "Total size is " << it->second.total_size << endl;
-				morose.insert(it->first); /* do this out of band, because upon death they are removed from the queue, invalidating iterators */
+	struct sized_buffer p(data, len, source_id, offset);
+	const uint8_t *rec = data.const_ptr() + offset;
+	uint8_t type = rec[0];
+	const size_t prolog = log_prolog_len(rec); /* type, version, timestamp */
+
+	uint64_t hash = 0;
+	bool has_hash = payload_hash_of(rec, len, hash);
+	payload_key key(source_id, hash);
+	if (has_hash && type == PAYLOAD) {
+		remember_payload(key, p);
+	}
+
+	/* what consumer groups split on */
+	uint32_t by_handle = mix(source_id);
+	uint32_t by_remote = by_handle;
+	if ((type == BITCOIN || type == BITCOIN_MSG) && len >= prolog + sizeof(uint32_t)) {
+		uint32_t id;
+		memcpy(&id, rec + prolog, sizeof(id));
+		by_handle = mix(((uint64_t) source_id << 32) | ntoh(id));
+		by_remote = remote_partition(source_id, type, rec + prolog, len - prolog, by_handle);
+	}
+
+	uint64_t end = journal_ ? journal_->append(p) : 0;
+	ring.emplace_back(p, appended, type, has_hash, key, end, by_handle, by_remote);
+	if (metrics_) {
+		metrics_->count(ring.back(), type == BITCOIN_MSG ? message_of(ring.back()) : NULL);
+	}
+	hold(p);
+	appended += len;
+	uint64_t seq = ring_base + ring.size() - 1;
+
+	/* everyone else is still working through the ring, and gets to
+	   this one in its turn */
+	bool moved = consumers.empty();
+	for(auto it = idle.begin(); it != idle.end();) {
+		if (wanted(*it, ring.back())) {
+			(*it)->set_events((*it)->get_events() | ev::WRITE);
+			it = idle.erase(it);
+		} else {
+			consumer_state &c(consumers.find(*it)->second);
+			moved = moved || c.cursor == ring_base;
+			c.cursor = seq + 1;
+			c.ring_position = ring.back().end;
+			++it;
+		}
+	}
+	if (moved) {
+		trim();
+	}
+
+	if (ring_bytes > max_size()) {
+		trim();
+		if (ring_bytes > 2 * max_size()) { /* the spiller fell behind */
+			shed(UINT64_MAX);
+		} else if (ring_bytes > max_size() && !spiller.is_active()) {
+			spiller.start();
+		}
+	}
+}
+
+/* The slowest consumers are what keeps the ring, so their backlogs
+   go, up to step bytes of them, until it fits */
+void collector::shed(uint64_t step) {
+	vector<pair<uint64_t, output_cxn::handler *> > slowest;
+	for(auto it = consumers.begin(); it != consumers.end(); ++it) {
+		slowest.push_back(make_pair(it->second.cursor, it->first));
+	}
+	sort(slowest.begin(), slowest.end());
+	for(auto it = slowest.begin(); it != slowest.end() && ring_bytes > max_size() && step > 0; ++it) {
+		if (!spill_backlog(it->second, consumers.find(it->second)->second, step)) {
+			cerr << "Disconnecting handler " << it->second->get_name() << ", its backlog is more than " << max_size() << " bytes" << endl;
+			delete it->second; /* retires it, which trims */
+		} else {
+			trim();
+		}
+	}
+}
+
+void collector::spiller_cb(ev::prepare &, int) {
+	shed(SPILL_STEP);
+	if (ring_bytes <= max_size()) {
+		spiller.stop();
+	}
+}
+
+void collector::hold(const struct sized_buffer &p) {
+	if (chunks[p.buffer.const_ptr()]++ == 0) {
+		ring_bytes += p.buffer.allocated();
+	}
+}
+
+void collector::release(const struct sized_buffer &p) {
+	auto it = chunks.find(p.buffer.const_ptr());
+	if (--it->second == 0) {
+		ring_bytes -= p.buffer.allocated();
+		chunks.erase(it);
+	}
+}
+
+bool collector::spill_backlog(output_cxn::handler *h, consumer_state &c, uint64_t &step) {
+	static const uint64_t spill_max = lookup_spill_max();
+	if (spill_dir().empty()) {
+		return false;
+	}
+	if (!c.spilled) {
+		c.spilled.reset(new spill(spill_dir()));
+	}
+	uint64_t before = c.spilled->size();
+	for(struct sized_buffer p; step > 0 && (p = next(h, c)).len > 0; ) {
+		if (!c.spilled->push(p, c.ring_position)) {
+			return false;
+		}
+		step -= min(step, (uint64_t) p.len);
+	}
+	if (c.spilled->size() > spill_max) {
+		cerr << "Handler " << h->get_name() << " has more than " << spill_max << " bytes spilled" << endl;
+		return false;
+	}
+	if (before == 0) {
+		cerr << "Spilling handler " << h->get_name() << ", its backlog is more than " << max_size() << " bytes" << endl;
+	}
+	return true;
+}
+
+vector<struct consumer_lag> collector::lags() const {
+	vector<struct consumer_lag> rv;
+	double now = ev_time();
+	for(auto it = consumers.begin(); it != consumers.end(); ++it) {
+		const consumer_state &c(it->second);
+		struct consumer_lag l = { it->first->get_name(), lag(c), 0, 0 };
+		const uint8_t *oldest = NULL;
+		if (c.replay) {
+			l.bytes += c.replay->remaining();
+		}
+		if (c.spilled && !c.spilled->empty()) {
+			l.spilled = c.spilled->size();
+			l.bytes += l.spilled;
+			oldest = c.spilled->front();
+		} else if (c.cursor < ring_base + ring.size()) {
+			const struct sized_buffer &p(ring[c.cursor - ring_base].record);
+			oldest = p.buffer.const_ptr() + p.offset;
+		}
+		if (oldest) {
+			l.seconds = max(0.0, now - log_timestamp(oldest) / 1e9);
+		}
+		rv.push_back(l);
+	}
+	return rv;
+}
+
+void collector::lag_cb(ev::timer &, int) {
+	vector<struct consumer_lag> behind(lags());
+	if (metrics::enabled()) { /* goes in its snapshots */
+		metrics::report_lags(this, behind);
+		return;
+	}
+	for(auto it = behind.begin(); it != behind.end(); ++it) {
+		if (it->bytes > 0) {
+			cerr << "Handler " << it->consumer << " is " << it->bytes << " bytes, " << it->seconds
+			     << " seconds behind (" << it->spilled << " bytes spilled)" << endl;
+		}
+	}
+}
+
+uint32_t collector::remote_partition(uint32_t source_id, uint8_t type, const uint8_t *rest, size_t len, uint32_t by_handle) {
+	uint32_t id;
+	memcpy(&id, rest, sizeof(id));
+	uint64_t cxn = ((uint64_t) source_id << 32) | ntoh(id);
+	if (type == BITCOIN_MSG) {
+		auto it = remotes.find(cxn);
+		return it == remotes.end() ? by_handle : it->second; /* connected before we started */
+	}
+
+	/* id, update_type, remote_addr */
+	uint32_t update_type;
+	struct sockaddr_in remote;
+	if (len < 2 * sizeof(uint32_t) + sizeof(remote)) {
+		return by_handle;
+	}
+	memcpy(&update_type, rest + sizeof(id), sizeof(update_type));
+	memcpy(&remote, rest + 2 * sizeof(uint32_t), sizeof(remote));
+	uint32_t rv = mix(((uint64_t) remote.sin_addr.s_addr << 16) | remote.sin_port);
+	if (ntoh(update_type) & (CONNECT_SUCCESS | ACCEPT_SUCCESS)) {
+		if (remotes.size() >= MAX_REMOTES) {
+			remotes.clear();
+		}
+		remotes[cxn] = rv;
+	} else {
+		remotes.erase(cxn);
+	}
+	return rv;
+}
+
+void collector::trim() {
+	uint64_t slowest = ring_base + ring.size();
+	for(auto it = consumers.begin(); it != consumers.end(); ++it) {
+		slowest = min(slowest, it->second.cursor);
+	}
+	while(ring_base < slowest) {
+		release(ring.front().record);
+		ring.pop_front();
+		++ring_base;
+	}
+
+	/* memberships nothing in the ring is assigned by */
+	uint64_t oldest = ring.empty() ? appended : ring.front().start;
+	for(auto it = groups.begin(); it != groups.end(); ++it) {
+		deque<struct group_epoch> &epochs(it->second.epochs);
+		while(epochs.size() > 1 && epochs[1].from <= oldest) {
+			epochs.pop_front();
+		}
+	}
+}
+
+uint64_t collector::lag(const consumer_state &c) const {
+	if (c.cursor >= ring_base + ring.size()) {
+		return 0;
+	}
+	return appended - ring[c.cursor - ring_base].start;
+}
+
+bool collector::wanted(output_cxn::handler *h, const struct ring_entry &e) const {
+	if (!h->interested(e.type)) {
+		return false;
+	}
+	if (!h->get_group().name.empty() && (e.type == PAYLOAD || owner(h, e) != h)) {
+		return false; /* payloads are pulled by the member that gets the BITCOIN_MSG */
+	}
+	return matches(h, e);
+}
+
+bool collector::matches(output_cxn::handler *h, const struct ring_entry &e) const {
+	if (!h->interested(e.type)) {
+		return false;
+	}
+	const record_filter *f = h->get_filter();
+	if (f == nullptr) {
+		return true;
+	}
+	if (e.type == PAYLOAD) {
+		return false; /* pop sends the ones it needs ahead of the BITCOIN_MSG records */
+	}
+	if (!f->matches(e.record.buffer.const_ptr() + e.record.offset, e.record.len, e.record.source_id)) {
+		return false;
+	}
+	return e.type != BITCOIN_MSG || !f->has_commands() || f->command_matches(command_of(e));
+}
+
+const struct bitcoin::packed_message * collector::message_of(const struct ring_entry &e) const {
+	const uint8_t *rec = e.record.buffer.const_ptr() + e.record.offset;
+	size_t len = e.record.len;
+	size_t msg = log_prolog_len(rec) + sizeof(uint32_t) + 1; /* after the id and is_sender */
+	if (e.has_hash) {
+		auto found = payloads.find(e.key);
+		if (found == payloads.end()) {
+			return NULL;
+		}
+		rec = found->second.buffer.const_ptr() + found->second.offset;
+		len = found->second.len;
+		msg = log_prolog_len(rec) + sizeof(uint64_t); /* after the hash */
+	}
+	if (len < msg + sizeof(struct bitcoin::packed_message)) {
+		return NULL;
+	}
+	return (const struct bitcoin::packed_message*)(rec + msg);
+}
+
+const char * collector::command_of(const struct ring_entry &e) const {
+	const struct bitcoin::packed_message *m = message_of(e);
+	return m ? m->command : NULL;
+}
+
+const output_cxn::handler * collector::owner(const output_cxn::handler *h, const struct ring_entry &e) const {
+	auto g = groups.find(h->get_group().name);
+	if (g == groups.end()) {
+		return nullptr;
+	}
+	const deque<struct group_epoch> &epochs(g->second.epochs);
+	for(auto it = epochs.rbegin(); it != epochs.rend(); ++it) {
+		if (it->from <= e.start) {
+			if (it->members.empty()) {
+				return nullptr;
+			}
+			return it->members[jump_hash(e.partition[g->second.key], it->members.size())];
+		}
+	}
+	return nullptr;
+}
+
+void collector::set_members(struct consumer_group &g, const vector<output_cxn::handler *> &members) {
+	if (!g.epochs.empty() && g.epochs.back().from == appended) {
+		g.epochs.back().members = members;
+	} else {
+		g.epochs.emplace_back(appended, members);
+	}
+}
+
+void collector::join_group(output_cxn::handler *h) {
+	const struct output_cxn::group_spec &spec(h->get_group());
+	auto g = groups.find(spec.name);
+	if (g == groups.end()) {
+		g = groups.insert(make_pair(spec.name, consumer_group(spec.key))).first;
+	}
+	vector<output_cxn::handler *> members;
+	if (!g->second.epochs.empty()) {
+		members = g->second.epochs.back().members;
+	}
+	members.push_back(h);
+	set_members(g->second, members);
+}
+
+void collector::leave_group(output_cxn::handler *h) {
+	auto g = groups.find(h->get_group().name);
+	if (g == groups.end() || g->second.epochs.empty()) {
+		return;
+	}
+	/* the last member takes its place, so only their keys move */
+	vector<output_cxn::handler *> members(g->second.epochs.back().members);
+	auto it = find(members.begin(), members.end(), h);
+	if (it == members.end()) {
+		return;
+	}
+	size_t slot = it - members.begin();
+	*it = members.back();
+	members.pop_back();
+	if (members.empty()) {
+		groups.erase(g);
+		return;
+	}
+	auto c = consumers.find(h);
+	if (c != consumers.end()) {
+		hand_over(h, c->second, g->second, members[min(slot, members.size() - 1)], members);
+	}
+	set_members(g->second, members);
+}
+
+/* What h was assigned in the ring and had yet to read goes to the
+   member its key goes to now, and what it spilled to heir, whoever
+   took its place. They get it ahead of the ring */
+void collector::hand_over(output_cxn::handler *h, consumer_state &from, const struct consumer_group &g,
+                          output_cxn::handler *heir, const vector<output_cxn::handler *> &members) {
+	set<output_cxn::handler *> woken;
+	for(uint64_t seq = from.cursor; seq < ring_base + ring.size(); ++seq) {
+		const struct ring_entry &e(ring[seq - ring_base]);
+		if (e.type == PAYLOAD || owner(h, e) != h) {
+			continue;
+		}
+		output_cxn::handler *to = members[jump_hash(e.partition[g.key], members.size())];
+		if (!matches(to, e)) {
+			continue;
+		}
+		consumer_state &c(consumers.find(to)->second);
+		if (e.has_hash && e.type == BITCOIN_MSG && c.payloads.insert(e.key).second) {
+			auto found = payloads.find(e.key);
+			if (found != payloads.end()) {
+				c.handed.push_back(found->second);
 			}
+		}
+		c.handed.push_back(e.record);
+		woken.insert(to);
+	}
 
+	if (from.spilled && !from.spilled->empty()) {
+		consumer_state &c(consumers.find(heir)->second);
+		if (!c.spilled) {
+			c.spilled = move(from.spilled);
+		} else {
+			uint64_t tag;
+			for(struct sized_buffer p(from.spilled->pop(tag)); p.len > 0; p = from.spilled->pop(tag)) {
+				if (!c.spilled->push(p, tag)) {
+					cerr << "Could not hand the spill of handler " << h->get_name() << " to " << heir->get_name() << endl;
+					break;
+				}
+			}
 		}
+		woken.insert(heir);
 	}
 
-	for(auto it = morose.begin(); it != morose.end(); ++it) {
-		cerr << "Disconnecting handler due to size exceeded " << max_size << endl;
-		delete (*it);
+	for(auto it = woken.begin(); it != woken.end(); ++it) {
+		if (idle.erase(*it)) {
+			(*it)->set_events((*it)->get_events() | ev::WRITE);
+		}
 	}
 }
 
 struct sized_buffer collector::pop(output_cxn::handler *h) {
 	struct sized_buffer rv;
-	auto it = queues.find(h);
-	if (it == queues.end()) {
+	auto it = consumers.find(h);
+	if (it == consumers.end()) {
 		cerr << "LOGIC ERROR, tried to pop non-existant id " << hex << h;
-	} else {
-		if (it->second.queue.size()) {
-			rv = it->second.queue.back();
-			it->second.queue.pop_back();
-			it->second.total_size -= rv.len;
+		return rv;
+	}
+	consumer_state &c(it->second);
+	if (c.replay) { /* older than anything spilled, which is older than the ring */
+		for(rv = c.replay->next(c.position); rv.len > 0; rv = c.replay->next(c.position)) {
+			const uint8_t *rec = rv.buffer.const_ptr() + rv.offset;
+			uint64_t hash = 0;
+			bool has_hash = payload_hash_of(rec, rv.len, hash);
+			struct ring_entry e(rv, 0, rec[0], has_hash, payload_key(rv.source_id, hash), c.position, 0, 0);
+			if (wanted(h, e)) {
+				if (has_hash && e.type == PAYLOAD) {
+					c.payloads.insert(e.key);
+				}
+				return rv;
+			}
+		}
+		c.replay.reset();
+		cerr << "Handler " << h->get_name() << " is done replaying, at offset " << c.position << endl;
+	}
+	if (c.spilled) {
+		rv = c.spilled->pop(c.position);
+		if (rv.len > 0) {
+			return rv;
+		}
+		c.spilled.reset();
+		cerr << "Handler " << h->get_name() << " caught up on its spill" << endl;
+	}
+	if (!c.handed.empty()) {
+		rv = c.handed.front();
+		c.handed.pop_front();
+		return rv;
+	}
+
+	uint64_t from = c.cursor;
+	rv = next(h, c);
+	c.position = c.ring_position;
+	if (rv.len == 0) {
+		idle.insert(h);
+	}
+	if (from == ring_base && c.cursor != from) {
+		trim();
+	}
+	return rv;
+}
+
+struct sized_buffer collector::next(output_cxn::handler *h, consumer_state &c) {
+	struct sized_buffer rv;
+	while(c.cursor < ring_base + ring.size()) {
+		struct ring_entry &e(ring[c.cursor - ring_base]);
+		if (!wanted(h, e)) {
+			c.ring_position = e.end;
+			++c.cursor;
+			continue;
+		}
+		if (e.has_hash && c.payloads.insert(e.key).second && e.type == BITCOIN_MSG) {
+			/* joined after the producer sent this one. The record
+			   itself comes next time */
+			auto found = payloads.find(e.key);
+			if (found != payloads.end()) {
+				rv = found->second;
+				break;
+			}
 		}
+		rv = e.record;
+		c.ring_position = e.end;
+		++c.cursor;
+		break;
 	}
 	return rv;
 }
 
+bool collector::replay(output_cxn::handler *h, enum log_replay_from from, uint64_t value) {
+	auto it = consumers.find(h);
+	if (journal_ == nullptr || it == consumers.end()) {
+		return false;
+	}
+	consumer_state &c(it->second);
+	if (from == LOG_REPLAY_OFFSET && value == LOG_REPLAY_NOW) {
+		return true;
+	}
+	/* up to where it joined, which is where the ring (or its spill)
+	   takes over */
+	journal_->flush();
+	uint64_t since = from == LOG_REPLAY_TIME ? value : 0;
+	c.replay.reset(new journal_reader(*journal_, from == LOG_REPLAY_OFFSET ? value : 0, c.position, since));
+	return true;
+}
+
+uint64_t collector::position(output_cxn::handler *h) const {
+	auto it = consumers.find(h);
+	return it == consumers.end() ? 0 : it->second.position;
+}
+
+void collector::resend_payloads(output_cxn::handler *h) {
+	auto it = consumers.find(h);
+	if (it != consumers.end()) {
+		it->second.payloads.clear();
+	}
+}
+
 void collector::add_consumer(output_cxn::handler *h) {
-	queues.insert(make_pair(h, 
-	                        sized_buffer_queue()));
+	uint64_t position = journal_ ? journal_->end() : 0;
+	consumers.insert(make_pair(h, consumer_state(ring_base + ring.size(), position)));
+	idle.insert(h);
+	if (!h->get_group().name.empty()) {
+		join_group(h);
+	}
+	update_interests();
 }
 
 void collector::retire_consumer(output_cxn::handler *h) {
-	queues.erase(h);
+	if (!h->get_group().name.empty()) {
+		leave_group(h);
+	}
+	consumers.erase(h);
+	idle.erase(h);
+	trim();
+	update_interests();
+}
+
+void collector::update_interests() {
+	uint8_t interests = 0;
+	for(auto it = consumers.begin(); it != consumers.end(); ++it) {
+		interests |= it->first->interest_mask();
+	}
+	for(auto it = groups.begin(); it != groups.end(); ++it) {
+		if (it->second.key == GROUP_BY_REMOTE) {
+			interests |= BITCOIN; /* the connects remote_partition learns peers from */
+		}
+	}
+	if (interests != interests_) {
+		interests_ = interests;
+		pipeline::set_interests(interests_);
+	}
 }
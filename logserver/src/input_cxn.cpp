@@ -5,11 +5,17 @@
 #include <fcntl.h>
 
 #include <set>
+#include <vector>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 
 #include "network.hpp"
 #include "netwrap.hpp"
-#include "collector.hpp"
+#include "pipeline.hpp"
+#include "config.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
 
 using namespace std;
 
@@ -18,7 +24,16 @@ namespace input_cxn {
 const uint32_t RECV_HEADER = 0x1;
 const uint32_t RECV_LOG = 0x2;
 
-set<uint32_t> taken_ids;
+static atomic<uint32_t> g_next_id(0);
+
+/* bytes of ring a producer may attach, from logger.max_shm_ring */
+static size_t max_ring_size() {
+	long long max_ring = 64 * 1024 * 1024;
+	get_config()->lookupValue("logger.max_shm_ring", max_ring);
+	return max_ring;
+}
+static thread_local set<handler*> g_handlers; /* on this ingest loop */
+static thread_local bool g_held(false); /* by the pipeline, whose queues are full */
 
 void handler::handle_accept_error(handlers::accept_handler<handler> *handler, const network_error &e) {
 	cerr << e.what() << endl;
@@ -30,27 +45,129 @@ void handler::handle_accept_error(handlers::accept_handler<handler> *handler, co
 }
 
 void handler::handle_accept(handlers::accept_handler<handler> *, int fd) {
-	new handler(fd); /* let him delete himself */
+	tcp_tune(fd);
+	uint32_t id = next_id();
+	pipeline::ingest([fd, id]() {
+			new handler(fd, id); /* let him delete himself */
+		});
 }
 
 
-handler::handler(int fd) 
-	: read_queue(4), state(RECV_HEADER), io(), id(time(NULL)) {
-	auto p = taken_ids.insert(id);
-	while(p.second == false) {
-		sleep(1);
-		id = time(NULL);
-		p = taken_ids.insert(id);
+uint32_t handler::next_id() {
+	uint32_t now = time(NULL);
+	uint32_t id = g_next_id.load();
+	while(!g_next_id.compare_exchange_weak(id, max(id, now) + 1)) {
 	}
+	return max(id, now);
+}
+
+handler::handler(int fd, uint32_t a_id) 
+	: read_queue(4), write_queue(), state(RECV_HEADER), io(), id(a_id), ring(), ring_io(), forwarded(false), sources() {
 	cerr << "Instantiating new input handler " << id << endl;
+	io.set(pipeline::loop());
 	io.set<handler, &handler::io_cb>(this);
-	io.start(fd, ev::READ);
+	io.set(fd, ev::READ);
+	watch();
+	ring_io.set(pipeline::loop());
+	ring_io.set<handler, &handler::ring_cb>(this);
+	read_queue.want_fds(true); /* for LOG_RING_ATTACH */
+	g_handlers.insert(this);
+	send_interests(pipeline::interests());
+	send_codecs();
+	send_source_id(0, id);
+}
+
+void handler::hold(bool on) {
+	g_held = on;
+	for(auto it = g_handlers.begin(); it != g_handlers.end(); ++it) {
+		handler *h = *it;
+		h->watch();
+		if (h->ring && on) {
+			h->ring_io.stop();
+		} else if (h->ring) {
+			h->ring_io.start();
+			h->ring_io.feed_event(ev::READ);
+		}
+	}
+}
+
+/* READ unless held, WRITE while there is something to send */
+void handler::watch() {
+	int events = (g_held ? 0 : (int) ev::READ) | (write_queue.to_write() ? (int) ev::WRITE : 0);
+	io.stop();
+	io.set(events);
+	if (events) {
+		io.start();
+	}
+}
+
+void handler::announce_interests(uint8_t interests) {
+	for(auto it = g_handlers.begin(); it != g_handlers.end(); ++it) {
+		(*it)->send_interests(interests);
+	}
+}
+
+void handler::send_interests(uint8_t interests) {
+	uint8_t msg[sizeof(uint32_t) + 2];
+	uint32_t netlen = hton((uint32_t) 2);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_INTERESTS;
+	msg[sizeof(netlen) + 1] = interests;
+	write_queue.append(msg, sizeof(msg));
+	watch();
+}
+
+void handler::send_codecs() {
+	uint8_t msg[sizeof(uint32_t) + 2];
+	uint32_t netlen = hton((uint32_t) 2);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_CODECS;
+	msg[sizeof(netlen) + 1] = (1 << LOG_CODEC_LZ4) | (1 << LOG_CODEC_ZSTD);
+	write_queue.append(msg, sizeof(msg));
+	watch();
+}
+
+void handler::refuse_ring() {
+	uint8_t msg[sizeof(uint32_t) + 1];
+	uint32_t netlen = hton((uint32_t) 1);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_RING_REFUSED;
+	write_queue.append(msg, sizeof(msg));
+	watch();
+}
+
+void handler::send_source_id(uint32_t theirs, uint32_t ours) {
+	uint8_t msg[sizeof(uint32_t) + 1 + 2 * sizeof(uint32_t)];
+	uint32_t netlen = hton((uint32_t)(sizeof(msg) - sizeof(netlen)));
+	theirs = hton(theirs);
+	ours = hton(ours);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_SOURCE_ID;
+	memcpy(msg + sizeof(netlen) + 1, &theirs, sizeof(theirs));
+	memcpy(msg + sizeof(netlen) + 1 + sizeof(theirs), &ours, sizeof(ours));
+	write_queue.append(msg, sizeof(msg));
+	watch();
 }
 
 void handler::io_cb(ev::io &watcher, int revents) {
+	if (revents & ev::WRITE) {
+		ssize_t r(1);
+		while(write_queue.to_write() && r > 0) {
+			pair<int,bool> res = write_queue.do_write(watcher.fd);
+			r = res.first;
+			if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) { 
+				cerr << "Got unexpected error on handler " << id << " : " << strerror(errno);
+				suicide();
+				return;
+			}
+		}
+		if (write_queue.to_write() == 0) {
+			watch();
+		}
+	}
 	if (revents & ev::READ) {
 		ssize_t r(1);
-		while(r > 0 && read_queue.hungry()) { /* do all reads we can in this event handler */
+		while(r > 0 && read_queue.hungry() && !g_held) { /* do all reads we can in this event handler */
 			do {
 				pair<int,bool> res = read_queue.do_read(watcher.fd);
 				r = res.first;
@@ -62,6 +179,9 @@ void handler::io_cb(ev::io &watcher, int revents) {
 				if (r == 0) { /* got disconnected! */
 					/* LOG disconnect */
 					cerr << "Remote disconnect from " << id << endl;
+					if (ring) { /* whatever it left behind */
+						drain_ring();
+					}
 					suicide();
 					return;
 				}
@@ -72,10 +192,20 @@ void handler::io_cb(ev::io &watcher, int revents) {
 					read_queue.cursor(0);
 					read_queue.to_read(ntoh(*((const uint32_t*) read_queue.extract_buffer().const_ptr())));
 					state = RECV_LOG;
+				} else if (forwarded) {
+					handle_forwarded(read_queue.extract_buffer(), read_queue.cursor());
+					read_queue.cursor(0);
+					read_queue.to_read(4);
+					state = RECV_HEADER;
+				} else if (read_queue.cursor() && read_queue.extract_buffer().const_ptr()[0] == 0) {
+					handle_transport(read_queue.extract_buffer().const_ptr(), read_queue.cursor());
+					read_queue.cursor(0);
+					read_queue.to_read(4);
+					state = RECV_HEADER;
 				} else {
 					/* item needs to be handled */
 					wrapped_buffer<uint8_t> p = read_queue.extract_buffer();
-					collector::get().append(move(p), read_queue.cursor(), id);
+					pipeline::publish(move(p), read_queue.cursor(), id);
 					read_queue.cursor(0);
 					read_queue.to_read(4);
 					state = RECV_HEADER;
@@ -86,7 +216,186 @@ void handler::io_cb(ev::io &watcher, int revents) {
 }
 
 
+void handler::handle_transport(const uint8_t *msg, size_t len) {
+	if (len >= 2 && msg[1] == LOG_FRAME) {
+		if (!unframe(msg + 2, len - 2)) {
+			cerr << "Dropping corrupt frame from " << id << endl;
+		}
+		return;
+	}
+	vector<int> fds(read_queue.take_fds());
+	if (len == 2 && msg[1] == LOG_FORWARD && fds.empty() && !ring) {
+		cerr << "Producer " << id << " is a logserver forwarding its sources" << endl;
+		forwarded = true;
+		read_queue.want_fds(false);
+		return;
+	}
+	if (len >= 2 && msg[1] == LOG_RING_ATTACH && fds.size() == 2 && !ring) {
+		static const size_t max_ring = max_ring_size();
+		try {
+			ring.reset(new shm_ring(fds[0], fds[1], max_ring));
+		} catch (const network_error &e) {
+			cerr << "Could not map log ring from " << id << ": " << e.what() << endl;
+			refuse_ring();
+			return;
+		}
+		cerr << "Producer " << id << " attached a " << ring->size() << " byte ring" << endl;
+		ring_io.set(ring->doorbell(), ev::READ);
+		if (g_held) { /* hold(false) starts it */
+			return;
+		}
+		ring_io.start();
+		if (!ring->sleep()) {
+			ring_io.feed_event(ev::READ);
+		}
+		return;
+	}
+	cerr << "Ignoring transport message from " << id << endl;
+	for(auto it = fds.begin(); it != fds.end(); ++it) {
+		close(*it);
+	}
+}
+
+uint32_t handler::source_of(uint32_t theirs) {
+	auto it = sources.find(theirs);
+	if (it != sources.end()) {
+		return it->second;
+	}
+	uint32_t ours = next_id();
+	sources.insert(make_pair(theirs, ours));
+	cerr << "Source " << theirs << " forwarded by " << id << " is " << ours << endl;
+	send_source_id(theirs, ours);
+	return ours;
+}
+
+/* a record with its source_id in front, or a frame of them, as
+   output_cxn writes them */
+void handler::handle_forwarded(const wrapped_buffer<uint8_t> &buf, size_t len) {
+	const uint8_t *msg = buf.const_ptr();
+	uint32_t theirs;
+	if (len <= sizeof(theirs)) {
+		return;
+	}
+	if (!log_is_frame(msg, len)) {
+		memcpy(&theirs, msg, sizeof(theirs));
+		theirs = ntoh(theirs);
+		if (theirs != 0) { /* 0 is the logserver's own, like marks */
+			pipeline::publish(wrapped_buffer<uint8_t>(buf), len - sizeof(theirs), source_of(theirs), sizeof(theirs));
+		}
+		return;
+	}
+
+	const uint8_t *frame = msg + sizeof(LOG_READER_FRAME_HEADER);
+	size_t frame_len = len - sizeof(LOG_READER_FRAME_HEADER);
+	size_t raw_len = log_frame_size(frame, frame_len);
+	wrapped_buffer<uint8_t> raw(max(raw_len, (size_t) 1));
+	if (raw_len == 0 || !log_unframe(frame, frame_len, raw.ptr())) {
+		cerr << "Dropping corrupt frame from " << id << endl;
+		return;
+	}
+	size_t off = 0;
+	uint32_t netlen;
+	while(off + sizeof(netlen) + sizeof(theirs) <= raw_len) {
+		memcpy(&netlen, raw.const_ptr() + off, sizeof(netlen));
+		size_t rec = ntoh(netlen);
+		if (rec <= sizeof(theirs) || off + sizeof(netlen) + rec > raw_len) {
+			cerr << "Dropping the rest of a corrupt frame from " << id << endl;
+			return;
+		}
+		memcpy(&theirs, raw.const_ptr() + off + sizeof(netlen), sizeof(theirs));
+		theirs = ntoh(theirs);
+		if (theirs != 0) {
+			pipeline::publish(wrapped_buffer<uint8_t>(raw), rec - sizeof(theirs), source_of(theirs),
+			                  off + sizeof(netlen) + sizeof(theirs));
+		}
+		off += sizeof(netlen) + rec;
+	}
+}
+
+/* decompresses a batch of records and passes them along by offset,
+   the same as records out of the ring */
+bool handler::unframe(const uint8_t *frame, size_t len) {
+	size_t raw_len = log_frame_size(frame, len);
+	if (raw_len == 0) {
+		return false;
+	}
+	wrapped_buffer<uint8_t> buf(raw_len);
+	if (!log_unframe(frame, len, buf.ptr())) {
+		return false;
+	}
+	size_t off = 0;
+	uint32_t netlen;
+	while(off + sizeof(netlen) <= raw_len) {
+		memcpy(&netlen, buf.const_ptr() + off, sizeof(netlen));
+		size_t rec = ntoh(netlen);
+		if (rec == 0 || off + sizeof(netlen) + rec > raw_len) {
+			return false;
+		}
+		pipeline::publish(wrapped_buffer<uint8_t>(buf), rec, id, off + sizeof(netlen));
+		off += sizeof(netlen) + rec;
+	}
+	return off == raw_len;
+}
+
+/* Hands everything in the ring to the collector. It all comes out in
+   one copy, into a chunk the records are then passed along in by
+   offset. Consuming in place would let the slowest consumer hold up
+   the producer. Returns the bytes left in it, the start of a record
+   still being written, or -1 if the ring is corrupt */
+ssize_t handler::drain_ring() {
+	const size_t chunk_max = 1 << 20;
+	size_t avail;
+	while((avail = ring->readable()) >= sizeof(uint32_t)) {
+		size_t chunk = min(avail, chunk_max);
+		wrapped_buffer<uint8_t> buf(chunk);
+		ring->peek(buf.ptr(), chunk);
+
+		size_t off = 0;
+		uint32_t netlen;
+		while(off + sizeof(netlen) <= chunk) {
+			memcpy(&netlen, buf.const_ptr() + off, sizeof(netlen));
+			size_t len = ntoh(netlen);
+			if (len == 0 || len + sizeof(netlen) > ring->size()) {
+				return -1;
+			}
+			if (off + sizeof(netlen) + len > chunk) {
+				break;
+			}
+			pipeline::publish(wrapped_buffer<uint8_t>(buf), len, id, off + sizeof(netlen));
+			off += sizeof(netlen) + len;
+		}
+
+		if (off == 0) { /* a record bigger than a chunk */
+			memcpy(&netlen, buf.const_ptr(), sizeof(netlen));
+			size_t len = ntoh(netlen);
+			if (avail < sizeof(netlen) + len) { /* writes are whole, so shouldn't happen */
+				return avail;
+			}
+			wrapped_buffer<uint8_t> big(sizeof(netlen) + len);
+			ring->peek(big.ptr(), sizeof(netlen) + len);
+			pipeline::publish(move(big), len, id, sizeof(netlen));
+			off = sizeof(netlen) + len;
+		}
+		ring->consume(off);
+	}
+	return ring->corrupt() ? -1 : avail;
+}
+
+void handler::ring_cb(ev::io & /* watcher */, int /* revents */) {
+	ring->clear_doorbell();
+	ssize_t pending;
+	do {
+		if ((pending = drain_ring()) < 0) {
+			cerr << "Corrupt log ring from " << id << ", dropping it" << endl;
+			ring_io.stop();
+			ring.reset();
+			return;
+		}
+	} while(!g_held && !ring->sleep(pending));
+}
+
 void handler::suicide() {
+	ring_io.stop();
 	io.stop();
 	close(io.fd);
 	io.fd = -1;
@@ -95,6 +404,12 @@ void handler::suicide() {
 
 
 handler::~handler() { 
+	g_handlers.erase(this);
+	metrics::forget(id);
+	for(auto it = sources.begin(); it != sources.end(); ++it) {
+		metrics::forget(it->second);
+	}
+	ring_io.stop();
 	if (io.fd >= 0) {
 		io.stop();
 		close(io.fd);
@@ -0,0 +1,373 @@
+#include "journal.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "config.hpp"
+#include "collector.hpp"
+#include "pipeline.hpp"
+#include "logger.hpp"
+#include "network.hpp"
+
+using namespace std;
+
+/* bytes of journal between index entries */
+const uint64_t INDEX_INTERVAL = 64 * 1024;
+/* appended records are written out once there are this many bytes,
+   or they have waited FLUSH_LATENCY seconds */
+const size_t FLUSH_SIZE = 1024 * 1024;
+const double FLUSH_LATENCY = 0.1;
+/* bytes a journal_reader reads at a time */
+const size_t READ_CHUNK = 1024 * 1024;
+/* length and source_id */
+const size_t RECORD_HEADER = 2 * sizeof(uint32_t);
+
+journal * journal::configured() {
+	const libconfig::Config *cfg(get_config());
+	const char *path = "";
+	cfg->lookupValue("logger.journal.path", path);
+	string dir(path);
+	if (dir.empty()) {
+		return nullptr;
+	}
+	if (dir[dir.size() - 1] != '/') {
+		dir += '/';
+	}
+	mkdir(dir.c_str(), 0777);
+	long long segment_size = 256 * 1024 * 1024;
+	long long max_size = 16LL * 1024 * 1024 * 1024;
+	cfg->lookupValue("logger.journal.segment_size", segment_size);
+	cfg->lookupValue("logger.journal.max_size", max_size);
+	return new journal(dir, segment_size, max_size);
+}
+
+journal * journal::get() {
+	static journal *j = configured();
+	return j;
+}
+
+static bool write_all(int fd, const vector<uint8_t> &buf) {
+	size_t done = 0;
+	while(done < buf.size()) {
+		ssize_t r = write(fd, buf.data() + done, buf.size() - done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			return false;
+		}
+		done += r;
+	}
+	return true;
+}
+
+journal::journal(const string &a_dir, uint64_t a_segment_size, uint64_t a_max_size)
+	: dir(a_dir), segment_size(a_segment_size), max_size(a_max_size), segments(), total(0), fd(-1), index_fd(-1),
+	  pending(), index_pending(), end_(0), next_index(0), last_time(0), flush_timer(pipeline::loop()) {
+	flush_timer.set<journal, &journal::flush_cb>(this);
+	recover();
+	open_last();
+	cerr << "Journal in " << dir << " has offsets " << begin() << " to " << end_ << endl;
+}
+
+string journal::path(uint64_t base, const char *ext) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%020llu.%s", (unsigned long long) base, ext);
+	return dir + name;
+}
+
+/* picks up the segments a previous run left, dropping a record it
+   was killed halfway through writing */
+void journal::recover() {
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+		cerr << "Could not open journal directory " << dir << ": " << strerror(errno) << endl;
+		return;
+	}
+	for(struct dirent *ent = readdir(d); ent != NULL; ent = readdir(d)) {
+		const char *name = ent->d_name;
+		if (strlen(name) != 24 || strcmp(name + 20, ".log") != 0 ||
+		    strspn(name, "0123456789") != 20) {
+			continue;
+		}
+		struct segment s = { strtoull(name, NULL, 10), 0, vector<struct index_entry>() };
+		struct stat st;
+		if (stat(path(s.base, "log").c_str(), &st) != 0) {
+			continue;
+		}
+		s.size = st.st_size;
+
+		int f = open(path(s.base, "idx").c_str(), O_RDONLY | O_CLOEXEC);
+		if (f >= 0) {
+			uint64_t entry[2];
+			while(read(f, entry, sizeof(entry)) == (ssize_t) sizeof(entry)) {
+				struct index_entry e = { ntoh(entry[0]), ntoh(entry[1]) };
+				if (e.offset >= s.base && e.offset < s.base + s.size) {
+					s.index.push_back(e);
+				}
+			}
+			close(f);
+		}
+		segments.insert(make_pair(s.base, s));
+	}
+	closedir(d);
+	if (segments.empty()) {
+		return;
+	}
+
+	struct segment &last(segments.rbegin()->second);
+	uint64_t pos = last.index.empty() ? last.base : last.index.back().offset;
+	int f = open(path(last.base, "log").c_str(), O_RDONLY | O_CLOEXEC);
+	uint32_t netlen;
+	while(f >= 0 && pos + sizeof(netlen) <= last.base + last.size &&
+	      pread(f, &netlen, sizeof(netlen), pos - last.base) == (ssize_t) sizeof(netlen) &&
+	      pos + sizeof(netlen) + ntoh(netlen) <= last.base + last.size) {
+		pos += sizeof(netlen) + ntoh(netlen);
+	}
+	if (f >= 0) {
+		close(f);
+	}
+	if (pos != last.base + last.size) {
+		cerr << "Dropping " << last.base + last.size - pos << " bytes of torn record from the journal" << endl;
+		if (truncate(path(last.base, "log").c_str(), pos - last.base) != 0) {
+			cerr << "Could not truncate journal: " << strerror(errno) << endl;
+		}
+		last.size = pos - last.base;
+	}
+	if (truncate(path(last.base, "idx").c_str(), last.index.size() * 2 * sizeof(uint64_t)) != 0 && errno != ENOENT) {
+		cerr << "Could not truncate journal index: " << strerror(errno) << endl;
+	}
+
+	for(auto it = segments.begin(); it != segments.end(); ++it) {
+		total += it->second.size;
+	}
+	end_ = last.base + last.size;
+	next_index = end_;
+	last_time = last.index.empty() ? 0 : last.index.back().time;
+}
+
+void journal::open_last() {
+	if (segments.empty()) {
+		struct segment s = { end_, 0, vector<struct index_entry>() };
+		segments.insert(make_pair(end_, s));
+	}
+	uint64_t base = segments.rbegin()->first;
+	fd = open(path(base, "log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	index_fd = open(path(base, "idx").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0 || index_fd < 0) {
+		cerr << "Could not open journal segment " << path(base, "log") << ": " << strerror(errno) << endl;
+	}
+}
+
+/* starts a new segment, and lets the oldest go if there are too many */
+void journal::roll() {
+	flush();
+	close(fd);
+	close(index_fd);
+	struct segment s = { end_, 0, vector<struct index_entry>() };
+	segments.insert(make_pair(end_, s));
+	open_last();
+
+	while(total > max_size && segments.size() > 1) {
+		auto oldest = segments.begin();
+		unlink(path(oldest->first, "log").c_str());
+		unlink(path(oldest->first, "idx").c_str());
+		total -= oldest->second.size;
+		segments.erase(oldest);
+	}
+}
+
+uint64_t journal::append(const struct sized_buffer &p) {
+	size_t need = RECORD_HEADER + p.len;
+	if (segments.rbegin()->second.size > 0 && segments.rbegin()->second.size + need > segment_size) {
+		roll();
+	}
+	struct segment &cur(segments.rbegin()->second);
+
+	if (end_ >= next_index) {
+		last_time = max(last_time, (uint64_t) (ev_now(pipeline::loop()) * 1e9));
+		struct index_entry e = { last_time, end_ };
+		cur.index.push_back(e);
+		uint64_t entry[2] = { hton(e.time), hton(e.offset) };
+		const uint8_t *bytes = (const uint8_t*) entry;
+		index_pending.insert(index_pending.end(), bytes, bytes + sizeof(entry));
+		next_index = end_ + INDEX_INTERVAL;
+	}
+
+	uint32_t hdr[2] = { hton((uint32_t) (p.len + sizeof(uint32_t))), hton(p.source_id) };
+	const uint8_t *bytes = (const uint8_t*) hdr;
+	pending.insert(pending.end(), bytes, bytes + sizeof(hdr));
+	bytes = p.buffer.const_ptr() + p.offset;
+	pending.insert(pending.end(), bytes, bytes + p.len);
+	cur.size += need;
+	total += need;
+	end_ += need;
+
+	if (pending.size() >= FLUSH_SIZE) {
+		flush();
+	} else if (!flush_timer.is_active()) {
+		flush_timer.start(FLUSH_LATENCY, 0);
+	}
+	return end_;
+}
+
+void journal::flush() {
+	flush_timer.stop();
+	if (!pending.empty() && !write_all(fd, pending)) {
+		cerr << "Could not write " << pending.size() << " bytes of journal: " << strerror(errno) << endl;
+	}
+	if (!index_pending.empty() && !write_all(index_fd, index_pending)) {
+		cerr << "Could not write journal index: " << strerror(errno) << endl;
+	}
+	pending.clear();
+	index_pending.clear();
+}
+
+uint64_t journal::begin() const {
+	return segments.empty() ? end_ : segments.begin()->first;
+}
+
+uint64_t journal::seek_offset(uint64_t offset) const {
+	if (offset <= begin()) {
+		return begin();
+	} else if (offset >= end_) {
+		return end_;
+	}
+	auto seg = --segments.upper_bound(offset);
+	const vector<struct index_entry> &index(seg->second.index);
+	auto it = upper_bound(index.begin(), index.end(), offset,
+	                      [](uint64_t o, const struct index_entry &e) { return o < e.offset; });
+	return it == index.begin() ? seg->first : (it - 1)->offset;
+}
+
+uint64_t journal::seek_time(uint64_t ns) const {
+	for(auto seg = segments.rbegin(); seg != segments.rend(); ++seg) {
+		const vector<struct index_entry> &index(seg->second.index);
+		if (index.empty() || index.front().time > ns) {
+			continue;
+		}
+		auto it = upper_bound(index.begin(), index.end(), ns,
+		                      [](uint64_t t, const struct index_entry &e) { return t < e.time; });
+		return (it - 1)->offset;
+	}
+	return begin();
+}
+
+bool journal::locate(uint64_t offset, string &seg_path, uint64_t &base, uint64_t &size) const {
+	auto it = segments.upper_bound(offset);
+	if (it == segments.begin()) {
+		return false;
+	}
+	--it;
+	if (offset >= it->first + it->second.size) {
+		return false;
+	}
+	seg_path = path(it->first, "log");
+	base = it->first;
+	size = it->second.size;
+	return true;
+}
+
+journal_reader::journal_reader(const journal &a_j, uint64_t a_from, uint64_t a_stop, uint64_t a_since)
+	: j(a_j), fd(-1), base(0), size(0), pos(a_since ? a_j.seek_time(a_since) : a_j.seek_offset(a_from)),
+	  from(a_from), stop(a_stop), since(a_since), chunk(), chunk_base(0), chunk_len(0) {}
+
+journal_reader::~journal_reader() {
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+bool journal_reader::fill() {
+	if (fd < 0 || pos < base || pos >= base + size) {
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+		string path;
+		if (!j.locate(pos, path, base, size)) {
+			if (pos >= j.begin()) {
+				return false;
+			}
+			pos = j.begin(); /* the segment has gone, so start with the oldest there is */
+			if (!j.locate(pos, path, base, size)) {
+				return false;
+			}
+		}
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			cerr << "Could not open journal segment " << path << ": " << strerror(errno) << endl;
+			return false;
+		}
+	}
+
+	size_t want = min((uint64_t) READ_CHUNK, min(base + size, stop) - pos);
+	chunk = wrapped_buffer<uint8_t>(want);
+	if (pread(fd, chunk.ptr(), want, pos - base) != (ssize_t) want) {
+		cerr << "Could not read journal: " << strerror(errno) << endl;
+		return false;
+	}
+	chunk_base = pos;
+	chunk_len = want;
+
+	uint32_t netlen;
+	memcpy(&netlen, chunk.const_ptr(), sizeof(netlen));
+	size_t first = sizeof(netlen) + ntoh(netlen);
+	if (first > chunk_len && pos + first <= base + size) { /* one record bigger than a chunk */
+		chunk.realloc(first);
+		if (pread(fd, chunk.ptr() + chunk_len, first - chunk_len, pos - base + chunk_len) != (ssize_t) (first - chunk_len)) {
+			cerr << "Could not read journal: " << strerror(errno) << endl;
+			return false;
+		}
+		chunk_len = first;
+	}
+	return true;
+}
+
+struct sized_buffer journal_reader::next(uint64_t &end) {
+	while(pos < stop) {
+		uint32_t netlen = 0;
+		bool whole = pos >= chunk_base && pos + sizeof(netlen) <= chunk_base + chunk_len;
+		if (whole) {
+			memcpy(&netlen, chunk.const_ptr() + (pos - chunk_base), sizeof(netlen));
+			whole = pos + sizeof(netlen) + ntoh(netlen) <= chunk_base + chunk_len;
+		}
+		if (!whole) {
+			if (!fill()) {
+				pos = stop;
+				break;
+			}
+			memcpy(&netlen, chunk.const_ptr(), sizeof(netlen));
+			if (ntoh(netlen) < sizeof(uint32_t) || sizeof(netlen) + ntoh(netlen) > chunk_len) {
+				cerr << "Corrupt journal at offset " << pos << ", ending replay" << endl;
+				pos = stop;
+				break;
+			}
+		}
+
+		const uint8_t *at = chunk.const_ptr() + (pos - chunk_base);
+		uint32_t source_id;
+		memcpy(&source_id, at + sizeof(netlen), sizeof(source_id));
+		uint64_t start = pos;
+		size_t len = ntoh(netlen) - sizeof(source_id);
+		pos += sizeof(netlen) + ntoh(netlen);
+		if (start < from) {
+			continue;
+		}
+		const uint8_t *rec = at + RECORD_HEADER;
+		if (since && (len < 2 + sizeof(uint64_t) || log_timestamp(rec) < since)) {
+			continue;
+		}
+		end = pos;
+		return sized_buffer(chunk, len, ntoh(source_id), start - chunk_base + RECORD_HEADER);
+	}
+	end = pos;
+	return sized_buffer();
+}
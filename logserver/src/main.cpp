@@ -6,6 +6,9 @@
 /* standard C++ libraries */
 #include <iostream>
 #include <utility>
+#include <algorithm>
+#include <vector>
+#include <memory>
 
 /* standard unix libraries */
 #include <sys/types.h>
@@ -22,11 +25,18 @@
 #include "accept_handler.hpp"
 #include "input_cxn.hpp"
 #include "output_cxn.hpp"
+#include "pipeline.hpp"
+#include "metrics.hpp"
 #include "logger.hpp"
 #include "config.hpp"
 
 using namespace std;
 
+static void stop_watcher(ev::sig &s, int /* revents */) {
+	cerr << "Stopping on signal " << s.signum << endl;
+	s.loop.break_loop(ev::ALL);
+}
+
 int main(int argc, char * argv[] ) {
 
 	if (startup_setup(argc, argv) != 0) {
@@ -36,6 +46,12 @@ int main(int argc, char * argv[] ) {
 	const libconfig::Config *cfg(get_config());
 	signal(SIGPIPE, SIG_IGN);
 
+	/* 0 to have the main loop do it all */
+	int ingest_threads = 0, fanout_threads = 0;
+	cfg->lookupValue("logger.ingest_threads", ingest_threads);
+	cfg->lookupValue("logger.fanout_threads", fanout_threads);
+	pipeline::start(max(ingest_threads, 0), max(fanout_threads, 0));
+
 	string root((const char*)cfg->lookup("logger.root"));
 
 	/* TODO: make configurable */
@@ -47,34 +63,124 @@ int main(int argc, char * argv[] ) {
 	/* TODO: clean this up, just leaving as POC for now */
 	handlers::accept_handler<output_cxn::handler> debug_handler(unix_sock_server(client_dir + "debug", 5, true));
 	output_cxn::handler::set_interest(&debug_handler, (uint8_t)DEBUG);
+	output_cxn::handler::set_channel(&debug_handler, "debug");
 
 	handlers::accept_handler<output_cxn::handler> ctrl_handler(unix_sock_server(client_dir + "ctrl", 5, true));
 	output_cxn::handler::set_interest(&ctrl_handler, (uint8_t)CTRL);
+	output_cxn::handler::set_channel(&ctrl_handler, "ctrl");
 
 	handlers::accept_handler<output_cxn::handler> error_handler(unix_sock_server(client_dir + "error", 5, true));
 	output_cxn::handler::set_interest(&error_handler, (uint8_t)ERROR);
+	output_cxn::handler::set_channel(&error_handler, "error");
 
 	handlers::accept_handler<output_cxn::handler> bitcoin_handler(unix_sock_server(client_dir + "bitcoin", 5, true));
 	output_cxn::handler::set_interest(&bitcoin_handler, (uint8_t)BITCOIN);
+	output_cxn::handler::set_channel(&bitcoin_handler, "bitcoin");
 
 	handlers::accept_handler<output_cxn::handler> bitcoin_msg_handler(unix_sock_server(client_dir + "bitcoin_msg", 5, true));
 	output_cxn::handler::set_interest(&bitcoin_msg_handler, (uint8_t)BITCOIN_MSG);
+	output_cxn::handler::set_channel(&bitcoin_msg_handler, "bitcoin_msg");
 
 	handlers::accept_handler<output_cxn::handler> bitcoin_foo_handler(unix_sock_server(client_dir + "bitcoinx", 5, true));
 	output_cxn::handler::set_interest(&bitcoin_foo_handler, (uint8_t)(BITCOIN_MSG | BITCOIN));
+	output_cxn::handler::set_channel(&bitcoin_foo_handler, "bitcoinx");
 
 	handlers::accept_handler<output_cxn::handler> all_handler(unix_sock_server(client_dir + "all", 5, true));
 	output_cxn::handler::set_interest(&all_handler, (uint8_t)~0);
+	output_cxn::handler::set_channel(&all_handler, "all");
+
+	/* readers here say where in the journal to start from, then keep
+	   going with live records like all */
+	unique_ptr<handlers::accept_handler<output_cxn::handler> > replay_handler;
+	const char *journal_path = "";
+	cfg->lookupValue("logger.journal.path", journal_path);
+	if (*journal_path) { /* the journal itself is opened by the fan-out loop keeping it */
+		replay_handler.reset(new handlers::accept_handler<output_cxn::handler>(unix_sock_server(client_dir + "replay", 5, true)));
+		output_cxn::handler::set_interest(replay_handler.get(), (uint8_t)~0);
+		output_cxn::handler::set_replay(replay_handler.get());
+		output_cxn::handler::set_channel(replay_handler.get(), "replay");
+	}
+
+	/* a snapshot of the per-second counts, then hung up on */
+	unique_ptr<handlers::accept_handler<metrics> > metrics_handler;
+	if (metrics::enabled()) {
+		metrics_handler.reset(new handlers::accept_handler<metrics>(unix_sock_server(client_dir + "metrics", 5, true)));
+		output_cxn::handler::set_channel("metrics", metrics::serve);
+	}
+
+	/* consumer groups, each with its own endpoint under groups/ */
+	vector<unique_ptr<handlers::accept_handler<output_cxn::handler> > > group_handlers;
+	if (cfg->exists("logger.groups")) {
+		string group_dir(client_dir + "groups/");
+		mkdir(group_dir.c_str(), 0777);
+		const libconfig::Setting &groups = cfg->lookup("logger.groups");
+		for(int i = 0; i < groups.getLength(); ++i) {
+			struct output_cxn::group_spec group;
+			int types = 0xff;
+			const char *name = "", *key_str = "handle";
+			groups[i].lookupValue("name", name);
+			groups[i].lookupValue("types", types);
+			groups[i].lookupValue("key", key_str);
+			group.name = name;
+			string key(key_str);
+			if (group.name.empty() || group.name.find('/') != string::npos) {
+				cerr << "Skipping consumer group " << i << " without a usable name" << endl;
+				continue;
+			}
+			if (key == "remote") {
+				group.key = GROUP_BY_REMOTE;
+			} else if (key != "handle") {
+				cerr << "Unknown key " << key << " for consumer group " << group.name << ", using handle" << endl;
+			}
+			group.lane = i;
+			group_handlers.emplace_back(new handlers::accept_handler<output_cxn::handler>(unix_sock_server(group_dir + group.name, 5, true)));
+			output_cxn::handler::set_interest(group_handlers.back().get(), (uint8_t)types);
+			output_cxn::handler::set_group(group_handlers.back().get(), group);
+			output_cxn::handler::set_channel(group_handlers.back().get(), "groups/" + group.name);
+		}
+	}
 
 
 	ev::default_loop loop;
 
+	/* as an aggregator, everything goes on to another logserver too */
+	unique_ptr<output_cxn::uplink> upstream;
+	const char *upstream_addr = "";
+	if (cfg->lookupValue("logger.upstream", upstream_addr) && *upstream_addr) {
+		const char *compression = "";
+		cfg->lookupValue("logger.compression", compression);
+		upstream.reset(new output_cxn::uplink(upstream_addr, log_codec_from_str(compression)));
+	}
+
 
 	handlers::accept_handler<input_cxn::handler> in_handler(unix_sock_server(root + "servers", 5, true));
 
-	while(true) {
-		loop.run();
+	/* the same over TCP, for producers and readers on other hosts.
+	   Readers there name their endpoint with LOG_CLIENT_CHANNEL */
+	const char *tcp_servers = "", *tcp_clients = "";
+	cfg->lookupValue("logger.tcp.servers", tcp_servers);
+	cfg->lookupValue("logger.tcp.clients", tcp_clients);
+	cfg->lookupValue("logger.tcp.nodelay", g_tcp_nodelay);
+	cfg->lookupValue("logger.tcp.buffer", g_tcp_buffer);
+	unique_ptr<handlers::accept_handler<input_cxn::handler> > tcp_in_handler;
+	if (*tcp_servers) {
+		tcp_in_handler.reset(new handlers::accept_handler<input_cxn::handler>(tcp_sock_server(tcp_servers, 64, true)));
 	}
+	unique_ptr<handlers::accept_handler<output_cxn::greeter> > tcp_out_handler;
+	if (*tcp_clients) {
+		tcp_out_handler.reset(new handlers::accept_handler<output_cxn::greeter>(tcp_sock_server(tcp_clients, 64, true)));
+	}
+
+	ev::sig sigterm, sigint;
+	sigterm.set<stop_watcher>();
+	sigterm.set(SIGTERM);
+	sigterm.start();
+	sigint.set<stop_watcher>();
+	sigint.set(SIGINT);
+	sigint.start();
+
+	loop.run();
+	pipeline::stop();
 
 	/* TODO: close and cleanup all output accept handlers. Doesn't matter because we are exiting now */
 
@@ -0,0 +1,94 @@
+#include "merge_queue.hpp"
+
+#include <algorithm>
+
+#include "config.hpp"
+#include "logger.hpp"
+#include "pipeline.hpp"
+
+using namespace std;
+
+static double lookup_merge_delay() {
+	double delay = 0;
+	get_config()->lookupValue("logger.merge_delay", delay);
+	return delay;
+}
+
+bool merge_queue::enabled() {
+	static const bool enabled = lookup_merge_delay() > 0;
+	return enabled;
+}
+
+merge_queue & merge_queue::get() {
+	static thread_local merge_queue *q = nullptr;
+	if (q == nullptr) {
+		q = new merge_queue(lookup_merge_delay());
+	}
+	return *q;
+}
+
+merge_queue::merge_queue(double a_delay)
+	: delay(a_delay), sources(), heads(), held(0), timer(pipeline::loop()) {
+	timer.set<merge_queue, &merge_queue::timer_cb>(this);
+}
+
+void merge_queue::push(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset) {
+	const uint8_t *rec = data.const_ptr() + offset;
+	uint64_t timestamp = len >= 2 && len >= log_prolog_len(rec) ? log_timestamp(rec) : 0;
+	double now = ev_now(pipeline::loop());
+
+	struct source &s(sources[source_id]);
+	if (s.queue.empty()) {
+		heads.push(make_pair(timestamp, source_id));
+	}
+	s.queue.emplace_back(sized_buffer(move(data), len, source_id, offset), timestamp, now);
+	s.newest = max(s.newest, timestamp);
+	s.heard = now;
+	++held;
+	release();
+}
+
+void merge_queue::release() {
+	double now = ev_now(pipeline::loop());
+
+	/* nothing older than this can still come from a source that is
+	   keeping up */
+	uint64_t watermark = ~0ULL;
+	for(auto it = sources.begin(); it != sources.end();) {
+		if (now - it->second.heard >= delay) {
+			if (it->second.queue.empty()) {
+				it = sources.erase(it);
+				continue;
+			}
+		} else {
+			watermark = min(watermark, it->second.newest);
+		}
+		++it;
+	}
+
+	while(!heads.empty()) {
+		head top(heads.top());
+		struct source &s(sources[top.second]);
+		struct pending &p(s.queue.front());
+		if (p.timestamp > watermark && now - p.arrived < delay) {
+			break;
+		}
+		heads.pop();
+		collector::get().append(move(p.record.buffer), p.record.len, p.record.source_id, p.record.offset);
+		s.queue.pop_front();
+		--held;
+		if (!s.queue.empty()) {
+			heads.push(make_pair(s.queue.front().timestamp, top.second));
+		}
+	}
+
+	if (held == 0) {
+		timer.stop();
+	} else if (!timer.is_active()) {
+		timer.start(delay / 4, delay / 4);
+	}
+}
+
+void merge_queue::timer_cb(ev::timer &, int) {
+	release();
+}
@@ -0,0 +1,303 @@
+#include "metrics.hpp"
+
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <map>
+
+#include "config.hpp"
+#include "collector.hpp"
+#include "pipeline.hpp"
+#include "logger.hpp"
+#include "network.hpp"
+
+using namespace std;
+
+/* seconds counted */
+const time_t WINDOW = 60;
+/* distinct commands counted in a second, the rest go under OTHER.
+   Received commands are whatever peers send */
+const size_t MAX_COMMANDS = 64;
+const char *OTHER = "(other)";
+
+/* names of the update_type bits */
+static const char *g_updates[8] = {
+	"CONNECT_SUCCESS", "ACCEPT_SUCCESS", "ORDERLY_DISCONNECT", "WRITE_DISCONNECT",
+	"UNEXPECTED_ERROR", "CONNECT_FAILURE", "PEER_RESET", "CONNECTOR_DISCONNECT",
+};
+static const uint32_t OPENED = CONNECT_SUCCESS | ACCEPT_SUCCESS;
+static const uint32_t CLOSED = ORDERLY_DISCONNECT | WRITE_DISCONNECT | UNEXPECTED_ERROR | PEER_RESET | CONNECTOR_DISCONNECT;
+
+bool metrics::enabled() {
+	static const bool rv = get_config()->exists("logger.metrics");
+	return rv;
+}
+
+uint8_t metrics::types() {
+	return enabled() ? (uint8_t) (BITCOIN | BITCOIN_MSG) : 0;
+}
+
+metrics * metrics::configured() {
+	if (!enabled()) {
+		return nullptr;
+	}
+	double interval = 0;
+	get_config()->lookupValue("logger.metrics.interval", interval);
+	return new metrics(interval);
+}
+
+metrics * metrics::get() {
+	if (!pipeline::first_fanout()) {
+		return nullptr;
+	}
+	static metrics *m = configured();
+	return m;
+}
+
+metrics::metrics(double interval)
+	: seconds(WINDOW), handles(), lags(), timer(pipeline::loop()) {
+	if (interval > 0) {
+		timer.set<metrics, &metrics::interval_cb>(this);
+		timer.start(interval, interval);
+	}
+}
+
+struct metrics::second & metrics::current() {
+	time_t now = (time_t) ev_now(pipeline::loop());
+	struct second &s(seconds[now % WINDOW]);
+	if (s.when != now) {
+		s = second();
+		s.when = now;
+	}
+	return s;
+}
+
+/* the command, made safe for a line of the snapshot */
+static string command_str(const struct bitcoin::packed_message *msg) {
+	string rv(msg->command, strnlen(msg->command, sizeof(msg->command)));
+	for(auto it = rv.begin(); it != rv.end(); ++it) {
+		if (!isgraph((unsigned char) *it)) {
+			*it = '?';
+		}
+	}
+	return rv.empty() ? string("?") : rv;
+}
+
+void metrics::count(const struct ring_entry &e, const struct bitcoin::packed_message *msg) {
+	const uint8_t *rec = e.record.buffer.const_ptr() + e.record.offset;
+	size_t len = e.record.len;
+	const size_t prolog = log_prolog_len(rec);
+	struct second &s(current());
+
+	for(int i = 0; i < 8; ++i) {
+		if (e.type & (1 << i)) {
+			++s.records[i];
+			s.bytes[i] += len;
+		}
+	}
+
+	if (e.type == BITCOIN && len >= prolog + 2 * sizeof(uint32_t)) {
+		uint32_t id, update_type;
+		memcpy(&id, rec + prolog, sizeof(id));
+		memcpy(&update_type, rec + prolog + sizeof(id), sizeof(update_type));
+		id = ntoh(id);
+		update_type = ntoh(update_type);
+		for(int i = 0; i < 8; ++i) {
+			if (update_type & (1 << i)) {
+				++s.updates[i];
+			}
+		}
+		if (update_type & OPENED) {
+			handles[e.record.source_id].insert(id);
+		} else if (update_type & CLOSED) {
+			auto it = handles.find(e.record.source_id);
+			if (it != handles.end()) {
+				it->second.erase(id);
+				if (it->second.empty()) {
+					handles.erase(it);
+				}
+			}
+		}
+	} else if (e.type == BITCOIN_MSG && msg && len >= prolog + sizeof(uint32_t) + 1) {
+		int sent = rec[prolog + sizeof(uint32_t)] & 1;
+		string command(command_str(msg));
+		if (s.msgs.size() >= MAX_COMMANDS && s.msgs.find(command) == s.msgs.end()) {
+			command = OTHER;
+		}
+		struct msg_count &m(s.msgs[command]);
+		++m.count[sent];
+		m.bytes[sent] += sizeof(*msg) + msg->length;
+	}
+}
+
+static void line(ostringstream &o, const string &name, uint64_t last, uint64_t window) {
+	if (window) {
+		o << name << ' ' << last << ' ' << window << '\n';
+	}
+}
+
+string metrics::snapshot() {
+	time_t now = (time_t) ev_now(pipeline::loop());
+	uint64_t records[2][8] = {}, bytes[2][8] = {}, updates[2][8] = {};
+	map<string, struct msg_count> msgs[2]; /* sorted, for the reader */
+
+	/* 0 is the last whole second, 1 the ones in the WINDOW up to it.
+	   now - WINDOW has the current second's bucket, so isn't one */
+	for(auto it = seconds.begin(); it != seconds.end(); ++it) {
+		if (it->when >= now || it->when <= now - WINDOW) {
+			continue;
+		}
+		for(int w = it->when == now - 1 ? 0 : 1; w < 2; ++w) {
+			for(int i = 0; i < 8; ++i) {
+				records[w][i] += it->records[i];
+				bytes[w][i] += it->bytes[i];
+				updates[w][i] += it->updates[i];
+			}
+			for(auto m = it->msgs.begin(); m != it->msgs.end(); ++m) {
+				struct msg_count &c(msgs[w][m->first]);
+				for(int d = 0; d < 2; ++d) {
+					c.count[d] += m->second.count[d];
+					c.bytes[d] += m->second.bytes[d];
+				}
+			}
+		}
+	}
+
+	ostringstream o;
+	o << "time " << now << " window " << WINDOW << '\n';
+	for(int i = 0; i < 8; ++i) {
+		string type(type_to_str((enum log_type) (1 << i)));
+		line(o, "records " + type, records[0][i], records[1][i]);
+		line(o, "bytes " + type, bytes[0][i], bytes[1][i]);
+	}
+	for(int i = 0; i < 8; ++i) {
+		line(o, string("updates ") + g_updates[i], updates[0][i], updates[1][i]);
+	}
+	static const char *directions[2] = { "received", "sent" };
+	for(int d = 0; d < 2; ++d) {
+		for(auto m = msgs[1].begin(); m != msgs[1].end(); ++m) {
+			auto last = msgs[0].find(m->first);
+			bool found = last != msgs[0].end();
+			line(o, string("msgs ") + directions[d] + " " + m->first,
+			     found ? last->second.count[d] : 0, m->second.count[d]);
+			line(o, string("msg_bytes ") + directions[d] + " " + m->first,
+			     found ? last->second.bytes[d] : 0, m->second.bytes[d]);
+		}
+	}
+	map<uint32_t, size_t> open; /* sorted, for the reader */
+	for(auto it = handles.begin(); it != handles.end(); ++it) {
+		open[it->first] = it->second.size();
+	}
+	for(auto it = open.begin(); it != open.end(); ++it) {
+		o << "handles " << it->first << ' ' << it->second << '\n';
+	}
+	map<string, const struct consumer_lag *> behind; /* sorted, for the reader */
+	for(auto it = lags.begin(); it != lags.end(); ++it) {
+		for(auto l = it->second.begin(); l != it->second.end(); ++l) {
+			behind[l->consumer] = &*l;
+		}
+	}
+	for(auto it = behind.begin(); it != behind.end(); ++it) {
+		o << "lag " << it->first << ' ' << it->second->bytes << ' ' << it->second->spilled << ' '
+		  << it->second->seconds << '\n';
+	}
+	return o.str();
+}
+
+/* A CONNECTOR record of source 0, i.e., the logserver, with the
+   snapshot in a LOG_METRICS event */
+void metrics::interval_cb(ev::timer &, int) {
+	string text(snapshot());
+	const size_t prolog = 2 + sizeof(uint64_t); /* type, version, timestamp */
+	size_t len = prolog + 1 + sizeof(uint16_t) + 1 + 1 + sizeof(uint32_t) + text.size();
+	wrapped_buffer<uint8_t> buf(len);
+	uint8_t *ptr = buf.ptr();
+
+	uint64_t timestamp = hton(g_log_now());
+	uint16_t event = hton((uint16_t) EVENT_LOG_METRICS);
+	uint32_t text_len = hton((uint32_t) text.size());
+	ptr[0] = CONNECTOR;
+	ptr[1] = LOG_FORMAT_VERSION;
+	memcpy(ptr + 2, &timestamp, sizeof(timestamp));
+	ptr += prolog;
+	*ptr++ = 0;
+	memcpy(ptr, &event, sizeof(event));
+	ptr += sizeof(event);
+	*ptr++ = 1; /* field count */
+	*ptr++ = FIELD_STR;
+	memcpy(ptr, &text_len, sizeof(text_len));
+	ptr += sizeof(text_len);
+	memcpy(ptr, text.data(), text.size());
+
+	pipeline::inject(buf, len, 0);
+}
+
+void metrics::forget(uint32_t source_id) {
+	if (!enabled()) {
+		return;
+	}
+	pipeline::fanout(0, [source_id]() {
+			get()->handles.erase(source_id);
+		});
+}
+
+void metrics::report_lags(const collector *from, const vector<struct consumer_lag> &lags) {
+	pipeline::fanout(0, [from, lags]() {
+			get()->lags[from] = lags;
+		});
+}
+
+/* writes a snapshot to a reader as fast as it takes it, then hangs up */
+class snapshot_writer {
+public:
+	snapshot_writer(int fd, const string &a_text) : text(a_text), sent(0), io(pipeline::loop()) {
+		io.set<snapshot_writer, &snapshot_writer::io_cb>(this);
+		io.start(fd, ev::WRITE);
+	}
+	void io_cb(ev::io &watcher, int) {
+		while(sent < text.size()) {
+			ssize_t r = write(watcher.fd, text.data() + sent, text.size() - sent);
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			if (r < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+				return;
+			}
+			if (r < 0) {
+				cerr << "Metrics reader on fd " << watcher.fd << " did not take the whole snapshot: " << strerror(errno) << endl;
+				break;
+			}
+			sent += r;
+		}
+		io.stop();
+		close(watcher.fd);
+		delete this;
+	}
+private:
+	string text;
+	size_t sent;
+	ev::io io;
+
+	snapshot_writer & operator=(snapshot_writer other);
+	snapshot_writer(const snapshot_writer &);
+};
+
+void metrics::serve(int fd) {
+	pipeline::fanout(0, [fd]() { /* where the counts are */
+			new snapshot_writer(fd, get()->snapshot());
+		});
+}
+
+void metrics::handle_accept_error(handlers::accept_handler<metrics> *h, const network_error &e) {
+	cerr << "Giving up accepting metrics readers\n";
+	cerr << e.what() << endl;
+	h->io.stop();
+}
+
+void metrics::handle_accept(handlers::accept_handler<metrics> *, int fd) {
+	serve(fd);
+}
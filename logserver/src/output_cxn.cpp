@@ -7,10 +7,13 @@
 
 #include <iostream>
 #include <map>
+#include <set>
+#include <atomic>
 
 #include "network.hpp"
 #include "netwrap.hpp"
 #include "collector.hpp"
+#include "pipeline.hpp"
 
 using namespace std;
 
@@ -20,6 +23,18 @@ const uint32_t RECV_HEADER = 0x1;
 const uint32_t RECV_LOG = 0x2;
 
 static map<handlers::accept_handler<handler> *, uint8_t>  g_interests;
+static map<handlers::accept_handler<handler> *, struct group_spec> g_groups;
+static set<handlers::accept_handler<handler> *> g_replay;
+static map<string, function<void(int)> > g_channels; /* what to do with a reader on each */
+static atomic<uint32_t> g_serial(0); /* handlers live on every fan-out loop */
+
+/* seconds a TCP reader has to name its channel */
+const double GREETING_TIMEOUT = 10;
+
+/* seconds between tries to reach logger.upstream */
+const double UPLINK_RETRY = 5;
+static atomic<bool> g_forwarding(false);
+static enum log_codec g_forward_codec(LOG_CODEC_NONE);
 
 
 void handler::handle_accept_error(handlers::accept_handler<handler> *handler, const network_error &e) {
@@ -33,7 +48,49 @@ void handler::handle_accept_error(handlers::accept_handler<handler> *handler, co
 }
 
 void handler::handle_accept(handlers::accept_handler<handler> *h, int fd) {
-	new handler(fd, get_interests(h)); /* let him delete himself */
+	uint8_t interests = get_interests(h);
+	if (g_replay.count(h)) {
+		pipeline::fanout(0, [fd, interests]() { /* where the journal is */
+				new handler(fd, interests, group_spec(), true);
+			});
+		return;
+	}
+	auto it = g_groups.find(h);
+	if (it != g_groups.end()) {
+		struct group_spec group(it->second);
+		pipeline::fanout(group.lane, [fd, interests, group]() {
+				new handler(fd, interests, group);
+			});
+		return;
+	}
+	pipeline::fanout([fd, interests]() {
+			new handler(fd, interests); /* let him delete himself */
+		});
+}
+
+void handler::set_group(handlers::accept_handler<handler> *h, const struct group_spec &group) {
+	g_groups[h] = group;
+}
+
+void handler::set_replay(handlers::accept_handler<handler> *h) {
+	g_replay.insert(h);
+}
+
+void handler::set_channel(handlers::accept_handler<handler> *h, const string &name) {
+	g_channels[name] = [h](int fd) { handle_accept(h, fd); };
+}
+
+void handler::set_channel(const string &name, function<void(int)> join) {
+	g_channels[name] = move(join);
+}
+
+bool handler::join_channel(const string &name, int fd) {
+	auto it = g_channels.find(name);
+	if (it == g_channels.end()) {
+		return false;
+	}
+	it->second(fd);
+	return true;
 }
 
 void handler::set_interest(handlers::accept_handler<handler> *h, uint8_t interest) {
@@ -53,9 +110,35 @@ uint8_t handler::get_interests(handlers::accept_handler<handler> *h) {
 	return rv;
 }
 
-handler::handler(int fd, uint8_t _interests) 
-	: interests(_interests), events(ev::NONE), write_queue(), io() {
-	cerr << "Instantiating new output handler on fd " << fd << "\n";
+/* raw bytes of records that go in one compressed frame */
+const size_t FRAME_BATCH = 64 * 1024;
+/* bytes of records queued per wakeup, and the most records, whose
+   length and source_id go in the header arena */
+const size_t WRITE_BATCH = 256 * 1024;
+const size_t WRITE_BATCH_RECORDS = 1024;
+const size_t RECORD_HEADER = 2 * sizeof(uint32_t);
+
+static string handler_name(const struct group_spec &group, bool replays, bool forwards) {
+	string kind(!group.name.empty() ? group.name : replays ? "replay" : forwards ? "upstream" : "reader");
+	return kind + "#" + to_string(++g_serial);
+}
+
+handler::handler(int fd, uint8_t _interests, const struct group_spec &_group, bool _replays, bool _forwards)
+	: interests(_interests), endpoint(_interests), filter(), group(_group), replays(_replays), waiting(_replays),
+	  marked(0), forwards(_forwards), name(handler_name(_group, _replays, _forwards)), events(ev::READ),
+	  write_queue(), read_queue(4), state(RECV_HEADER), codec(LOG_CODEC_NONE), headers(), records_sent(0),
+	  writes(0), io() {
+	cerr << "Instantiating new output handler " << name << " on fd " << fd << "\n";
+	if (forwards) {
+		uint8_t hello[sizeof(uint32_t) + 2];
+		uint32_t netlen = hton((uint32_t) 2);
+		memcpy(hello, &netlen, sizeof(netlen));
+		hello[sizeof(netlen)] = 0;
+		hello[sizeof(netlen) + 1] = LOG_FORWARD;
+		write_queue.append(hello, sizeof(hello));
+		events = ev::READ | ev::WRITE;
+	}
+	io.set(pipeline::loop());
 	io.set<handler, &handler::io_cb>(this);
 	io.set(fd, events);
 	io.start(); 
@@ -76,11 +159,15 @@ int handler::get_events() const {
 }
 
 handler::~handler() {
+	cerr << "Output handler " << name << " sent " << records_sent << " records in " << writes << " writes" << endl;
 	collector::get().retire_consumer(this);
 	if (io.fd >= 0) {
 		io.stop();
 		close(io.fd);
 	}
+	if (forwards) {
+		g_forwarding = false; /* the uplink connects again */
+	}
 }
 
 void handler::io_cb(ev::io &watcher, int revents) {
@@ -89,6 +176,7 @@ void handler::io_cb(ev::io &watcher, int revents) {
 		while (write_queue.to_write() && r > 0) { 
 			pair<int,bool> res = write_queue.do_write(watcher.fd);
 			r = res.first;
+			++writes;
 			
 			if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) { 
 				/* most probably a disconnect of some sort, log error and queue object for deletion */
@@ -104,24 +192,197 @@ void handler::io_cb(ev::io &watcher, int revents) {
 			}
 		}
 
+		if (write_queue.to_write() == 0 && !waiting) {
+			if (codec != LOG_CODEC_NONE) {
+				append_frame();
+			} else {
+				append_batch();
+			}
+			if (replays) {
+				append_mark();
+			}
+		}
 		if (write_queue.to_write() == 0) {
+			set_events(ev::READ); /* nothing to pop (or not yet told where to start), so just wait */
+		}
+	}
 
-			struct sized_buffer p(collector::get().pop(this));
-			if (p.len) {
-				uint32_t id = hton(p.source_id);
-				uint32_t len = hton((uint32_t)(p.len + sizeof(id)));
-				write_queue.append((uint8_t*)&len, sizeof(len));
-				write_queue.append((uint8_t*)&id, sizeof(id));
-				write_queue.append(p.buffer, p.len);
-			} else {
-				this->events = ev::NONE;
-				io.set(ev::NONE);
-				io.stop();/* nothing to pop, so just wait */
+	if (revents & ev::READ) {
+		ssize_t r(1);
+		while(r > 0 && read_queue.hungry()) {
+			do {
+				pair<int,bool> res = read_queue.do_read(watcher.fd);
+				r = res.first;
+				if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+					cerr << "Received error on read: " << strerror(errno) << endl;
+					suicide();
+					return;
+				}
+				if (r == 0) {
+					cerr << "Disconnect\n";
+					suicide();
+					return;
+				}
+			} while (r > 0 && read_queue.to_read() > 0);
+
+			if (!read_queue.hungry()) {
+				if (state == RECV_HEADER) {
+					read_queue.cursor(0);
+					read_queue.to_read(ntoh(*((const uint32_t*) read_queue.extract_buffer().const_ptr())));
+					state = RECV_LOG;
+				} else {
+					handle_message(read_queue.extract_buffer().const_ptr(), read_queue.cursor());
+					read_queue.cursor(0);
+					read_queue.to_read(4);
+					state = RECV_HEADER;
+				}
 			}
 		}
 	}
 }	
 
+void handler::handle_message(const uint8_t *msg, size_t len) {
+	if (forwards) {
+		handle_upstream(msg, len);
+		return;
+	}
+	if (len >= 2 && msg[0] == LOG_CLIENT_CODEC &&
+	    (msg[1] == LOG_CODEC_NONE || msg[1] == LOG_CODEC_LZ4 || msg[1] == LOG_CODEC_ZSTD)) {
+		codec = static_cast<enum log_codec>(msg[1]);
+	} else if (len >= 1 && msg[0] == LOG_CLIENT_FILTER) {
+		unique_ptr<record_filter> f(record_filter::parse(msg + 1, len - 1));
+		if (!f) {
+			cerr << "Malformed filter from reader on fd " << io.fd << endl;
+			return;
+		}
+		interests = endpoint & f->types();
+		filter = move(f);
+		collector::get().update_interests();
+	} else if (len == 2 + sizeof(uint64_t) && msg[0] == LOG_CLIENT_REPLAY && waiting &&
+	           (msg[1] == LOG_REPLAY_OFFSET || msg[1] == LOG_REPLAY_TIME)) {
+		uint64_t value;
+		memcpy(&value, msg + 2, sizeof(value));
+		if (!collector::get().replay(this, static_cast<enum log_replay_from>(msg[1]), ntoh(value))) {
+			cerr << "No journal to replay, reader on fd " << io.fd << " only gets live records" << endl;
+		}
+		waiting = false;
+		set_events(events | ev::WRITE);
+	} else if (len == 1 && msg[0] == LOG_CLIENT_RESEND) {
+		/* records are only popped once the queue is empty, so the mark
+		   goes after everything it was sent without them */
+		collector::get().resend_payloads(this);
+		append_mark(true);
+		set_events(events | ev::WRITE);
+	} else {
+		cerr << "Ignoring message from reader on fd " << io.fd << endl;
+	}
+}
+
+/* what an upstream logserver tells its producers */
+void handler::handle_upstream(const uint8_t *msg, size_t len) {
+	if (len >= 2 && msg[0] == LOG_INTERESTS) {
+		interests = endpoint & msg[1];
+		collector::get().resend_payloads(this);
+		collector::get().update_interests();
+		set_events(events | ev::WRITE);
+	} else if (len >= 2 && msg[0] == LOG_CODECS) {
+		codec = (msg[1] & (1 << g_forward_codec)) ? g_forward_codec : LOG_CODEC_NONE;
+	} else if (len >= 1 + 2 * sizeof(uint32_t) && msg[0] == LOG_SOURCE_ID) {
+		uint32_t theirs, ours;
+		memcpy(&theirs, msg + 1, sizeof(theirs));
+		memcpy(&ours, msg + 1 + sizeof(theirs), sizeof(ours));
+		if (theirs == 0) {
+			cerr << "Upstream knows this logserver as " << ntoh(ours) << endl;
+		} else {
+			cerr << "Upstream knows source " << ntoh(theirs) << " as " << ntoh(ours) << endl;
+		}
+	}
+}
+
+void handler::append_mark(bool always) {
+	uint64_t position = collector::get().position(this);
+	if (position == marked && !always) {
+		return;
+	}
+	marked = position;
+	const size_t mark_len = sizeof(uint32_t) + 2 + sizeof(uint64_t);
+	wrapped_buffer<uint8_t> mark(sizeof(uint32_t) + mark_len);
+	uint8_t *ptr = mark.ptr();
+	uint32_t netlen = hton((uint32_t) mark_len);
+	uint64_t offset = hton(position);
+	memcpy(ptr, &netlen, sizeof(netlen));
+	memset(ptr + sizeof(netlen), 0, sizeof(uint32_t) + 1); /* source_id and type */
+	ptr[sizeof(netlen) + sizeof(uint32_t) + 1] = LOG_READER_MARK;
+	memcpy(ptr + sizeof(netlen) + sizeof(uint32_t) + 2, &offset, sizeof(offset));
+	write_queue.append(mark, sizeof(uint32_t) + mark_len);
+}
+
+/* queues up to WRITE_BATCH worth of records, to go out in as few
+   writevs as will take them. Their prefixes go in the header arena,
+   which is free again once the queue has drained */
+void handler::append_batch() {
+	if (!headers || headers.use_count() > 1) {
+		headers = wrapped_buffer<uint8_t>(WRITE_BATCH_RECORDS * RECORD_HEADER);
+	}
+	/* once a slice is queued the arena is shared, and ptr() would copy
+	   it for every record after. Each header is filled before its slice
+	   is queued, and only through this */
+	uint8_t *base = headers.ptr();
+	size_t bytes = 0, count = 0;
+	while(bytes < WRITE_BATCH && count < WRITE_BATCH_RECORDS) {
+		struct sized_buffer p(collector::get().pop(this));
+		if (p.len == 0) {
+			break;
+		}
+		uint32_t id = hton(p.source_id);
+		uint32_t len = hton((uint32_t)(p.len + sizeof(id)));
+		uint8_t *hdr = base + count * RECORD_HEADER;
+		memcpy(hdr, &len, sizeof(len));
+		memcpy(hdr + sizeof(len), &id, sizeof(id));
+		write_queue.append(headers, count * RECORD_HEADER, RECORD_HEADER);
+		write_queue.append(p.buffer, p.offset, p.len);
+		bytes += RECORD_HEADER + p.len;
+		++count;
+	}
+	records_sent += count;
+}
+
+/* pops up to FRAME_BATCH worth of records and queues them as one
+   frame, or as they are if they don't compress */
+void handler::append_frame() {
+	wrapped_buffer<uint8_t> batch(FRAME_BATCH);
+	size_t len = 0;
+	while(len < FRAME_BATCH) {
+		struct sized_buffer p(collector::get().pop(this));
+		if (p.len == 0) {
+			break;
+		}
+		uint32_t id = hton(p.source_id);
+		uint32_t netlen = hton((uint32_t)(p.len + sizeof(id)));
+		size_t need = len + sizeof(netlen) + sizeof(id) + p.len;
+		if (batch.allocated() < need) {
+			batch.realloc(need);
+		}
+		uint8_t *ptr = batch.ptr() + len;
+		memcpy(ptr, &netlen, sizeof(netlen));
+		memcpy(ptr + sizeof(netlen), &id, sizeof(id));
+		memcpy(ptr + sizeof(netlen) + sizeof(id), p.buffer.const_ptr() + p.offset, p.len);
+		len = need;
+		++records_sent;
+	}
+	if (len == 0) {
+		return;
+	}
+	wrapped_buffer<uint8_t> frame;
+	size_t frame_len = log_frame(codec, batch.const_ptr(), len, LOG_READER_FRAME_HEADER,
+	                             sizeof(LOG_READER_FRAME_HEADER), frame);
+	if (frame_len) {
+		write_queue.append(frame, frame_len);
+	} else {
+		write_queue.append(batch, len);
+	}
+}
+
 void handler::suicide() {
 	if (io.fd >= 0) {
 		io.stop();
@@ -132,4 +393,110 @@ void handler::suicide() {
 }
 
 
+uplink::uplink(const string &a_upstream, enum log_codec codec) : upstream(a_upstream), timer() {
+	g_forward_codec = codec;
+	timer.set<uplink, &uplink::timer_cb>(this);
+	timer.set(0, UPLINK_RETRY);
+	timer.start();
+}
+
+void uplink::timer_cb(ev::timer &, int) {
+	if (g_forwarding) {
+		return;
+	}
+	int fd;
+	try {
+		if (upstream.find('/') != string::npos) {
+			fd = unix_sock_client(upstream, true);
+		} else {
+			fd = tcp_sock_client(upstream, true);
+		}
+	} catch (const network_error &e) {
+		cerr << "Could not reach upstream logserver " << upstream << ": " << e.what() << endl;
+		return;
+	}
+	cerr << "Forwarding to upstream logserver " << upstream << endl;
+	g_forwarding = true;
+	pipeline::fanout(0, [fd]() {
+			new handler(fd, (uint8_t) ~0, group_spec(), false, true);
+		});
+}
+
+void greeter::handle_accept_error(handlers::accept_handler<greeter> *h, const network_error &e) {
+	cerr << "Giving up accepting readers over TCP\n";
+	cerr << e.what() << endl;
+	h->io.stop();
+	close(h->io.fd);
+}
+
+void greeter::handle_accept(handlers::accept_handler<greeter> *, int fd) {
+	tcp_tune(fd);
+	new greeter(fd); /* deletes itself once it is done */
+}
+
+greeter::greeter(int fd) : io(), timeout(), msg(), got(0), want(sizeof(uint32_t)) {
+	io.set<greeter, &greeter::io_cb>(this);
+	io.set(fd, ev::READ);
+	io.start();
+	timeout.set<greeter, &greeter::timeout_cb>(this);
+	timeout.start(GREETING_TIMEOUT, 0);
+}
+
+greeter::~greeter() {
+	io.stop();
+	timeout.stop();
+}
+
+void greeter::io_cb(ev::io &watcher, int) {
+	/* only what the greeting needs, the rest is for the handler */
+	ssize_t r = read(watcher.fd, msg + got, want - got);
+	if (r < 0 && (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (r <= 0) {
+		done(false);
+		return;
+	}
+	got += r;
+	if (got < want) {
+		return;
+	}
+	if (want == sizeof(uint32_t)) {
+		uint32_t len;
+		memcpy(&len, msg, sizeof(len));
+		len = ntoh(len);
+		if (len < 2 || len > 1 + LOG_CHANNEL_MAX) {
+			cerr << "Bad greeting from TCP reader on fd " << watcher.fd << endl;
+			done(false);
+			return;
+		}
+		want += len;
+		return;
+	}
+	if (msg[sizeof(uint32_t)] != LOG_CLIENT_CHANNEL) {
+		cerr << "TCP reader on fd " << watcher.fd << " did not say its channel" << endl;
+		done(false);
+		return;
+	}
+	string name((const char*) msg + sizeof(uint32_t) + 1, want - sizeof(uint32_t) - 1);
+	if (!handler::join_channel(name, watcher.fd)) {
+		cerr << "TCP reader on fd " << watcher.fd << " asked for unknown channel " << name << endl;
+		done(false);
+		return;
+	}
+	done(true);
+}
+
+void greeter::timeout_cb(ev::timer &, int) {
+	cerr << "TCP reader on fd " << io.fd << " did not say its channel in time" << endl;
+	done(false);
+}
+
+void greeter::done(bool joined) {
+	if (!joined) {
+		close(io.fd);
+	}
+	delete this;
+}
+
 };
@@ -0,0 +1,338 @@
+#include "pipeline.hpp"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <signal.h>
+
+#include "config.hpp"
+#include "collector.hpp"
+#include "merge_queue.hpp"
+#include "metrics.hpp"
+#include "input_cxn.hpp"
+#include "spsc_queue.hpp"
+
+using namespace std;
+
+namespace pipeline {
+
+/* records waiting between an ingest loop and a fan-out loop */
+const size_t QUEUE_SIZE = 65536;
+/* records taken off each queue per wakeup, so readers get a turn */
+const size_t DRAIN_MAX = 4096;
+/* seconds between tries to move parked records into a full queue */
+const double RETRY_INTERVAL = 0.001;
+
+class worker {
+public:
+	struct ev_loop *loop;
+	ev::async wake;
+	mutex lock;
+	vector<function<void()> > tasks;
+	/* by ingest loop, if this is a fan-out loop. Null for itself */
+	vector<unique_ptr<spsc_queue<struct sized_buffer> > > inbound;
+	atomic<uint8_t> interests; /* of its collector */
+	size_t lane; /* which ingest loop, if it is one */
+	ev::prepare flusher; /* wakes the fan-out loops, before an ingest loop waits */
+	/* if this is an ingest loop, by fan-out loop, records that did not
+	   fit in its queue. Its producers aren't read while there are any */
+	vector<deque<struct sized_buffer> > parked;
+	size_t parked_count;
+	ev::timer retry; /* to move parked records along */
+	bool stopping; /* ran finish, its thread is done */
+	thread runner;
+
+	worker(struct ev_loop *a_loop)
+		: loop(a_loop), wake(a_loop), lock(), tasks(), inbound(), interests(0), lane(0), flusher(a_loop),
+		  parked(), parked_count(0), retry(a_loop), stopping(false), runner() {
+		wake.set<worker, &worker::wake_cb>(this);
+		wake.start();
+		flusher.set<worker, &worker::flush_cb>(this);
+		retry.set<worker, &worker::retry_cb>(this);
+	}
+
+	void post(function<void()> task) {
+		{
+			lock_guard<mutex> guard(lock);
+			tasks.push_back(move(task));
+		}
+		wake.send();
+	}
+
+	void wake_cb(ev::async &, int);
+	void flush_cb(ev::prepare &, int) { flush(); }
+	void park(size_t fanout, const struct sized_buffer &p);
+	void retry_cb(ev::timer &, int);
+	void finish();
+	void run();
+private:
+	worker & operator=(worker other);
+	worker(const worker &);
+};
+
+/* to the collector of the calling fan-out loop, by way of its
+   merge_queue if there is one */
+static void deliver(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset) {
+	if (merge_queue::enabled()) {
+		merge_queue::get().push(move(data), len, source_id, offset);
+	} else {
+		collector::get().append(move(data), len, source_id, offset);
+	}
+}
+
+static thread_local worker *t_self = nullptr;
+static vector<worker*> g_ingest;
+static vector<worker*> g_fanout;
+static atomic<uint8_t> g_announced(0);
+static thread_local vector<worker*> t_unwoken; /* published to since the last flush */
+
+void worker::wake_cb(ev::async &, int) {
+	vector<function<void()> > todo;
+	{
+		lock_guard<mutex> guard(lock);
+		todo.swap(tasks);
+	}
+	for(auto it = todo.begin(); it != todo.end(); ++it) {
+		(*it)();
+	}
+
+	bool more = false;
+	struct sized_buffer p;
+	for(auto it = inbound.begin(); it != inbound.end(); ++it) {
+		if (!*it) {
+			continue;
+		}
+		size_t n = 0;
+		while(n < DRAIN_MAX && (*it)->pop(p)) {
+			deliver(move(p.buffer), p.len, p.source_id, p.offset);
+			++n;
+		}
+		more = more || n == DRAIN_MAX;
+	}
+	if (more) {
+		wake.send();
+	}
+}
+
+void worker::park(size_t fanout, const struct sized_buffer &p) {
+	if (parked_count++ == 0) {
+		input_cxn::handler::hold(true);
+		retry.start(RETRY_INTERVAL, RETRY_INTERVAL);
+	}
+	parked[fanout].push_back(p);
+}
+
+void worker::retry_cb(ev::timer &, int) {
+	for(size_t i = 0; i < parked.size(); ++i) {
+		deque<struct sized_buffer> &waiting(parked[i]);
+		if (waiting.empty()) {
+			continue;
+		}
+		spsc_queue<struct sized_buffer> &q(*g_fanout[i]->inbound[lane]);
+		while(!waiting.empty() && q.push(waiting.front())) {
+			waiting.pop_front();
+			--parked_count;
+		}
+		g_fanout[i]->wake.send();
+	}
+	if (parked_count == 0) {
+		retry.stop();
+		input_cxn::handler::hold(false);
+	}
+}
+
+/* its last task, from stop */
+void worker::finish() {
+	struct sized_buffer p;
+	for(auto it = inbound.begin(); it != inbound.end(); ++it) {
+		while(*it && (*it)->pop(p)) {
+			deliver(move(p.buffer), p.len, p.source_id, p.offset);
+		}
+	}
+	if (first_fanout() && journal::get()) {
+		journal::get()->flush();
+	}
+	stopping = true;
+	ev_break(loop, EVBREAK_ALL);
+}
+
+void worker::run() {
+	t_self = this;
+	sigset_t all; /* signals are for the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	while(!stopping) {
+		ev_run(loop, 0);
+	}
+}
+
+void start(unsigned ingest_threads, unsigned fanout_threads) {
+	worker *home = new worker(ev_default_loop(0));
+	t_self = home;
+
+	for(unsigned i = 0; i < ingest_threads; ++i) {
+		g_ingest.push_back(new worker(ev_loop_new(EVFLAG_AUTO)));
+	}
+	if (g_ingest.empty()) {
+		g_ingest.push_back(home);
+	}
+	for(unsigned i = 0; i < fanout_threads; ++i) {
+		g_fanout.push_back(new worker(ev_loop_new(EVFLAG_AUTO)));
+	}
+	if (g_fanout.empty()) {
+		g_fanout.push_back(home);
+	}
+
+	for(size_t i = 0; i < g_ingest.size(); ++i) {
+		g_ingest[i]->lane = i;
+		g_ingest[i]->flusher.start();
+		g_ingest[i]->parked.resize(g_fanout.size());
+	}
+	for(auto f = g_fanout.begin(); f != g_fanout.end(); ++f) {
+		for(auto i = g_ingest.begin(); i != g_ingest.end(); ++i) {
+			(*f)->inbound.emplace_back(*f == *i ? nullptr : new spsc_queue<struct sized_buffer>(QUEUE_SIZE));
+		}
+	}
+
+	vector<worker*> all(g_ingest);
+	all.insert(all.end(), g_fanout.begin(), g_fanout.end());
+	for(auto it = all.begin(); it != all.end(); ++it) {
+		if (*it != home && !(*it)->runner.joinable()) {
+			worker *w = *it;
+			w->runner = thread([w]() { w->run(); });
+		}
+	}
+	if (ingest_threads || fanout_threads) {
+		cerr << "Logserver running " << ingest_threads << " ingest and " << fanout_threads << " fan-out threads" << endl;
+	}
+}
+
+static void run_on(worker *w, function<void()> task) {
+	if (w == t_self) {
+		task();
+	} else {
+		w->post(move(task));
+	}
+}
+
+void stop() {
+	vector<worker*> all(g_ingest);
+	all.insert(all.end(), g_fanout.begin(), g_fanout.end());
+	for(auto it = all.begin(); it != all.end(); ++it) {
+		worker *w = *it;
+		run_on(w, [w]() { w->finish(); });
+		if (w->runner.joinable()) {
+			w->runner.join();
+		}
+	}
+}
+
+/* only called from main, by the accept handlers */
+void ingest(function<void()> make) {
+	static size_t next = 0;
+	run_on(g_ingest[next++ % g_ingest.size()], move(make));
+}
+
+void fanout(function<void()> make) {
+	static size_t next = 0;
+	run_on(g_fanout[next++ % g_fanout.size()], move(make));
+}
+
+void fanout(size_t lane, function<void()> make) {
+	run_on(g_fanout[lane % g_fanout.size()], move(make));
+}
+
+bool first_fanout() {
+	return t_self == g_fanout[0];
+}
+
+struct ev_loop * loop() {
+	return t_self->loop;
+}
+
+size_t fanout_loops() {
+	return g_fanout.size();
+}
+
+void publish(wrapped_buffer<uint8_t> &&data, size_t len, uint32_t source_id, size_t offset) {
+	worker *self = t_self;
+	for(size_t i = 0; i < g_fanout.size(); ++i) {
+		worker *w = g_fanout[i];
+		if (w == self) {
+			deliver(wrapped_buffer<uint8_t>(data), len, source_id, offset);
+			continue;
+		}
+		spsc_queue<struct sized_buffer> &q(*w->inbound[self->lane]);
+		struct sized_buffer p(data, len, source_id, offset);
+		/* behind the parked ones, to keep each producer's order */
+		if (!self->parked[i].empty() || !q.push(p)) {
+			self->park(i, p);
+		}
+		if (find(t_unwoken.begin(), t_unwoken.end(), w) == t_unwoken.end()) {
+			t_unwoken.push_back(w);
+		}
+	}
+}
+
+void inject(const wrapped_buffer<uint8_t> &data, size_t len, uint32_t source_id) {
+	for(auto it = g_fanout.begin(); it != g_fanout.end(); ++it) {
+		wrapped_buffer<uint8_t> copy(data);
+		run_on(*it, [copy, len, source_id]() {
+				collector::get().append(wrapped_buffer<uint8_t>(copy), len, source_id);
+			});
+	}
+}
+
+void flush() {
+	for(auto it = t_unwoken.begin(); it != t_unwoken.end(); ++it) {
+		(*it)->wake.send();
+	}
+	t_unwoken.clear();
+}
+
+static uint8_t always_forward() {
+	/* types the archiver (or anyone else) must never miss, even while
+	   disconnected, and what the metrics count */
+	int always_forward = 0;
+	get_config()->lookupValue("logger.always_forward", always_forward);
+	return always_forward | metrics::types();
+}
+
+uint8_t interests() {
+	static const uint8_t forward = always_forward();
+	uint8_t rv = forward;
+	for(auto it = g_fanout.begin(); it != g_fanout.end(); ++it) {
+		rv |= (*it)->interests.load();
+	}
+	return rv;
+}
+
+/* Each ingest loop sends whatever the union is by the time it gets
+   to it, so announcements racing from two fan-out loops can't leave
+   the producers with a stale one */
+static void announce() {
+	for(auto it = g_ingest.begin(); it != g_ingest.end(); ++it) {
+		run_on(*it, []() { input_cxn::handler::announce_interests(interests()); });
+	}
+}
+
+void set_interests(uint8_t mask) {
+	t_self->interests = mask;
+	uint8_t now = interests();
+	if (g_announced.exchange(now) != now) {
+		announce();
+	}
+}
+
+void forget_payloads() {
+	g_announced = interests();
+	announce();
+}
+
+};
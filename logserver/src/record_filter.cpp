@@ -0,0 +1,124 @@
+#include "record_filter.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include "logger.hpp"
+#include "network.hpp"
+
+using namespace std;
+
+const uint64_t SAMPLE_ALL = 1ULL << 32;
+
+unique_ptr<record_filter> record_filter::parse(const uint8_t *msg, size_t len) {
+	unique_ptr<record_filter> rv(new record_filter());
+	const uint8_t *end = msg + len;
+	uint32_t sample_ppm;
+	uint16_t handle_count;
+	if (len < 2 + 2 * sizeof(uint32_t) + sizeof(handle_count)) {
+		return nullptr;
+	}
+	rv->types_ = *msg++;
+	rv->direction = *msg++;
+	memcpy(&rv->source_id_, msg, sizeof(rv->source_id_));
+	rv->source_id_ = ntoh(rv->source_id_);
+	msg += sizeof(rv->source_id_);
+	memcpy(&sample_ppm, msg, sizeof(sample_ppm));
+	sample_ppm = ntoh(sample_ppm);
+	msg += sizeof(sample_ppm);
+	memcpy(&handle_count, msg, sizeof(handle_count));
+	handle_count = ntoh(handle_count);
+	msg += sizeof(handle_count);
+
+	if ((size_t)(end - msg) < handle_count * sizeof(uint32_t) + 1) {
+		return nullptr;
+	}
+	for(uint16_t i = 0; i < handle_count; ++i) {
+		uint32_t id;
+		memcpy(&id, msg, sizeof(id));
+		rv->handle_ids.push_back(ntoh(id));
+		msg += sizeof(id);
+	}
+	sort(rv->handle_ids.begin(), rv->handle_ids.end());
+
+	uint8_t command_count = *msg++;
+	if ((size_t)(end - msg) != command_count * sizeof(std::array<char, 12>)) {
+		return nullptr;
+	}
+	for(uint8_t i = 0; i < command_count; ++i) {
+		std::array<char, 12> command;
+		memcpy(command.data(), msg, command.size());
+		rv->commands.push_back(command);
+		msg += command.size();
+	}
+
+	if (sample_ppm >= LOG_FILTER_ALL) {
+		rv->sample_below = SAMPLE_ALL;
+	} else {
+		rv->sample_below = (((uint64_t) sample_ppm) << 32) / LOG_FILTER_ALL;
+	}
+	return rv;
+}
+
+bool record_filter::matches(const uint8_t *rec, size_t len, uint32_t source_id) const {
+	uint8_t type = rec[0];
+	if (!(type & types_) || (source_id_ && source_id != source_id_)) {
+		return false;
+	}
+
+	const size_t prolog = log_prolog_len(rec);
+	bool has_handle = type == BITCOIN || type == BITCOIN_MSG;
+	if (has_handle && !handle_ids.empty()) {
+		uint32_t id;
+		if (len < prolog + sizeof(id)) {
+			return false;
+		}
+		memcpy(&id, rec + prolog, sizeof(id));
+		if (!binary_search(handle_ids.begin(), handle_ids.end(), ntoh(id))) {
+			return false;
+		}
+	}
+
+	if (type == BITCOIN_MSG && direction) {
+		if (len < prolog + sizeof(uint32_t) + 1) {
+			return false;
+		}
+		uint8_t dir = (rec[prolog + sizeof(uint32_t)] & 1) ? LOG_FILTER_SENT : LOG_FILTER_RECEIVED;
+		if (!(dir & direction)) {
+			return false;
+		}
+	}
+
+	if (sample_below < SAMPLE_ALL) {
+		/* FNV-1a of the source, type, timestamp and handle, so every
+		   reader sampling at a rate gets the same records */
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for(unsigned i = 0; i < sizeof(source_id); ++i) {
+			hash = (hash ^ ((source_id >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+		}
+		size_t n = min(len, prolog + (has_handle ? sizeof(uint32_t) : 0));
+		for(size_t i = 0; i < n; ++i) {
+			hash = (hash ^ rec[i]) * 0x100000001b3ULL;
+		}
+		/* timestamps differ in few bits, so finish it like murmur3 */
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		if ((hash & 0xffffffffULL) >= sample_below) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool record_filter::command_matches(const char *command) const {
+	if (command == NULL) {
+		return false;
+	}
+	for(auto it = commands.begin(); it != commands.end(); ++it) {
+		if (memcmp(it->data(), command, it->size()) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,129 @@
+#include "spill.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "collector.hpp"
+
+using namespace std;
+
+/* bytes of each segment file, unless a record needs more */
+const size_t SEGMENT_SIZE = 64 * 1024 * 1024;
+/* bytes copied out of a segment at a time */
+const size_t CHUNK_SIZE = 256 * 1024;
+/* length, source_id and tag */
+const size_t SPILL_HEADER = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+spill::spill(const string &a_dir)
+	: dir(a_dir), segments(), chunk(), chunk_pos(0), chunk_end(0), written(0), read(0) {}
+
+spill::~spill() {
+	while(!segments.empty()) {
+		release_front();
+	}
+}
+
+void spill::release_front() {
+	struct segment &s(segments.front());
+	munmap(s.base, s.capacity);
+	close(s.fd);
+	segments.pop_front();
+}
+
+bool spill::push(const struct sized_buffer &p, uint64_t tag) {
+	size_t need = SPILL_HEADER + p.len;
+	if (segments.empty() || segments.back().capacity - segments.back().end < need) {
+		struct segment s = { -1, nullptr, max(SEGMENT_SIZE, need), 0, 0 };
+		string path(dir + "spill-XXXXXX");
+		s.fd = mkstemp(&path[0]);
+		if (s.fd < 0) {
+			cerr << "Could not create spill file in " << dir << ": " << strerror(errno) << endl;
+			return false;
+		}
+		unlink(path.c_str());
+		/* allocated up front, so a full disk fails here rather than
+		   as a SIGBUS writing the mapping */
+		int err = posix_fallocate(s.fd, 0, s.capacity);
+		if (err != 0) {
+			cerr << "Could not allocate " << s.capacity << " bytes of spill: " << strerror(err) << endl;
+			close(s.fd);
+			return false;
+		}
+		void *base = mmap(NULL, s.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s.fd, 0);
+		if (base == MAP_FAILED) {
+			cerr << "Could not map spill file: " << strerror(errno) << endl;
+			close(s.fd);
+			return false;
+		}
+		s.base = (uint8_t*) base;
+		segments.push_back(s);
+	}
+
+	struct segment &s(segments.back());
+	uint32_t hdr[2] = { (uint32_t) p.len, p.source_id };
+	memcpy(s.base + s.end, hdr, sizeof(hdr));
+	memcpy(s.base + s.end + sizeof(hdr), &tag, sizeof(tag));
+	memcpy(s.base + s.end + SPILL_HEADER, p.buffer.const_ptr() + p.offset, p.len);
+	s.end += need;
+	written += need;
+	return true;
+}
+
+const uint8_t * spill::front() const {
+	if (chunk_pos < chunk_end) {
+		return chunk.const_ptr() + chunk_pos + SPILL_HEADER;
+	}
+	for(auto it = segments.begin(); it != segments.end(); ++it) {
+		if (it->pos < it->end) {
+			return it->base + it->pos + SPILL_HEADER;
+		}
+	}
+	return NULL;
+}
+
+struct sized_buffer spill::pop(uint64_t &tag) {
+	if (chunk_pos == chunk_end) {
+		while(!segments.empty() && segments.front().pos == segments.front().end) {
+			if (segments.size() == 1) {
+				/* all read, so start it over */
+				segments.front().pos = segments.front().end = 0;
+				return sized_buffer();
+			}
+			release_front();
+		}
+		if (segments.empty()) {
+			return sized_buffer();
+		}
+
+		/* as many whole records as fit in a chunk, at least one */
+		struct segment &s(segments.front());
+		size_t len = 0;
+		while(s.pos + len < s.end) {
+			uint32_t rec_len;
+			memcpy(&rec_len, s.base + s.pos + len, sizeof(rec_len));
+			if (len > 0 && len + SPILL_HEADER + rec_len > CHUNK_SIZE) {
+				break;
+			}
+			len += SPILL_HEADER + rec_len;
+		}
+		chunk = wrapped_buffer<uint8_t>(len);
+		memcpy(chunk.ptr(), s.base + s.pos, len);
+		s.pos += len;
+		chunk_pos = 0;
+		chunk_end = len;
+	}
+
+	uint32_t hdr[2];
+	memcpy(hdr, chunk.const_ptr() + chunk_pos, sizeof(hdr));
+	memcpy(&tag, chunk.const_ptr() + chunk_pos + sizeof(hdr), sizeof(tag));
+	struct sized_buffer rv(chunk, hdr[0], hdr[1], chunk_pos + SPILL_HEADER);
+	chunk_pos += SPILL_HEADER + hdr[0];
+	read += SPILL_HEADER + hdr[0];
+	return rv;
+}
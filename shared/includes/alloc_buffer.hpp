@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <iterator>
 #include <type_traits>
+#include <atomic>
 
 
 
@@ -35,7 +36,7 @@ public:
 private:
 	size_type allocated_;
 	POD_T * buffer_;
-	mutable size_type * refcount_;
+	mutable std::atomic<size_type> * refcount_; /* atomic, so copies can be dropped on other threads */
 
 public:
 
@@ -176,7 +177,7 @@ public:
 		return allocated_;
 	}
 
-	long use_count() const { return refcount_ ? *refcount_ : 0; }
+	long use_count() const { return refcount_ ? refcount_->load() : 0; }
 
 };
 
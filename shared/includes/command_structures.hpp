@@ -18,14 +18,25 @@ enum commands {
 };
 
 const uint32_t BROADCAST_TARGET(0xFFFFFFFF);
+/* targets of { GROUP_TARGET, group_id } address a group defined with a GROUP message */
+const uint32_t GROUP_TARGET(0xFFFFFFFE);
 
 enum message_types {
 	BITCOIN_PACKED_MESSAGE = 1,
 	COMMAND = 2,
 	REGISTER= 3,
 	CONNECT = 4,
+	TEMPLATE_MESSAGE = 5,
+	SCHEDULE = 6,
+	GROUP = 7,
+	RING_SETUP = 8,
 };
 
+/* A version 1 message has its payload prefixed by a uint32_t request
+   id (network byte order, counted in length). Every version 1 message
+   is answered with a completion carrying the same request id, instead
+   of the bare version 0 replies (or nothing at all) */
+
 struct message {
 	uint8_t version; 
 	uint32_t length; /* sizeof(payload) */
@@ -48,6 +59,110 @@ struct connection_info { /* response to COMMAND_GET_CXN && part of response for
 } __attribute__((packed));
 
 
+/* A template is a bitcoin message with slots the connector fills in
+   separately for every target when it is sent. Integer sources are
+   written little endian (as bitcoin wants them), truncated to width */
+enum patch_sources {
+	PATCH_REMOTE_ADDR = 1, /* width 4 (ipv4), 6 (ipv4, port), 18 (ipv6 mapped, port), 26 (version net addr) or 30 (addr net addr, time set to now) */
+	PATCH_LOCAL_ADDR = 2, /* same widths as PATCH_REMOTE_ADDR */
+	PATCH_NONCE = 3, /* random, width 1-8 */
+	PATCH_TIME = 4, /* unix time, width 1-8 */
+	PATCH_HANDLE_ID = 5, /* width 1-8 */
+};
+
+struct patch_slot {
+	uint32_t offset; /* network byte order, offset into the bitcoin payload */
+	uint8_t width;
+	uint8_t source; /* patch_sources */
+} __attribute__((packed));
+
+/* payload for TEMPLATE_MESSAGE. Registers like BITCOIN_PACKED_MESSAGE
+   and returns the new id the same way */
+struct template_payload {
+	uint32_t slot_cnt; /* network byte order */
+	struct patch_slot slots[0];
+	/* followed by a struct bitcoin::packed_message */
+} __attribute__((packed));
+
+
+struct completion {
+	uint32_t length; /* network byte order, of payload */
+	uint32_t request_id; /* network byte order */
+	uint8_t message_type;
+	uint8_t command; /* for COMMAND messages, 0 otherwise */
+	int32_t status; /* network byte order, 0 on success, otherwise an errno */
+	uint8_t payload[0];
+	/* payload by message type, all numbers network byte order:
+	   REGISTER, BITCOIN_PACKED_MESSAGE, TEMPLATE_MESSAGE: uint32_t id
+	   CONNECT: struct connection_info on success, error text (NUL terminated) on failure
+	   COMMAND_GET_CXN: struct connection_info[]
+	   COMMAND_SEND_MSG: struct send_result[]
+	   COMMAND_DISCONNECT: uint32_t handles disconnected
+	   SCHEDULE: uint32_t targets scheduled
+	   GROUP: uint32_t group id on GROUP_DEFINE, command is the operation
+	   RING_SETUP: uint32_t ring size */
+} __attribute__((packed));
+
+struct send_result {
+	uint32_t handle_id; /* network byte order */
+	uint32_t queued; /* network byte order, bytes waiting to go out to handle_id, this message included */
+} __attribute__((packed));
+
+enum group_operations {
+	GROUP_DEFINE = 1, /* replies with the new group id, 0 on failure */
+	GROUP_DELETE = 2,
+};
+
+enum group_direction {
+	DIRECTION_ANY = 0,
+	DIRECTION_OUTBOUND = 1, /* we initiated */
+	DIRECTION_INBOUND = 2, /* they initiated */
+};
+
+/* payload for GROUP. A group belongs to the control connection that
+   defined it and is kept up to date as peers come and go. A peer is a
+   member if it matches every predicate given */
+struct group_msg {
+	uint8_t operation; /* group_operations */
+	uint32_t group_id; /* network byte order, for GROUP_DELETE */
+	uint8_t direction; /* group_direction */
+	uint32_t subnet; /* network byte order, remote address must be in subnet/prefix_len */
+	uint8_t prefix_len; /* 0 matches everything */
+	uint32_t handle_cnt; /* network byte order, 0 for any handle */
+	uint32_t agent_len; /* network byte order, 0 for any user agent */
+	uint32_t handles[0]; /* network byte order */
+	/* followed by agent_len bytes, a substring of the peer's user agent */
+} __attribute__((packed));
+
+/* payload for RING_SETUP. The connector creates a shared memory ring
+   (see shm_ring.hpp) the client then writes ctrl::messages into
+   instead of the socket. The reply (a bare uint32_t ring size, 0 on
+   failure, or a completion with it) carries the ring's memfd and
+   eventfd doorbell as SCM_RIGHTS, in that order. Replies to messages
+   sent over the ring still come back on the socket */
+struct ring_setup {
+	uint32_t size; /* network byte order, requested ring size in bytes */
+} __attribute__((packed));
+
+enum schedule_ordering {
+	ORDER_RANDOM = 0,
+	ORDER_ADDRESS = 1, /* by remote address, then port */
+	ORDER_EXPLICIT = 2, /* order of the targets list */
+};
+
+/* payload for SCHEDULE. Sends a registered message to the targets,
+   the first at start, the rest spread evenly across window. Each
+   send is logged with its actual time */
+struct schedule_msg {
+	uint32_t message_id; /* network byte order */
+	uint64_t start; /* network byte order, ns since epoch (CLOCK_REALTIME), 0 is now */
+	uint64_t window; /* network byte order, ns */
+	uint8_t ordering; /* schedule_ordering */
+	uint32_t target_cnt; /* network byte order */
+	uint32_t targets[0]; /* network byte order. BROADCAST_TARGET means all, GROUP_TARGET a group */
+} __attribute__((packed));
+
+
 struct command_msg {
 	uint8_t command;
 	uint32_t message_id; /* network byte order */
@@ -1,10 +1,20 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include <string>
+
 #include <libconfig.h++>
 
 int startup_setup(int argc, char *argv[], bool drop_perms = true);
 const libconfig::Config * load_config(const char *filename);
 const libconfig::Config * get_config();
 
+/* Sockets to the logserver, as a producer or a reader of the endpoint
+   channel (e.g. all). Over TCP to logger.remote, at the ports in
+   logger.tcp, if that is set, so this need not run on the logserver's
+   host, and to the unix sockets under logger.root otherwise. Throw
+   network_error */
+int log_server_socket(bool nonblocking);
+int log_client_socket(const std::string &channel, bool nonblocking);
+
 #endif
@@ -1,6 +1,9 @@
 #ifndef CONNECTOR_HPP
 #define CONNECTOR_HPP
 
+#include <string>
+#include <vector>
+
 #include "wrapped_buffer.hpp"
 #include "command_structures.hpp"
 
@@ -24,6 +27,8 @@ public:
 	message & operator=(const message &other);
 	virtual ~message() {};
 	virtual std::pair<wrapped_buffer<uint8_t>, size_t> serialize() const;
+	/* serializes as a version 1 message, answered by a completion with request_id */
+	std::pair<wrapped_buffer<uint8_t>, size_t> serialize(uint32_t request_id) const;
 	static std::unique_ptr<message> deserialize(const wrapped_buffer<uint8_t> &buffer);
 
 	ctrl::message_types type() const;
@@ -58,6 +63,63 @@ public:
 	void payload(const uint8_t *new_payload, size_t length);
 };
 
+class template_msg : public message {
+public:
+	/* payload is a packed bitcoin message, slot offsets are relative to its payload, host byte order */
+	template_msg(const uint8_t *payload, size_t payload_size, const std::vector<struct patch_slot> &slots);
+	template_msg(const wrapped_buffer<uint8_t> &contents) : message(contents) {}
+	template_msg(template_msg &&moved) : message(std::move(moved.buffer)) {}
+	template_msg(const template_msg &copy) : message(copy.buffer) {}
+	template_msg & operator=(const template_msg &other) {
+		buffer = other.buffer;
+		return *this;
+	}
+
+	std::vector<struct patch_slot> slots() const; /* offsets in host byte order */
+	const uint8_t * payload() const; /* the packed bitcoin message */
+};
+
+class schedule_msg : public message {
+public:
+	/* times in ns, host byte order. start is CLOCK_REALTIME, 0 is now */
+	schedule_msg(uint32_t message_id, uint64_t start, uint64_t window, enum schedule_ordering ordering, const std::vector<uint32_t> &targets);
+	schedule_msg(const wrapped_buffer<uint8_t> &contents) : message(contents) {}
+	schedule_msg(schedule_msg &&moved) : message(std::move(moved.buffer)) {}
+	schedule_msg(const schedule_msg &copy) : message(copy.buffer) {}
+	schedule_msg & operator=(const schedule_msg &other) {
+		buffer = other.buffer;
+		return *this;
+	}
+
+	uint32_t message_id() const;
+	uint64_t start() const;
+	uint64_t window() const;
+	enum schedule_ordering ordering() const;
+	std::vector<uint32_t> targets() const;
+};
+
+class group_msg : public message {
+public:
+	/* numbers in host byte order */
+	group_msg(enum group_operations operation, uint32_t group_id, enum group_direction direction, 
+	          uint32_t subnet, uint8_t prefix_len, const std::vector<uint32_t> &handles, const std::string &agent);
+	group_msg(const wrapped_buffer<uint8_t> &contents) : message(contents) {}
+	group_msg(group_msg &&moved) : message(std::move(moved.buffer)) {}
+	group_msg(const group_msg &copy) : message(copy.buffer) {}
+	group_msg & operator=(const group_msg &other) {
+		buffer = other.buffer;
+		return *this;
+	}
+
+	enum group_operations operation() const;
+	uint32_t group_id() const;
+	enum group_direction direction() const;
+	uint32_t subnet() const;
+	uint8_t prefix_len() const;
+	std::vector<uint32_t> handles() const;
+	std::string agent() const;
+};
+
 class connect_msg : public message {
 public:
 	connect_msg(const struct sockaddr_in *remote_addr, const struct sockaddr_in *local_addr);
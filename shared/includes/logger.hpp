@@ -1,9 +1,16 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
+#include <cstring>
+
 #include <iostream>
 #include <deque>
+#include <memory>
+#include <map>
+#include <vector>
+#include <string>
 #include <sstream>
+#include <type_traits>
 
 #include "ev++.h"
 
@@ -11,9 +18,11 @@
 #include "command_structures.hpp"
 #include "bitcoin.hpp"
 #include "write_buffer.hpp"
+#include "read_buffer.hpp"
 
 
 enum log_type {
+	PAYLOAD=0x1, /* message bodies BITCOIN_MSG records refer to, delivered with BITCOIN_MSG, buffered */
 	DEBUG=0x2, /* interpret as a string, unbuffered */
 	CTRL=0x4, /* control messages, unbuffered */
 	ERROR=0x8, /* strings, unbuffered */
@@ -54,12 +63,20 @@ std::string type_to_str(enum log_type type);
 /* general log format: */
 // uint32_t source_id /* generated by log server, network byte order */
 // uint8_t type
-// uint64_t timestamp /* network byte order */
+// uint8_t version /* LOG_FORMAT_VERSION */
+// uint64_t timestamp /* nanoseconds since the epoch, network byte order */
 // The rest... (stringstreamed i.e., operator<<(ostream, rest) done)
 
+/* Version 1 records had no version byte and their timestamp was in
+   whole seconds. The top byte of a version 1 timestamp is always 0,
+   which is where the version goes, so readers can take either and
+   bring version 1 records up to date with log_upgrade. The layouts
+   below are all current version, i.e., after the timestamp. */
+
 /* Log format for BITCOIN types */
 // uint32_t source_id /* generated by log server */ 
 // uint8_t type (i.e., BITCOIN)
+// uint8_t version
 // uint64_t timestamp /* NBO */
 // uint32_t id 
 // uin32_t update_type //see above
@@ -73,20 +90,83 @@ std::string type_to_str(enum log_type type);
 /* Log format for BITCOIN_MSG types */
 //    uint32_t source_id /* generated by log server */
 //    uint8_t type
+//    uint8_t version
 //		uint64_t timestamp; /* network byte order */
 // 	uint32_t id; /* network byte order */
 //		uint8_t is_sender;    
 // 	struct packed_message msg
 // };
 
+/* Messages we send are usually the same few registered messages
+   going to many peers, so with g_log_dedup_payloads the first time a
+   sent message is logged it goes out as a PAYLOAD record and every
+   BITCOIN_MSG record for it, that one included, carries just its
+   hash, with BITCOIN_MSG_PAYLOAD_REF set in is_sender. The hash is
+   only meaningful together with the source_id. Received messages are
+   always logged whole. */
+
+/* Log format for PAYLOAD types */
+//    uint32_t source_id /* generated by log server */
+//    uint8_t type
+//    uint8_t version
+//		uint64_t timestamp; /* network byte order */
+//		uint64_t hash; /* network byte order */
+// 	struct packed_message msg
+
+/* Log format for BITCOIN_MSG payload references */
+//    uint32_t source_id /* generated by log server */
+//    uint8_t type
+//    uint8_t version
+//		uint64_t timestamp; /* network byte order */
+// 	uint32_t id; /* network byte order */
+//		uint8_t is_sender; /* 1 | BITCOIN_MSG_PAYLOAD_REF */
+//		uint64_t hash; /* network byte order */
+
+const uint8_t BITCOIN_MSG_PAYLOAD_REF(0x2);
+
+
+const uint8_t LOG_FORMAT_VERSION(2);
 
 struct log_format {
 	uint32_t source_id;
 	uint8_t type;
+	uint8_t version;
 	uint64_t timestamp;
 	uint8_t rest[0];
 } __attribute__((packed));
 
+struct log_format_v1 {
+	uint32_t source_id;
+	uint8_t type;
+	uint64_t timestamp; /* seconds */
+	uint8_t rest[0];
+} __attribute__((packed));
+
+/* bytes from type to the end of the timestamp, of a record as a
+   producer sends it, i.e., rec points at the type */
+inline size_t log_prolog_len(const uint8_t *rec) {
+	return rec[1] == 0 ? 1 + sizeof(uint64_t) : 2 + sizeof(uint64_t);
+}
+
+/* when a record as a producer sends it was logged, in nanoseconds */
+inline uint64_t log_timestamp(const uint8_t *rec) {
+	uint64_t timestamp;
+	if (rec[1] == 0) { /* version 1, in seconds */
+		memcpy(&timestamp, rec + 1, sizeof(timestamp));
+		return ntoh(timestamp) * 1000000000ULL;
+	}
+	memcpy(&timestamp, rec + 2, sizeof(timestamp));
+	return ntoh(timestamp);
+}
+
+/* buf, or a copy of it in scratch brought up to the current version,
+   with len adjusted to match. buf is a whole record as the logserver
+   hands it out and must be at least a version 1 header long */
+const struct log_format * log_upgrade(const uint8_t *buf, size_t &len, std::vector<uint8_t> &scratch);
+
+/* CLOCK_REALTIME in nanoseconds, what records are stamped with */
+uint64_t g_log_now();
+
 
 struct bitcoin_log_format {
 	struct log_format header;
@@ -105,91 +185,555 @@ struct bitcoin_msg_log_format {
 	struct bitcoin::packed_message msg;
 } __attribute__((packed));
 
+struct bitcoin_msg_ref_log_format {
+	struct log_format header;
+	uint32_t id ;
+	uint8_t is_sender;
+	uint64_t hash;
+} __attribute__((packed));
+
+struct payload_log_format {
+	struct log_format header;
+	uint64_t hash;
+	struct bitcoin::packed_message msg;
+} __attribute__((packed));
+
+uint64_t payload_hash(const struct bitcoin::packed_message *m);
+
+/* Readers keep the PAYLOAD records they have seen to resolve
+   BITCOIN_MSG references with. Records are whole, as the logserver
+   hands them out (i.e., with a source_id). Past max_size bytes of
+   them the oldest are forgotten */
+class payload_cache {
+public:
+	payload_cache(size_t a_max_size = 64 * 1024 * 1024) : payloads(), order(), size(0), max_size(a_max_size) {}
+	/* remembers log if it is a PAYLOAD record */
+	void remember(const struct log_format *log, size_t len);
+	/* the message a BITCOIN_MSG record carries or refers to, NULL if
+	   it refers to a payload never seen, or forgotten */
+	const struct bitcoin::packed_message * resolve(const struct log_format *log, size_t len) const;
+private:
+	typedef std::pair<uint32_t, uint64_t> key; /* source_id, hash */
+	std::map<key, std::vector<uint8_t> > payloads;
+	std::deque<key> order; /* oldest first */
+	size_t size; /* bytes of payloads */
+	size_t max_size;
+};
+
+
+
+/* A producer can move its records to a shared memory ring (see
+   shm_ring.hpp) by sending, as the very first thing on the socket, a
+   transport message with the ring's memfd and doorbell attached as
+   SCM_RIGHTS. Transport messages are framed like records of type 0: */
+// uint32_t length (NBO)
+// uint8_t zero
+// uint8_t kind (see log_transport_msg)
+/* From then on records go into the ring, framed the same as on the
+   socket. A record too big to ever fit in the ring still goes over
+   the socket, and so may be seen out of order */
+
+enum log_transport_msg {
+	LOG_RING_ATTACH=1, /* memfd, doorbell */
+	LOG_FRAME=2, /* compressed records, see below */
+	LOG_FORWARD=3, /* from a logserver, see below */
+};
+
+/* A logserver with logger.upstream set forwards everything it gets to
+   that one, as a producer that starts with a LOG_FORWARD transport
+   message. After it, each message is a record the way readers get
+   them, with its source_id first (frames included), so the upstream
+   keeps the sources apart. It gives each a source_id of its own, and
+   says which with LOG_SOURCE_ID */
+
+class shm_ring;
+
+/* The logserver writes back to producers on the same socket. Each
+   message is a uint32_t length (NBO) followed by: */
+// uint8_t kind (see log_server_msg)
+// the rest, by kind
+
+enum log_server_msg {
+	LOG_INTERESTS=1, /* uint8_t mask of the log_types anyone is subscribed to. Also
+	                    means the logserver forgot the payloads it was sent */
+	LOG_CODECS=2, /* uint8_t mask, 1 << log_codec, of the frames it can take */
+	LOG_SOURCE_ID=3, /* uint32_t (NBO) source_id it was sent as, 0 for the producer
+	                    itself, then uint32_t (NBO) the one the logserver gave it */
+	LOG_RING_REFUSED=4, /* nothing. It did not take the LOG_RING_ATTACH ring, e.g.,
+	                       too big, so records go over the socket, those in it too */
+};
+
+/* Readers can write to the logserver on their socket too, with the
+   same framing: */
+// uint8_t kind (see log_client_msg)
+// the rest, by kind
+
+enum log_client_msg {
+	LOG_CLIENT_CODEC=1, /* uint8_t log_codec to send frames in from now on */
+	LOG_CLIENT_FILTER=2, /* what of its endpoint's records it wants, see below */
+	LOG_CLIENT_REPLAY=3, /* where in the journal to start, see below */
+	LOG_CLIENT_CHANNEL=4, /* the endpoint name, e.g. all or groups/<name>, over TCP */
+	LOG_CLIENT_RESEND=5, /* nothing. Send payloads again, see below */
+};
+
+/* Over TCP there is one port for all the readers, so there is no
+   path to say what a reader wants. Its first message has to be a
+   LOG_CLIENT_CHANNEL naming the endpoint it would otherwise have
+   connected to under clients/, up to LOG_CHANNEL_MAX bytes. The
+   logserver hangs up on anything else */
+const size_t LOG_CHANNEL_MAX(255);
+
+/* says which endpoint fd, a socket to the logserver's TCP port for
+   readers, is for */
+bool log_request_channel(int fd, const std::string &channel);
+
+/* A reader that wants only some of what its endpoint carries sends a
+   filter, and the logserver drops the rest before they are queued to
+   it. A later filter replaces an earlier one. After the kind: */
+// uint8_t types /* log_type mask, narrowing the endpoint's */
+// uint8_t direction /* LOG_FILTER_RECEIVED and/or LOG_FILTER_SENT, 0 for both */
+// uint32_t source_id /* NBO, 0 for any */
+// uint32_t sample_ppm /* NBO, records kept per million, LOG_FILTER_ALL for all */
+// uint16_t handle_count /* NBO, 0 for any */
+// uint32_t handle_ids[handle_count] /* NBO */
+// uint8_t command_count /* 0 for any */
+// char commands[command_count][12] /* as in the message header */
+/* Direction and commands only apply to BITCOIN_MSG records, and
+   handle ids to BITCOIN and BITCOIN_MSG ones; the others pass them.
+   Sampling is by a hash of the record, so it is the same for every
+   reader. Payloads are only sent ahead of the BITCOIN_MSG records that
+   get through */
+
+const uint8_t LOG_FILTER_RECEIVED(0x1);
+const uint8_t LOG_FILTER_SENT(0x2);
+const uint32_t LOG_FILTER_ALL(1000000);
+
+struct log_filter {
+	uint8_t types;
+	uint8_t direction;
+	uint32_t source_id;
+	uint32_t sample_ppm;
+	std::vector<uint32_t> handle_ids;
+	std::vector<std::string> commands;
+	log_filter() : types(0xff), direction(0), source_id(0), sample_ppm(LOG_FILTER_ALL),
+	               handle_ids(), commands() {}
+};
+
+/* With logger.journal set, the logserver keeps every record it gets
+   in an append only journal on disk, addressed by byte offset, which
+   only ever grows. Readers on the replay endpoint get nothing until
+   they say where to start, with: */
+// uint8_t from (see log_replay_from)
+// uint64_t value (NBO) /* an offset, or nanoseconds since the epoch */
+/* and get what the journal has from there on, then carry on with live
+   records with nothing missed or repeated. After every batch they are
+   sent a mark, from source 0: */
+// uint32_t length (NBO)
+// uint32_t source_id (zero)
+// uint8_t type (zero)
+// uint8_t LOG_READER_MARK
+// uint64_t offset (NBO) /* just past the records sent so far */
+/* so a reader that goes away can replay from the last mark it handled
+   when it comes back. Journal segments are written like verbatim
+   logs, so the same tools read them */
+
+enum log_replay_from {
+	LOG_REPLAY_OFFSET=1, /* LOG_REPLAY_NOW to start with live records */
+	LOG_REPLAY_TIME=2, /* records logged since, by their timestamp */
+};
+
+const uint64_t LOG_REPLAY_NOW(~0ULL);
+const uint8_t LOG_READER_MARK(0xff);
+
+/* asks for a replay on fd, a replay endpoint socket */
+bool log_request_replay(int fd, enum log_replay_from from, uint64_t value);
+
+/* A reader that starts a new file, as verbatim does on rotation, can
+   have the payloads it was already sent sent again with
+   LOG_CLIENT_RESEND. It is answered with a mark (as above, the offset
+   is 0 without a journal), and every BITCOIN_MSG reference after the
+   mark comes after its PAYLOAD record again */
+bool log_request_resend(int fd);
+
+/* if a whole record (after its length) from the logserver is a mark,
+   and if so, its offset */
+inline bool log_is_mark(const uint8_t *rec, size_t len, uint64_t *offset) {
+	static const uint8_t mark[] = { 0, 0, 0, 0, 0, LOG_READER_MARK };
+	if (len != sizeof(mark) + sizeof(*offset) || memcmp(rec, mark, sizeof(mark)) != 0) {
+		return false;
+	}
+	memcpy(offset, rec + sizeof(mark), sizeof(*offset));
+	*offset = ntoh(*offset);
+	return true;
+}
+
+/* Records can travel compressed, a run of whole records to a frame.
+   A producer only sends frames once the logserver has offered their
+   codec, and the logserver only sends them to readers that asked. On
+   the producer link a frame is a transport message: */
+// uint32_t length (NBO)
+// uint8_t zero
+// uint8_t kind (LOG_FRAME)
+// uint8_t codec
+// uint32_t raw_len (NBO)
+// the records, compressed, framed as they would be on the link
+/* and to readers it takes the place of a record, from source 0: */
+// uint32_t length (NBO)
+// uint32_t source_id (zero)
+// uint8_t type (zero)
+// uint8_t codec
+// uint32_t raw_len (NBO)
+// the records, compressed, each with its length and source_id
+/* verbatim archives keep them as they come */
+
+enum log_codec {
+	LOG_CODEC_NONE=0,
+	LOG_CODEC_LZ4=1, /* fast */
+	LOG_CODEC_ZSTD=2, /* dense */
+};
+
+/* "none", "lz4" or "zstd", LOG_CODEC_NONE for anything else */
+enum log_codec log_codec_from_str(const char *str);
+
+/* what the link headers before the codec byte are */
+const uint8_t LOG_PRODUCER_FRAME_HEADER[] = { 0, LOG_FRAME };
+const uint8_t LOG_READER_FRAME_HEADER[] = { 0, 0, 0, 0, 0 };
+
+/* Frames the len bytes of records at src into out: the length, then
+   hdr_len bytes of hdr, then the codec and the rest. Returns the bytes
+   of frame, or 0 if compressing did not make it smaller */
+size_t log_frame(enum log_codec codec, const uint8_t *src, size_t len,
+                 const uint8_t *hdr, size_t hdr_len, wrapped_buffer<uint8_t> &out);
 
+/* frame points at the codec byte of len bytes of frame. The bytes its
+   records come to, 0 if it is malformed */
+size_t log_frame_size(const uint8_t *frame, size_t len);
+
+/* decompresses frame into dst, log_frame_size bytes of it. Returns
+   false if it is corrupt */
+bool log_unframe(const uint8_t *frame, size_t len, uint8_t *dst);
+
+/* if a whole record (after its length) from the logserver is a frame */
+inline bool log_is_frame(const uint8_t *rec, size_t len) {
+	return len > sizeof(LOG_READER_FRAME_HEADER) + 1 + sizeof(uint32_t) &&
+		memcmp(rec, LOG_READER_FRAME_HEADER, sizeof(LOG_READER_FRAME_HEADER)) == 0 &&
+		rec[sizeof(LOG_READER_FRAME_HEADER)] != LOG_READER_MARK;
+}
+
+/* asks the logserver for frames on fd, a reader socket */
+bool log_request_codec(int fd, enum log_codec codec);
+
+/* sends filter to the logserver on fd, a reader socket */
+bool log_request_filter(int fd, const struct log_filter &filter);
 
 class log_buffer {
 public:
 	write_buffer write_queue;
+	read_buffer read_queue; /* messages from the logserver */
+	bool reading_len;
 	int fd;
 	ev::io io;
-	/* fd should be a writable unix socket */
+	ev::timer batch_timer; /* bounds how long binary records wait in the store */
+	ev::timer stats_timer; /* reports on batching every g_log_stats_interval */
+	std::unique_ptr<shm_ring> ring; /* records go here instead of write_queue, if set up */
+	std::deque<std::pair<wrapped_buffer<uint8_t>, size_t> > ring_queue; /* waiting for room in the ring */
+	size_t ring_cursor; /* how much of the front of ring_queue is in the ring */
+	size_t ring_queued; /* bytes in ring_queue */
+	enum log_codec codec; /* g_log_codec, once the logserver offers it */
+	ev::timer ring_timer; /* to try again once it was full */
+	/* the records behind what is in write_queue, to spool them if the
+	   logserver goes before they are sent */
+	struct unsent {
+		wrapped_buffer<uint8_t> records;
+		size_t offset;
+		size_t len;
+		size_t wire; /* bytes of write_queue they take, framed or not */
+		bool framed;
+		unsent(wrapped_buffer<uint8_t> &b, size_t offset, size_t len, size_t wire, bool framed)
+			: records(b), offset(offset), len(len), wire(wire), framed(framed) {}
+	};
+	std::deque<struct unsent> unsent_queue;
+	size_t unsent_cursor; /* bytes of the front of unsent_queue written */
+	/* fd should be a unix socket to the logserver */
 	log_buffer(int fd);
 	void append(wrapped_buffer<uint8_t> &ptr, size_t len);
+	size_t backlog() const; /* bytes waiting to go to the logserver */
+	void want_write();
+	void start_batch_timer();
 	void io_cb(ev::io &watcher, int revents);
+	void batch_cb(ev::timer &watcher, int revents);
+	void stats_cb(ev::timer &watcher, int revents);
+	void ring_cb(ev::timer &watcher, int revents);
 	~log_buffer();
+private:
+	bool do_read();
+	void suicide();
+	void setup_ring();
+	/* after LOG_RING_REFUSED, moves what is in the ring and ring_queue to write_queue */
+	void drop_ring();
+	void drain_ring_queue();
+	void enqueue(wrapped_buffer<uint8_t> &ptr, size_t len);
+	/* the len bytes of records from offset on, to write_queue as they are */
+	void queue_records(wrapped_buffer<uint8_t> &ptr, size_t offset, size_t len);
+	void written(size_t len);
+	/* on losing the logserver, moves every record not wholly sent to the spool */
+	void spool_unsent();
+	void refill();
+	log_buffer & operator=(log_buffer other);
+	log_buffer(const log_buffer &);
+	log_buffer(const log_buffer &&other);
+	log_buffer & operator=(log_buffer &&other);
 };
 
 extern log_buffer *g_log_buffer; /* initialize with log socket and assign */
 
+/* log types someone downstream of the logserver wants. Everything
+   until the logserver says otherwise, and everything goes to the
+   console fallback */
+extern uint8_t g_log_interests;
+/* what the logserver calls this producer, once it said. 0 until then */
+extern uint32_t g_log_source_id;
+
+/* log sent messages as payload references, set from logger.dedup_payloads */
+extern bool g_log_dedup_payloads;
+
+/* batching of binary records, set from logger.max_latency (seconds),
+   logger.max_batch (bytes) and logger.stats_interval (seconds, 0 for
+   no LOG_BATCHING events) before creating g_log_buffer */
+extern double g_log_max_latency;
+extern size_t g_log_max_batch;
+extern double g_log_stats_interval;
+
+/* bytes of shared memory ring to the logserver, set from
+   logger.shm_ring. 0 to send everything over the socket */
+extern size_t g_log_ring_size;
+
+/* codec to send the logserver frames in, over the socket, set from
+   logger.compression */
+extern enum log_codec g_log_codec;
+
+/* With a spool open, records that cannot go to the logserver, because
+   there is none or g_log_spool_memory bytes are already waiting for
+   it, are appended to the spool file instead. They are sent, before
+   anything newer, as the logserver catches up. If the logserver goes,
+   the records still waiting for it go in front of the spool. The file is kept
+   under g_log_spool_max bytes by g_log_spool_policy. Set from
+   logger.spool.memory, logger.spool.max_size and logger.spool.policy
+   ("drop_newest" or "drop_oldest") */
+enum spool_policy {
+	SPOOL_DROP_NEWEST, /* records that don't fit are dropped */
+	SPOOL_DROP_OLDEST, /* the oldest are dropped to make room */
+};
+
+extern size_t g_log_spool_memory;
+extern size_t g_log_spool_max;
+extern enum spool_policy g_log_spool_policy;
+
+/* starts the spool at path, from logger.spool.path. Anything in the
+   file from before is discarded. Returns false with errno set if it
+   could not */
+bool g_log_open_spool(const std::string &path);
+
+struct log_batch_stats {
+	uint64_t batches; /* stores handed to g_log_buffer */
+	uint64_t bytes;
+	double latency_total; /* seconds from the first record in a store to handing it off */
+	double latency_max;
+	size_t batch_size; /* what it has adapted to */
+};
+
+/* since the last reset */
+const struct log_batch_stats & g_log_batch_stats();
+void g_log_reset_batch_stats();
+
+inline bool g_log_wanted(uint8_t type) {
+	return !g_log_buffer || (g_log_interests & type);
+}
+
 extern size_t g_log_cursor;
 extern wrapped_buffer<uint8_t> g_log_store;
 
+/* Text logs are formatted straight into g_log_store behind whatever is
+   already buffered there. len is the length of the record being
+   built, from its length prefix on. Nothing is allocated unless the
+   store has to grow or a type only has an operator<< */
+
+/* makes room for more bytes after the len already in the record */
+void g_log_reserve(size_t len, size_t more);
+
+inline void g_log_put(size_t &len, const char *str, size_t str_len) {
+	g_log_reserve(len, str_len);
+	memcpy(g_log_store.ptr() + g_log_cursor + len, str, str_len);
+	len += str_len;
+}
+
+inline void g_log_put(size_t &len, char c) {
+	g_log_reserve(len, 1);
+	g_log_store.ptr()[g_log_cursor + len] = c;
+	++len;
+}
+
+void g_log_format(size_t &len, const char *str);
+inline void g_log_format(size_t &len, char *str) { g_log_format(len, (const char *) str); }
+void g_log_format(size_t &len, const std::string &str);
+void g_log_format(size_t &len, const struct sockaddr &addr);
+void g_log_format(size_t &len, const struct sockaddr_in &addr);
+void g_log_format(size_t &len, const struct bitcoin::packed_message *m);
+void g_log_format(size_t &len, const struct bitcoin::packed_message &m);
+void g_log_format(size_t &len, const struct ctrl::message *m);
+void g_log_format(size_t &len, const struct ctrl::message &m);
+void g_log_format_unsigned(size_t &len, unsigned long long val);
+void g_log_format_signed(size_t &len, long long val);
+void g_log_format_double(size_t &len, double val);
+
+/* integers print in decimal, except the char types which (like
+   ostream) print as the character itself */
 template <typename T>
-void g_log_inner(wrapped_buffer<uint8_t> &wbuf, size_t &len, const T &s) {
-	std::stringstream oss;
-	oss << s;
-	const std::string str(oss.str());
-	if (wbuf.allocated() < len + str.size()+1) {
-		wbuf.realloc(len + str.size()+1);
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type 
+g_log_format(size_t &len, T val) {
+	if (std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value) {
+		g_log_put(len, (char) val);
+	} else if (std::is_same<T, bool>::value) {
+		g_log_put(len, val ? '1' : '0');
+	} else if (std::is_signed<T>::value) {
+		g_log_format_signed(len, (long long) val);
+	} else {
+		g_log_format_unsigned(len, (unsigned long long) val);
 	}
-	std::copy((uint8_t*)str.c_str(), (uint8_t*)str.c_str() + str.size() + 1, wbuf.ptr() + len);
-	len += str.size() + 1;
 }
 
-template <typename T, typename... Targs>
-void g_log_inner(wrapped_buffer<uint8_t> &wbuf, size_t &len, const T &val, Targs... Fargs) {
-	/* if we are in the inners we are in a generic sequence, in which
-	   case just make it an ascii stream with a newline at the end */
-	std::stringstream oss;
-	oss << val << ' ';
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+g_log_format(size_t &len, T val) {
+	g_log_format_double(len, val);
+}
+
+/* anything else goes through its operator<< */
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_enum<T>::value>::type
+g_log_format(size_t &len, const T &val) {
+	std::ostringstream oss;
+	oss << val;
 	const std::string str(oss.str());
-	if (wbuf.allocated() < len + str.size()) {
-		wbuf.realloc(len + str.size());
-	}
-	std::copy((uint8_t*)str.c_str(), (uint8_t*)str.c_str() + str.size(), wbuf.ptr() + len);
-	len += str.size();
+	g_log_put(len, str.c_str(), str.size());
+}
+
+/* ascii, space separated, terminated by a nul */
+template <typename T>
+void g_log_inner(size_t &len, const T &val) {
+	g_log_format(len, val);
+	g_log_put(len, '\0');
+}
 
-	g_log_inner(wbuf, len, Fargs...);
+template <typename T, typename... Targs>
+void g_log_inner(size_t &len, const T &val, Targs... Fargs) {
+	g_log_format(len, val);
+	g_log_put(len, ' ');
+	g_log_inner(len, Fargs...);
 }
 
+/* starts a text record of type at the cursor and returns its length so far */
+size_t g_log_text_begin(uint8_t type);
+/* finishes it and hands the store to g_log_buffer */
+void g_log_text_end(size_t len);
+
 template <int N, typename... Targs>
 void g_log(const std::string &val, Targs... Fargs) {
-	uint64_t net_time = hton((uint64_t)ev::now(ev_default_loop()));
-
-	wrapped_buffer<uint8_t> wbuf(128);
-	uint8_t *ptr = wbuf.ptr();
-	uint8_t n = N;
-
-	ptr += 4; /* leave room for the length to be written */
-
-	std::copy((uint8_t*)&n, (uint8_t*)(&n) + 1, ptr);
-	ptr += 1;
-	
-	std::copy((uint8_t*) &net_time, ((uint8_t*)&net_time) + sizeof(net_time),
-	          ptr);
-	ptr += sizeof(net_time);;
-
-	size_t len = sizeof(net_time) + sizeof(n) + sizeof(uint32_t);
-	
-	g_log_inner(wbuf,len,val, Fargs...);
-	if (g_log_buffer) {
-		uint32_t netlen = hton((uint32_t)(len-4)); /* don't include length in length itself */
-		ptr = wbuf.ptr();
-		std::copy((uint8_t*) &netlen, ((uint8_t*)&netlen) + 4, ptr);
-		if (g_log_cursor > 0) { /* flush here to maintain ordering */ 
-			g_log_buffer->append(g_log_store, g_log_cursor);
-			g_log_cursor = 0;
-			g_log_store = wrapped_buffer<uint8_t>(4096);
-		}
-		g_log_buffer->append(wbuf, len);
-	} else {
-		std::cerr << "<<CONSOLE FALLBACK>> " << ((char*) wbuf.const_ptr() + 1 + sizeof(net_time) + 4) << std::endl;
+	if (!g_log_wanted(N)) {
+		return;
 	}
+	size_t len = g_log_text_begin(N);
+	g_log_inner(len, val, Fargs...);
+	g_log_text_end(len);
+}
+
+/* Structured records for the common CTRL, CONNECTOR and ERROR
+   events. They share the text record's header and type, but rest
+   starts with a nul so text readers see an empty string: */
+// uint8_t zero
+// uint16_t event_id /* NBO, see log_event */
+// uint8_t field_cnt
+// then field_cnt of: uint8_t tag (see log_field) and its value
+
+enum log_event {
+	/* CTRL */
+	EVENT_REGISTER=1, /* u32 old_regid, u32 new_regid */
+	EVENT_MESSAGE_REGISTERED=2, /* u32 regid, u32 message_id, str command, u32 length, u32 slot_cnt */
+	EVENT_CXN_REQUESTED=3, /* u32 regid, u32 connections */
+	EVENT_CONNECT_ATTEMPT=4, /* u32 regid, addr remote */
+	EVENT_CTRL_DISCONNECT=5, /* u32 handler_id */
+	EVENT_SCHEDULE=6, /* u32 message_id, u32 targets, u64 start, u64 window */
+	EVENT_SCHEDULED_SEND=7, /* u32 message_id, u32 handle_id, u64 scheduled, u64 actual */
+	EVENT_SCHEDULE_COMPLETE=8, /* u32 message_id, u32 targets, u64 max_skew */
+	EVENT_GROUP_DEFINED=9, /* u32 regid, u32 group_id, u32 members */
+	EVENT_GROUP_DELETED=10, /* u32 regid, u32 group_id, u32 deleted */
+	EVENT_RING_SETUP=11, /* u32 regid, u32 size */
+	/* CONNECTOR */
+	EVENT_STARTUP=32, /* str commit */
+	EVENT_SHUTDOWN=33, /* nothing */
+	EVENT_BLACKLIST_LOADED=34, /* u32 entries */
+	EVENT_LOG_BATCHING=35, /* u64 batches, u64 bytes, u64 mean_latency_us, u64 max_latency_us, u64 batch_size */
+	EVENT_LOG_SPOOL_DRAINED=36, /* u64 bytes, u64 dropped (records) */
+	EVENT_LOG_METRICS=37, /* str snapshot, as on the logserver's metrics endpoint */
+	/* ERROR */
+	EVENT_SYSCALL_ERROR=64, /* i32 errno, str context */
+	EVENT_INVALID_CTRL_MESSAGE=65, /* u32 regid, u32 message_type */
+	EVENT_INVALID_MESSAGE_ID=66, /* u32 regid, u32 message_id */
+	EVENT_BLACKLISTED_CONNECT=67, /* addr remote */
+};
+
+enum log_field {
+	FIELD_U32=1, /* NBO */
+	FIELD_I32=2, /* NBO */
+	FIELD_U64=3, /* NBO */
+	FIELD_ADDR=4, /* struct sockaddr_in, as in BITCOIN records */
+	FIELD_STR=5, /* uint32_t len NBO, then len chars, no nul */
+};
+
+std::string event_to_str(enum log_event event);
+/* prints the fields of the event in rest (len bytes, from the zero
+   on) as name=value. Returns false if it isn't a well formed event */
+bool print_event(std::ostream &o, const uint8_t *rest, size_t len);
+
+void g_log_field(size_t &len, uint32_t val);
+void g_log_field(size_t &len, int32_t val);
+void g_log_field(size_t &len, uint64_t val);
+void g_log_field(size_t &len, const struct sockaddr_in &addr);
+void g_log_field(size_t &len, const char *str);
+void g_log_field(size_t &len, const std::string &str);
+
+inline void g_log_fields(size_t &/*len*/) {}
+
+template <typename T, typename... Targs>
+void g_log_fields(size_t &len, const T &val, Targs... Fargs) {
+	g_log_field(len, val);
+	g_log_fields(len, Fargs...);
+}
+
+template <int N, typename... Targs>
+void g_log_event(enum log_event event, Targs... Fargs) {
+	static_assert(N == CTRL || N == CONNECTOR || N == ERROR, "events are CTRL, CONNECTOR or ERROR records");
+	static_assert(sizeof...(Fargs) < 256, "too many fields");
+	if (!g_log_wanted(N)) {
+		return;
+	}
+	size_t len = g_log_text_begin(N);
+	uint16_t net_event = hton((uint16_t) event);
+	g_log_put(len, '\0');
+	g_log_put(len, (const char *) &net_event, sizeof(net_event));
+	g_log_put(len, (char) sizeof...(Fargs));
+	g_log_fields(len, Fargs...);
+	g_log_text_end(len);
 }
 
 template <int N> void g_log(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m);
 template <> void g_log<BITCOIN_MSG>(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m);
 
+/* as above, stamped with timestamp (as from g_log_now, 0 for now)
+   instead, e.g., the kernel receive time of the message */
+template <int N> void g_log(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m, uint64_t timestamp);
+template <> void g_log<BITCOIN_MSG>(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m, uint64_t timestamp);
+
 template <int N> void g_log(uint32_t update_type, uint32_t handle_id, const struct sockaddr_in &remote, 
                             const struct sockaddr_in &local, const char * text, uint32_t text_len);
 template <> void g_log<BITCOIN>(uint32_t update_type, uint32_t handle_id, const struct sockaddr_in &remote, 
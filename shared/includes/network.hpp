@@ -43,5 +43,16 @@ int unix_sock_setup(const std::string &path, struct sockaddr_un *addr, bool nonb
 int unix_sock_server(const std::string &path, int listen, bool nonblocking);
 int unix_sock_client(const std::string &path, bool nonblocking);
 
+/* addr is host:port, [v6 host]:port, or :port for any address on the
+   server side. Clients connect blocking, then go nonblocking if asked */
+int tcp_sock_server(const std::string &addr, int listen, bool nonblocking);
+int tcp_sock_client(const std::string &addr, bool nonblocking);
+
+/* what tcp_tune sets on the TCP sockets it is given */
+extern bool g_tcp_nodelay;
+extern int g_tcp_buffer; /* SO_SNDBUF and SO_RCVBUF, 0 to leave them be */
+/* does nothing to other sockets */
+void tcp_tune(int fd);
+
 
 #endif
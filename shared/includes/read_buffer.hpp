@@ -2,6 +2,7 @@
 #define READ_BUFFER_HPP
 
 #include <memory>
+#include <vector>
 #include "wrapped_buffer.hpp"
 
 /* to be used for accumulating read calls and extract realloc when ready to act on the data */
@@ -10,8 +11,10 @@ public:
 	/* return value from read, whether the read is complete (i.e., buffer can be extracted) */
 	read_buffer(size_t to_read) : 
 		cursor_(0), to_read_(to_read), buffer_(std::max(to_read, (size_t)1<<10)), 
-		recv_buffer_(new uint8_t[4096]), rb_loc_(0), rb_size_(0) {
+		recv_buffer_(new uint8_t[4096]), rb_loc_(0), rb_size_(0), want_fds_(false), fds_(),
+		want_timestamps_(false), rb_timestamp_(0), timestamp_(0) {
 	}
+	~read_buffer();
 	std::pair<int,bool> do_read(int fd); /* will read to_read_ bytes */
 	std::pair<int,bool> do_read(int fd, size_t size); /* will read size bytes */
    void to_read(size_t);
@@ -21,6 +24,17 @@ public:
 	bool hungry() const;
 	wrapped_buffer<uint8_t> extract_buffer();
 	const wrapped_buffer<uint8_t> extract_buffer() const;
+	/* have reads keep any fds passed with SCM_RIGHTS (otherwise the
+	   kernel closes them). They are the caller's once taken, any not
+	   taken are closed with the buffer */
+	void want_fds(bool want) { want_fds_ = want; }
+	std::vector<int> take_fds();
+	/* have reads pick up the kernel receive time of the data, for fds
+	   with SO_TIMESTAMPNS set */
+	void want_timestamps(bool want) { want_timestamps_ = want; }
+	/* kernel receive time, in nanoseconds since the epoch, of the
+	   data the byte at cursor 0 came in with. 0 if not known */
+	uint64_t timestamp() const { return timestamp_; }
 	/* Doesn't work for some reason :-( TODO: figure out why
 	operator const uint8_t*() const { return buffer_.const_ptr(); }
 	operator uint8_t*()  { return buffer_.ptr(); }
@@ -32,6 +46,12 @@ private:
 	std::unique_ptr<uint8_t[]> recv_buffer_;
 	size_t rb_loc_;
 	size_t rb_size_;
+	bool want_fds_;
+	std::vector<int> fds_;
+	bool want_timestamps_;
+	uint64_t rb_timestamp_; /* of what is in recv_buffer_ */
+	uint64_t timestamp_;
+	ssize_t recv_ancillary(int fd);
 };
 
 #endif
@@ -0,0 +1,86 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/types.h>
+
+#include <atomic>
+
+/* single producer, single consumer byte ring in shared memory (a
+   memfd) with an eventfd doorbell. The fds are passed to the other
+   process over a unix socket (see send_with_fds) and mapped there.
+
+   The producer only rings the doorbell if the consumer said it is
+   going to sleep, so a busy consumer costs the producer no
+   syscalls. Writes are all or nothing, so framed records are never
+   split between two wakeups.
+
+   The other side can scribble on the header, so the size is read
+   once when mapping and head - tail is checked against it on every
+   read. The memfd is sealed against resizing, an attached ring that
+   isn't is refused (else truncating it would SIGBUS us) */
+
+struct shm_ring_header {
+	std::atomic<uint64_t> head; /* bytes ever written, producer owned */
+	char pad1[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> tail; /* bytes ever consumed, consumer owned */
+	char pad2[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint32_t> sleeping; /* consumer is (about to be) waiting on the doorbell */
+	uint32_t pad3;
+	uint64_t size; /* of data, a power of two */
+	uint8_t data[0];
+};
+
+class shm_ring {
+public:
+	/* creates a new ring of at least size bytes. Throws network_error */
+	shm_ring(size_t size);
+	/* maps a ring created elsewhere, takes ownership of the fds. Throws
+	   network_error, also if its data is more than max_size bytes or
+	   the memfd isn't sealed against resizing */
+	shm_ring(int memfd, int doorbell, size_t max_size = SIZE_MAX);
+	~shm_ring();
+
+	int memfd() const { return memfd_; }
+	int doorbell() const { return doorbell_; }
+	size_t size() const { return size_; }
+
+	/* producer side */
+	bool write(const uint8_t *data, size_t len); /* false if there isn't room for all of it */
+	size_t writable() const;
+
+	/* consumer side */
+	size_t readable() const; /* 0 if corrupt */
+	bool corrupt() const; /* head and tail are further apart than the ring is big */
+	void peek(uint8_t *dest, size_t len) const; /* len <= readable() */
+	void consume(size_t len);
+	/* call before waiting on the doorbell, with the bytes you are
+	   leaving in the ring until more arrive (the start of a record). If
+	   it returns false data arrived in the meantime and you should not
+	   wait */
+	bool sleep(size_t pending = 0);
+	void clear_doorbell();
+
+private:
+	int memfd_;
+	int doorbell_;
+	size_t mapped_;
+	struct shm_ring_header *hdr_;
+	size_t size_; /* hdr_->size when mapped, the header isn't trusted after */
+	uint64_t mask_;
+
+	void map(size_t max_size);
+	shm_ring & operator=(shm_ring other);
+	shm_ring(const shm_ring &);
+	shm_ring(const shm_ring &&other);
+	shm_ring & operator=(shm_ring &&other);
+};
+
+/* sendmsg len bytes from data with the fds attached as SCM_RIGHTS. Blocking semantics of sock apply */
+ssize_t send_with_fds(int sock, const uint8_t *data, size_t len, const int *fds, size_t fd_cnt);
+/* recvmsg up to len bytes, any fds received (up to fd_cnt) stored in fds, the rest set to -1 */
+ssize_t recv_with_fds(int sock, uint8_t *data, size_t len, int *fds, size_t fd_cnt);
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef WRITE_BUFFER_HPP
 #define WRITE_BUFFER_HPP
 
-#include <list>
+#include <deque>
 #include <memory>
 #include <cstring>
 
@@ -17,6 +17,7 @@ public:
 
 	void append(const uint8_t *ptr, size_t len);
 	void append(wrapped_buffer<uint8_t> &buf, size_t len);
+	void append(wrapped_buffer<uint8_t> &buf, size_t offset, size_t len); /* the len bytes from offset on */
 
    size_t to_write() const;
 
@@ -32,6 +33,9 @@ private:
 		buffer_container(wrapped_buffer<uint8_t> b, size_t len) : cursor(0), writable(len), buffer(b) {
 			assert(buffer.allocated() >= len);
 		}
+		buffer_container(wrapped_buffer<uint8_t> b, size_t offset, size_t len) : cursor(offset), writable(offset + len), buffer(b) {
+			assert(buffer.allocated() >= offset + len);
+		}
 
 
 		/* TODO: make smarter */
@@ -40,8 +44,11 @@ private:
 		}
 	};
 
+	/* buffers handed to one writev */
+	static const int max_iov = 256;
+
 	size_t to_write_; /* not actually necessary, more a debugging aid */
-	std::list<struct buffer_container> buffers_; /* first is bytes in the buffer writable */
+	std::deque<struct buffer_container> buffers_; /* first is bytes in the buffer writable */
 
 };
 
@@ -26,7 +26,7 @@ alloc_buffer<T>::alloc_buffer(size_type initial_elements)
 	  refcount_(nullptr)
 {
 	if (initial_elements != 0) {
-		refcount_ = new size_type(1);
+		refcount_ = new std::atomic<size_type>(1);
 		buffer_ = (POD_T*)malloc(allocated_);
 		if (buffer_ == nullptr || refcount_ == nullptr) {
 			delete refcount_;
@@ -71,8 +71,7 @@ alloc_buffer<T> & alloc_buffer<T>::operator=(alloc_buffer other) {
 template <typename T> 
 alloc_buffer<T>::~alloc_buffer() {
 	if (refcount_) { /* may have been moved */
-		--*refcount_;
-		if (*refcount_ == 0) {
+		if (--*refcount_ == 0) {
 			delete refcount_;
 			free(buffer_);
 		}
@@ -92,7 +91,7 @@ void alloc_buffer<T>::realloc(size_type new_elt_cnt) {
 	}
 
 	if (!refcount_) {
-		refcount_ = new size_type(1);
+		refcount_ = new std::atomic<size_type>(1);
 	}
 
 	if (*refcount_ == 1) { /* yay, fast realloc */
@@ -139,9 +138,13 @@ typename alloc_buffer<T>::pointer alloc_buffer<T>::ptr() {
 			throw runtime_error(string("realloc failure: ") + strerror(errno));
 		}
 		memcpy(newbuf, buffer_, allocated_);
+		POD_T *old = buffer_;
 		buffer_ = newbuf;
-		--(*refcount_);
-		refcount_ = new size_type(1);
+		if (--(*refcount_) == 0) { /* the others went away meanwhile */
+			delete refcount_;
+			free(old);
+		}
+		refcount_ = new std::atomic<size_type>(1);
 	} 
 	return (pointer) buffer_;
 }
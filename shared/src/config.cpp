@@ -8,6 +8,9 @@
 #include <boost/program_options.hpp>
 
 #include "config.hpp"
+#include "logger.hpp"
+#include "network.hpp"
+#include "netwrap.hpp"
 
 using namespace libconfig;
 using namespace std;
@@ -102,3 +105,48 @@ const Config * load_config(const char *filename) {
 const Config * get_config() {
 	return &g_config;
 }
+
+/* host:port of the logserver's TCP port for which (servers or
+   clients), if logger.remote is set */
+static bool log_remote(const char *which, string &addr) {
+	const char *host = "", *listen = "";
+	if (!g_config.lookupValue("logger.remote", host) || !*host) {
+		return false;
+	}
+	g_config.lookupValue((string("logger.tcp.") + which).c_str(), listen);
+	const char *port = strrchr(listen, ':');
+	if (port == nullptr) {
+		throw network_error(string("logger.remote is set without a port in logger.tcp.") + which, EINVAL);
+	}
+	g_config.lookupValue("logger.tcp.nodelay", g_tcp_nodelay);
+	g_config.lookupValue("logger.tcp.buffer", g_tcp_buffer);
+	addr = string(host) + port;
+	return true;
+}
+
+int log_server_socket(bool nonblocking) {
+	string addr;
+	if (log_remote("servers", addr)) {
+		if (g_log_ring_size > 0) {
+			cerr << "Not using logger.shm_ring, the logserver is remote" << endl;
+			g_log_ring_size = 0;
+		}
+		return tcp_sock_client(addr, nonblocking);
+	}
+	string root((const char*)g_config.lookup("logger.root"));
+	return unix_sock_client(root + "servers", nonblocking);
+}
+
+int log_client_socket(const string &channel, bool nonblocking) {
+	string addr;
+	if (log_remote("clients", addr)) {
+		int sock = tcp_sock_client(addr, nonblocking);
+		if (!log_request_channel(sock, channel)) {
+			close(sock);
+			throw network_error("could not send channel " + channel + " to " + addr, errno);
+		}
+		return sock;
+	}
+	string root((const char*)g_config.lookup("logger.root"));
+	return unix_sock_client(root + "clients/" + channel, nonblocking);
+}
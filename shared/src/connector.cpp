@@ -37,6 +37,20 @@ std::pair<wrapped_buffer<uint8_t>, size_t> message::serialize() const {
 	return make_pair(buffer, ntoh(msg->length) + sizeof(*msg));
 }
 
+std::pair<wrapped_buffer<uint8_t>, size_t> message::serialize(uint32_t request_id) const {
+	pair<wrapped_buffer<uint8_t>, size_t> v0(serialize());
+	const struct ctrl::message *msg = (const struct ctrl::message*) v0.first.const_ptr();
+	wrapped_buffer<uint8_t> rv(v0.second + sizeof(request_id));
+	struct ctrl::message *out = (struct ctrl::message*) rv.ptr();
+	out->version = 1;
+	out->length = hton((uint32_t)(ntoh(msg->length) + sizeof(request_id)));
+	out->message_type = msg->message_type;
+	request_id = hton(request_id);
+	memcpy(out->payload, &request_id, sizeof(request_id));
+	memcpy(out->payload + sizeof(request_id), msg->payload, ntoh(msg->length));
+	return make_pair(rv, v0.second + sizeof(request_id));
+}
+
 unique_ptr<message> message::deserialize(const wrapped_buffer<uint8_t> &buffer) {
 	unique_ptr<message> rv;
 	const struct ctrl::message *msg = (const struct ctrl::message*) buffer.const_ptr();
@@ -53,6 +67,15 @@ unique_ptr<message> message::deserialize(const wrapped_buffer<uint8_t> &buffer)
 	case CONNECT:
 		rv = unique_ptr<ctrl::easy::message>(new connect_msg(buffer));
 		break;
+	case TEMPLATE_MESSAGE:
+		rv = unique_ptr<ctrl::easy::message>(new template_msg(buffer));
+		break;
+	case SCHEDULE:
+		rv = unique_ptr<ctrl::easy::message>(new schedule_msg(buffer));
+		break;
+	case GROUP:
+		rv = unique_ptr<ctrl::easy::message>(new group_msg(buffer));
+		break;
 	default:
 		throw runtime_error("Unknown type");
 		break;
@@ -87,6 +110,155 @@ void bitcoin_msg::payload(const uint8_t *new_payload, size_t length) {
 }
 
 
+template_msg::template_msg(const uint8_t *payload, size_t payload_size, const std::vector<struct patch_slot> &a_slots) 
+	: message(wrapped_buffer<uint8_t>(sizeof(ctrl::message) + sizeof(template_payload) + sizeof(patch_slot) * a_slots.size() + payload_size)) {
+	size_t slot_bytes = sizeof(template_payload) + sizeof(patch_slot) * a_slots.size();
+	ctrl::message *msg = (ctrl::message *)buffer.ptr();
+	msg->version = 0;
+	msg->message_type = TEMPLATE_MESSAGE;
+	msg->length = hton((uint32_t)(slot_bytes + payload_size));
+	struct template_payload *tmpl = (struct template_payload *) msg->payload;
+	tmpl->slot_cnt = hton((uint32_t)a_slots.size());
+	for(size_t i = 0; i < a_slots.size(); ++i) {
+		tmpl->slots[i] = a_slots[i];
+		tmpl->slots[i].offset = hton(a_slots[i].offset);
+	}
+	memcpy(msg->payload + slot_bytes, payload, payload_size);
+}
+
+vector<struct patch_slot> template_msg::slots() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	const struct template_payload *tmpl = (const struct template_payload *) msg->payload;
+	vector<struct patch_slot> rv(ntoh(tmpl->slot_cnt));
+	for(size_t i = 0; i < rv.size(); ++i) {
+		rv[i] = tmpl->slots[i];
+		rv[i].offset = ntoh(tmpl->slots[i].offset);
+	}
+	return rv;
+}
+
+const uint8_t * template_msg::payload() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	const struct template_payload *tmpl = (const struct template_payload *) msg->payload;
+	return msg->payload + sizeof(*tmpl) + sizeof(struct patch_slot) * ntoh(tmpl->slot_cnt);
+}
+
+
+schedule_msg::schedule_msg(uint32_t a_message_id, uint64_t a_start, uint64_t a_window, enum schedule_ordering a_ordering, const std::vector<uint32_t> &a_targets)
+	: message(wrapped_buffer<uint8_t>(sizeof(ctrl::message) + sizeof(ctrl::schedule_msg) + 4*a_targets.size())) {
+	ctrl::message *msg = (ctrl::message *)buffer.ptr();
+	msg->version = 0;
+	msg->message_type = SCHEDULE;
+	msg->length = hton((uint32_t)(sizeof(ctrl::schedule_msg) + 4 * a_targets.size()));
+	struct ctrl::schedule_msg *smsg = (struct ctrl::schedule_msg*) msg->payload;
+	smsg->message_id = hton(a_message_id);
+	smsg->start = hton(a_start);
+	smsg->window = hton(a_window);
+	smsg->ordering = a_ordering;
+	smsg->target_cnt = hton((uint32_t)a_targets.size());
+	for(size_t i = 0; i < a_targets.size(); ++i) {
+		smsg->targets[i] = hton(a_targets[i]);
+	}
+}
+
+uint32_t schedule_msg::message_id() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ntoh(((const struct ctrl::schedule_msg*) msg->payload)->message_id);
+}
+
+uint64_t schedule_msg::start() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ntoh(((const struct ctrl::schedule_msg*) msg->payload)->start);
+}
+
+uint64_t schedule_msg::window() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ntoh(((const struct ctrl::schedule_msg*) msg->payload)->window);
+}
+
+enum schedule_ordering schedule_msg::ordering() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return (enum schedule_ordering) ((const struct ctrl::schedule_msg*) msg->payload)->ordering;
+}
+
+vector<uint32_t> schedule_msg::targets() const {
+	vector<uint32_t> rv;
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	const struct ctrl::schedule_msg *smsg = (const struct ctrl::schedule_msg*) msg->payload;
+	uint32_t tc = ntoh(smsg->target_cnt);
+	rv.reserve(tc);
+	for(uint32_t i = 0; i < tc; ++i) {
+		rv.push_back(ntoh(smsg->targets[i]));
+	}
+	return rv;
+}
+
+
+group_msg::group_msg(enum group_operations a_operation, uint32_t a_group_id, enum group_direction a_direction, 
+                     uint32_t a_subnet, uint8_t a_prefix_len, const std::vector<uint32_t> &a_handles, const std::string &a_agent)
+	: message(wrapped_buffer<uint8_t>(sizeof(ctrl::message) + sizeof(ctrl::group_msg) + 4*a_handles.size() + a_agent.size())) {
+	ctrl::message *msg = (ctrl::message *)buffer.ptr();
+	msg->version = 0;
+	msg->message_type = GROUP;
+	msg->length = hton((uint32_t)(sizeof(ctrl::group_msg) + 4*a_handles.size() + a_agent.size()));
+	struct ctrl::group_msg *gmsg = (struct ctrl::group_msg*) msg->payload;
+	gmsg->operation = a_operation;
+	gmsg->group_id = hton(a_group_id);
+	gmsg->direction = a_direction;
+	gmsg->subnet = hton(a_subnet);
+	gmsg->prefix_len = a_prefix_len;
+	gmsg->handle_cnt = hton((uint32_t)a_handles.size());
+	gmsg->agent_len = hton((uint32_t)a_agent.size());
+	for(size_t i = 0; i < a_handles.size(); ++i) {
+		gmsg->handles[i] = hton(a_handles[i]);
+	}
+	memcpy(gmsg->handles + a_handles.size(), a_agent.data(), a_agent.size());
+}
+
+enum group_operations group_msg::operation() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return (enum group_operations) ((const struct ctrl::group_msg*) msg->payload)->operation;
+}
+
+uint32_t group_msg::group_id() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ntoh(((const struct ctrl::group_msg*) msg->payload)->group_id);
+}
+
+enum group_direction group_msg::direction() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return (enum group_direction) ((const struct ctrl::group_msg*) msg->payload)->direction;
+}
+
+uint32_t group_msg::subnet() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ntoh(((const struct ctrl::group_msg*) msg->payload)->subnet);
+}
+
+uint8_t group_msg::prefix_len() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	return ((const struct ctrl::group_msg*) msg->payload)->prefix_len;
+}
+
+vector<uint32_t> group_msg::handles() const {
+	vector<uint32_t> rv;
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	const struct ctrl::group_msg *gmsg = (const struct ctrl::group_msg*) msg->payload;
+	uint32_t cnt = ntoh(gmsg->handle_cnt);
+	rv.reserve(cnt);
+	for(uint32_t i = 0; i < cnt; ++i) {
+		rv.push_back(ntoh(gmsg->handles[i]));
+	}
+	return rv;
+}
+
+string group_msg::agent() const {
+	const ctrl::message *msg = (const ctrl::message*) buffer.const_ptr();
+	const struct ctrl::group_msg *gmsg = (const struct ctrl::group_msg*) msg->payload;
+	return string((const char *) (gmsg->handles + ntoh(gmsg->handle_cnt)), ntoh(gmsg->agent_len));
+}
+
+
 connect_msg::connect_msg(const struct sockaddr_in *remote_addr, const struct sockaddr_in *local_addr) 
 	: message(CONNECT, vector<uint8_t>(sizeof(*remote_addr) * 2), sizeof(*remote_addr) * 2) {
 	struct ctrl::message *msg = (struct ctrl::message *) buffer.ptr();
@@ -1,9 +1,20 @@
 #include <cassert>
+#include <cstdio>
+#include <ctime>
+
+#include <vector>
+#include <unordered_set>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 
+#include <lz4.h>
+#include <zstd.h>
+
 #include "logger.hpp"
+#include "shm_ring.hpp"
+#include "netwrap.hpp"
 
 
 
@@ -11,51 +22,562 @@ using namespace std;
 
 
 log_buffer *g_log_buffer;
+uint8_t g_log_interests(0xFF);
+uint32_t g_log_source_id(0);
 
-const static size_t store_size(4096);
+/* Binary records are batched in the store until it reaches
+   g_log_batch_size or the oldest has waited g_log_max_latency. The
+   batch size doubles, up to g_log_max_batch, whenever a store fills
+   well within the latency bound and halves, down to min_batch, when
+   the timer finds it mostly empty */
+const static size_t min_batch(4096);
+double g_log_max_latency(0.1);
+size_t g_log_max_batch(262144);
+double g_log_stats_interval(0);
+size_t g_log_ring_size(0);
+static size_t g_log_batch_size(min_batch);
+static double g_log_batch_start(0); /* when the first record went in the store */
+static struct log_batch_stats g_log_stats = { 0, 0, 0, 0, min_batch };
 
 size_t g_log_cursor(0);
-wrapped_buffer<uint8_t> g_log_store(store_size);
+wrapped_buffer<uint8_t> g_log_store(min_batch);
+
+/* stores handed to g_log_buffer. Once it is done writing one out we
+   are the only owner left and it can be filled again */
+const static size_t store_pool_max(8);
+static vector<wrapped_buffer<uint8_t> > g_log_store_pool;
+
+/* text records sit in the store until g_log_buffer next gets to write */
+static bool g_log_text_pending(false);
+
+enum flush_reason {
+	FLUSH_FULL,
+	FLUSH_TIMER,
+	FLUSH_TEXT,
+};
+
+static void flush_store(enum flush_reason why);
+/* flushes the store once its batch is g_log_max_latency old, else
+   has timer wait out the rest */
+static void batch_due(ev::timer &timer);
+
+bool g_log_dedup_payloads(false);
+
+/* hashes (NBO) of the payloads the logserver has been sent. It only
+   keeps so many itself, so this starts over when it says to */
+const static size_t payloads_max(65536);
+static unordered_set<uint64_t> g_log_payloads;
+
+enum log_codec g_log_codec(LOG_CODEC_NONE);
+const static size_t frame_min(512); /* smaller batches go as they are */
+const static size_t frame_max(64 * 1024 * 1024); /* biggest raw_len we'll take */
+const static int zstd_level(3);
+
+size_t g_log_spool_memory(64 * 1024 * 1024);
+size_t g_log_spool_max(1024 * 1024 * 1024);
+enum spool_policy g_log_spool_policy(SPOOL_DROP_NEWEST);
+
+/* Records from head to tail of the spool file are waiting to go out.
+   What is before head has been sent and is punched out of the file,
+   which starts over once it is all sent */
+static int g_log_spool_fd(-1);
+static off_t g_log_spool_head(0);
+static off_t g_log_spool_tail(0);
+static uint64_t g_log_spool_bytes(0); /* spooled since it was last empty */
+static uint64_t g_log_spool_dropped(0); /* records */
+const static size_t spool_chunk(1024 * 1024); /* read back at a time */
+
+bool g_log_open_spool(const string &path) {
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	if (g_log_spool_fd >= 0) {
+		close(g_log_spool_fd);
+	}
+	g_log_spool_fd = fd;
+	g_log_spool_head = g_log_spool_tail = 0;
+	return true;
+}
+
+static bool spool_pending() {
+	return g_log_spool_head < g_log_spool_tail;
+}
+
+static size_t count_records(const uint8_t *buf, size_t len) {
+	size_t cnt = 0;
+	uint32_t netlen;
+	for(size_t pos = 0; pos + sizeof(netlen) <= len; pos += sizeof(netlen) + ntoh(netlen)) {
+		memcpy(&netlen, buf + pos, sizeof(netlen));
+		++cnt;
+	}
+	return cnt;
+}
+
+/* gives back the space of what has been sent */
+static void spool_release() {
+	if (g_log_spool_head == g_log_spool_tail) {
+		if (ftruncate(g_log_spool_fd, 0) != 0) {
+			cerr << "Could not truncate log spool: " << strerror(errno) << endl;
+		}
+		g_log_spool_head = g_log_spool_tail = 0;
+		return;
+	}
+	off_t hole = g_log_spool_head & ~(off_t) 4095;
+	if (hole > 0) {
+		/* not every filesystem can, in which case it just stays until the spool empties */
+		fallocate(g_log_spool_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, hole);
+	}
+}
+
+/* drops whole records from the front until len more bytes fit */
+static void spool_drop_oldest(size_t len) {
+	uint32_t netlen;
+	while(spool_pending() && (size_t) (g_log_spool_tail - g_log_spool_head) + len > g_log_spool_max) {
+		if (pread(g_log_spool_fd, &netlen, sizeof(netlen), g_log_spool_head) != sizeof(netlen)) {
+			g_log_spool_head = g_log_spool_tail;
+			break;
+		}
+		g_log_spool_head += sizeof(netlen) + ntoh(netlen);
+		++g_log_spool_dropped;
+	}
+	g_log_spool_head = min(g_log_spool_head, g_log_spool_tail);
+	spool_release();
+}
+
+static void spool_append(const uint8_t *buf, size_t len) {
+	if (g_log_spool_policy == SPOOL_DROP_OLDEST) {
+		spool_drop_oldest(len);
+	}
+	if ((size_t) (g_log_spool_tail - g_log_spool_head) + len > g_log_spool_max) {
+		g_log_spool_dropped += count_records(buf, len);
+		return;
+	}
+	size_t done = 0;
+	while(done < len) {
+		ssize_t r = pwrite(g_log_spool_fd, buf + done, len - done, g_log_spool_tail + done);
+		if (r < 0 && errno != EINTR) {
+			cerr << "Could not write to log spool: " << strerror(errno) << endl;
+			g_log_spool_dropped += count_records(buf, len);
+			return;
+		}
+		done += max(r, (ssize_t) 0);
+	}
+	g_log_spool_tail += len;
+	g_log_spool_bytes += len;
+}
+
+/* puts records in front of what is spooled, for records older than it */
+static void spool_prepend(const uint8_t *buf, size_t len) {
+	if ((size_t) (g_log_spool_tail - g_log_spool_head) + len > g_log_spool_max) {
+		g_log_spool_dropped += count_records(buf, len);
+		return;
+	}
+	if ((off_t) len > g_log_spool_head) { /* move the spool back to make room */
+		off_t shift = len - g_log_spool_head;
+		wrapped_buffer<uint8_t> chunk(spool_chunk);
+		for(off_t end = g_log_spool_tail; end > g_log_spool_head; ) {
+			size_t n = min((off_t) spool_chunk, end - g_log_spool_head);
+			end -= n;
+			if (pread(g_log_spool_fd, chunk.ptr(), n, end) != (ssize_t) n ||
+			    pwrite(g_log_spool_fd, chunk.const_ptr(), n, end + shift) != (ssize_t) n) {
+				cerr << "Could not move log spool, dropping it: " << strerror(errno) << endl;
+				g_log_spool_head = g_log_spool_tail;
+				spool_release();
+				shift = len;
+				break;
+			}
+		}
+		g_log_spool_head += shift;
+		g_log_spool_tail += shift;
+	}
+	size_t done = 0;
+	while(done < len) {
+		ssize_t r = pwrite(g_log_spool_fd, buf + done, len - done, g_log_spool_head - len + done);
+		if (r <= 0) {
+			cerr << "Could not write to log spool: " << strerror(errno) << endl;
+			g_log_spool_dropped += count_records(buf, len);
+			return;
+		}
+		done += r;
+	}
+	g_log_spool_head -= len;
+	g_log_spool_bytes += len;
+}
+
+/* whole records from the front of the spool, about max bytes of them
+   unless the first is bigger. Returns how many bytes went in buf */
+static size_t spool_read(wrapped_buffer<uint8_t> &buf, size_t max) {
+	size_t want = min(max, (size_t) (g_log_spool_tail - g_log_spool_head));
+	buf = wrapped_buffer<uint8_t>(want);
+	if (pread(g_log_spool_fd, buf.ptr(), want, g_log_spool_head) != (ssize_t) want) {
+		cerr << "Could not read log spool, dropping it: " << strerror(errno) << endl;
+		g_log_spool_head = g_log_spool_tail;
+		spool_release();
+		return 0;
+	}
+
+	size_t end = 0;
+	uint32_t netlen;
+	while(end + sizeof(netlen) <= want) {
+		memcpy(&netlen, buf.const_ptr() + end, sizeof(netlen));
+		size_t rec = sizeof(netlen) + ntoh(netlen);
+		if (end + rec > want) {
+			break;
+		}
+		end += rec;
+	}
+	if (end == 0) { /* one record bigger than max */
+		memcpy(&netlen, buf.const_ptr(), sizeof(netlen));
+		end = sizeof(netlen) + ntoh(netlen);
+		buf.realloc(end);
+		if (pread(g_log_spool_fd, buf.ptr() + want, end - want, g_log_spool_head + want) != (ssize_t) (end - want)) {
+			cerr << "Could not read log spool, dropping it: " << strerror(errno) << endl;
+			g_log_spool_head = g_log_spool_tail;
+			spool_release();
+			return 0;
+		}
+	}
+	g_log_spool_head += end;
+	spool_release();
+	return end;
+}
 
 
 
 
 
 
-log_buffer::log_buffer(int fd) : write_queue(), fd(fd), io() { 
+log_buffer::log_buffer(int fd) : write_queue(), read_queue(sizeof(uint32_t)), reading_len(true), fd(fd), io(), 
+                                  batch_timer(), stats_timer(), ring(), ring_queue(), ring_cursor(0), ring_queued(0), codec(LOG_CODEC_NONE),
+                                  ring_timer(), unsent_queue(), unsent_cursor(0) { 
+	g_log_interests = 0xFF; /* until this logserver tells us */
+	g_log_payloads.clear();
 	io.set<log_buffer, &log_buffer::io_cb>(this);
-	io.set(fd, ev::WRITE);
+	io.set(fd, ev::READ | ev::WRITE);
 	io.start();
+	batch_timer.set<log_buffer, &log_buffer::batch_cb>(this);
+	stats_timer.set<log_buffer, &log_buffer::stats_cb>(this);
+	ring_timer.set<log_buffer, &log_buffer::ring_cb>(this);
+	if (g_log_stats_interval > 0) {
+		stats_timer.start(g_log_stats_interval, g_log_stats_interval);
+	}
+	if (g_log_ring_size > 0) {
+		setup_ring();
+	}
+	refill();
+	if (g_log_cursor > 0) { /* batched while we had no logserver */
+		batch_timer.start(g_log_max_latency, 0);
+	}
+}
+
+void log_buffer::start_batch_timer() {
+	if (!batch_timer.is_active()) {
+		batch_timer.start(g_log_max_latency, 0);
+	}
+}
+
+void log_buffer::batch_cb(ev::timer &, int) {
+	batch_due(batch_timer);
+}
+
+void log_buffer::stats_cb(ev::timer &, int) {
+	if (g_log_stats.batches == 0) {
+		return;
+	}
+	g_log_event<CONNECTOR>(EVENT_LOG_BATCHING, g_log_stats.batches, g_log_stats.bytes,
+	                       (uint64_t) (g_log_stats.latency_total / g_log_stats.batches * 1e6),
+	                       (uint64_t) (g_log_stats.latency_max * 1e6), (uint64_t) g_log_batch_size);
+	g_log_reset_batch_stats();
+}
+
+void log_buffer::setup_ring() {
+	try {
+		ring.reset(new shm_ring(g_log_ring_size));
+	} catch (const network_error &e) {
+		cerr << "Could not create log ring, using the socket: " << e.what() << endl;
+		return;
+	}
+	uint8_t msg[sizeof(uint32_t) + 2];
+	uint32_t netlen = hton((uint32_t) 2);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = 0;
+	msg[sizeof(netlen) + 1] = LOG_RING_ATTACH;
+	int fds[2] = { ring->memfd(), ring->doorbell() };
+	if (send_with_fds(fd, msg, sizeof(msg), fds, 2) != (ssize_t) sizeof(msg)) {
+		/* nothing else has been sent yet, so if none of it went the socket still works */
+		cerr << "Could not hand log ring to the logserver, using the socket: " << strerror(errno) << endl;
+		ring.reset();
+	}
+}
+
+void log_buffer::drop_ring() {
+	cerr << "The logserver refused the log ring, using the socket" << endl;
+	/* nobody else reads the ring, so take back what is in it */
+	size_t left = ring->readable();
+	if (left) {
+		wrapped_buffer<uint8_t> back(left);
+		ring->peek(back.ptr(), left);
+		queue_records(back, 0, left);
+	}
+	for(auto it = ring_queue.begin(); it != ring_queue.end(); ++it) {
+		queue_records(it->first, ring_cursor, it->second - ring_cursor);
+		ring_cursor = 0;
+	}
+	ring_queue.clear();
+	ring_queued = 0;
+	ring_cursor = 0;
+	ring_timer.stop();
+	ring.reset();
+	want_write();
+}
+
+/* puts as many whole records from ring_queue in the ring as fit */
+void log_buffer::drain_ring_queue() {
+	while(!ring_queue.empty()) {
+		wrapped_buffer<uint8_t> &buf = ring_queue.front().first;
+		size_t len = ring_queue.front().second;
+		const uint8_t *base = buf.const_ptr();
+		size_t room = ring->writable();
+		size_t end = ring_cursor;
+		uint32_t netlen;
+		while(end < len) {
+			memcpy(&netlen, base + end, sizeof(netlen));
+			size_t rec = sizeof(netlen) + ntoh(netlen);
+			if (end + rec - ring_cursor > room) {
+				break;
+			}
+			end += rec;
+		}
+		if (end > ring_cursor) {
+			bool wrote = ring->write(base + ring_cursor, end - ring_cursor);
+			assert(wrote);
+			(void) wrote;
+			ring_cursor = end;
+		}
+
+		if (ring_cursor < len) {
+			memcpy(&netlen, base + ring_cursor, sizeof(netlen));
+			size_t rec = sizeof(netlen) + ntoh(netlen);
+			if (rec <= ring->size()) { /* wait for the logserver to make room */
+				if (!ring_timer.is_active()) {
+					ring_timer.start(0.001, 0);
+				}
+				return;
+			}
+			/* never going to fit */
+			queue_records(buf, ring_cursor, rec);
+			ring_cursor += rec;
+		}
+
+		if (ring_cursor == len) {
+			ring_queue.pop_front();
+			ring_queued -= len;
+			ring_cursor = 0;
+		}
+	}
 }
+
+void log_buffer::ring_cb(ev::timer &, int) {
+	drain_ring_queue();
+	refill();
+}
+
+size_t log_buffer::backlog() const {
+	return write_queue.to_write() + ring_queued - ring_cursor;
+}
+
 void log_buffer::append(wrapped_buffer<uint8_t> &ptr, size_t len) {
-	size_t to_write = write_queue.to_write();
-	write_queue.append(ptr, len);
-	if (to_write == 0) {
-		io.set(fd, ev::WRITE);
+	if (g_log_spool_fd >= 0 && (spool_pending() || backlog() + len > g_log_spool_memory)) {
+		spool_append(ptr.const_ptr(), len);
+		return;
+	}
+	enqueue(ptr, len);
+}
+
+/* sends what was spooled, while there isn't much else waiting */
+void log_buffer::refill() {
+	if (g_log_spool_fd < 0 || !spool_pending()) {
+		return;
+	}
+	while(spool_pending() && backlog() < min(spool_chunk, g_log_spool_memory)) {
+		wrapped_buffer<uint8_t> buf;
+		size_t len = spool_read(buf, spool_chunk);
+		if (len > 0) {
+			enqueue(buf, len);
+		}
+	}
+	if (!spool_pending()) {
+		g_log_event<CONNECTOR>(EVENT_LOG_SPOOL_DRAINED, g_log_spool_bytes, g_log_spool_dropped);
+		g_log_spool_bytes = g_log_spool_dropped = 0;
+	}
+}
+
+void log_buffer::enqueue(wrapped_buffer<uint8_t> &ptr, size_t len) {
+	if (ring) {
+		ring_queue.emplace_back(ptr, len);
+		ring_queued += len;
+		drain_ring_queue();
+		return;
+	}
+	wrapped_buffer<uint8_t> frame;
+	size_t frame_len = 0;
+	if (codec != LOG_CODEC_NONE && len >= frame_min) {
+		frame_len = log_frame(codec, ptr.const_ptr(), len, LOG_PRODUCER_FRAME_HEADER,
+		                      sizeof(LOG_PRODUCER_FRAME_HEADER), frame);
+	}
+	if (!frame_len) {
+		queue_records(ptr, 0, len);
+		return;
+	}
+	if (write_queue.to_write() == 0) {
+		want_write();
+	}
+	write_queue.append(frame, frame_len);
+	unsent_queue.emplace_back(ptr, 0, len, frame_len, true);
+}
+
+void log_buffer::queue_records(wrapped_buffer<uint8_t> &ptr, size_t offset, size_t len) {
+	if (write_queue.to_write() == 0) {
+		want_write();
+	}
+	write_queue.append(ptr, offset, len);
+	unsent_queue.emplace_back(ptr, offset, len, len, false);
+}
+
+/* len more bytes of write_queue went to the logserver */
+void log_buffer::written(size_t len) {
+	unsent_cursor += len;
+	while(!unsent_queue.empty() && unsent_cursor >= unsent_queue.front().wire) {
+		unsent_cursor -= unsent_queue.front().wire;
+		unsent_queue.pop_front();
+	}
+}
+
+void log_buffer::want_write() {
+	io.set(fd, ev::READ | ev::WRITE);
+}
+
+/* returns false if the log is gone */
+bool log_buffer::do_read() {
+	ssize_t r(1);
+	while(r > 0) {
+		auto res = read_queue.do_read(fd);
+		r = res.first;
+		if (r == 0 || (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)) {
+			cerr << "Lost log server: " << (r == 0 ? "disconnected" : strerror(errno)) << endl;
+			return false;
+		}
+		if (!read_queue.hungry()) {
+			const uint8_t *buf = read_queue.extract_buffer().const_ptr();
+			if (reading_len) {
+				uint32_t netlen;
+				memcpy(&netlen, buf, sizeof(netlen));
+				read_queue.cursor(0);
+				read_queue.to_read(ntoh(netlen));
+				reading_len = false;
+			} else {
+				if (read_queue.cursor() >= 2 && buf[0] == LOG_INTERESTS) {
+					g_log_interests = buf[1];
+					g_log_payloads.clear();
+				} else if (read_queue.cursor() >= 2 && buf[0] == LOG_CODECS) {
+					codec = (buf[1] & (1 << g_log_codec)) ? g_log_codec : LOG_CODEC_NONE;
+				} else if (read_queue.cursor() >= 1 + 2 * sizeof(uint32_t) && buf[0] == LOG_SOURCE_ID) {
+					uint32_t id;
+					memcpy(&id, buf + 1 + sizeof(id), sizeof(id));
+					g_log_source_id = ntoh(id);
+				} else if (read_queue.cursor() >= 1 && buf[0] == LOG_RING_REFUSED && ring) {
+					drop_ring();
+				}
+				read_queue.cursor(0);
+				read_queue.to_read(sizeof(uint32_t));
+				reading_len = true;
+			}
+		}
 	}
+	return true;
 }
 
-void log_buffer::io_cb(ev::io &watcher, int /*revents*/) {
+void log_buffer::io_cb(ev::io &watcher, int revents) {
+	if ((revents & ev::READ) && !do_read()) {
+		suicide();
+		return;
+	}
+	if (g_log_text_pending) {
+		flush_store(FLUSH_TEXT);
+	}
 	ssize_t r(1);
 	while(write_queue.to_write() && r > 0) {
 		auto res = write_queue.do_write(watcher.fd);
 		r = res.first;
+		if (r > 0) {
+			written(r);
+		}
 		if (r < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) { 
 			/* where to log when the log is dead... */
 			cerr << "Cannot write out log: " << strerror(errno) << endl;
-			io.stop();
-			close(io.fd);
-			g_log_buffer = NULL;
-			delete this;
+			suicide();
 			/* TODO: re-establish connection? */
 			return;
 		}
 	}
+	refill();
 	if (write_queue.to_write() == 0) {
-		io.set(watcher.fd, ev::NONE);
+		io.set(watcher.fd, ev::READ);
+	}
+}
+
+/* In the order they were to go: what was left in the ring, which the
+   logserver drains when it closes cleanly, then write_queue, of which
+   a partly written record or frame never made it, then ring_queue.
+   All of it is older than anything already spooled */
+void log_buffer::spool_unsent() {
+	if (g_log_spool_fd < 0) {
+		return;
+	}
+	vector<uint8_t> out;
+	if (ring && ring->readable()) {
+		out.resize(ring->readable());
+		ring->peek(out.data(), out.size());
+	}
+	for(auto it = unsent_queue.begin(); it != unsent_queue.end(); ++it) {
+		const uint8_t *base = it->records.const_ptr();
+		size_t start = it->offset, end = it->offset + it->len;
+		if (it == unsent_queue.begin() && !it->framed) { /* skip the records that went */
+			uint32_t netlen;
+			while(start < end) {
+				memcpy(&netlen, base + start, sizeof(netlen));
+				size_t rec = sizeof(netlen) + ntoh(netlen);
+				if (start + rec - it->offset > unsent_cursor) {
+					break;
+				}
+				start += rec;
+			}
+		}
+		out.insert(out.end(), base + start, base + end);
+	}
+	for(auto it = ring_queue.begin(); it != ring_queue.end(); ++it) {
+		size_t start = it == ring_queue.begin() ? ring_cursor : 0;
+		out.insert(out.end(), it->first.const_ptr() + start, it->first.const_ptr() + it->second);
+	}
+	if (!out.empty()) {
+		spool_prepend(out.data(), out.size());
 	}
 }
+
+void log_buffer::suicide() {
+	spool_unsent();
+	g_log_buffer = NULL;
+	g_log_text_pending = false;
+	g_log_interests = 0xFF;
+	g_log_payloads.clear();
+	delete this;
+}
+
 log_buffer::~log_buffer() {
+	batch_timer.stop();
+	stats_timer.stop();
+	ring_timer.stop();
 	io.stop();
 	close(io.fd);
 }
@@ -63,25 +585,339 @@ log_buffer::~log_buffer() {
 static void append_buf(wrapped_buffer<uint8_t> &buf, size_t len) {
 	if (g_log_buffer) {
 		g_log_buffer->append(buf, len);
+	} else if (g_log_spool_fd >= 0) {
+		spool_append(buf.const_ptr(), len);
 	} else {
 		std::cerr << "<<CONSOLE FALLBACK>> " << "BITCOIN: " << " TODO: pretty print this fallback, but really, don't use the fallback\n";
 	}
 }
 
+const struct log_batch_stats & g_log_batch_stats() {
+	return g_log_stats;
+}
+
+void g_log_reset_batch_stats() {
+	size_t batch_size = g_log_batch_size;
+	g_log_stats = log_batch_stats();
+	g_log_stats.batch_size = batch_size;
+}
+
+static void batch_due(ev::timer &timer) {
+	if (g_log_cursor == 0) {
+		return;
+	}
+	double remaining = g_log_batch_start + g_log_max_latency - ev::now(ev_default_loop());
+	if (remaining > 0) { /* the batch it was started for already went */
+		timer.start(remaining, 0);
+	} else {
+		flush_store(FLUSH_TIMER);
+	}
+}
+
+static void spool_batch_cb(ev::timer &timer, int /* revents */) {
+	if (!g_log_buffer) { /* else its batch_timer has the store */
+		batch_due(timer);
+	}
+}
+
+/* batch_timer's part while there is no logserver, so records get to
+   the spool within g_log_max_latency too, not only once the store is
+   full */
+static ev::timer & spool_batch_timer() {
+	static ev::timer *timer = nullptr;
+	if (!timer) {
+		timer = new ev::timer(ev_default_loop());
+		timer->set<spool_batch_cb>();
+	}
+	return *timer;
+}
+
+/* the store is empty and a record is about to go in it */
+static void batch_begin() {
+	g_log_batch_start = ev::now(ev_default_loop());
+	if (g_log_buffer) {
+		g_log_buffer->start_batch_timer();
+	} else if (g_log_spool_fd >= 0 && !spool_batch_timer().is_active()) {
+		spool_batch_timer().start(g_log_max_latency, 0);
+	}
+}
+
+/* hands off whatever is at the cursor and starts a fresh store */
+static void flush_store(enum flush_reason why) {
+	g_log_text_pending = false;
+	if (g_log_cursor > 0) {
+		double latency = ev::now(ev_default_loop()) - g_log_batch_start;
+		++g_log_stats.batches;
+		g_log_stats.bytes += g_log_cursor;
+		g_log_stats.latency_total += latency;
+		g_log_stats.latency_max = max(g_log_stats.latency_max, latency);
+
+		if (why == FLUSH_FULL && latency < g_log_max_latency / 2) {
+			g_log_batch_size = min(2 * g_log_batch_size, max(g_log_max_batch, min_batch));
+		} else if (why == FLUSH_TIMER && g_log_cursor < g_log_batch_size / 4) {
+			g_log_batch_size = max(g_log_batch_size / 2, min_batch);
+		}
+		g_log_stats.batch_size = g_log_batch_size;
+
+		append_buf(g_log_store, g_log_cursor);
+	}
+	g_log_cursor = 0;
+
+	wrapped_buffer<uint8_t> fresh;
+	for(size_t i = 0; i < g_log_store_pool.size(); ++i) {
+		if (g_log_store_pool[i].use_count() == 1) {
+			fresh = move(g_log_store_pool[i]);
+			g_log_store_pool[i] = move(g_log_store_pool.back());
+			g_log_store_pool.pop_back();
+			break;
+		}
+	}
+	if (!fresh) {
+		fresh = wrapped_buffer<uint8_t>(g_log_batch_size);
+	}
+	if (g_log_store_pool.size() < store_pool_max) {
+		g_log_store_pool.push_back(g_log_store);
+	}
+	g_log_store = move(fresh);
+}
+
+void g_log_reserve(size_t len, size_t more) {
+	size_t needed = g_log_cursor + len + more;
+	if (needed > g_log_store.allocated()) {
+		/* the store is never shared while being filled, so this is a plain realloc */
+		g_log_store.realloc(max(needed, 2 * g_log_store.allocated()));
+	}
+}
+
+uint64_t g_log_now() {
+	/* served from the vDSO, so no system call */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const struct log_format * log_upgrade(const uint8_t *buf, size_t &len, vector<uint8_t> &scratch) {
+	const struct log_format *log = (const struct log_format*) buf;
+	if (log->version != 0) {
+		return log;
+	}
+	const struct log_format_v1 *old = (const struct log_format_v1*) buf;
+	scratch.resize(len + 1);
+	struct log_format *upgraded = (struct log_format*) scratch.data();
+	upgraded->source_id = old->source_id;
+	upgraded->type = old->type;
+	upgraded->version = LOG_FORMAT_VERSION;
+	upgraded->timestamp = hton((uint64_t) (ntoh(old->timestamp) * 1000000000ULL));
+	copy(old->rest, buf + len, upgraded->rest);
+	++len;
+	return upgraded;
+}
+
+/* writes type, version and timestamp (now if 0) at ptr, returns what follows */
+static uint8_t * g_log_prolog(uint8_t *ptr, uint8_t type, uint64_t timestamp = 0) {
+	uint64_t net_time = hton(timestamp ? timestamp : g_log_now());
+	ptr[0] = type;
+	ptr[1] = LOG_FORMAT_VERSION;
+	memcpy(ptr + 2, &net_time, sizeof(net_time));
+	return ptr + 2 + sizeof(net_time);
+}
+
+size_t g_log_text_begin(uint8_t type) {
+	size_t len = 4 + 2 + sizeof(uint64_t); /* length is written at the end */
+	if (g_log_cursor == 0) {
+		batch_begin();
+	}
+	g_log_reserve(0, len);
+	g_log_prolog(g_log_store.ptr() + g_log_cursor + 4, type);
+	return len;
+}
+
+void g_log_text_end(size_t len) {
+	if (!g_log_buffer) {
+		const uint8_t *rest = g_log_store.const_ptr() + g_log_cursor + 4 + 2 + sizeof(uint64_t);
+		std::cerr << "<<CONSOLE FALLBACK>> ";
+		if (*rest == 0) {
+			print_event(std::cerr, rest, len - (rest - g_log_store.const_ptr() - g_log_cursor));
+			std::cerr << std::endl;
+		} else {
+			std::cerr << ((const char*) rest) << std::endl;
+		}
+		if (g_log_spool_fd < 0) {
+			return;
+		}
+		/* and keep it, to be spooled with the binary records */
+	}
+
+	uint32_t netlen = hton((uint32_t)(len-4)); /* don't include length in length itself */
+	memcpy(g_log_store.ptr() + g_log_cursor, &netlen, sizeof(netlen));
+	g_log_cursor += len;
+	/* text is unbuffered, but g_log_buffer only writes once per loop
+	   iteration anyway, so everything logged until then goes out in
+	   one append */
+	if (g_log_cursor >= g_log_batch_size) {
+		flush_store(FLUSH_FULL);
+	} else if (g_log_buffer && !g_log_text_pending) {
+		g_log_text_pending = true;
+		g_log_buffer->want_write();
+	}
+}
+
+void g_log_field(size_t &len, uint32_t val) {
+	val = hton(val);
+	g_log_put(len, (char) FIELD_U32);
+	g_log_put(len, (const char *) &val, sizeof(val));
+}
+
+void g_log_field(size_t &len, int32_t val) {
+	val = hton(val);
+	g_log_put(len, (char) FIELD_I32);
+	g_log_put(len, (const char *) &val, sizeof(val));
+}
+
+void g_log_field(size_t &len, uint64_t val) {
+	val = hton(val);
+	g_log_put(len, (char) FIELD_U64);
+	g_log_put(len, (const char *) &val, sizeof(val));
+}
+
+void g_log_field(size_t &len, const struct sockaddr_in &addr) {
+	g_log_put(len, (char) FIELD_ADDR);
+	g_log_put(len, (const char *) &addr, sizeof(addr));
+}
+
+void g_log_field(size_t &len, const char *str) {
+	uint32_t str_len = strlen(str);
+	uint32_t net_len = hton(str_len);
+	g_log_put(len, (char) FIELD_STR);
+	g_log_put(len, (const char *) &net_len, sizeof(net_len));
+	g_log_put(len, str, str_len);
+}
+
+void g_log_field(size_t &len, const string &str) {
+	uint32_t net_len = hton((uint32_t) str.size());
+	g_log_put(len, (char) FIELD_STR);
+	g_log_put(len, (const char *) &net_len, sizeof(net_len));
+	g_log_put(len, str.c_str(), str.size());
+}
+
+void g_log_format(size_t &len, const char *str) {
+	g_log_put(len, str, strlen(str));
+}
+
+void g_log_format(size_t &len, const string &str) {
+	g_log_put(len, str.c_str(), str.size());
+}
+
+void g_log_format_unsigned(size_t &len, unsigned long long val) {
+	char digits[20];
+	char *p = digits + sizeof(digits);
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	g_log_put(len, p, digits + sizeof(digits) - p);
+}
+
+void g_log_format_signed(size_t &len, long long val) {
+	if (val < 0) {
+		g_log_put(len, '-');
+		g_log_format_unsigned(len, 0ULL - (unsigned long long) val);
+	} else {
+		g_log_format_unsigned(len, val);
+	}
+}
+
+void g_log_format_double(size_t &len, double val) {
+	/* same as the ostream default */
+	char str[32];
+	int r = snprintf(str, sizeof(str), "%g", val);
+	g_log_put(len, str, min((size_t) r, sizeof(str) - 1));
+}
+
+static void g_log_format_hex(size_t &len, uint32_t val) {
+	char digits[8];
+	char *p = digits + sizeof(digits);
+	do {
+		*--p = "0123456789abcdef"[val & 0xf];
+		val >>= 4;
+	} while (val);
+	g_log_put(len, p, digits + sizeof(digits) - p);
+}
+
+void g_log_format(size_t &len, const struct sockaddr &addr) {
+	if (addr.sa_family == AF_INET) {
+		/* inet_ntop is slow enough to matter here */
+		const struct sockaddr_in *saddr = (const struct sockaddr_in*)&addr;
+		const uint8_t *octets = (const uint8_t *) &saddr->sin_addr.s_addr;
+		for(int i = 0; i < 4; ++i) {
+			if (i) {
+				g_log_put(len, '.');
+			}
+			g_log_format_unsigned(len, octets[i]);
+		}
+		g_log_put(len, ':');
+		g_log_format_unsigned(len, ntoh(saddr->sin_port));
+	} else {
+		ostringstream oss;
+		oss << addr;
+		g_log_format(len, oss.str());
+	}
+}
+
+void g_log_format(size_t &len, const struct sockaddr_in &addr) {
+	g_log_format(len, *(const struct sockaddr*)&addr);
+}
+
+void g_log_format(size_t &len, const struct bitcoin::packed_message *m) {
+	g_log_format(len, "MSG { length => ");
+	g_log_format_unsigned(len, m->length);
+	g_log_format(len, ", magic => 0x");
+	g_log_format_hex(len, m->magic);
+	g_log_format(len, ", command => ");
+	g_log_put(len, m->command, strnlen(m->command, sizeof(m->command)));
+	g_log_format(len, ", checksum => 0x");
+	g_log_format_hex(len, m->checksum);
+	g_log_format(len, ", payload => ommitted}");
+}
+
+void g_log_format(size_t &len, const struct bitcoin::packed_message &m) {
+	g_log_format(len, &m);
+}
+
+void g_log_format(size_t &len, const struct ctrl::message *m) {
+	g_log_format(len, "MSG { length => ");
+	g_log_format_unsigned(len, ntoh(m->length));
+	g_log_format(len, ", type => ");
+	g_log_format_unsigned(len, m->message_type);
+	g_log_format(len, ", payload => ommitted}");
+}
+
+void g_log_format(size_t &len, const struct ctrl::message &m) {
+	g_log_format(len, &m);
+}
+
+
+/* makes room at the cursor for a binary record of len bytes (plus
+   its length), flushing the batch if it would go over */
+static void g_log_binary_reserve(size_t len) {
+	if (g_log_cursor > 0 && g_log_cursor + len + 4 > g_log_batch_size) {
+		flush_store(FLUSH_FULL);
+	}
+	if (g_log_cursor == 0) {
+		batch_begin();
+	}
+	g_log_reserve(0, len + 4);
+}
 
 template <> void g_log<BITCOIN>(uint32_t update_type, uint32_t handle_id, const struct sockaddr_in &remote, 
                                 const struct sockaddr_in &local, const char * text, uint32_t text_len) {
-	uint64_t net_time = hton((uint64_t)ev::now(ev_default_loop()));
-	size_t len = 1 + sizeof(net_time) + sizeof(handle_id) + sizeof(update_type) +
+	if (!g_log_wanted(BITCOIN)) {
+		return;
+	}
+	size_t len = 2 + sizeof(uint64_t) + sizeof(handle_id) + sizeof(update_type) +
 		2*sizeof(remote) + sizeof(text_len) + text_len;
 
-	if (store_size == 1 || len + 4 > g_log_store.allocated() - g_log_cursor) {
-		if (g_log_cursor > 0) { /* yes, may conceivably just want to grow buffer for sufficiently small cursors... */
-			append_buf(g_log_store, g_log_cursor);
-		}
-		g_log_cursor = 0;
-		g_log_store = wrapped_buffer<uint8_t>(max((size_t)store_size, len+4));
-	}
+	g_log_binary_reserve(len);
 
 	uint8_t *base_ptr = g_log_store.ptr() + g_log_cursor;
 	uint8_t *cur_ptr = base_ptr;
@@ -91,13 +927,7 @@ template <> void g_log<BITCOIN>(uint32_t update_type, uint32_t handle_id, const
 	copy((uint8_t*) &netlen, ((uint8_t*)&netlen) + 4, cur_ptr);
 	cur_ptr += 4;
 
-	uint8_t typ = BITCOIN;
-	copy((uint8_t*) &typ, ((uint8_t*) &typ) + 1, cur_ptr);
-	cur_ptr += 1;
-
-	copy((uint8_t*) &net_time, ((uint8_t*)&net_time) + sizeof(net_time),
-	     cur_ptr);
-	cur_ptr += sizeof(net_time);
+	cur_ptr = g_log_prolog(cur_ptr, BITCOIN);
 
 	handle_id = hton(handle_id);
 	copy((uint8_t*) &handle_id, ((uint8_t*)&handle_id) + sizeof(handle_id), 
@@ -130,50 +960,282 @@ template <> void g_log<BITCOIN>(uint32_t update_type, uint32_t handle_id, const
 	g_log_cursor += cur_ptr - base_ptr;
 }
 
-template <> void g_log<BITCOIN_MSG>(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m) {
+/* starts a binary record with len bytes from its type on at the
+   cursor, stamped with timestamp (now if 0), and returns where what
+   follows the timestamp goes */
+static uint8_t * g_log_binary_begin(uint8_t type, size_t len, uint64_t timestamp) {
+	g_log_binary_reserve(len);
 
-	uint64_t net_time = hton((uint64_t)ev::now(ev_default_loop()));
-	uint32_t net_id = hton(id);
-	size_t len = 1 + sizeof(net_time) + sizeof(net_id) + 1 + sizeof(*m) + m->length;
+	uint8_t *ptr = g_log_store.ptr() + g_log_cursor;
+	uint32_t netlen = hton((uint32_t)len);
+	memcpy(ptr, &netlen, sizeof(netlen));
+	g_log_cursor += len + 4;
+	return g_log_prolog(ptr + sizeof(netlen), type, timestamp);
+}
+
+enum log_codec log_codec_from_str(const char *str) {
+	if (strcmp(str, "lz4") == 0) {
+		return LOG_CODEC_LZ4;
+	} else if (strcmp(str, "zstd") == 0) {
+		return LOG_CODEC_ZSTD;
+	}
+	return LOG_CODEC_NONE;
+}
+
+size_t log_frame(enum log_codec codec, const uint8_t *src, size_t len,
+                 const uint8_t *hdr, size_t hdr_len, wrapped_buffer<uint8_t> &out) {
+	const size_t prolog = sizeof(uint32_t) + hdr_len + 1 + sizeof(uint32_t);
+	size_t bound;
+	if (codec == LOG_CODEC_LZ4 && len <= LZ4_MAX_INPUT_SIZE) {
+		bound = LZ4_compressBound(len);
+	} else if (codec == LOG_CODEC_ZSTD) {
+		bound = ZSTD_compressBound(len);
+	} else {
+		return 0;
+	}
+	if (!out || out.use_count() > 1 || out.allocated() < prolog + bound) {
+		out = wrapped_buffer<uint8_t>(prolog + bound);
+	}
+	uint8_t *dst = out.ptr() + prolog;
+
+	size_t clen = 0;
+	if (codec == LOG_CODEC_LZ4) {
+		int r = LZ4_compress_default((const char*) src, (char*) dst, len, bound);
+		clen = r > 0 ? r : 0;
+	} else {
+		size_t r = ZSTD_compress(dst, bound, src, len, zstd_level);
+		clen = ZSTD_isError(r) ? 0 : r;
+	}
+	if (clen == 0 || prolog + clen >= len) {
+		return 0;
+	}
+
+	uint8_t *ptr = out.ptr();
+	uint32_t netlen = hton((uint32_t) (prolog - sizeof(netlen) + clen));
+	uint32_t raw_len = hton((uint32_t) len);
+	memcpy(ptr, &netlen, sizeof(netlen));
+	memcpy(ptr + sizeof(netlen), hdr, hdr_len);
+	ptr[sizeof(netlen) + hdr_len] = codec;
+	memcpy(ptr + sizeof(netlen) + hdr_len + 1, &raw_len, sizeof(raw_len));
+	return prolog + clen;
+}
+
+size_t log_frame_size(const uint8_t *frame, size_t len) {
+	uint32_t raw_len;
+	if (len < 1 + sizeof(raw_len) || (frame[0] != LOG_CODEC_LZ4 && frame[0] != LOG_CODEC_ZSTD)) {
+		return 0;
+	}
+	memcpy(&raw_len, frame + 1, sizeof(raw_len));
+	raw_len = ntoh(raw_len);
+	return raw_len <= frame_max ? raw_len : 0;
+}
+
+bool log_unframe(const uint8_t *frame, size_t len, uint8_t *dst) {
+	size_t raw_len = log_frame_size(frame, len);
+	if (raw_len == 0) {
+		return false;
+	}
+	const uint8_t *src = frame + 1 + sizeof(uint32_t);
+	size_t clen = len - 1 - sizeof(uint32_t);
+	if (frame[0] == LOG_CODEC_LZ4) {
+		return LZ4_decompress_safe((const char*) src, (char*) dst, clen, raw_len) == (int) raw_len;
+	}
+	size_t r = ZSTD_decompress(dst, raw_len, src, clen);
+	return !ZSTD_isError(r) && r == raw_len;
+}
+
+bool log_request_codec(int fd, enum log_codec codec) {
+	uint8_t msg[sizeof(uint32_t) + 2];
+	uint32_t netlen = hton((uint32_t) 2);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_CLIENT_CODEC;
+	msg[sizeof(netlen) + 1] = codec;
+	return write(fd, msg, sizeof(msg)) == (ssize_t) sizeof(msg);
+}
+
+bool log_request_channel(int fd, const string &channel) {
+	if (channel.empty() || channel.size() > LOG_CHANNEL_MAX) {
+		return false;
+	}
+	vector<uint8_t> msg(sizeof(uint32_t) + 1 + channel.size());
+	uint32_t netlen = hton((uint32_t)(msg.size() - sizeof(netlen)));
+	memcpy(msg.data(), &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_CLIENT_CHANNEL;
+	memcpy(msg.data() + sizeof(netlen) + 1, channel.data(), channel.size());
+	return write(fd, msg.data(), msg.size()) == (ssize_t) msg.size();
+}
 
-	if (len + 4 > g_log_store.allocated() - g_log_cursor) {
-		if (g_log_cursor > 0) {
-			append_buf(g_log_store, g_log_cursor);
+bool log_request_replay(int fd, enum log_replay_from from, uint64_t value) {
+	uint8_t msg[sizeof(uint32_t) + 2 + sizeof(value)];
+	uint32_t netlen = hton((uint32_t)(sizeof(msg) - sizeof(netlen)));
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_CLIENT_REPLAY;
+	msg[sizeof(netlen) + 1] = from;
+	value = hton(value);
+	memcpy(msg + sizeof(netlen) + 2, &value, sizeof(value));
+	return write(fd, msg, sizeof(msg)) == (ssize_t) sizeof(msg);
+}
+
+bool log_request_resend(int fd) {
+	uint8_t msg[sizeof(uint32_t) + 1];
+	uint32_t netlen = hton((uint32_t) 1);
+	memcpy(msg, &netlen, sizeof(netlen));
+	msg[sizeof(netlen)] = LOG_CLIENT_RESEND;
+	return write(fd, msg, sizeof(msg)) == (ssize_t) sizeof(msg);
+}
+
+bool log_request_filter(int fd, const struct log_filter &filter) {
+	const size_t command_len = sizeof(((struct bitcoin::packed_message*)0)->command);
+	if (filter.handle_ids.size() > 0xffff || filter.commands.size() > 0xff) {
+		return false;
+	}
+
+	vector<uint8_t> msg(sizeof(uint32_t) + 3 + 2 * sizeof(uint32_t) + sizeof(uint16_t) +
+	                    filter.handle_ids.size() * sizeof(uint32_t) + 1 +
+	                    filter.commands.size() * command_len);
+	uint8_t *ptr = msg.data();
+	uint32_t netlen = hton((uint32_t)(msg.size() - sizeof(netlen)));
+	memcpy(ptr, &netlen, sizeof(netlen));
+	ptr += sizeof(netlen);
+	*ptr++ = LOG_CLIENT_FILTER;
+	*ptr++ = filter.types;
+	*ptr++ = filter.direction;
+	uint32_t source_id = hton(filter.source_id);
+	memcpy(ptr, &source_id, sizeof(source_id));
+	ptr += sizeof(source_id);
+	uint32_t sample = hton(filter.sample_ppm);
+	memcpy(ptr, &sample, sizeof(sample));
+	ptr += sizeof(sample);
+	uint16_t handle_count = hton((uint16_t) filter.handle_ids.size());
+	memcpy(ptr, &handle_count, sizeof(handle_count));
+	ptr += sizeof(handle_count);
+	for(auto it = filter.handle_ids.begin(); it != filter.handle_ids.end(); ++it) {
+		uint32_t id = hton(*it);
+		memcpy(ptr, &id, sizeof(id));
+		ptr += sizeof(id);
+	}
+	*ptr++ = filter.commands.size();
+	for(auto it = filter.commands.begin(); it != filter.commands.end(); ++it) {
+		if (it->size() > command_len) {
+			return false;
 		}
-		g_log_cursor = 0;
-		g_log_store = wrapped_buffer<uint8_t>(max((size_t)store_size, len+4));
+		memcpy(ptr, it->data(), it->size()); /* the rest is already zero */
+		ptr += command_len;
 	}
 
-	uint8_t *base_ptr = g_log_store.ptr() + g_log_cursor;
-	uint8_t *cur_ptr = base_ptr;
+	size_t done = 0;
+	while(done < msg.size()) {
+		ssize_t wr = write(fd, msg.data() + done, msg.size() - done);
+		if (wr < 0 && errno == EINTR) {
+			continue;
+		} else if (wr <= 0) {
+			return false;
+		}
+		done += wr;
+	}
+	return true;
+}
 
-	uint32_t netlen = hton((uint32_t)len);
-	copy((uint8_t*) &netlen, ((uint8_t*)&netlen) + 4, cur_ptr);
-	cur_ptr += 4;
+uint64_t payload_hash(const struct bitcoin::packed_message *m) {
+	/* a broadcast logs the same buffer for every peer. The header
+	   has the checksum in it, so it has to match too in case the
+	   memory got reused */
+	static const struct bitcoin::packed_message *last(NULL);
+	static struct bitcoin::packed_message last_header;
+	static uint64_t last_hash(0);
+	if (m == last && memcmp(m, &last_header, sizeof(*m)) == 0) {
+		return last_hash;
+	}
 
-	uint8_t typ = BITCOIN_MSG;
-	copy((uint8_t*) &typ, ((uint8_t*) &typ) + 1, cur_ptr);
-	cur_ptr += 1;
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const uint8_t *ptr = (const uint8_t*) m;
+	const uint8_t *end = ptr + sizeof(*m) + m->length;
+	for(; ptr != end; ++ptr) {
+		hash = (hash ^ *ptr) * 0x100000001b3ULL;
+	}
 
-	copy((uint8_t*) &net_time, ((uint8_t*)&net_time) + sizeof(net_time),
-	     cur_ptr);
-	cur_ptr += sizeof(net_time);
+	last = m;
+	memcpy(&last_header, m, sizeof(*m));
+	last_hash = hash;
+	return hash;
+}
 
-	copy((uint8_t*) &net_id, ((uint8_t*)&net_id) + sizeof(net_id), 
-	     cur_ptr);
-	cur_ptr += sizeof(net_id);
+template <> void g_log<BITCOIN_MSG>(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m) {
+	g_log<BITCOIN_MSG>(id, is_sender, m, 0);
+}
 
-	assert(sizeof(is_sender) == 1);
-	copy((uint8_t*) &is_sender, ((uint8_t*)&is_sender) + sizeof(is_sender), 
-	     cur_ptr);
-	cur_ptr += sizeof(is_sender);
+template <> void g_log<BITCOIN_MSG>(uint32_t id, bool is_sender, const struct bitcoin::packed_message *m, uint64_t timestamp) {
+	if (!g_log_wanted(BITCOIN_MSG)) {
+		return;
+	}
 
-	copy((uint8_t*) m, ((uint8_t*)m) + sizeof(*m) + m->length, 
-	     cur_ptr);
-	cur_ptr += sizeof(*m) + m->length;
+	uint32_t net_id = hton(id);
+	size_t msg_len = sizeof(*m) + m->length;
+	const size_t prolog = 2 + sizeof(uint64_t); /* type, version, timestamp */
 
-	g_log_cursor += cur_ptr - base_ptr;
+	if (is_sender && g_log_dedup_payloads && g_log_buffer) {
+		uint64_t net_hash = hton(payload_hash(m));
+		if (g_log_payloads.find(net_hash) == g_log_payloads.end()) {
+			if (g_log_payloads.size() >= payloads_max) {
+				g_log_payloads.clear();
+			}
+			g_log_payloads.insert(net_hash);
+			uint8_t *ptr = g_log_binary_begin(PAYLOAD, prolog + sizeof(net_hash) + msg_len, timestamp);
+			memcpy(ptr, &net_hash, sizeof(net_hash));
+			memcpy(ptr + sizeof(net_hash), m, msg_len);
+		}
+
+		uint8_t *ptr = g_log_binary_begin(BITCOIN_MSG, prolog + sizeof(net_id) + 1 + sizeof(net_hash), timestamp);
+		memcpy(ptr, &net_id, sizeof(net_id));
+		ptr[sizeof(net_id)] = 1 | BITCOIN_MSG_PAYLOAD_REF;
+		memcpy(ptr + sizeof(net_id) + 1, &net_hash, sizeof(net_hash));
+		return;
+	}
 
+	uint8_t *ptr = g_log_binary_begin(BITCOIN_MSG, prolog + sizeof(net_id) + 1 + msg_len, timestamp);
+	memcpy(ptr, &net_id, sizeof(net_id));
+	ptr[sizeof(net_id)] = is_sender ? 1 : 0;
+	memcpy(ptr + sizeof(net_id) + 1, m, msg_len);
+}
+
+void payload_cache::remember(const struct log_format *log, size_t len) {
+	if (log->type != PAYLOAD || len < sizeof(struct payload_log_format)) {
+		return;
+	}
+	const struct payload_log_format *p = (const struct payload_log_format*) log;
+	const uint8_t *msg = (const uint8_t*) &p->msg;
+	key k(ntoh(log->source_id), ntoh(p->hash));
+	auto res = payloads.insert(make_pair(k, vector<uint8_t>()));
+	if (res.second) {
+		order.push_back(k);
+	}
+	vector<uint8_t> &payload = res.first->second;
+	size -= payload.size();
+	payload.assign(msg, ((const uint8_t*) log) + len);
+	size += payload.size();
+	while(size > max_size && order.size() > 1) {
+		auto oldest = payloads.find(order.front());
+		size -= oldest->second.size();
+		payloads.erase(oldest);
+		order.pop_front();
+	}
+}
+
+const struct bitcoin::packed_message * payload_cache::resolve(const struct log_format *log, size_t len) const {
+	const struct bitcoin_msg_log_format *msg = (const struct bitcoin_msg_log_format*) log;
+	if (log->type != BITCOIN_MSG || len < sizeof(struct bitcoin_msg_ref_log_format)) {
+		return NULL;
+	}
+	if (!(msg->is_sender & BITCOIN_MSG_PAYLOAD_REF)) {
+		return len < sizeof(*msg) ? NULL : &msg->msg;
+	}
+	const struct bitcoin_msg_ref_log_format *ref = (const struct bitcoin_msg_ref_log_format*) log;
+	auto it = payloads.find(make_pair(ntoh(log->source_id), ntoh(ref->hash)));
+	if (it == payloads.end()) {
+		return NULL;
+	}
+	return (const struct bitcoin::packed_message*) it->second.data();
 }
 
 
@@ -221,8 +1283,131 @@ ostream & operator<<(ostream &o, const struct sockaddr &addr) {
 	return o;
 }
 
+struct event_desc {
+	enum log_event event;
+	const char *name;
+	const char *fields[5];
+};
+
+static const struct event_desc g_events[] = {
+	{ EVENT_REGISTER, "REGISTER", { "old_regid", "new_regid" } },
+	{ EVENT_MESSAGE_REGISTERED, "MESSAGE_REGISTERED", { "regid", "message_id", "command", "length", "slot_cnt" } },
+	{ EVENT_CXN_REQUESTED, "CXN_REQUESTED", { "regid", "connections" } },
+	{ EVENT_CONNECT_ATTEMPT, "CONNECT_ATTEMPT", { "regid", "remote" } },
+	{ EVENT_CTRL_DISCONNECT, "CTRL_DISCONNECT", { "handler_id" } },
+	{ EVENT_SCHEDULE, "SCHEDULE", { "message_id", "targets", "start", "window" } },
+	{ EVENT_SCHEDULED_SEND, "SCHEDULED_SEND", { "message_id", "handle_id", "scheduled", "actual" } },
+	{ EVENT_SCHEDULE_COMPLETE, "SCHEDULE_COMPLETE", { "message_id", "targets", "max_skew" } },
+	{ EVENT_GROUP_DEFINED, "GROUP_DEFINED", { "regid", "group_id", "members" } },
+	{ EVENT_GROUP_DELETED, "GROUP_DELETED", { "regid", "group_id", "deleted" } },
+	{ EVENT_RING_SETUP, "RING_SETUP", { "regid", "size" } },
+	{ EVENT_STARTUP, "STARTUP", { "commit" } },
+	{ EVENT_SHUTDOWN, "SHUTDOWN", { } },
+	{ EVENT_BLACKLIST_LOADED, "BLACKLIST_LOADED", { "entries" } },
+	{ EVENT_LOG_BATCHING, "LOG_BATCHING", { "batches", "bytes", "mean_latency_us", "max_latency_us", "batch_size" } },
+	{ EVENT_LOG_SPOOL_DRAINED, "LOG_SPOOL_DRAINED", { "bytes", "dropped" } },
+	{ EVENT_LOG_METRICS, "LOG_METRICS", { "snapshot" } },
+	{ EVENT_SYSCALL_ERROR, "SYSCALL_ERROR", { "errno", "context" } },
+	{ EVENT_INVALID_CTRL_MESSAGE, "INVALID_CTRL_MESSAGE", { "regid", "message_type" } },
+	{ EVENT_INVALID_MESSAGE_ID, "INVALID_MESSAGE_ID", { "regid", "message_id" } },
+	{ EVENT_BLACKLISTED_CONNECT, "BLACKLISTED_CONNECT", { "remote" } },
+};
+
+static const struct event_desc * find_event(uint16_t event) {
+	for(size_t i = 0; i < sizeof(g_events) / sizeof(g_events[0]); ++i) {
+		if (g_events[i].event == event) {
+			return &g_events[i];
+		}
+	}
+	return nullptr;
+}
+
+string event_to_str(enum log_event event) {
+	const struct event_desc *desc = find_event(event);
+	return desc ? desc->name : "UNKNOWN_EVENT";
+}
+
+bool print_event(ostream &o, const uint8_t *rest, size_t len) {
+	const uint8_t *end = rest + len;
+	uint16_t event;
+	if (len < 1 + sizeof(event) + 1 || rest[0] != 0) {
+		return false;
+	}
+	memcpy(&event, rest + 1, sizeof(event));
+	event = ntoh(event);
+	uint8_t field_cnt = rest[1 + sizeof(event)];
+	rest += 1 + sizeof(event) + 1;
+
+	const struct event_desc *desc = find_event(event);
+	if (desc) {
+		o << desc->name;
+	} else {
+		o << "EVENT(" << event << ")";
+	}
+
+	for(uint8_t i = 0; i < field_cnt; ++i) {
+		if (rest >= end) {
+			return false;
+		}
+		uint8_t tag = *rest++;
+		o << ' ';
+		if (desc && i < sizeof(desc->fields) / sizeof(desc->fields[0]) && desc->fields[i]) {
+			o << desc->fields[i] << '=';
+		}
+		if (tag == FIELD_U32 || tag == FIELD_I32) {
+			uint32_t val;
+			if (end - rest < (ssize_t) sizeof(val)) {
+				return false;
+			}
+			memcpy(&val, rest, sizeof(val));
+			rest += sizeof(val);
+			if (tag == FIELD_U32) {
+				o << ntoh(val);
+			} else {
+				o << (int32_t) ntoh(val);
+			}
+		} else if (tag == FIELD_U64) {
+			uint64_t val;
+			if (end - rest < (ssize_t) sizeof(val)) {
+				return false;
+			}
+			memcpy(&val, rest, sizeof(val));
+			rest += sizeof(val);
+			o << ntoh(val);
+		} else if (tag == FIELD_ADDR) {
+			struct sockaddr_in addr;
+			if (end - rest < (ssize_t) sizeof(addr)) {
+				return false;
+			}
+			memcpy(&addr, rest, sizeof(addr));
+			rest += sizeof(addr);
+			o << addr;
+		} else if (tag == FIELD_STR) {
+			uint32_t str_len;
+			if (end - rest < (ssize_t) sizeof(str_len)) {
+				return false;
+			}
+			memcpy(&str_len, rest, sizeof(str_len));
+			rest += sizeof(str_len);
+			str_len = ntoh(str_len);
+			if ((size_t) (end - rest) < str_len) {
+				return false;
+			}
+			o.write((const char *) rest, str_len);
+			rest += str_len;
+		} else {
+			o << "?";
+			return false;
+		}
+	}
+	return true;
+}
+
 string type_to_str(enum log_type type) {
 	switch(type) {
+	case PAYLOAD:
+		return "PAYLOAD";
+		break;
 	case DEBUG:
 		return "DEBUG";
 		break;
@@ -37,7 +37,7 @@ mmap_buffer<T>::mmap_buffer(size_type initial_elements)
 {
 	if (initial_elements > 0) {
 		allocated_ = (round_to_page(initial_elements * sizeof(POD_T)));
-		refcount_ = new size_type(1);
+		refcount_ = new std::atomic<size_type>(1);
 		buffer_ = (POD_T*)mmap(NULL, allocated_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 		if (buffer_ == MAP_FAILED) {
 			delete refcount_;
@@ -91,8 +91,7 @@ mmap_buffer<T> & mmap_buffer<T>::operator=(mmap_buffer other) {
 template <typename T> 
 mmap_buffer<T>::~mmap_buffer() {
 	if (refcount_) { /* may have been moved */
-		--*refcount_;
-		if (*refcount_ == 0) {
+		if (--*refcount_ == 0) {
 			delete refcount_;
 			munmap(buffer_, allocated_);
 		}
@@ -118,7 +117,7 @@ void mmap_buffer<T>::realloc(size_type new_elt_cnt) {
 			if (buffer_ == MAP_FAILED) {
 				throw runtime_error(string("mmap failure in realloc: ") + strerror(errno));
 			}
-			refcount_ = new size_type(1);
+			refcount_ = new std::atomic<size_type>(1);
 		} else {
 			POD_T *newbuf = (POD_T*) mremap(buffer_, allocated_, size, MREMAP_MAYMOVE);
 			if (newbuf == MAP_FAILED) {
@@ -155,9 +154,13 @@ typename mmap_buffer<T>::pointer mmap_buffer<T>::ptr() {
 			throw std::runtime_error(std::string("mmap failure: ") + strerror(errno));
 		}
 		memcpy(newbuf, buffer_, allocated_);
+		POD_T *old = buffer_;
 		buffer_ = newbuf;
-		--(*refcount_);
-		refcount_ = new size_type(1);
+		if (--(*refcount_) == 0) { /* the others went away meanwhile */
+			delete refcount_;
+			munmap(old, allocated_);
+		}
+		refcount_ = new std::atomic<size_type>(1);
 	} 
 	return (pointer) buffer_;
 }
@@ -4,6 +4,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "network.hpp"
 #include "netwrap.hpp"
@@ -36,3 +39,86 @@ int unix_sock_client(const std::string &path, bool nonblocking) {
 	Connect(sock, (struct sockaddr *)&addr, strlen(addr.sun_path) + sizeof(addr.sun_family));
 	return sock;
 }
+
+bool g_tcp_nodelay(true);
+int g_tcp_buffer(0);
+
+static struct addrinfo * tcp_lookup(const std::string &addr, bool passive) {
+	size_t colon = addr.rfind(':');
+	if (colon == std::string::npos) {
+		throw network_error("no port in " + addr, EINVAL);
+	}
+	std::string host(addr, 0, colon), port(addr, colon + 1);
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+		host = host.substr(1, host.size() - 2);
+	}
+	struct addrinfo hints;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	struct addrinfo *res = NULL;
+	int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res);
+	if (err != 0) {
+		throw network_error("could not resolve " + addr + ": " + gai_strerror(err), EINVAL);
+	}
+	return res;
+}
+
+int tcp_sock_server(const std::string &addr, int listen, bool nonblocking) {
+	struct addrinfo *res = tcp_lookup(addr, true);
+	int sock = -1;
+	try {
+		sock = Socket(res->ai_family, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (nonblocking) {
+			fcntl(sock, F_SETFL, O_NONBLOCK);
+		}
+		Bind(sock, res->ai_addr, res->ai_addrlen);
+		Listen(sock, listen);
+	} catch (const network_error &) {
+		if (sock >= 0) {
+			close(sock);
+		}
+		freeaddrinfo(res);
+		throw;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+int tcp_sock_client(const std::string &addr, bool nonblocking) {
+	struct addrinfo *res = tcp_lookup(addr, false);
+	int sock = -1, err = 0;
+	for(struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			err = errno;
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(res);
+	do_error(sock < 0, "connect failure to " + addr, err ? err : ECONNREFUSED);
+	tcp_tune(sock);
+	if (nonblocking) {
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+	}
+	return sock;
+}
+
+void tcp_tune(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0 ||
+	    (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+		return;
+	}
+	int nodelay = g_tcp_nodelay;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (g_tcp_buffer > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &g_tcp_buffer, sizeof(g_tcp_buffer));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_tcp_buffer, sizeof(g_tcp_buffer));
+	}
+}
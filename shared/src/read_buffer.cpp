@@ -1,9 +1,11 @@
 #include "read_buffer.hpp"
 
 #include <cstring>
+#include <ctime>
 #include <stdexcept>
 
 #include <sys/socket.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -19,7 +21,7 @@ pair<int,bool> read_buffer::do_read(int fd, size_t size) {
 	if (rb_size_ <= rb_loc_) { /* have to do a recv */
 		/* location at size, so can reset */
 		rb_size_ = rb_loc_ = 0;
-		recv_ret = recv(fd, recv_buffer_.get(), 4096, 0);
+		recv_ret = want_fds_ || want_timestamps_ ? recv_ancillary(fd) : recv(fd, recv_buffer_.get(), 4096, 0);
 		if (recv_ret > 0) {
 			rb_size_ += recv_ret;
 		}
@@ -30,6 +32,9 @@ pair<int,bool> read_buffer::do_read(int fd, size_t size) {
 		rv.first = recv_ret;
 	} else {
 		size_t rd = min(size, rb_size_ - rb_loc_);
+		if (cursor_ == 0) {
+			timestamp_ = rb_timestamp_;
+		}
 		memcpy(buffer_.ptr() + cursor_, recv_buffer_.get() + rb_loc_, rd);
 		rb_loc_ += rd;
 		rv.first = rd;
@@ -43,6 +48,54 @@ pair<int,bool> read_buffer::do_read(int fd, size_t size) {
 	return rv;
 }
 
+ssize_t read_buffer::recv_ancillary(int fd) {
+	struct iovec iov;
+	iov.iov_base = recv_buffer_.get();
+	iov.iov_len = 4096;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(4 * sizeof(int)) + CMSG_SPACE(sizeof(struct timespec))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	rb_timestamp_ = 0;
+	ssize_t rv = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (rv >= 0) {
+		for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+				size_t cnt = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for(size_t i = 0; i < cnt; ++i) {
+					int passed;
+					memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(passed));
+					fds_.push_back(passed);
+				}
+			} else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				rb_timestamp_ = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			}
+		}
+	}
+	return rv;
+}
+
+vector<int> read_buffer::take_fds() {
+	vector<int> rv;
+	rv.swap(fds_);
+	return rv;
+}
+
+read_buffer::~read_buffer() {
+	for(auto it = fds_.begin(); it != fds_.end(); ++it) {
+		close(*it);
+	}
+}
+
 pair<int,bool> read_buffer::do_read(int fd) {
 	return do_read(fd, to_read_);
 }
@@ -0,0 +1,237 @@
+#include "shm_ring.hpp"
+
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "netwrap.hpp"
+
+using namespace std;
+
+shm_ring::shm_ring(size_t size) 
+	: memfd_(-1), doorbell_(-1), mapped_(0), hdr_(nullptr), size_(0), mask_(0)
+{
+	size_t data_size = 4096;
+	while (data_size < size) {
+		data_size <<= 1;
+	}
+
+	memfd_ = memfd_create("shm_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	do_error(memfd_ < 0, "memfd_create failure", errno);
+	if (ftruncate(memfd_, sizeof(struct shm_ring_header) + data_size) != 0) {
+		int err = errno;
+		close(memfd_);
+		do_error(true, "ftruncate failure", err);
+	}
+	if (fcntl(memfd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+		int err = errno;
+		close(memfd_);
+		do_error(true, "memfd seal failure", err);
+	}
+	doorbell_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (doorbell_ < 0) {
+		int err = errno;
+		close(memfd_);
+		do_error(true, "eventfd failure", err);
+	}
+
+	map(SIZE_MAX);
+	hdr_->head = 0;
+	hdr_->tail = 0;
+	hdr_->sleeping = 0;
+	hdr_->size = data_size;
+	size_ = data_size;
+	mask_ = data_size - 1;
+}
+
+shm_ring::shm_ring(int memfd, int doorbell, size_t max_size) 
+	: memfd_(memfd), doorbell_(doorbell), mapped_(0), hdr_(nullptr), size_(0), mask_(0)
+{
+	map(max_size);
+	uint64_t size = hdr_->size; /* read it once, the other side can change it */
+	if (size == 0 || (size & (size - 1)) || 
+	    size + sizeof(struct shm_ring_header) > mapped_) {
+		munmap(hdr_, mapped_);
+		close(memfd_);
+		close(doorbell_);
+		do_error(true, "shm_ring bad size", EINVAL);
+	}
+	size_ = size;
+	mask_ = size - 1;
+}
+
+void shm_ring::map(size_t max_size) {
+	struct stat st;
+	int rv = fstat(memfd_, &st);
+	if (rv != 0 || (size_t) st.st_size < sizeof(struct shm_ring_header)) {
+		int err = rv != 0 ? errno : EINVAL;
+		close(memfd_);
+		close(doorbell_);
+		do_error(true, "shm_ring fstat failure", err);
+	}
+	if ((size_t) st.st_size - sizeof(struct shm_ring_header) > max_size) {
+		close(memfd_);
+		close(doorbell_);
+		do_error(true, "shm_ring too large", EFBIG);
+	}
+	int seals = fcntl(memfd_, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+		int err = seals < 0 ? errno : EPERM;
+		close(memfd_);
+		close(doorbell_);
+		do_error(true, "shm_ring not sealed", err);
+	}
+	mapped_ = st.st_size;
+	void *p = mmap(NULL, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		close(memfd_);
+		close(doorbell_);
+		do_error(true, "mmap failure", err);
+	}
+	hdr_ = (struct shm_ring_header *) p;
+}
+
+shm_ring::~shm_ring() {
+	munmap(hdr_, mapped_);
+	close(memfd_);
+	close(doorbell_);
+}
+
+size_t shm_ring::writable() const {
+	uint64_t used = hdr_->head.load(memory_order_relaxed) - hdr_->tail.load(memory_order_acquire);
+	return used > size_ ? 0 : size_ - used;
+}
+
+bool shm_ring::write(const uint8_t *data, size_t len) {
+	if (len > writable()) {
+		return false;
+	}
+	uint64_t head = hdr_->head.load(memory_order_relaxed);
+	size_t pos = head & mask_;
+	size_t first = min(len, size_ - pos);
+	memcpy(hdr_->data + pos, data, first);
+	memcpy(hdr_->data, data + first, len - first);
+	hdr_->head.store(head + len, memory_order_seq_cst);
+
+	/* seq_cst on both sides orders this against the consumer's sleep() */
+	if (hdr_->sleeping.exchange(0, memory_order_seq_cst)) {
+		uint64_t one = 1;
+		if (::write(doorbell_, &one, sizeof(one)) < 0) {
+			/* only fails with the counter saturated, so the consumer is getting woken anyway */
+		}
+	}
+	return true;
+}
+
+size_t shm_ring::readable() const {
+	uint64_t used = hdr_->head.load(memory_order_acquire) - hdr_->tail.load(memory_order_relaxed);
+	return used > size_ ? 0 : used;
+}
+
+bool shm_ring::corrupt() const {
+	return hdr_->head.load(memory_order_acquire) - hdr_->tail.load(memory_order_relaxed) > size_;
+}
+
+void shm_ring::peek(uint8_t *dest, size_t len) const {
+	uint64_t tail = hdr_->tail.load(memory_order_relaxed);
+	size_t pos = tail & mask_;
+	len = min(len, size_);
+	size_t first = min(len, size_ - pos);
+	memcpy(dest, hdr_->data + pos, first);
+	memcpy(dest + first, hdr_->data, len - first);
+}
+
+void shm_ring::consume(size_t len) {
+	hdr_->tail.fetch_add(len, memory_order_release);
+}
+
+bool shm_ring::sleep(size_t pending) {
+	hdr_->sleeping.store(1, memory_order_seq_cst);
+	if (hdr_->head.load(memory_order_seq_cst) - hdr_->tail.load(memory_order_relaxed) != pending) {
+		hdr_->sleeping.store(0, memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+void shm_ring::clear_doorbell() {
+	uint64_t cnt;
+	while(read(doorbell_, &cnt, sizeof(cnt)) > 0) {
+	}
+}
+
+ssize_t send_with_fds(int sock, const uint8_t *data, size_t len, const int *fds, size_t fd_cnt) {
+	struct iovec iov;
+	iov.iov_base = (void *) data;
+	iov.iov_len = len;
+
+	char control[CMSG_SPACE(sizeof(int) * 8)];
+	if (fd_cnt > 8) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd_cnt) {
+		bzero(control, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_cnt);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_cnt);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_cnt);
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t recv_with_fds(int sock, uint8_t *data, size_t len, int *fds, size_t fd_cnt) {
+	struct iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	char control[CMSG_SPACE(sizeof(int) * 8)];
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	for(size_t i = 0; i < fd_cnt; ++i) {
+		fds[i] = -1;
+	}
+
+	ssize_t rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	if (rv < 0) {
+		return rv;
+	}
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(size_t i = 0; i < cnt; ++i) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (i < fd_cnt) {
+					fds[i] = fd;
+				} else {
+					close(fd);
+				}
+			}
+		}
+	}
+	return rv;
+}
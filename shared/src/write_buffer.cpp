@@ -3,6 +3,7 @@
 #include <utility>
 
 #include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std;
 
@@ -16,19 +17,31 @@ pair<int,bool> write_buffer::do_write(int fd, size_t size) {
 	assert(size);
 	assert(buffers_.size());
 
-	/* try to write out the remainder of the page(s) */
-	struct buffer_container &curbuf = buffers_.front();
-
-	size_t min_write = min(to_write_, curbuf.writable - curbuf.cursor);
-	rv.first = write(fd, curbuf.buffer.const_ptr() + curbuf.cursor, min_write);
-
-	if (rv.first > 0) {
-		curbuf.cursor += rv.first;
-		to_write_ -= rv.first;
+	/* gather as many of the queued buffers as one writev takes */
+	struct iovec iov[max_iov];
+	int iovcnt = 0;
+	size_t gathered = 0;
+	for(auto it = buffers_.begin(); it != buffers_.end() && iovcnt < max_iov && gathered < size; ++it) {
+		size_t len = min(it->writable - it->cursor, size - gathered);
+		iov[iovcnt].iov_base = (void*) (it->buffer.const_ptr() + it->cursor);
+		iov[iovcnt].iov_len = len;
+		gathered += len;
+		++iovcnt;
 	}
+	rv.first = writev(fd, iov, iovcnt);
 
-	if (curbuf.cursor == curbuf.writable) {
-		buffers_.pop_front();
+	if (rv.first > 0) {
+		size_t written = rv.first;
+		to_write_ -= written;
+		while(written) {
+			struct buffer_container &curbuf = buffers_.front();
+			size_t len = min(written, curbuf.writable - curbuf.cursor);
+			curbuf.cursor += len;
+			written -= len;
+			if (curbuf.cursor == curbuf.writable) {
+				buffers_.pop_front();
+			}
+		}
 	}
 
 	assert(to_write_ == 0 || buffers_.size());
@@ -45,6 +58,11 @@ void write_buffer::append(wrapped_buffer<uint8_t> &buf, size_t len) {
 	buffers_.emplace_back(buf, len);
 	to_write_ += len;
 }
+void write_buffer::append(wrapped_buffer<uint8_t> &buf, size_t offset, size_t len) {
+	assert(buf.allocated() >= offset + len);
+	buffers_.emplace_back(buf, offset, len);
+	to_write_ += len;
+}
 
 size_t write_buffer::to_write() const { 
 	assert(to_write_ == 0 || buffers_.size());
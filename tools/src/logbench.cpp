@@ -0,0 +1,328 @@
+/* standard C libraries */
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+/* standard C++ libraries */
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <random>
+
+/* standard unix libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* external libraries */
+#include <boost/program_options.hpp>
+
+#include "network.hpp"
+#include "bitcoin.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+/* Measures the cost of a text g_log call, against the stringstream
+   encoder it replaced, and checks both put the same bytes on the
+   wire. Then shows what batching of BITCOIN_MSG records does for
+   throughput and latency, both flat out and at a trickle. The log
+   socket is drained by a thread so only the producer side is
+   timed. Last, what each frame codec costs and saves on a stream of
+   records like the connector's. */
+
+/* the encoder g_log used to have */
+template <typename T>
+void legacy_inner(wrapped_buffer<uint8_t> &wbuf, size_t &len, const T &s) {
+	stringstream oss;
+	oss << s;
+	const string str(oss.str());
+	if (wbuf.allocated() < len + str.size()+1) {
+		wbuf.realloc(len + str.size()+1);
+	}
+	copy((uint8_t*)str.c_str(), (uint8_t*)str.c_str() + str.size() + 1, wbuf.ptr() + len);
+	len += str.size() + 1;
+}
+
+template <typename T, typename... Targs>
+void legacy_inner(wrapped_buffer<uint8_t> &wbuf, size_t &len, const T &val, Targs... Fargs) {
+	stringstream oss;
+	oss << val << ' ';
+	const string str(oss.str());
+	if (wbuf.allocated() < len + str.size()) {
+		wbuf.realloc(len + str.size());
+	}
+	copy((uint8_t*)str.c_str(), (uint8_t*)str.c_str() + str.size(), wbuf.ptr() + len);
+	len += str.size();
+	legacy_inner(wbuf, len, Fargs...);
+}
+
+template <int N, typename... Targs>
+void legacy_log(const string &val, Targs... Fargs) {
+	uint64_t net_time = hton((uint64_t)ev::now(ev_default_loop()));
+	wrapped_buffer<uint8_t> wbuf(128);
+	uint8_t *ptr = wbuf.ptr();
+	uint8_t n = N;
+	ptr[4] = n;
+	memcpy(ptr + 5, &net_time, sizeof(net_time));
+	size_t len = sizeof(net_time) + sizeof(n) + sizeof(uint32_t);
+	legacy_inner(wbuf, len, val, Fargs...);
+	uint32_t netlen = hton((uint32_t)(len-4));
+	memcpy(wbuf.ptr(), &netlen, sizeof(netlen));
+	g_log_buffer->append(wbuf, len);
+}
+
+static vector<uint8_t> read_record(int fd) {
+	uint32_t netlen;
+	if (recv(fd, &netlen, sizeof(netlen), MSG_WAITALL) != sizeof(netlen)) {
+		throw runtime_error(strerror(errno));
+	}
+	vector<uint8_t> rv(ntoh(netlen));
+	if (recv(fd, rv.data(), rv.size(), MSG_WAITALL) != (ssize_t) rv.size()) {
+		throw runtime_error(strerror(errno));
+	}
+	return rv;
+}
+
+static void print_batching(const char *what, size_t count, double secs) {
+	const struct log_batch_stats &st(g_log_batch_stats());
+	cout << what << count / secs << " records/s, " << st.batches << " batches of "
+	     << (st.batches ? st.bytes / st.batches : 0) << " bytes, latency mean "
+	     << (st.batches ? st.latency_total / st.batches * 1e3 : 0) << "ms max " << st.latency_max * 1e3
+	     << "ms, batch size now " << st.batch_size << endl;
+	g_log_reset_batch_stats();
+}
+
+/* until the batch timer has had its say */
+static void drain_store() {
+	while(g_log_cursor) {
+		ev_run(ev_default_loop(), EVRUN_ONCE);
+	}
+}
+
+static void drain() {
+	do {
+		ev_run(ev_default_loop(), EVRUN_NOWAIT);
+	} while(g_log_buffer->write_queue.to_write());
+}
+
+/* BITCOIN_MSG records as the connector writes them without payload
+   dedup: mostly invs and addrs from a few hundred peers, with a ping
+   now and then. Hashes are random, so incompressible, as they are on
+   the wire */
+static vector<uint8_t> sample_records(size_t bytes) {
+	mt19937_64 rng(8333);
+	vector<uint8_t> rv;
+	uint64_t timestamp = 1792386193000000000ULL;
+	while(rv.size() < bytes) {
+		uint32_t kind = rng() % 10;
+		vector<uint8_t> payload;
+		const char *command;
+		if (kind < 6) {
+			command = "inv";
+			size_t count = 1 + rng() % 8;
+			payload.push_back(count);
+			for(size_t i = 0; i < count; ++i) {
+				uint32_t type = hton((uint32_t) 1);
+				payload.insert(payload.end(), (uint8_t*) &type, (uint8_t*) &type + sizeof(type));
+				for(int j = 0; j < 4; ++j) {
+					uint64_t r = rng();
+					payload.insert(payload.end(), (uint8_t*) &r, (uint8_t*) &r + sizeof(r));
+				}
+			}
+		} else if (kind < 9) {
+			command = "addr";
+			size_t count = 1 + rng() % 10;
+			payload.push_back(count);
+			for(size_t i = 0; i < count; ++i) {
+				uint8_t addr[30];
+				bzero(addr, sizeof(addr));
+				uint32_t when = (uint32_t) (timestamp / 1000000000ULL) - rng() % 10800;
+				memcpy(addr, &when, sizeof(when));
+				addr[4] = 1; /* NODE_NETWORK */
+				addr[22] = addr[23] = 0xff;
+				uint32_t ip = rng();
+				memcpy(addr + 24, &ip, sizeof(ip));
+				addr[28] = 0x20;
+				addr[29] = 0x8d;
+				payload.insert(payload.end(), addr, addr + sizeof(addr));
+			}
+		} else {
+			command = "ping";
+			uint64_t nonce = rng();
+			payload.insert(payload.end(), (uint8_t*) &nonce, (uint8_t*) &nonce + sizeof(nonce));
+		}
+
+		timestamp += rng() % 200000;
+		struct bitcoin::packed_message hdr;
+		bzero(&hdr, sizeof(hdr));
+		hdr.magic = 0xd9b4bef9;
+		strcpy(hdr.command, command);
+		hdr.length = payload.size();
+		hdr.checksum = rng();
+
+		uint32_t netlen = hton((uint32_t) (2 + sizeof(timestamp) + sizeof(uint32_t) + 1 + sizeof(hdr) + payload.size()));
+		uint64_t net_time = hton(timestamp);
+		uint32_t net_id = hton((uint32_t) (rng() % 400));
+		uint8_t prolog[2] = { BITCOIN_MSG, LOG_FORMAT_VERSION };
+		rv.insert(rv.end(), (uint8_t*) &netlen, (uint8_t*) &netlen + sizeof(netlen));
+		rv.insert(rv.end(), prolog, prolog + sizeof(prolog));
+		rv.insert(rv.end(), (uint8_t*) &net_time, (uint8_t*) &net_time + sizeof(net_time));
+		rv.insert(rv.end(), (uint8_t*) &net_id, (uint8_t*) &net_id + sizeof(net_id));
+		rv.push_back(kind % 2);
+		rv.insert(rv.end(), (uint8_t*) &hdr, (uint8_t*) &hdr + sizeof(hdr));
+		rv.insert(rv.end(), payload.begin(), payload.end());
+	}
+	return rv;
+}
+
+/* frames records in batches of the given size, as the producer and
+   the logserver do, and unframes them again */
+static void bench_codec(const char *what, enum log_codec codec, const vector<uint8_t> &records, size_t batch) {
+	wrapped_buffer<uint8_t> frame;
+	vector<uint8_t> raw(batch);
+	size_t in(0), out(0);
+	double csecs(0), dsecs(0);
+	for(size_t off = 0; off + batch <= records.size(); off += batch) {
+		auto start = chrono::steady_clock::now();
+		size_t len = log_frame(codec, records.data() + off, batch, LOG_PRODUCER_FRAME_HEADER,
+		                       sizeof(LOG_PRODUCER_FRAME_HEADER), frame);
+		auto mid = chrono::steady_clock::now();
+		csecs += chrono::duration<double>(mid - start).count();
+		in += batch;
+		if (len == 0) {
+			out += batch;
+			continue;
+		}
+		out += len;
+		const uint8_t *codec_byte = frame.const_ptr() + sizeof(uint32_t) + sizeof(LOG_PRODUCER_FRAME_HEADER);
+		bool ok = log_unframe(codec_byte, len - (codec_byte - frame.const_ptr()), raw.data());
+		dsecs += chrono::duration<double>(chrono::steady_clock::now() - mid).count();
+		if (!ok || !equal(raw.begin(), raw.end(), records.begin() + off)) {
+			cerr << what << " did not round trip" << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	cout << what << batch / 1024 << "KiB batches: " << (double) out / in * 100 << "% of the bytes, compress "
+	     << in / csecs / 1e6 << " MB/s, decompress " << in / dsecs / 1e6 << " MB/s" << endl;
+}
+
+int main(int argc, char *argv[]) {
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "Produce help message")
+		("count", po::value<size_t>()->default_value(1000000), "log calls per encoder")
+		("trickle", po::value<size_t>()->default_value(50), "BITCOIN_MSG records logged 10ms apart");
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+	if (vm.count("help")) {
+		cout << desc << endl;
+		return EXIT_SUCCESS;
+	}
+	size_t count = vm["count"].as<size_t>();
+	size_t trickle = vm["trickle"].as<size_t>();
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		cerr << "socketpair: " << strerror(errno) << endl;
+		return EXIT_FAILURE;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	g_log_buffer = new log_buffer(fds[0]);
+
+	struct sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = hton((uint16_t) 8333);
+	inet_pton(AF_INET, "192.0.2.17", &addr.sin_addr);
+	struct bitcoin::packed_message ping;
+	bzero(&ping, sizeof(ping));
+	ping.magic = 0xd9b4bef9;
+	strcpy(ping.command, "ping");
+	ping.length = 8;
+	ping.checksum = 0x62caf07e;
+	const struct bitcoin::packed_message *msg = &ping;
+
+	/* same arguments through both. The timestamps differ, and the old
+	   encoder wrote version 1 records, without the version byte */
+	g_log<CTRL>("Registering message", 3768959520U, -42, 1.5, 'x', addr, msg);
+	drain();
+	legacy_log<CTRL>("Registering message", 3768959520U, -42, 1.5, 'x', addr, msg);
+	drain();
+	vector<uint8_t> ours(read_record(fds[1]));
+	vector<uint8_t> theirs(read_record(fds[1]));
+	if (ours.size() != theirs.size() + 1 || ours[0] != theirs[0] || ours[1] != LOG_FORMAT_VERSION ||
+	    !equal(ours.begin() + 10, ours.end(), theirs.begin() + 9)) {
+		cerr << "Encoders disagree:\n" << (char*) ours.data() + 10 << '\n' << (char*) theirs.data() + 9 << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "formats match: " << (char*) ours.data() + 10 << endl;
+
+	atomic<bool> done(false);
+	thread reader([&]() {
+			char buf[65536];
+			while(!done.load() && read(fds[1], buf, sizeof(buf)) > 0) {
+			}
+		});
+
+	for(int which = 0; which < 2; ++which) {
+		double secs = 0;
+		for(size_t i = 0; i < count; ++i) {
+			auto start = chrono::steady_clock::now();
+			if (which == 0) {
+				g_log<CTRL>("Scheduled send", i, addr, "scheduled", 1792386193000000000ULL, msg);
+			} else {
+				legacy_log<CTRL>("Scheduled send", i, addr, "scheduled", 1792386193000000000ULL, msg);
+			}
+			secs += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (i % 64 == 63) {
+				ev_run(ev_default_loop(), EVRUN_NOWAIT);
+			}
+		}
+		drain();
+		cout << (which == 0 ? "g_log:        " : "stringstream: ") << secs * 1e9 / count << " ns/call" << endl;
+	}
+
+	drain_store();
+	g_log_reset_batch_stats();
+	auto start = chrono::steady_clock::now();
+	for(size_t i = 0; i < count; ++i) {
+		g_log<BITCOIN_MSG>(i, false, msg);
+		if (i % 64 == 63) {
+			ev_run(ev_default_loop(), EVRUN_NOWAIT);
+		}
+	}
+	drain_store();
+	drain();
+	print_batching("flat out: ", count, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+	start = chrono::steady_clock::now();
+	for(size_t i = 0; i < trickle; ++i) {
+		g_log<BITCOIN_MSG>(i, false, msg);
+		this_thread::sleep_for(chrono::milliseconds(10));
+		ev_run(ev_default_loop(), EVRUN_NOWAIT);
+	}
+	drain_store();
+	drain();
+	print_batching("trickle:  ", trickle, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+	done = true;
+	shutdown(fds[0], SHUT_RDWR);
+	reader.join();
+
+	vector<uint8_t> records(sample_records(64 * 1024 * 1024));
+	for(size_t batch = 4096; batch <= 65536; batch *= 4) {
+		bench_codec("lz4  ", LOG_CODEC_LZ4, records, batch);
+		bench_codec("zstd ", LOG_CODEC_ZSTD, records, batch);
+	}
+	return EXIT_SUCCESS;
+}
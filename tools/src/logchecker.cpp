@@ -30,37 +30,73 @@ using namespace std;
 
 namespace po = boost::program_options;
 
-uint32_t validate_record(const wrapped_buffer<uint8_t> &buf) {
+uint32_t validate_record(const uint8_t *buf, size_t len) {
 
 	static uint64_t last_timestamp(0);
+	static payload_cache payloads;
+	static vector<uint8_t> upgraded;
+	const uint64_t second = 1000000000ULL;
 
 
 	uint32_t rv = 0;
-	const struct log_format *log( (const struct log_format*) buf.const_ptr());
+	const struct log_format *log(log_upgrade(buf, len, upgraded));
 	switch(log->type) {
-	case DEBUG: case CTRL: case ERROR: case BITCOIN: case BITCOIN_MSG: case CONNECTOR:
+	case DEBUG: case CTRL: case ERROR: case BITCOIN: case BITCOIN_MSG: case CONNECTOR: case PAYLOAD:
 		break;
 	default:
 		cerr << "Invalid log type, got " << log->type << endl;
 		rv = 1;
 	}
+	if (log->version != LOG_FORMAT_VERSION) {
+		cerr << "Invalid log format version, got " << (int) log->version << endl;
+		rv |= 1;
+	}
 
-	uint64_t timestamp = ntoh(log->timestamp) + 120; /* allow two minute jitter. Unlikely to happen in a corrupt log */
-	if (last_timestamp && (timestamp < last_timestamp  || timestamp - last_timestamp > 86300*3)) {
-		cerr << "timestamp negative or jumped more than three days. Got " << (timestamp - 120) << " last was " << last_timestamp << endl;
+	uint64_t timestamp = ntoh(log->timestamp) + 120*second; /* allow two minute jitter. Unlikely to happen in a corrupt log */
+	if (last_timestamp && (timestamp < last_timestamp  || timestamp - last_timestamp > 86300*3*second)) {
+		cerr << "timestamp negative or jumped more than three days. Got " << (timestamp - 120*second) << " last was " << last_timestamp << endl;
 		rv |= 2;
 	}
 
-	last_timestamp = timestamp - 120;
+	last_timestamp = timestamp - 120*second;
 
+	payloads.remember(log, len);
 	if (log->type == BITCOIN_MSG) {
-		const struct bitcoin_msg_log_format *msg((const struct bitcoin_msg_log_format*) log);
-		const char *s;
-		for(s = msg->msg.command; *s && isprint(*s); ++s);
-		if (*s) {
-			cerr << "Got invalid command: " << msg->msg.command << endl;
-			rv |= 4;
+		const struct bitcoin::packed_message *msg(payloads.resolve(log, len));
+		if (msg) {
+			const char *s;
+			for(s = msg->command; *s && isprint(*s); ++s);
+			if (*s) {
+				cerr << "Got invalid command: " << msg->command << endl;
+				rv |= 4;
+			}
+		} else {
+			/* fine if the log was started after the payload went by */
+			cerr << "Got reference to a payload never seen" << endl;
+		}
+	}
+	return rv;
+}
+
+/* every record in a compressed batch, as verbatim writes them */
+uint32_t validate_frame(const uint8_t *buf, size_t len) {
+	const uint8_t *frame = buf + sizeof(LOG_READER_FRAME_HEADER);
+	len -= sizeof(LOG_READER_FRAME_HEADER);
+	vector<uint8_t> raw(log_frame_size(frame, len));
+	if (raw.empty() || !log_unframe(frame, len, raw.data())) {
+		cerr << "Corrupt frame" << endl;
+		return 1;
+	}
+	uint32_t rv = 0;
+	size_t off = 0;
+	while(off + sizeof(uint32_t) <= raw.size() && !(rv & (1|2))) {
+		uint32_t rec = ntoh(*((const uint32_t*) (raw.data() + off)));
+		if (off + sizeof(uint32_t) + rec > raw.size()) {
+			cerr << "Record overruns its frame" << endl;
+			return 1;
 		}
+		rv |= validate_record(raw.data() + off + sizeof(uint32_t), rec);
+		off += sizeof(uint32_t) + rec;
 	}
 	return rv;
 }
@@ -133,7 +169,9 @@ int main(int argc, char *argv[]) {
 			buf.realloc(remaining);
 			reading_len = false;
 		} else {
-			if (validate_record(buf) & (1|2)) {
+			uint32_t valid = log_is_frame(buf.const_ptr(), cursor) ? validate_frame(buf.const_ptr(), cursor)
+				: validate_record(buf.const_ptr(), cursor);
+			if (valid & (1|2)) {
 				rv = 1;
 				break;
 			}
@@ -32,7 +32,7 @@ sub inet_ntoa {
 
 sub iso8601 {
 	my $date = DateTime->from_epoch(epoch => $_[0], time_zone => 'UTC');
-	return $date->ymd().' '.$date->hms().'z';
+	return $date->ymd().' '.$date->hms().sprintf('.%06d', $date->microsecond).'z';
 }
 
 
@@ -100,11 +100,53 @@ sub get_command_id {
 memoize('get_command_id');
 
 
+# Messages we send may be logged once as a PAYLOAD record (type 1) and
+# referred to by hash from the BITCOIN_MSG records for them. Hashes
+# are per source_id. Past $g_payload_max bytes of them the oldest are
+# forgotten.
+my %g_payloads;
+my @g_payload_order;
+my $g_payload_bytes = 0;
+my $g_payload_max = 64 * 1024 * 1024;
+
+sub payload_handler {
+	my ($source_id, $type, $timestamp, $rest) = @_;
+	my ($hash, $msg) = unpack("a8a*", $rest);
+	my $key = "$source_id:$hash";
+	if (exists $g_payloads{$key}) {
+		$g_payload_bytes -= length($g_payloads{$key});
+	} else {
+		push @g_payload_order, $key;
+	}
+	$g_payloads{$key} = $msg;
+	$g_payload_bytes += length($msg);
+	while ($g_payload_bytes > $g_payload_max && @g_payload_order > 1) {
+		my $oldest = shift @g_payload_order;
+		$g_payload_bytes -= length(delete $g_payloads{$oldest});
+	}
+}
+
+# returns ($handle_id, $is_sender, $msg) for a BITCOIN_MSG record, with
+# $msg undefined if it refers to a payload not seen (e.g., logged in
+# an earlier file)
+sub bitcoin_msg_parts {
+	my ($source_id, $rest) = @_;
+	my ($handle_id, $is_sender, $msg) = unpack("NCa*", $rest);
+	if ($is_sender & 2) {
+		$msg = $g_payloads{"$source_id:" . substr($msg, 0, 8)};
+	}
+	return ($handle_id, $is_sender & 1, $msg);
+}
+
 sub bitcoin_msg_handler {
 	my ($source_id, $type, $timestamp, $rest) = @_;
-	my ($handle_id, $is_sender,
-	    $magic, $command, $length,
-	    $checksum, $payload) = unpack("NCVZ[12]VVa*", $rest);
+	my ($handle_id, $is_sender, $msg) = bitcoin_msg_parts($source_id, $rest);
+	unless (defined $msg) {
+		print "Reference to a payload never seen\n";
+		return;
+	}
+	my ($magic, $command, $length,
+	    $checksum, $payload) = unpack("VZ[12]VVa*", $msg);
 	my $command_id = get_command_id($command);
 }
 
@@ -136,8 +178,20 @@ sub pass2_bitcoin_msg_handler {
 
 
 
+# Version 2 records put a version byte where the top byte of a
+# version 1 timestamp (whole seconds, so always 0) was, and count
+# nanoseconds. Either way, the timestamp comes back in seconds
+sub unpack_record {
+	my ($source_id, $type, $version) = unpack("NCC", $_[0]);
+	return unpack("NCQ>a*", $_[0]) if $version == 0;
+	my ($timestamp, $rest);
+	($source_id, $type, $version, $timestamp, $rest) = unpack("NCCQ>a*", $_[0]);
+	return ($source_id, $type, $timestamp / 1e9, $rest);
+}
+
 sub handle_message {
-	my ($source_id, $type, $timestamp, $rest) = unpack("NCQ>a*", $_[0]);
+	my ($source_id, $type, $timestamp, $rest) = unpack_record($_[0]);
+	die "compressed frame in the log, run it through loginflate first" if $source_id == 0 && $type == 0;
 	my $handlers = $_[1];
 	if (!defined $handlers->{$type}) {
 		print { my_err() } "Unhandled type : type\n";
@@ -213,6 +267,7 @@ sub do_pass {
 }
 
 my %handlers = (
+                      1 => \&payload_handler,
                       2 => \&as_text,
                       4 => \&as_text,
                       8 => \&as_text,
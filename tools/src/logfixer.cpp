@@ -54,7 +54,7 @@ pair<const uint8_t *,size_t> get_bytes(const char *filename) {
 }
 
 inline bool is_type(uint8_t t) {
-	return t == DEBUG || t == CTRL || t == ERROR || t == BITCOIN || t == BITCOIN_MSG || t == CONNECTOR || t == CLIENT;
+	return t == DEBUG || t == CTRL || t == ERROR || t == BITCOIN || t == BITCOIN_MSG || t == CONNECTOR || t == CLIENT || t == PAYLOAD;
 }
 
 int main() {
@@ -71,7 +71,12 @@ int main() {
 	while(buf < meta.first + meta.second) { /* assume it starts good */
 		/* find candidate types, if what follows looks like a timestamp, assume it is */
 		while(!is_type(*buf)) { ++buf; }
-		time_t time = ntoh(*( (uint64_t*)(buf+1)));
+		time_t time;
+		if (buf[1] == LOG_FORMAT_VERSION) {
+			time = ntoh(*( (uint64_t*)(buf+2))) / 1000000000ULL;
+		} else {
+			time = ntoh(*( (uint64_t*)(buf+1)));
+		}
 
 		if (last == nullptr || ((time - last_time >= 0) && (time - last_time < 5*60))) {
 
@@ -0,0 +1,117 @@
+/* standard C libraries */
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+/* standard C++ libraries */
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+/* standard unix libraries */
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* external libraries */
+#include <boost/program_options.hpp>
+
+#include "network.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+/* verbatim writes the compressed frames the logserver sends it as
+   they are. This writes a log with every frame expanded into the
+   records in it, for the readers (the perl importers, for one) that
+   only understand plain records. Records that aren't frames are
+   copied over unchanged */
+
+static bool read_all(int fd, uint8_t *buf, size_t len) {
+	while(len > 0) {
+		ssize_t rd = read(fd, buf, len);
+		if (rd < 0 && errno == EINTR) {
+			continue;
+		} else if (rd <= 0) {
+			return false;
+		}
+		buf += rd;
+		len -= rd;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	po::options_description desc("Options");
+	desc.add_options()
+		("help", "Produce help message")
+		("logfile", po::value<string>(), "specify the log file")
+		("outfile", po::value<string>(), "where to write the inflated log");
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help") || vm.count("logfile") != 1 || vm.count("outfile") != 1) {
+		cout << desc << endl;
+		return EXIT_FAILURE;
+	}
+
+	string filename = vm["logfile"].as<string>();
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "Could not open file " << filename << ' ' << strerror(errno) << endl;
+		return EXIT_FAILURE;
+	}
+
+	ofstream out(vm["outfile"].as<string>(), ios::out | ios::trunc | ios::binary);
+	if (!out.is_open()) {
+		cerr << "Could not open " << vm["outfile"].as<string>() << endl;
+		return EXIT_FAILURE;
+	}
+
+	size_t frames(0), records(0);
+	vector<uint8_t> buf, raw;
+	uint32_t netlen;
+	while(read_all(fd, (uint8_t*) &netlen, sizeof(netlen))) {
+		buf.resize(ntoh(netlen));
+		if (!read_all(fd, buf.data(), buf.size())) {
+			cerr << "This file seems to have dangling data. If you are concerned about this, run logtruncate on it." << endl;
+			break;
+		}
+		if (!log_is_frame(buf.data(), buf.size())) {
+			out.write((const char*) &netlen, sizeof(netlen));
+			out.write((const char*) buf.data(), buf.size());
+			++records;
+			continue;
+		}
+
+		const uint8_t *frame = buf.data() + sizeof(LOG_READER_FRAME_HEADER);
+		size_t len = buf.size() - sizeof(LOG_READER_FRAME_HEADER);
+		raw.resize(log_frame_size(frame, len));
+		if (raw.empty() || !log_unframe(frame, len, raw.data())) {
+			cerr << "Corrupt frame after " << records << " records, giving up" << endl;
+			return EXIT_FAILURE;
+		}
+		/* the records in it are framed the same as the log */
+		out.write((const char*) raw.data(), raw.size());
+		++frames;
+		size_t off = 0;
+		while(off + sizeof(netlen) <= raw.size()) {
+			memcpy(&netlen, raw.data() + off, sizeof(netlen));
+			off += sizeof(netlen) + ntoh(netlen);
+			++records;
+		}
+	}
+
+	close(fd);
+	out.close();
+	if (!out) {
+		cerr << "Error writing the inflated log" << endl;
+		return EXIT_FAILURE;
+	}
+	cerr << "Inflated " << frames << " frames, " << records << " records" << endl;
+	return EXIT_SUCCESS;
+}
@@ -78,7 +78,7 @@ sub inet_ntoa {
 
 sub iso8601 {
 	my $date = DateTime->from_epoch(epoch => $_[0], time_zone => 'UTC');
-	return $date->ymd().' '.$date->hms().'z';
+	return $date->ymd().' '.$date->hms().sprintf('.%06d', $date->microsecond).'z';
 }
 
 
@@ -292,11 +292,38 @@ select id from commands where command = ?});
 
 
 
+# Messages we send may be logged once as a PAYLOAD record (type 1) and
+# referred to by hash from the BITCOIN_MSG records for them. Hashes
+# are per source_id.
+my %g_payloads;
+
+sub payload_handler {
+	my ($source_id, $type, $timestamp, $rest) = @_;
+	my ($hash, $msg) = unpack("a8a*", $rest);
+	$g_payloads{"$source_id:$hash"} = $msg;
+}
+
+# returns ($handle_id, $is_sender, $msg) for a BITCOIN_MSG record, with
+# $msg undefined if it refers to a payload not seen (e.g., logged in
+# an earlier file)
+sub bitcoin_msg_parts {
+	my ($source_id, $rest) = @_;
+	my ($handle_id, $is_sender, $msg) = unpack("NCa*", $rest);
+	if ($is_sender & 2) {
+		$msg = $g_payloads{"$source_id:" . substr($msg, 0, 8)};
+	}
+	return ($handle_id, $is_sender & 1, $msg);
+}
+
 sub pass0_bitcoin_msg_handler {
 	my ($source_id, $type, $timestamp, $rest) = @_;
-	my ($handle_id, $is_sender,
-	    $magic, $command, $length,
-	    $checksum, $payload) = unpack("NCVZ[12]VVa*", $rest);
+	my ($handle_id, $is_sender, $msg) = bitcoin_msg_parts($source_id, $rest);
+	unless (defined $msg) {
+		print { my_err() } "Skipping message referring to a payload not in this file\n";
+		return;
+	}
+	my ($magic, $command, $length,
+	    $checksum, $payload) = unpack("VZ[12]VVa*", $msg);
 	my $command_id = get_command_id($command);
 
 	$g_pass_data[0]{last_ts} = $timestamp;
@@ -310,9 +337,10 @@ sub pass0_bitcoin_msg_handler {
 
 sub pass1_bitcoin_msg_handler {
 	my ($source_id, $type, $timestamp, $rest) = @_;
-	my ($handle_id, $is_sender,
-	    $magic, $command, $length,
-	    $checksum, $payload) = unpack("NCVZ[12]VVa*", $rest);
+	my ($handle_id, $is_sender, $msg) = bitcoin_msg_parts($source_id, $rest);
+	return unless defined $msg;
+	my ($magic, $command, $length,
+	    $checksum, $payload) = unpack("VZ[12]VVa*", $msg);
 	my $command_id = get_command_id($command);
 	$g_pass_data[1]{bid_rows}++;
 }
@@ -320,10 +348,11 @@ sub pass1_bitcoin_msg_handler {
 
 sub pass2_bitcoin_msg_handler {
 	my ($source_id, $type, $timestamp, $rest) = @_;
+	my ($handle_id, $is_sender, $msg) = bitcoin_msg_parts($source_id, $rest);
+	return unless defined $msg;
 	my $mid = pass2_prolog($source_id, $type, $timestamp);
-	my ($handle_id, $is_sender,
-	    $magic, $command, $length,
-	    $checksum, $payload) = unpack("NCVZ[12]VVH*", $rest);
+	my ($magic, $command, $length,
+	    $checksum, $payload) = unpack("VZ[12]VVH*", $msg);
 
 	my $command_id = get_command_id($command);
 	my $bid = $g_pass_data[2]{next_bid}++;
@@ -336,8 +365,20 @@ sub pass2_bitcoin_msg_handler {
 
 
 
+# Version 2 records put a version byte where the top byte of a
+# version 1 timestamp (whole seconds, so always 0) was, and count
+# nanoseconds. Either way, the timestamp comes back in seconds
+sub unpack_record {
+	my ($source_id, $type, $version) = unpack("NCC", $_[0]);
+	return unpack("NCQ>a*", $_[0]) if $version == 0;
+	my ($timestamp, $rest);
+	($source_id, $type, $version, $timestamp, $rest) = unpack("NCCQ>a*", $_[0]);
+	return ($source_id, $type, $timestamp / 1e9, $rest);
+}
+
 sub handle_message {
-	my ($source_id, $type, $timestamp, $rest) = unpack("NCQ>a*", $_[0]);
+	my ($source_id, $type, $timestamp, $rest) = unpack_record($_[0]);
+	die "compressed frame in the log, run it through loginflate first" if $source_id == 0 && $type == 0;
 	my $handlers = $_[1];
 	if (!defined $handlers->{$type}) {
 		print { my_err() } "Unhandled type : $type\n";
@@ -488,6 +529,7 @@ sub process_buckets {
 
 
 my %pass0_handlers = (
+                      1 => \&payload_handler,
                       2 => \&pass0_as_text,
                       4 => \&void_handler,
                       8 => \&void_handler,
@@ -497,6 +539,7 @@ my %pass0_handlers = (
                      );
 
 my %pass1_handlers = (
+                      1 => \&payload_handler,
                       2 => \&void_handler,
                       4 => \&void_handler,
                       8 => \&void_handler,
@@ -506,6 +549,7 @@ my %pass1_handlers = (
                      );
 
 my %pass2_handlers = (
+                      1 => \&payload_handler,
                       2 => \&void_handler,
                       4 => \&void_handler,
                       8 => \&void_handler,
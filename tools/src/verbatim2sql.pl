@@ -103,12 +103,39 @@ insert into cxn_text_map (bitcoin_cxn_msg_id, txt_id) values (?,?)
 	}
 }
 
+# Messages we send may be logged once as a PAYLOAD record (type 1) and
+# referred to by hash from the BITCOIN_MSG records for them. Hashes
+# are per source_id.
+my %g_payloads;
+
+sub payload_handler {
+	my ($type, $timestamp, $rest, $source_id) = @_;
+	my ($hash, $msg) = unpack("a8a*", $rest);
+	$g_payloads{"$source_id:$hash"} = $msg;
+}
+
+# returns ($handle_id, $is_sender, $msg) for a BITCOIN_MSG record, with
+# $msg undefined if it refers to a payload not seen (e.g., logged in
+# an earlier file)
+sub bitcoin_msg_parts {
+	my ($source_id, $rest) = @_;
+	my ($handle_id, $is_sender, $msg) = unpack("NCa*", $rest);
+	if ($is_sender & 2) {
+		$msg = $g_payloads{"$source_id:" . substr($msg, 0, 8)};
+	}
+	return ($handle_id, $is_sender & 1, $msg);
+}
+
 sub bitcoin_msg_handler {
-	my ($type, $timestamp, $rest) = @_;
+	my ($type, $timestamp, $rest, $source_id) = @_;
+	my ($handle_id, $is_sender, $msg) = bitcoin_msg_parts($source_id, $rest);
+	unless (defined $msg) {
+		print STDERR "Skipping message referring to a payload never seen\n";
+		return;
+	}
 	my $mid = insert_prolog($type, $timestamp);
-	my ($handle_id, $is_sender,
-	    $magic, $command, $length,
-	    $checksum, $payload) = unpack("NCVZ[12]VVa*", $rest);
+	my ($magic, $command, $length,
+	    $checksum, $payload) = unpack("VZ[12]VVa*", $msg);
 
 	my $sth = $g_dbh->prepare_cached(q{
 insert into bitcoin_messages (message_id, handle_id, is_sender, command)
@@ -125,6 +152,7 @@ values
 }
 
 my %handlers = (
+                1 => \&payload_handler,
                 2 => \&as_text,
                 4 => \&as_text,
                 8 => \&as_text,
@@ -133,12 +161,24 @@ my %handlers = (
 );
 
 
+# Version 2 records put a version byte where the top byte of a
+# version 1 timestamp (whole seconds, so always 0) was, and count
+# nanoseconds. Either way, the timestamp comes back in seconds
+sub unpack_record {
+	my ($source_id, $type, $version) = unpack("NCC", $_[0]);
+	return unpack("NCQ>a*", $_[0]) if $version == 0;
+	my ($timestamp, $rest);
+	($source_id, $type, $version, $timestamp, $rest) = unpack("NCCQ>a*", $_[0]);
+	return ($source_id, $type, $timestamp / 1e9, $rest);
+}
+
 sub handle_message {
-	my ($source_id, $type, $timestamp, $rest) = unpack("NCQ>a*", $_[0]);
+	my ($source_id, $type, $timestamp, $rest) = unpack_record($_[0]);
+	die "compressed frame in the log, run it through loginflate first" if $source_id == 0 && $type == 0;
 	if (!defined $handlers{$type}) {
 		print STDERR "Unhandled type : type\n";
 	} else {
-		$handlers{$type}->($type, $timestamp, $rest);
+		$handlers{$type}->($type, $timestamp, $rest, $source_id);
 	}
 }
 
@@ -155,7 +195,7 @@ CREATE TABLE IF NOT EXISTS types (
 
 INSERT OR IGNORE INTO types (id, type) VALUES
 (2, "DEBUG"), (4, "CTRL"), (8, "ERROR"),
-(16, "BITCOIN"), (32, "BITCOIN_MSG"), (64, "CONNECTOR");
+(16, "BITCOIN"), (32, "BITCOIN_MSG"), (64, "CONNECTOR"), (1, "PAYLOAD");
 
 CREATE TABLE IF NOT EXISTS messages (
    id INTEGER PRIMARY KEY,